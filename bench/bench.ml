@@ -0,0 +1,101 @@
+(* Measures the cost of crossing the OCaml/C boundary in the bindings:
+   callbacks are driven the way libmilter would call them and mutators are
+   called against a mock libmilter, with filter functions that do nothing.
+   Reports the time and the number of words allocated on the OCaml heap per
+   call. *)
+
+open Mock_driver
+
+let iterations =
+  try int_of_string Sys.argv.(1) with _ -> 100_000
+
+let words () =
+  let s = Gc.quick_stat () in
+  s.Gc.minor_words +. s.Gc.major_words -. s.Gc.promoted_words
+
+let report name elapsed allocated =
+  let n = float_of_int iterations in
+  Printf.printf "%-32s %10.1f ns/op %8.1f words/op\n%!"
+    name (elapsed /. n) (allocated /. n)
+
+let measure name f =
+  let w = words () in
+  let elapsed = f () in
+  report name elapsed (words () -. w)
+
+let bench_callback name cb =
+  measure (name ^ " (OCaml thread)") (fun () ->
+    callback cb iterations false);
+  measure (name ^ " (C thread)") (fun () ->
+    callback cb iterations true)
+
+let bench_stub name f =
+  measure name (fun () ->
+    let t = Unix.gettimeofday () in
+    for _ = 1 to iterations do
+      f ()
+    done;
+    (Unix.gettimeofday () -. t) *. 1e9)
+
+let continue _ = Milter.Continue
+let continue2 _ _ = Milter.Continue
+let continue3 _ _ _ = Milter.Continue
+
+let filter =
+  { Milter.empty with
+    Milter.name = "bench"
+  ; connect   = Some continue3
+  ; helo      = Some continue2
+  ; envfrom   = Some continue3
+  ; envrcpt   = Some continue3
+  ; header    = Some continue3
+  ; eoh       = Some continue
+  ; body      = Some continue3
+  ; eom       = Some continue
+  ; abort     = Some continue
+  ; close     = Some continue
+  ; unknown   = Some continue2
+  ; data      = Some continue
+  ; negotiate = Some (fun _ f s -> (Milter.Continue, f, s))
+  }
+
+let () =
+  Milter.register filter;
+  Printf.printf "%d iterations\n\n%!" iterations;
+
+  bench_callback "connect+close" Session;
+  bench_callback "helo" Helo;
+  bench_callback "envfrom" Envfrom;
+  bench_callback "envrcpt" Envrcpt;
+  bench_callback "header" Header;
+  bench_callback "eoh" Eoh;
+  bench_callback "body (64 KiB)" Body;
+  bench_callback "eom" Eom;
+  bench_callback "abort" Abort;
+  bench_callback "unknown" Unknown;
+  bench_callback "data" Data;
+  bench_callback "negotiate" Negotiate;
+  print_newline ();
+
+  let ctx = ctx () in
+  let body = Bytes.create 4096 in
+  bench_stub "getsymval" (fun () -> ignore (Milter.getsymval ctx "i"));
+  bench_stub "getpriv" (fun () -> ignore (Milter.getpriv ctx));
+  bench_stub "setpriv" (fun () -> Milter.setpriv ctx (Some 1));
+  bench_stub "setreply" (fun () ->
+    Milter.setreply ctx "550" (Some "5.7.1") (Some "Rejected"));
+  bench_stub "setmlreply" (fun () ->
+    Milter.setmlreply ctx "550" (Some "5.7.1") ["Rejected"; "Go away"]);
+  bench_stub "addheader" (fun () ->
+    Milter.addheader ctx "X-Bench" "value");
+  bench_stub "chgheader" (fun () ->
+    Milter.chgheader ctx "X-Bench" 1 (Some "value"));
+  bench_stub "insheader" (fun () ->
+    Milter.insheader ctx 0 "X-Bench" "value");
+  bench_stub "chgfrom" (fun () ->
+    Milter.chgfrom ctx "<sender@example.com>" None);
+  bench_stub "addrcpt" (fun () -> Milter.addrcpt ctx "<rcpt@example.org>");
+  bench_stub "delrcpt" (fun () -> Milter.delrcpt ctx "<rcpt@example.org>");
+  bench_stub "replacebody (4 KiB)" (fun () -> Milter.replacebody ctx body);
+  bench_stub "progress" (fun () -> Milter.progress ctx);
+  bench_stub "quarantine" (fun () -> Milter.quarantine ctx "bench")
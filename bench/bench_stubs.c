@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "mock_mfapi.h"
+
+/*
+ * Drives the callbacks registered through Milter.register the way
+ * libmilter would. Callbacks are either called from the OCaml thread,
+ * which is already registered and holds the runtime lock, or from a fresh
+ * C thread, which registers and takes the lock on each call.
+ */
+
+enum bench_callback {
+    BENCH_SESSION,  /* connect followed by close */
+    BENCH_HELO,
+    BENCH_ENVFROM,
+    BENCH_ENVRCPT,
+    BENCH_HEADER,
+    BENCH_EOH,
+    BENCH_BODY,
+    BENCH_EOM,
+    BENCH_ABORT,
+    BENCH_UNKNOWN,
+    BENCH_DATA,
+    BENCH_NEGOTIATE,
+};
+
+struct bench_run {
+    enum bench_callback cb;
+    long iterations;
+    int64_t elapsed;
+};
+
+static struct smfi_str bench_ctx;
+static unsigned char bench_body[65536];
+
+static int64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_call(enum bench_callback cb)
+{
+    unsigned long f0, f1, f2, f3;
+    struct sockaddr_in sin;
+    char *envfrom[] = {
+        "<sender@example.com>", "SIZE=12345", "BODY=8BITMIME", NULL
+    };
+    char *envrcpt[] = { "<rcpt@example.org>", "NOTIFY=NEVER", NULL };
+
+    switch (cb) {
+    case BENCH_SESSION:
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(25);
+        sin.sin_addr.s_addr = htonl(0xc0000201);
+        mock_desc.xxfi_connect(&bench_ctx, "mail.example.com",
+                               (_SOCK_ADDR *)&sin);
+        mock_desc.xxfi_close(&bench_ctx);
+        break;
+    case BENCH_HELO:
+        mock_desc.xxfi_helo(&bench_ctx, "mail.example.com");
+        break;
+    case BENCH_ENVFROM:
+        mock_desc.xxfi_envfrom(&bench_ctx, envfrom);
+        break;
+    case BENCH_ENVRCPT:
+        mock_desc.xxfi_envrcpt(&bench_ctx, envrcpt);
+        break;
+    case BENCH_HEADER:
+        mock_desc.xxfi_header(&bench_ctx, "Subject",
+                              "A fairly typical subject line");
+        break;
+    case BENCH_EOH:
+        mock_desc.xxfi_eoh(&bench_ctx);
+        break;
+    case BENCH_BODY:
+        mock_desc.xxfi_body(&bench_ctx, bench_body, sizeof(bench_body));
+        break;
+    case BENCH_EOM:
+        mock_desc.xxfi_eom(&bench_ctx);
+        break;
+    case BENCH_ABORT:
+        mock_desc.xxfi_abort(&bench_ctx);
+        break;
+    case BENCH_UNKNOWN:
+        mock_desc.xxfi_unknown(&bench_ctx, "XFOO bar");
+        break;
+    case BENCH_DATA:
+        mock_desc.xxfi_data(&bench_ctx);
+        break;
+    case BENCH_NEGOTIATE:
+        mock_desc.xxfi_negotiate(&bench_ctx, ~0UL, ~0UL, 0, 0,
+                                 &f0, &f1, &f2, &f3);
+        break;
+    }
+}
+
+static void *
+bench_thread(void *arg)
+{
+    long i;
+    int64_t start;
+    struct bench_run *run = arg;
+
+    start = bench_now();
+    for (i = 0; i < run->iterations; i++)
+        bench_call(run->cb);
+    run->elapsed = bench_now() - start;
+
+    /* The first call set up the connection state, which only the session
+     * releases; close it outside the timing so runs start afresh. */
+    if (run->cb != BENCH_SESSION)
+        mock_desc.xxfi_close(&bench_ctx);
+
+    return NULL;
+}
+
+CAMLprim value
+caml_bench_ctx(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn((value)&bench_ctx);
+}
+
+/* Returns the time taken by the given number of calls, in nanoseconds. */
+CAMLprim value
+caml_bench_callback(value cb_val, value iterations_val, value foreign_val)
+{
+    CAMLparam3(cb_val, iterations_val, foreign_val);
+    pthread_t thread;
+    struct bench_run run;
+
+    run.cb = Int_val(cb_val);
+    run.iterations = Long_val(iterations_val);
+
+    if (Bool_val(foreign_val)) {
+        caml_release_runtime_system();
+        pthread_create(&thread, NULL, bench_thread, &run);
+        pthread_join(thread, NULL);
+        caml_acquire_runtime_system();
+    } else {
+        bench_thread(&run);
+    }
+
+    CAMLreturn(caml_copy_double((double)run.elapsed));
+}
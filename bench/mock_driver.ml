@@ -0,0 +1,19 @@
+(* Callbacks registered through Milter.register, called the way libmilter
+   would call them, on a context of the mock libmilter. *)
+
+type callback
+  = Session
+  | Helo
+  | Envfrom
+  | Envrcpt
+  | Header
+  | Eoh
+  | Body
+  | Eom
+  | Abort
+  | Unknown
+  | Data
+  | Negotiate
+
+external ctx : unit -> Milter.ctx = "caml_bench_ctx"
+external callback : callback -> int -> bool -> float = "caml_bench_callback"
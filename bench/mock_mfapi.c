@@ -0,0 +1,73 @@
+#include <stddef.h>
+
+#include "mock_mfapi.h"
+
+struct smfiDesc mock_desc;
+
+int
+smfi_register(struct smfiDesc desc)
+{
+    mock_desc = desc;
+    return MI_SUCCESS;
+}
+
+int
+smfi_setpriv(SMFICTX *ctx, void *priv)
+{
+    ctx->priv = priv;
+    return MI_SUCCESS;
+}
+
+void *
+smfi_getpriv(SMFICTX *ctx)
+{
+    return ctx->priv;
+}
+
+char *
+smfi_getsymval(SMFICTX *ctx, char *name)
+{
+    return name[0] == 'i' && name[1] == '\0' ? "4FQjXb1Hz3z9" : NULL;
+}
+
+int
+smfi_setmlreply(SMFICTX *ctx, const char *rcode, const char *xcode, ...)
+{
+    return MI_SUCCESS;
+}
+
+int
+smfi_version(unsigned int *major, unsigned int *minor, unsigned int *pl)
+{
+    *major = 1;
+    *minor = 0;
+    *pl = 1;
+    return MI_SUCCESS;
+}
+
+int smfi_opensocket(int rmsocket) { return MI_SUCCESS; }
+int smfi_main(void) { return MI_SUCCESS; }
+int smfi_setbacklog(int backlog) { return MI_SUCCESS; }
+int smfi_setdbg(int level) { return MI_SUCCESS; }
+int smfi_settimeout(int timeout) { return MI_SUCCESS; }
+int smfi_setconn(char *conn) { return MI_SUCCESS; }
+int smfi_stop(void) { return MI_SUCCESS; }
+
+int smfi_setreply(SMFICTX *ctx, char *rcode, char *xcode, char *msg)
+{ return MI_SUCCESS; }
+int smfi_addheader(SMFICTX *ctx, char *f, char *v) { return MI_SUCCESS; }
+int smfi_chgheader(SMFICTX *ctx, char *f, int idx, char *v)
+{ return MI_SUCCESS; }
+int smfi_insheader(SMFICTX *ctx, int idx, char *f, char *v)
+{ return MI_SUCCESS; }
+int smfi_chgfrom(SMFICTX *ctx, char *mail, char *args) { return MI_SUCCESS; }
+int smfi_addrcpt(SMFICTX *ctx, char *rcpt) { return MI_SUCCESS; }
+int smfi_addrcpt_par(SMFICTX *ctx, char *rcpt, char *args)
+{ return MI_SUCCESS; }
+int smfi_delrcpt(SMFICTX *ctx, char *rcpt) { return MI_SUCCESS; }
+int smfi_progress(SMFICTX *ctx) { return MI_SUCCESS; }
+int smfi_replacebody(SMFICTX *ctx, unsigned char *body, int len)
+{ return MI_SUCCESS; }
+int smfi_quarantine(SMFICTX *ctx, char *reason) { return MI_SUCCESS; }
+int smfi_setsymlist(SMFICTX *ctx, int stage, char *macros)
+{ return MI_SUCCESS; }
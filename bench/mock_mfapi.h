@@ -0,0 +1,18 @@
+#ifndef MOCK_MFAPI_H
+#define MOCK_MFAPI_H
+
+#include <libmilter/mfapi.h>
+
+/*
+ * Stand-in for libmilter: the filter description given to smfi_register()
+ * is kept so its callbacks can be called directly, and contexts are plain
+ * structures holding the private data pointer.
+ */
+
+struct smfi_str {
+    void *priv;
+};
+
+extern struct smfiDesc mock_desc;
+
+#endif
@@ -115,12 +115,32 @@ external setdbg : int -> unit = "caml_milter_setdbg"
 external stop : unit -> unit = "caml_milter_stop"
 external main : unit -> unit = "caml_milter_main"
 
+external inheritsocket : Unix.file_descr -> unit = "caml_milter_inheritsocket"
+external handoff : string -> unit = "caml_milter_handoff"
+external takeover : string -> Unix.file_descr = "caml_milter_takeover"
+external setmaxconnections : int -> unit = "caml_milter_setmaxconnections"
+external setlocktarget : float -> unit = "caml_milter_setlocktarget"
+external lockwait : unit -> float = "caml_milter_lockwait"
+external rejections : unit -> int = "caml_milter_rejections"
+external connections : unit -> int = "caml_milter_connections"
+external drain : unit -> unit = "caml_milter_drain"
+
 external getsymval : ctx -> string -> string option =
   "caml_milter_getsymval"
 external getpriv : ctx -> 'a option =
   "caml_milter_getpriv"
-external setpriv : ctx -> 'a option -> unit =
+external set_priv : ctx -> 'a option -> int -> unit =
   "caml_milter_setpriv"
+external memory_limited : unit -> bool = "caml_milter_memory_limited"
+
+let setpriv ctx v =
+  let size =
+    if memory_limited () then
+      Obj.reachable_words (Obj.repr v) * (Sys.word_size / 8)
+    else
+      0 in
+  set_priv ctx v size
+
 external setreply : ctx -> string -> string option -> string option -> unit =
   "caml_milter_setreply"
 external setmlreply : ctx -> string -> string option -> string list -> unit =
@@ -144,6 +164,12 @@ external replacebody : ctx -> bytes -> unit =
   "caml_milter_replacebody"
 external progress : ctx -> unit =
   "caml_milter_progress"
+external setwatchdog : float -> float -> unit =
+  "caml_milter_setwatchdog"
+external setmtatimeout : float -> unit =
+  "caml_milter_setmtatimeout"
+external deadline : ctx -> float option =
+  "caml_milter_deadline"
 external quarantine : ctx -> string -> unit =
   "caml_milter_quarantine"
 external version : unit -> int * int * int =
@@ -174,3 +200,292 @@ let empty =
   ; data      = None
   ; negotiate = None
   }
+
+external setresolver : Unix.inet_addr -> int -> unit =
+  "caml_milter_setresolver"
+
+module Dnsbl = struct
+  type listing =
+    { zone  : string
+    ; name  : string
+    ; addrs : string list
+    }
+
+  external add : string -> unit = "caml_milter_dnsbl_add"
+  external add_domain : string -> unit = "caml_milter_dnsbl_add_domain"
+  external check : ctx -> string -> unit = "caml_milter_dnsbl_check"
+  external results : ctx -> listing list = "caml_milter_dnsbl_results"
+  external pending : ctx -> int = "caml_milter_dnsbl_pending"
+  external wait : ctx -> float -> unit = "caml_milter_dnsbl_wait"
+end
+
+module Spf = struct
+  type result
+    = Pass
+    | Fail
+    | Softfail
+    | Neutral
+    | No_policy
+    | Temperror
+    | Permerror
+
+  external enable : unit -> unit = "caml_milter_spf_enable"
+  external check : ctx -> string -> unit = "caml_milter_spf_check"
+  external result : ctx -> result option = "caml_milter_spf_result"
+  external wait : ctx -> float -> unit = "caml_milter_spf_wait"
+  external stats : unit -> int * int = "caml_milter_spf_stats"
+end
+
+module Ratelimit = struct
+  type t
+
+  external openfile : string -> int -> t = "caml_milter_ratelimit_open"
+  external take : t -> string -> float -> float -> bool =
+    "caml_milter_ratelimit_take"
+  external peek : t -> string -> float -> float -> float =
+    "caml_milter_ratelimit_peek"
+end
+
+module Greylist = struct
+  type t
+
+  type policy =
+    { delay  : int
+    ; retry  : int
+    ; expire : int
+    }
+
+  type result
+    = Pass
+    | Defer of int
+
+  external openfile : string -> int -> policy -> t =
+    "caml_milter_greylist_open"
+  external check : t -> Unix.inet_addr -> string -> string -> result =
+    "caml_milter_greylist_check"
+end
+
+module Log = struct
+  type level
+    = Debug
+    | Info
+    | Notice
+    | Warning
+    | Error
+
+  external openfile : string -> unit = "caml_milter_log_open"
+  external setlevel : level -> unit = "caml_milter_log_setlevel"
+  external enabled : level -> bool = "caml_milter_log_enabled"
+  external write : level -> ctx option -> string -> unit =
+    "caml_milter_log_write"
+  external dropped : unit -> int = "caml_milter_log_dropped"
+
+  let log ?ctx level msg =
+    write level ctx msg
+
+  let logf ?ctx level fmt =
+    if enabled level then
+      Printf.ksprintf (write level ctx) fmt
+    else
+      Printf.ikfprintf (fun () -> ()) () fmt
+end
+
+module Trace = struct
+  external openfile : string -> int -> unit = "caml_milter_trace_open"
+  external stop : unit -> unit = "caml_milter_trace_stop"
+  external dropped : unit -> int = "caml_milter_trace_dropped"
+end
+
+module Tap = struct
+  external start : string -> string list -> (string -> unit) -> unit =
+    "caml_milter_tap_start"
+  external dropped : unit -> int = "caml_milter_tap_dropped"
+end
+
+module Headers = struct
+  type selector
+    = First of string
+    | Last of string
+    | Nth of string * int
+
+  external enable : unit -> unit = "caml_milter_headers_enable"
+  external count : ctx -> string -> int = "caml_milter_headers_count"
+  external find : ctx -> selector -> string option =
+    "caml_milter_headers_find"
+  external find_all : ctx -> string -> string list =
+    "caml_milter_headers_find_all"
+  external to_list : ctx -> (string * string) list =
+    "caml_milter_headers_to_list"
+  external locate : ctx -> selector -> int * int =
+    "caml_milter_headers_locate"
+
+  let name = function
+    | First name | Last name | Nth (name, _) -> name
+
+  let change ctx sel value =
+    let occurrence, _ = locate ctx sel in
+    chgheader ctx (name sel) occurrence value
+
+  let insert_before ctx sel field value =
+    let _, position = locate ctx sel in
+    insheader ctx position field value
+
+  let insert_after ctx sel field value =
+    let _, position = locate ctx sel in
+    insheader ctx (position + 1) field value
+end
+
+module Bodycache = struct
+  external setsize : int -> bool -> unit = "caml_milter_bodycache_setsize"
+  external find : ctx -> stat option = "caml_milter_bodycache_find"
+  external add : ctx -> stat -> float -> unit = "caml_milter_bodycache_add"
+  external digest : ctx -> string option = "caml_milter_bodycache_digest"
+  external stats : unit -> int * int = "caml_milter_bodycache_stats"
+end
+
+module Scan = struct
+  type verdict
+    = Pending
+    | Clean
+    | Infected of string
+    | Failed of string
+
+  type attachment =
+    { filename     : string
+    ; content_type : string
+    ; size         : int
+    ; verdict      : verdict
+    }
+
+  external setscanner : string -> int -> unit = "caml_milter_scan_setscanner"
+  external wait : ctx -> float -> unit = "caml_milter_scan_wait"
+  external results : ctx -> attachment list = "caml_milter_scan_results"
+end
+
+module Envelope = struct
+  type path =
+    { null   : bool
+    ; local  : string
+    ; domain : string
+    ; params : (string * string option) list
+    }
+
+  external enable : unit -> unit = "caml_milter_envelope_enable"
+  external sender : ctx -> path option = "caml_milter_envelope_sender"
+  external recipient : ctx -> path option = "caml_milter_envelope_recipient"
+  external parse_path : bool -> string -> string list -> path option
+                      = "caml_milter_envelope_parse"
+
+  let parse ?(recipient = false) path args = parse_path recipient path args
+end
+
+module Policy = struct
+  type t
+  type builder
+
+  external openfile : string -> t = "caml_milter_policy_open"
+  external find : t -> string -> string option = "caml_milter_policy_find"
+  external mem : t -> string -> bool = "caml_milter_policy_mem"
+  external length : t -> int = "caml_milter_policy_length"
+  external reload : t -> bool = "caml_milter_policy_reload"
+  external create : string -> builder = "caml_milter_policy_create"
+  external add : builder -> string -> string -> unit = "caml_milter_policy_add"
+  external commit : builder -> unit = "caml_milter_policy_commit"
+end
+
+module Pool = struct
+  type stats =
+    { workers     : int
+    ; busy        : int
+    ; queued      : int
+    ; peak_queued : int
+    ; jobs        : int
+    ; queue_wait  : float
+    }
+
+  external start_pool : int -> int list -> unit = "caml_milter_pool_start"
+  external stats : unit -> stats = "caml_milter_pool_stats"
+
+  let start ?(cpus = []) n = start_pool n cpus
+end
+
+module Bayes = struct
+  type builder
+
+  external load : string -> unit = "caml_milter_bayes_load"
+  external score : ctx -> float option = "caml_milter_bayes_score"
+  external create : unit -> builder = "caml_milter_bayes_create"
+  external update : string -> builder = "caml_milter_bayes_update"
+  external train : builder -> spam:bool -> string -> unit =
+    "caml_milter_bayes_train"
+  external commit : builder -> string -> unit = "caml_milter_bayes_commit"
+end
+
+module Memory = struct
+  type usage =
+    { native : int
+    ; copied : int
+    ; priv   : int
+    ; peak   : int
+    }
+
+  external set_limits : int -> int -> unit = "caml_milter_memory_setlimits"
+  external usage : ctx -> usage = "caml_milter_memory_usage"
+  external total : unit -> int = "caml_milter_memory_total"
+  external refusals : unit -> int = "caml_milter_memory_refusals"
+
+  let setlimits ?(connection = 0) ?(total = 0) () =
+    set_limits connection total
+end
+
+module Body = struct
+  type view
+
+  external view : ctx -> view = "caml_milter_body_view"
+  external length : view -> int = "caml_milter_body_length"
+  external valid : view -> bool = "caml_milter_body_valid"
+  external get : view -> int -> char = "caml_milter_body_get"
+  external sub : view -> int -> int -> string = "caml_milter_body_sub"
+  external blit : view -> int -> bytes -> int -> int -> unit =
+    "caml_milter_body_blit"
+  external retain : view -> view = "caml_milter_body_retain"
+  external release : view -> unit = "caml_milter_body_release"
+
+  let to_string v = sub v 0 (length v)
+end
+
+module Urls = struct
+  type url =
+    { url  : string
+    ; host : string
+    }
+
+  external set_max : int -> unit = "caml_milter_urls_enable"
+  external get : ctx -> url list = "caml_milter_urls_get"
+
+  let enable ?(max = 1024) () = set_max max
+end
+
+module Dkim = struct
+  type canonicalization = Simple | Relaxed
+
+  external set_enable : string list -> canonicalization -> canonicalization ->
+    unit = "caml_milter_dkim_enable"
+  external load : string -> string -> string -> unit = "caml_milter_dkim_load"
+  external sign_message : ctx -> string -> string -> unit =
+    "caml_milter_dkim_sign"
+
+  let default_headers =
+    [ "From"; "Reply-To"; "Subject"; "Date"; "To"; "Cc"; "In-Reply-To"
+    ; "References"; "Message-ID"; "MIME-Version"; "Content-Type"
+    ; "Content-Transfer-Encoding"
+    ]
+
+  let enable ?(headers = default_headers) ?(header = Relaxed)
+             ?(body = Relaxed) () =
+    set_enable headers header body
+
+  let load_key ~selector ~domain path = load selector domain path
+
+  let sign ctx ~selector ~domain = sign_message ctx selector domain
+end
@@ -186,6 +186,53 @@ val main : unit -> unit
       if {!stop} is called from one of the callbacks defined in {!register}
       of if an error occurs. *)
 
+val inheritsocket : Unix.file_descr -> unit
+  (** Makes the filter listen on an already bound and listening socket, such
+      as one obtained from {!takeover}, instead of creating the socket
+      specified by {!setconn}. Must be called after {!register} and before
+      {!main}, in place of {!setconn} and {!opensocket}. *)
+
+val handoff : string -> unit
+  (** [handoff path] passes the filter's listening socket to the process
+      waiting in {!takeover} on the UNIX socket [path] and then stops
+      accepting new connections, as in {!stop}. The path of a UNIX
+      socket is left in place for the new process. Connections already in
+      progress are not interrupted; use {!drain} to wait for them after
+      {!main} returns. *)
+
+val takeover : string -> Unix.file_descr
+  (** [takeover path] creates a UNIX socket at [path] and blocks until a
+      running filter calls {!handoff} on it, returning the listening socket
+      it passed. The result is meant to be given to {!inheritsocket}. *)
+
+val setmaxconnections : int -> unit
+  (** Sets the maximum number of connections handled at once. Connections
+      beyond the limit are answered with [Tempfail] without calling the
+      [connect] callback. [0], the default, means no limit. *)
+
+val setlocktarget : float -> unit
+  (** Sets the target, in seconds, for the time callbacks wait to acquire
+      the runtime lock. When the shortest wait observed over a 100ms
+      interval exceeds the target, new connections are answered with
+      [Tempfail] without calling the [connect] callback until the backlog
+      clears. [0.], the default, disables the check. *)
+
+val lockwait : unit -> float
+  (** Returns the shortest time, in seconds, that callbacks waited for the
+      runtime lock during the last complete 100ms interval. *)
+
+val rejections : unit -> int
+  (** Returns the number of connections refused because of
+      {!setmaxconnections} or {!setlocktarget}. *)
+
+val connections : unit -> int
+  (** Returns the number of connections currently being handled by the
+      filter. *)
+
+val drain : unit -> unit
+  (** Blocks until all connections currently being handled by the filter
+      are closed. *)
+
 val getsymval : ctx -> string -> string option
   (** Gets the value of a milter macro. The availability of macros depends on
       each specific MTA. *)
@@ -249,6 +296,24 @@ val progress : ctx -> unit
       the MTA to reset its timeouts. Can only be called from the [eom]
       callback. *)
 
+val setwatchdog : float -> float -> unit
+  (** [setwatchdog interval limit] makes the library call {!progress} every
+      [interval] seconds on behalf of [eom] callbacks that are still
+      running, until [limit] seconds after the callback started. Reports
+      are sent from a separate thread that does not need the runtime lock.
+      An [interval] of [0.], the default, disables the watchdog; otherwise
+      both must be positive, or [Milter_error] is raised. *)
+
+val setmtatimeout : float -> unit
+  (** Tells the library how many seconds the MTA waits for a reply to each
+      callback. Only used by {!deadline}. *)
+
+val deadline : ctx -> float option
+  (** Returns the time, comparable to [Unix.gettimeofday ()], by which the
+      current callback should return. For [eom] with the watchdog enabled
+      this is the watchdog [limit]; otherwise it is given by
+      {!setmtatimeout}. Returns [None] if neither is set. *)
+
 val quarantine : ctx -> string -> unit
   (** Quarantines the message using the given reason. Can only be called from
       the [eom] callback. *)
@@ -266,3 +331,723 @@ val version_code : int
 val empty : filter
   (** A default filter with [name] set to an empty string, [version] set to
       {!version_code} and all callback fields set to [None]. *)
+
+val setresolver : Unix.inet_addr -> int -> unit
+  (** [setresolver addr port] sets the recursive DNS server used by the
+      library's own lookups. Defaults to the first [nameserver] in
+      [/etc/resolv.conf]. Queries are only sent over UDP: a truncated
+      answer is taken as a server failure rather than retried over TCP. *)
+
+(** Asynchronous DNS blocklist lookups.
+
+    Queries against the configured DNSBL zones for the client address,
+    and against the RHSBL zones for the client host name, are sent as soon
+    as a connection starts, before the [connect] callback runs. They are
+    resolved in the background over UDP, from random ports and with
+    random ids, and answers are cached according to their TTL. Callbacks
+    later collect whatever results are in without blocking. *)
+module Dnsbl : sig
+  type listing =
+    { zone  : string
+        (** The zone that lists the client. *)
+    ; name  : string
+        (** The address or domain that was looked up. *)
+    ; addrs : string list
+        (** The addresses returned by the zone, such as ["127.0.0.2"]. *)
+    }
+
+  val add : string -> unit
+    (** Adds a DNSBL zone queried with the reversed client address. Must be
+        called before {!main}. *)
+
+  val add_domain : string -> unit
+    (** Adds an RHSBL zone queried with the client host name and with the
+        domains given to {!check}. Must be called before {!main}. *)
+
+  val check : ctx -> string -> unit
+    (** Starts queries for a domain, such as the sender's, against the
+        RHSBL zones. *)
+
+  val results : ctx -> listing list
+    (** Returns the listings among the answers received so far for this
+        connection. Never blocks. *)
+
+  val pending : ctx -> int
+    (** Returns the number of queries of this connection not yet
+        answered. *)
+
+  val wait : ctx -> float -> unit
+    (** [wait ctx timeout] blocks for at most [timeout] seconds until all
+        queries of this connection are answered. Other callbacks keep
+        running meanwhile. *)
+end
+
+(** Sender Policy Framework.
+
+    The envelope sender is checked against the client address in C, as
+    soon as it is received, using the library's resolver (see
+    {!setresolver}, which can also point it at a local test server).
+    Includes, redirects and address lookups are resolved concurrently,
+    parsed records are cached for the TTL of their DNS answer, and results
+    for the smallest TTL of the answers they depend on. Callbacks collect
+    the result without blocking, or wait for it without holding up other
+    callbacks.
+
+    The null sender is checked as [postmaster] at the HELO name. Clients
+    whose address is unknown, such as local ones, get [No_policy]. *)
+module Spf : sig
+  type result
+    = Pass
+    | Fail
+    | Softfail
+    | Neutral
+    | No_policy
+        (** No record, or the sender domain is not a valid domain. *)
+    | Temperror
+    | Permerror
+
+  val enable : unit -> unit
+    (** Enables evaluation of every envelope sender. Must be called before
+        {!register}. *)
+
+  val check : ctx -> string -> unit
+    (** Starts a new evaluation for the given sender, such as an address
+        from the message headers, replacing the current one. *)
+
+  val result : ctx -> result option
+    (** Returns the result for the current sender, or [None] if answers
+        are still outstanding. Never blocks. *)
+
+  val wait : ctx -> float -> unit
+    (** [wait ctx timeout] blocks for at most [timeout] seconds until the
+        result is known. Other callbacks keep running meanwhile. *)
+
+  val stats : unit -> int * int
+    (** Returns the number of evaluations answered from the result cache
+        and the number that were not. *)
+end
+
+(** Rate limiting shared between processes.
+
+    Token buckets are kept in a memory-mapped file. Any number of filter
+    processes may use the same file at once; updates are lock-free and
+    take well under a microsecond, so they may be done from any callback
+    while holding the runtime lock. *)
+module Ratelimit : sig
+  type t
+    (** A rate limit table. *)
+
+  val openfile : string -> int -> t
+    (** [openfile path slots] maps the table stored in [path], creating it
+        with room for [slots] keys (rounded up to a power of two) if it
+        does not exist. An existing table keeps its original size. *)
+
+  val take : t -> string -> float -> float -> bool
+    (** [take t key rate burst] takes a token from the bucket of [key],
+        which holds at most [burst] tokens and is refilled with [rate]
+        tokens per second. Returns [false], taking nothing, if the bucket
+        is empty. Buckets hold at most about a million tokens, with a
+        precision of 1/16 of a token. If the table is too full to hold
+        [key], the request is allowed. Keys only take over the slots of
+        buckets that have refilled at their own rate. *)
+
+  val peek : t -> string -> float -> float -> float
+    (** [peek t key rate burst] returns the number of tokens left in the
+        bucket of [key] without taking any. *)
+end
+
+(** Greylisting.
+
+    Triplets of client network, sender and recipient are stored in a
+    memory-mapped file, which several filter processes may share. Lookups
+    are lock-free and take a few microseconds, so they may be done from the
+    [envrcpt] callback while holding the runtime lock. Each process that
+    opens the file also expires old entries from it in the background. *)
+module Greylist : sig
+  type t
+    (** A greylisting table. *)
+
+  type policy =
+    { delay  : int
+        (** Seconds a triplet is deferred after it is first seen. *)
+    ; retry  : int
+        (** Seconds a deferred triplet is remembered waiting for a retry. *)
+    ; expire : int
+        (** Seconds a triplet that passed is remembered after it was last
+            seen. *)
+    }
+
+  type result
+    = Pass
+    | Defer of int
+        (** The triplet must be retried after the given number of
+            seconds. *)
+
+  val openfile : string -> int -> policy -> t
+    (** [openfile path slots policy] maps the table stored in [path],
+        creating it with room for [slots] triplets (rounded up to a power of
+        two) if it does not exist. An existing table keeps its original
+        size. *)
+
+  val check : t -> Unix.inet_addr -> string -> string -> result
+    (** [check t addr sender rcpt] records a delivery attempt and tells
+        whether it may proceed. Clients are grouped by /24 (IPv4) or /64
+        (IPv6) network, and addresses are compared case-insensitively. If
+        the table is too full to hold the triplet, the attempt passes. *)
+end
+
+(** Asynchronous logging.
+
+    Messages are copied into a buffer owned by the calling thread, without
+    taking any lock or doing any I/O; a background thread writes them out
+    every few tens of milliseconds, one line each, in time order. If a
+    thread logs faster than that, excess messages are dropped and counted
+    rather than slowing mail flow down. Messages are truncated to 232
+    bytes. Errors raised as [Milter_error] are logged as well. *)
+module Log : sig
+  type level
+    = Debug
+    | Info
+    | Notice
+    | Warning
+    | Error
+
+  val openfile : string -> unit
+    (** [openfile path] opens [path] for appending and starts logging to it.
+        Calling it again, for instance after the file was rotated, reopens
+        the log. Messages logged before the first call are discarded. *)
+
+  val setlevel : level -> unit
+    (** Sets the least severe level logged. The default is [Info]. *)
+
+  val enabled : level -> bool
+    (** Tells whether messages of the given level are logged. *)
+
+  val log : ?ctx:ctx -> level -> string -> unit
+    (** Logs a message. When [ctx] is given, the line is tagged with the
+        connection it belongs to. *)
+
+  val logf : ?ctx:ctx -> level -> ('a, unit, string, unit) format4 -> 'a
+    (** Like {!log}, with a format string. Nothing is formatted if the level
+        is not logged. *)
+
+  val dropped : unit -> int
+    (** Returns the number of messages dropped so far. *)
+end
+
+(** Connection tracing.
+
+    A sample of connections can be traced to a file in the Fuchsia trace
+    format, which can be opened in {{:https://ui.perfetto.dev}Perfetto}.
+    Each traced connection appears as a thread with a span for the
+    connection, one for each message and one for each callback. Callback
+    spans record the time spent waiting for the runtime lock, the size of
+    the callback's arguments and the status it returned.
+
+    Events are buffered in memory and written by a background thread when
+    the connection closes, so tracing adds well under a microsecond to each
+    callback. *)
+module Trace : sig
+  val openfile : string -> int -> unit
+    (** [openfile path n] truncates [path] and traces one connection in [n]
+        to it. Calling it again switches to a new file; connections that
+        were open at the time are written to the new file. *)
+
+  val stop : unit -> unit
+    (** Stops tracing new connections. Connections already being traced
+        are still written when they close. *)
+
+  val dropped : unit -> int
+    (** Returns the number of traced connections that could not be written
+        because the background thread fell behind. *)
+end
+
+(** Message tap.
+
+    The tap keeps a copy of every message, for archiving or offline
+    analysis, without the filter having to rebuild it. Messages are put
+    together in C from the envelope, header and body callbacks, without
+    taking the runtime lock, and written to a spool directory by a
+    background thread once the [eom] callback is reached. Each file holds
+    the envelope sender, the recipients and selected macros as
+    [X-Envelope-From], [X-Envelope-To] and [X-Envelope-Macro] header
+    fields, followed by the message with CRLF line endings.
+
+    The tap needs the header and body callbacks, so the corresponding steps
+    must not be disabled in [negotiate]. *)
+module Tap : sig
+  val start : string -> string list -> (string -> unit) -> unit
+    (** [start dir macros notify] spools messages to [dir], recording the
+        values of [macros] (such as ["i"] or ["{client_addr}"]) as seen at
+        the end of the message. [notify] is called from a background
+        thread with the path of each file once it is safely on disk.
+
+        Must be called before {!register}. *)
+
+  val dropped : unit -> int
+    (** Returns the number of messages that could not be spooled, because
+        the writer fell behind, memory ran out or writing failed. *)
+end
+
+(** Header store.
+
+    When enabled, the header fields of each message are kept in C, indexed
+    by case-insensitive name, as they are received. Lookups by name and
+    occurrence take constant time, and the [chgheader] and [insheader]
+    wrappers below compute the indexes libmilter expects. The store is
+    filled without taking the runtime lock, so no [header] callback is
+    needed. Selectors refer to the header as received, before any change
+    made by the filter. *)
+module Headers : sig
+  type selector
+    = First of string
+    | Last of string
+    | Nth of string * int
+        (** [Nth (name, n)] selects the [n]th field named [name], starting
+            from 1. *)
+
+  val enable : unit -> unit
+    (** Enables the header store. Must be called before {!register}; the
+        functions below raise [Milter_error] if it was not. *)
+
+  val count : ctx -> string -> int
+    (** Returns the number of fields with the given name. *)
+
+  val find : ctx -> selector -> string option
+    (** Returns the value of the selected field. *)
+
+  val find_all : ctx -> string -> string list
+    (** Returns the values of the fields with the given name, from top to
+        bottom. *)
+
+  val to_list : ctx -> (string * string) list
+    (** Returns all fields of the header, from top to bottom. *)
+
+  val change : ctx -> selector -> string option -> unit
+    (** Like {!chgheader}, for the selected field. Raises [Not_found] if
+        there is no such field. Can only be called from the [eom]
+        callback. *)
+
+  val insert_before : ctx -> selector -> string -> string -> unit
+    (** [insert_before ctx sel field value] inserts a field right above the
+        selected one, with {!insheader}. Raises [Not_found] if there is no
+        such field. Can only be called from the [eom] callback. *)
+
+  val insert_after : ctx -> selector -> string -> string -> unit
+    (** Like {!insert_before}, inserting the field right below the selected
+        one. *)
+end
+
+(** Body verdict cache.
+
+    Bulk mail sends the same body to many recipients over many
+    connections. When the cache is enabled, each body is hashed in C as it
+    is received, and the filter can remember the verdict it reached for a
+    body so that later copies skip the analysis. Bodies are compared after
+    ignoring carriage returns, trailing whitespace, runs of whitespace and
+    trailing empty lines. Bodies shorter than 64 bytes are never cached.
+    The cache is shared by all connections and holds a bounded number of
+    verdicts, dropping the least recently used ones. *)
+module Bodycache : sig
+  val setsize : int -> bool -> unit
+    (** [setsize n shortcircuit] enables the cache, which will hold at most
+        [n] verdicts. If [shortcircuit] is [true], a message whose body is
+        in the cache gets the cached verdict at the end of the message
+        without the [eom] callback being called. Must be called before
+        {!register}. *)
+
+  val find : ctx -> stat option
+    (** Returns the cached verdict for the body of the current message.
+        Can only be called from the [eom] callback. *)
+
+  val add : ctx -> stat -> float -> unit
+    (** [add ctx stat ttl] caches [stat] as the verdict for the body of the
+        current message, for [ttl] seconds. Can only be called from the
+        [eom] callback. *)
+
+  val digest : ctx -> string option
+    (** Returns the hash of the body received so far, in hexadecimal. The
+        key of the hash is chosen at random on startup, so digests can only
+        be compared within one process. *)
+
+  val stats : unit -> int * int
+    (** Returns the number of lookups that found a verdict and of those
+        that did not. *)
+end
+
+(** Attachment scanning.
+
+    Attachments are extracted in C as the body is received, decoded from
+    base64 if needed, into anonymous memory files (memfds). Each one is
+    sealed when complete and its descriptor passed to a scanner process
+    over a Unix socket, so attachments are never copied into the OCaml
+    heap nor written to disk. Verdicts are collected in the background
+    while the rest of the message arrives.
+
+    For each attachment the scanner receives a connection carrying one
+    message, ["<size> <filename>\n"], along with the descriptor
+    (SCM_RIGHTS), and must answer with a single line: ["OK"],
+    ["FOUND <name>"] or ["ERROR <reason>"]. *)
+module Scan : sig
+  type verdict
+    = Pending
+    | Clean
+    | Infected of string
+        (** The name of what the scanner found. *)
+    | Failed of string
+        (** The attachment could not be scanned, for the given reason. *)
+
+  type attachment =
+    { filename     : string
+        (** The file name given in the message, or ["partN"]. *)
+    ; content_type : string
+    ; size         : int
+        (** Decoded size in bytes. *)
+    ; verdict      : verdict
+    }
+
+  val setscanner : string -> int -> unit
+    (** [setscanner path max_size] enables scanning, sending attachments of
+        up to [max_size] bytes to the scanner listening on [path]. Larger
+        attachments fail without being sent. Must be called before
+        {!register}. *)
+
+  val wait : ctx -> float -> unit
+    (** [wait ctx timeout] blocks for at most [timeout] seconds until every
+        attachment of the current message has a verdict. Other callbacks
+        keep running meanwhile. Should be called from the [eom] callback,
+        where all attachments are known. *)
+
+  val results : ctx -> attachment list
+    (** Returns the attachments of the current message, in order. *)
+end
+
+(** Envelope address parsing.
+
+    Once enabled, the arguments of the [envfrom] and [envrcpt] callbacks
+    are parsed in C according to the RFC 5321 path syntax, before the
+    callbacks are called, so filters need not parse them again. *)
+module Envelope : sig
+  type path =
+    { null   : bool
+        (** Whether this is the null reverse-path, [<>]. *)
+    ; local  : string
+        (** The local part, without quoting if it was a quoted string. *)
+    ; domain : string
+        (** The domain, lowercased, or the address literal in brackets.
+            Empty for the null path and for [<Postmaster>]. *)
+    ; params : (string * string option) list
+        (** ESMTP parameters, with uppercased keywords and values as they
+            were given, in the order of the arguments. *)
+    }
+
+  val enable : unit -> unit
+    (** Enables the parser. Must be called before {!register}. *)
+
+  val sender : ctx -> path option
+    (** Returns the reverse-path of the current message, or [None] if it
+        is not syntactically valid. Source routes are ignored and UTF-8 is
+        accepted as allowed by RFC 6531. *)
+
+  val recipient : ctx -> path option
+    (** Returns the forward-path given to the current [envrcpt] callback,
+        or [None] if it is not syntactically valid. Recipients are parsed
+        even if the filter has no [envrcpt] callback. *)
+
+  val parse : ?recipient:bool -> string -> string list -> path option
+    (** [parse path args] parses a path and its ESMTP arguments, as given
+        to the [envfrom] callback, or to the [envrcpt] callback if
+        [recipient] is [true]. Only reverse-paths may be null and only
+        forward-paths may be [<Postmaster>]. *)
+end
+
+(** Policy tables.
+
+    Read-only key-value tables stored in a memory-mapped file. Nothing is
+    loaded into the OCaml heap, so the GC never scans their data, and
+    opening a table only reads through its index once. Lookups take
+    a few hundred nanoseconds when the pages are resident and may be done
+    from any callback. *)
+module Policy : sig
+  type t
+    (** An open table. *)
+
+  type builder
+    (** A table being written. *)
+
+  val openfile : string -> t
+    (** Maps the table stored in the given file. *)
+
+  val find : t -> string -> string option
+    (** Returns the value of a key. *)
+
+  val mem : t -> string -> bool
+    (** Returns whether a key is in the table. *)
+
+  val length : t -> int
+    (** Returns the number of keys in the table. *)
+
+  val reload : t -> bool
+    (** Maps the file the table was opened from again if it was replaced,
+        returning whether it was. The new file is mapped and checked
+        without blocking other threads, and then takes effect at once for
+        all lookups. On error the current table is kept. *)
+
+  val create : string -> builder
+    (** Starts writing a new table that will replace the given file. The
+        table is written to a temporary file in the same directory, with
+        the permissions of the file it replaces, or [0o644]. *)
+
+  val add : builder -> string -> string -> unit
+    (** [add b key value] adds an entry to the table. If a key is added
+        more than once, its first value is kept. *)
+
+  val commit : builder -> unit
+    (** Writes the index and atomically renames the table into place,
+        syncing the file and its directory to disk. The builder cannot be
+        used afterwards. Tables that are never committed are removed when
+        their builder is garbage collected. *)
+end
+
+(** Worker pool.
+
+    By default each callback runs in the libmilter thread of its
+    connection, and all of these threads compete for the runtime lock.
+    In pool mode, connection threads instead queue their callbacks for a
+    fixed number of worker threads and wait for them. The OCaml runtime
+    is then only entered from the workers, which are registered with it
+    once, and may be pinned to CPUs sharing a cache.
+
+    Time spent in the queue is counted as waiting for the runtime lock by
+    {!setlocktarget} and {!lockwait}. A callback that blocks, for instance
+    in {!Dnsbl.wait}, keeps its worker busy meanwhile. *)
+module Pool : sig
+  type stats =
+    { workers     : int
+    ; busy        : int
+        (** Workers currently running a callback. *)
+    ; queued      : int
+        (** Callbacks currently waiting for a worker. *)
+    ; peak_queued : int
+        (** The most callbacks ever waiting at once. *)
+    ; jobs        : int
+        (** Callbacks run by the pool so far. *)
+    ; queue_wait  : float
+        (** Total time callbacks spent waiting for a worker, in
+            seconds. *)
+    }
+
+  val start : ?cpus:int list -> int -> unit
+    (** [start ~cpus n] starts [n] workers and enables pool mode. Worker
+        [i] is pinned to the [i]-th CPU of [cpus], wrapping around; by
+        default workers are not pinned. Must be called once, before
+        {!register}. *)
+
+  val stats : unit -> stats
+    (** Returns the pool's current state and counters. *)
+end
+
+(** Statistical classification.
+
+    Message bodies are split into tokens in C as they are received, and
+    at end of message each distinct token is looked up in a memory-mapped
+    table of spam and ham counts. The counts are combined into a score
+    with Robinson's chi-squared method, as SpamBayes does. None of this
+    holds the runtime lock or touches the OCaml heap.
+
+    Tables are built offline from messages already sorted into spam and
+    ham, with the functions below or the [milter-bayes] tool. *)
+module Bayes : sig
+  type builder
+    (** A table being built. *)
+
+  val load : string -> unit
+    (** Maps the given token table and enables the classifier, which must
+        first be done before {!register}. Calling [load] again replaces
+        the table; messages being scored keep using the old one until they
+        are done. *)
+
+  val score : ctx -> float option
+    (** Returns the score of the current message, from 0 (ham) to 1
+        (spam), with 0.5 meaning there is not enough evidence. Available
+        from the [eom] callback; messages are only scored when the filter
+        has one, and the score is [None] otherwise. *)
+
+  val create : unit -> builder
+    (** Starts an empty table. *)
+
+  val update : string -> builder
+    (** Starts a table with the counts of an existing one. *)
+
+  val train : builder -> spam:bool -> string -> unit
+    (** [train b ~spam body] counts the tokens of a message body. *)
+
+  val commit : builder -> string -> unit
+    (** Writes the table to the given file, atomically replacing it and
+        keeping its permissions, or [0o644] for a new file. The file and
+        its directory are synced to disk. *)
+end
+
+(** Memory accounting.
+
+    Each connection is charged for the buffers the native features keep
+    for it, the callback arguments handed to OCaml during the current
+    message, and its {!setpriv} value. Charges are brought up to date
+    when a callback starts; the process total also includes messages
+    queued by the {!Tap}. A connection over its limit, or any connection
+    while the total is over the global limit, gets a temporary failure
+    before its data reaches the native features or OCaml.
+
+    Body chunks are not charged, as OCaml sees them without a copy; the
+    parts kept with {!Body.retain} are charged as native buffers. *)
+module Memory : sig
+  type usage =
+    { native : int
+        (** Buffers kept by the native features, in bytes. *)
+    ; copied : int
+        (** Callback arguments copied to OCaml during the current
+            message. *)
+    ; priv   : int
+        (** Size of the {!setpriv} value when it was last set; only
+            measured while a limit is set. *)
+    ; peak   : int
+        (** The largest charge of the connection so far. *)
+    }
+
+  val setlimits : ?connection:int -> ?total:int -> unit -> unit
+    (** Sets the per-connection and process ceilings, in bytes; zero, the
+        default, means no limit. Should be called before {!register}. *)
+
+  val usage : ctx -> usage
+    (** Returns what the connection was charged when its current
+        callback started. *)
+
+  val total : unit -> int
+    (** Returns the memory charged to all connections, in bytes. *)
+
+  val refusals : unit -> int
+    (** Returns the number of callbacks refused for exceeding a limit. *)
+end
+
+(** Borrowed body views.
+
+    The bigarray passed to the [body] callback points into a buffer owned
+    by libmilter, which is reused once the callback returns. A view gives
+    access to the same chunk without a copy, but checks on every access
+    that the callback has not returned, raising [Milter_error] otherwise.
+
+    Data that must outlive the callback is copied with {!retain} into a
+    buffer kept by the connection and reused for later copies, so that
+    retaining chunks does not allocate once the connection has warmed up.
+    Retained views stay valid until they are released, the next message
+    starts or the message is aborted. Their buffers are freed when the
+    connection closes. *)
+module Body : sig
+  type view
+
+  val view : ctx -> view
+    (** Returns a view of the current chunk. Can only be called from the
+        [body] callback. *)
+
+  val length : view -> int
+    (** Returns the length of the view, even once it is no longer
+        valid. *)
+
+  val valid : view -> bool
+    (** Returns whether the view can still be accessed. *)
+
+  val get : view -> int -> char
+    (** [get v i] returns the byte at position [i]. *)
+
+  val sub : view -> int -> int -> string
+    (** [sub v pos len] copies [len] bytes starting at [pos]. *)
+
+  val to_string : view -> string
+    (** Copies the whole view. *)
+
+  val blit : view -> int -> bytes -> int -> int -> unit
+    (** [blit v pos dst dst_pos len] copies [len] bytes starting at [pos]
+        to [dst], starting at [dst_pos]. *)
+
+  val retain : view -> view
+    (** Copies the view into a buffer of the connection and returns a view
+        of the copy, which is valid until the end of the message. *)
+
+  val release : view -> unit
+    (** Returns the buffer of a retained view to the connection, which
+        invalidates the view. Does nothing for other views. Retained views
+        that are garbage collected are released as well. *)
+end
+
+(** URL extraction.
+
+    Body chunks are scanned in C as they are received. The MIME structure
+    of the message is followed to find its text parts, which are decoded
+    from quoted-printable or base64 on the fly, so URLs are found across
+    chunks, soft line breaks and HTML attributes alike. Other parts, and
+    the preamble and epilogue of multipart messages, are skipped.
+
+    Each URL is normalized so that it can be looked up as is: the scheme
+    and host are lowercased, the host is percent-decoded and converted to
+    its IDNA form, numeric IPv4 hosts are written as dotted quads, HTML
+    entities, user information, default ports and fragments are removed,
+    and percent-escapes in the path are decoded when they stand for
+    unreserved characters and uppercased otherwise. Only ASCII letters are
+    lowercased in internationalized hosts. *)
+module Urls : sig
+  type url =
+    { url  : string
+        (** The normalized URL. *)
+    ; host : string
+        (** Its host, as it appears in [url]. *)
+    }
+
+  val enable : ?max:int -> unit -> unit
+    (** Enables extraction, keeping at most [max] distinct URLs per
+        message, 1024 by default. Must be called before {!register}. *)
+
+  val get : ctx -> url list
+    (** Returns the distinct URLs of the current message, in order of
+        first appearance. Available from the [eom] callback. *)
+end
+
+(** DKIM signing.
+
+    While signing is enabled, the body of every message is canonicalized
+    and hashed in C as it is received, and the headers to be signed are
+    copied from the [header] callback. Signing at end of message then only
+    has to hash those headers and compute the RSA-SHA256 signature, which
+    is done without the runtime lock, so that it does not hold up the
+    callbacks of other connections.
+
+    Private keys are parsed once, when loaded, and cached per selector and
+    domain. The signature is inserted as the first header of the message,
+    which requires the [ADDHDRS] flag. *)
+module Dkim : sig
+  type canonicalization = Simple | Relaxed
+
+  val default_headers : string list
+    (** The headers signed by default, from the list recommended by RFC
+        6376. *)
+
+  val enable : ?headers:string list -> ?header:canonicalization ->
+               ?body:canonicalization -> unit -> unit
+    (** Enables signing of the given headers, which must include [From],
+        with the given header and body canonicalizations, both [Relaxed]
+        by default. Must be called before {!register}. As libmilter
+        removes the whitespace after the colon of header names, [Simple]
+        header canonicalization only gives valid signatures for headers
+        written as [Name: value]. *)
+
+  val load_key : selector:string -> domain:string -> string -> unit
+    (** [load_key ~selector ~domain path] loads the RSA private key in the
+        given PEM file, replacing any key previously loaded for the same
+        selector and domain. Messages being signed keep using the old
+        key. *)
+
+  val sign : ctx -> selector:string -> domain:string -> unit
+    (** Signs the current message with the key loaded for the selector and
+        domain, and inserts the resulting [DKIM-Signature] header. Can only
+        be called from the [eom] callback, possibly more than once, for
+        example to sign with several domains. *)
+end
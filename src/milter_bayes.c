@@ -0,0 +1,807 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Statistical body classifier. Body chunks are split into tokens in C as
+ * they arrive, without the runtime lock, and the distinct tokens of each
+ * message are collected in a small hash set. At end of message their
+ * spam and ham counts are looked up in a memory-mapped token table and
+ * combined into a score with Robinson's chi-squared method, as in
+ * SpamBayes.
+ *
+ * Tokens are runs of letters, digits, bytes above 0x7f and the characters
+ * in BAYES_INNER, with the punctuation in BAYES_TRIM trimmed from their
+ * ends, ASCII lowercased and between BAYES_MIN_TOKEN and BAYES_MAX_TOKEN
+ * bytes long. '@' and '$' are kept, so that "$100" and "user@" stay
+ * distinct from "100" and "user".
+ * Tables are built with the same tokenizer from the training functions
+ * below, so the two always agree.
+ *
+ * The table in use is reference counted: a new one may be loaded at any
+ * time, and the old one is unmapped once no message is being scored
+ * against it.
+ */
+
+#define BAYES_MAGIC      0x4d425931 /* "MBY1" */
+#define BAYES_VERSION    1
+#define BAYES_MIN_TOKEN  3
+#define BAYES_MAX_TOKEN  24
+#define BAYES_MAX_SEEN   65536
+#define BAYES_INNER      "'-._@$"
+#define BAYES_TRIM       "'-._"
+
+/* SpamBayes defaults. */
+#define BAYES_S          0.45
+#define BAYES_X          0.5
+#define BAYES_MIN_STRENGTH 0.1
+#define BAYES_MAX_CLUES  150
+
+struct bayes_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nslots;
+    uint64_t count;
+    uint64_t nspam;     /* Messages trained on. */
+    uint64_t nham;
+    int64_t created;
+    uint64_t reserved[2];
+};
+
+struct bayes_slot {
+    uint64_t hash;      /* Zero for empty slots. */
+    uint32_t spam;
+    uint32_t ham;
+};
+
+struct bayes_table {
+    struct bayes_header *h;
+    struct bayes_slot *slots;
+    size_t len;
+    int refs;
+};
+
+/* Distinct tokens of a message and the token cut by the end of a chunk. */
+struct bayes_tokens {
+    uint64_t *seen;
+    int nseen;
+    int size;
+    char tok[BAYES_MAX_TOKEN];
+    int toklen;
+    int toolong;
+};
+
+struct milter_bayes {
+    struct bayes_tokens tokens;
+    int scored;
+    double score;
+};
+
+struct bayes_builder {
+    struct bayes_slot *slots;
+    uint64_t nslots;
+    uint64_t count;
+    uint64_t nspam;
+    uint64_t nham;
+};
+
+#define Bayes_builder_val(v) (*(struct bayes_builder **)Data_custom_val(v))
+
+static pthread_mutex_t bayes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct bayes_table *bayes_current = NULL;
+static int bayes_enabled = 0;
+
+int
+milter_bayes_enabled(void)
+{
+    return bayes_enabled;
+}
+
+/* Tokenizer. */
+
+static int
+bayes_word(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c >= 0x80
+        || (c != '\0' && strchr(BAYES_INNER, c) != NULL);
+}
+
+#ifdef __SSE2__
+/* Returns a mask of the word characters among the 16 bytes at p. */
+static unsigned
+bayes_mask16(const unsigned char *p)
+{
+    __m128i v, l, m;
+
+    v = _mm_loadu_si128((const __m128i *)p);
+
+    /* Bytes above 0x7f are negative. */
+    m = _mm_cmplt_epi8(v, _mm_setzero_si128());
+
+    /* Range checks as signed comparisons: c - lo + 0x80 < hi - lo - 0x80. */
+    l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    l = _mm_add_epi8(l, _mm_set1_epi8((char)(0x80 - 'a')));
+    m = _mm_or_si128(m, _mm_cmplt_epi8(l, _mm_set1_epi8((char)(26 - 0x80))));
+    l = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - '0')));
+    m = _mm_or_si128(m, _mm_cmplt_epi8(l, _mm_set1_epi8((char)(10 - 0x80))));
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('@')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/* Returns the length of the leading run of bytes that are (or are not,
+ * if word is zero) word characters. */
+static size_t
+bayes_span(const unsigned char *p, size_t len, int word)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    unsigned mask;
+
+    for (; i + 16 <= len; i += 16) {
+        mask = bayes_mask16(p + i);
+        if (word)
+            mask = ~mask & 0xffff;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++)
+        if (bayes_word(p[i]) != word)
+            break;
+    return i;
+}
+
+static void
+bayes_add(struct bayes_tokens *t, uint64_t hash)
+{
+    int i, j, size;
+    uint64_t *seen;
+
+    if (hash == 0)
+        hash = 1;
+    if (2 * (t->nseen + 1) > t->size) {
+        if (t->nseen >= BAYES_MAX_SEEN)
+            return;
+        size = t->size == 0 ? 1024 : t->size * 2;
+        seen = calloc(size, sizeof(*seen));
+        if (seen == NULL)
+            return;
+        for (i = 0; i < t->size; i++) {
+            if (t->seen[i] == 0)
+                continue;
+            for (j = t->seen[i] & (size - 1); seen[j] != 0;
+                 j = (j + 1) & (size - 1))
+                ;
+            seen[j] = t->seen[i];
+        }
+        free(t->seen);
+        t->seen = seen;
+        t->size = size;
+    }
+
+    for (i = hash & (t->size - 1); t->seen[i] != 0; i = (i + 1) & (t->size - 1))
+        if (t->seen[i] == hash)
+            return;
+    t->seen[i] = hash;
+    t->nseen++;
+}
+
+static void
+bayes_end(struct bayes_tokens *t)
+{
+    int start = 0, end = t->toklen;
+
+    while (start < end && strchr(BAYES_TRIM, t->tok[start]) != NULL)
+        start++;
+    while (end > start && strchr(BAYES_TRIM, t->tok[end - 1]) != NULL)
+        end--;
+    if (!t->toolong && end - start >= BAYES_MIN_TOKEN)
+        bayes_add(t, milter_hash64(t->tok + start, end - start));
+    t->toklen = 0;
+    t->toolong = 0;
+}
+
+static void
+bayes_feed(struct bayes_tokens *t, const unsigned char *data, size_t len)
+{
+    int j;
+    size_t i, n;
+
+    i = 0;
+    while (i < len) {
+        if (t->toklen == 0 && !t->toolong) {
+            i += bayes_span(data + i, len - i, 0);
+            if (i == len)
+                break;
+        }
+
+        n = bayes_span(data + i, len - i, 1);
+        if (t->toolong || t->toklen + n > BAYES_MAX_TOKEN) {
+            t->toolong = 1;
+        } else {
+            for (j = 0; j < (int)n; j++) {
+                t->tok[t->toklen + j] = data[i + j] >= 'A' && data[i + j] <= 'Z'
+                                      ? data[i + j] + ('a' - 'A')
+                                      : data[i + j];
+            }
+            t->toklen += n;
+        }
+        i += n;
+
+        /* A token reaching the end of the chunk may continue in the next. */
+        if (i < len)
+            bayes_end(t);
+    }
+}
+
+static void
+bayes_tokens_clear(struct bayes_tokens *t)
+{
+    if (t->nseen > 0)
+        memset(t->seen, 0, t->size * sizeof(*t->seen));
+    t->nseen = 0;
+    t->toklen = 0;
+    t->toolong = 0;
+}
+
+/* Token tables. */
+
+static struct bayes_table *
+bayes_map(const char *path)
+{
+    int fd;
+    void *base;
+    struct stat st;
+    struct bayes_header *h;
+    struct bayes_table *t;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    h = base;
+    if (h->magic != BAYES_MAGIC || h->version != BAYES_VERSION
+            || h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0
+            || h->count >= h->nslots
+            || (st.st_size - sizeof(*h)) / sizeof(struct bayes_slot)
+               != h->nslots) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    t = malloc(sizeof(*t));
+    if (t == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    t->h = h;
+    t->slots = (struct bayes_slot *)(h + 1);
+    t->len = st.st_size;
+    t->refs = 1;
+    return t;
+}
+
+static struct bayes_table *
+bayes_acquire(void)
+{
+    struct bayes_table *t;
+
+    pthread_mutex_lock(&bayes_mutex);
+    t = bayes_current;
+    if (t != NULL)
+        t->refs++;
+    pthread_mutex_unlock(&bayes_mutex);
+    return t;
+}
+
+static void
+bayes_release(struct bayes_table *t)
+{
+    int refs;
+
+    if (t == NULL)
+        return;
+    pthread_mutex_lock(&bayes_mutex);
+    refs = --t->refs;
+    pthread_mutex_unlock(&bayes_mutex);
+    if (refs == 0) {
+        munmap(t->h, t->len);
+        free(t);
+    }
+}
+
+/* Probes at most nslots slots, so that a table with no free slot left,
+ * which only a corrupt file can be, does not make lookups spin. */
+static const struct bayes_slot *
+bayes_lookup(const struct bayes_slot *slots, uint64_t nslots, uint64_t hash)
+{
+    uint64_t i, n, mask = nslots - 1;
+
+    for (i = hash & mask, n = 0; n < nslots && slots[i].hash != 0;
+         i = (i + 1) & mask, n++)
+        if (slots[i].hash == hash)
+            return &slots[i];
+    return NULL;
+}
+
+static int
+bayes_strength_cmp(const void *a, const void *b)
+{
+    double x = fabs(*(const double *)a - 0.5);
+    double y = fabs(*(const double *)b - 0.5);
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Returns the probability that the sum of v/2 chi-squared variables with
+ * two degrees of freedom is at least x2; v is even. */
+static double
+bayes_chi2q(double x2, int v)
+{
+    int i;
+    double m = x2 / 2.0, sum, term;
+
+    sum = term = exp(-m);
+    for (i = 1; i < v / 2; i++) {
+        term *= m / i;
+        sum += term;
+    }
+    return sum < 1.0 ? sum : 1.0;
+}
+
+static double
+bayes_classify(const struct bayes_table *t, const struct bayes_tokens *tok)
+{
+    int i, n;
+    double *clues, f, spam, ham, s, h;
+    const struct bayes_slot *slot;
+
+    if (t->h->nspam == 0 || t->h->nham == 0)
+        return 0.5;
+    clues = malloc(tok->nseen * sizeof(*clues) + 1);
+    if (clues == NULL)
+        return 0.5;
+
+    n = 0;
+    for (i = 0; i < tok->size; i++) {
+        if (tok->seen[i] == 0)
+            continue;
+        slot = bayes_lookup(t->slots, t->h->nslots, tok->seen[i]);
+        if (slot == NULL)
+            continue;
+        spam = (double)slot->spam / t->h->nspam;
+        ham = (double)slot->ham / t->h->nham;
+        if (spam + ham == 0.0)
+            continue;
+        f = spam / (spam + ham);
+        f = (BAYES_S * BAYES_X + (slot->spam + slot->ham) * f)
+          / (BAYES_S + slot->spam + slot->ham);
+        if (fabs(f - 0.5) >= BAYES_MIN_STRENGTH)
+            clues[n++] = f;
+    }
+
+    if (n > BAYES_MAX_CLUES) {
+        qsort(clues, n, sizeof(*clues), bayes_strength_cmp);
+        n = BAYES_MAX_CLUES;
+    }
+    if (n == 0) {
+        free(clues);
+        return 0.5;
+    }
+
+    s = h = 0.0;
+    for (i = 0; i < n; i++) {
+        s += log1p(-clues[i]);
+        h += log(clues[i]);
+    }
+    free(clues);
+
+    s = 1.0 - bayes_chi2q(-2.0 * s, 2 * n);
+    h = 1.0 - bayes_chi2q(-2.0 * h, 2 * n);
+    return (s - h + 1.0) / 2.0;
+}
+
+/* Connection hooks. */
+
+static struct milter_bayes *
+bayes_get(SMFICTX *ctx)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->bayes == NULL)
+        p->bayes = calloc(1, sizeof(*p->bayes));
+    return p->bayes;
+}
+
+void
+milter_bayes_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+
+    if (!bayes_enabled)
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || p->bayes == NULL)
+        return;
+    bayes_tokens_clear(&p->bayes->tokens);
+    p->bayes->scored = 0;
+}
+
+void
+milter_bayes_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    struct milter_bayes *b;
+
+    if (!bayes_enabled || (b = bayes_get(ctx)) == NULL)
+        return;
+    bayes_feed(&b->tokens, data, len);
+}
+
+/* Only called when the filter has an eom callback, the only place the
+ * score can be read from. */
+void
+milter_bayes_eom(SMFICTX *ctx)
+{
+    struct bayes_table *t;
+    struct milter_bayes *b;
+
+    if (!bayes_enabled || (b = bayes_get(ctx)) == NULL)
+        return;
+    if (b->tokens.toklen > 0)
+        bayes_end(&b->tokens);
+    if ((t = bayes_acquire()) == NULL)
+        return;
+    b->score = bayes_classify(t, &b->tokens);
+    b->scored = 1;
+    bayes_release(t);
+}
+
+void
+milter_bayes_free(struct milter_priv *p)
+{
+    if (p->bayes == NULL)
+        return;
+    free(p->bayes->tokens.seen);
+    free(p->bayes);
+    p->bayes = NULL;
+}
+
+size_t
+milter_bayes_memory(const struct milter_priv *p)
+{
+    if (p->bayes == NULL)
+        return 0;
+    return sizeof(*p->bayes) + p->bayes->tokens.size * sizeof(uint64_t);
+}
+
+CAMLprim value
+caml_milter_bayes_load(value path_val)
+{
+    CAMLparam1(path_val);
+    char *path;
+    struct bayes_table *t, *old;
+
+    path = strdup(String_val(path_val));
+    if (path == NULL)
+        milter_error("Milter.Bayes.load");
+
+    caml_release_runtime_system();
+    t = bayes_map(path);
+    caml_acquire_runtime_system();
+    free(path);
+    if (t == NULL)
+        milter_error("Milter.Bayes.load");
+
+    pthread_mutex_lock(&bayes_mutex);
+    old = bayes_current;
+    bayes_current = t;
+    pthread_mutex_unlock(&bayes_mutex);
+    bayes_release(old);
+
+    bayes_enabled = 1;
+    milter_log(MILTER_LOG_INFO, NULL,
+               "bayes: loaded %s, %llu tokens, %llu spam, %llu ham",
+               String_val(path_val), (unsigned long long)t->h->count,
+               (unsigned long long)t->h->nspam,
+               (unsigned long long)t->h->nham);
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_bayes_score(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal1(v);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->bayes == NULL || !p->bayes->scored)
+        CAMLreturn(Val_none);
+    v = caml_copy_double(p->bayes->score);
+    CAMLreturn(Val_some(v));
+}
+
+/* Training. */
+
+static void
+bayes_builder_finalize(value b_val)
+{
+    struct bayes_builder *b = Bayes_builder_val(b_val);
+
+    if (b == NULL)
+        return;
+    free(b->slots);
+    free(b);
+}
+
+static struct custom_operations bayes_builder_ops = {
+    "milter.bayes.builder",
+    bayes_builder_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+static struct bayes_slot *
+bayes_builder_slot(struct bayes_builder *b, uint64_t hash)
+{
+    uint64_t i, j, nslots;
+    struct bayes_slot *slots;
+
+    if (2 * (b->count + 1) > b->nslots) {
+        nslots = b->nslots == 0 ? 65536 : b->nslots * 2;
+        slots = calloc(nslots, sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+        for (i = 0; i < b->nslots; i++) {
+            if (b->slots[i].hash == 0)
+                continue;
+            for (j = b->slots[i].hash & (nslots - 1); slots[j].hash != 0;
+                 j = (j + 1) & (nslots - 1))
+                ;
+            slots[j] = b->slots[i];
+        }
+        free(b->slots);
+        b->slots = slots;
+        b->nslots = nslots;
+    }
+
+    for (i = hash & (b->nslots - 1); b->slots[i].hash != 0;
+         i = (i + 1) & (b->nslots - 1))
+        if (b->slots[i].hash == hash)
+            return &b->slots[i];
+    b->slots[i].hash = hash;
+    b->count++;
+    return &b->slots[i];
+}
+
+static value
+bayes_builder_alloc(struct bayes_builder *b)
+{
+    CAMLparam0();
+    CAMLlocal1(res);
+
+    res = caml_alloc_custom(&bayes_builder_ops, sizeof(b), 0, 1);
+    Bayes_builder_val(res) = b;
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_bayes_create(value unit)
+{
+    CAMLparam1(unit);
+    struct bayes_builder *b;
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        milter_error("Milter.Bayes.create");
+    CAMLreturn(bayes_builder_alloc(b));
+}
+
+CAMLprim value
+caml_milter_bayes_update(value path_val)
+{
+    CAMLparam1(path_val);
+    uint64_t i;
+    struct bayes_slot *slot;
+    struct bayes_table *t;
+    struct bayes_builder *b;
+
+    t = bayes_map(String_val(path_val));
+    if (t == NULL)
+        milter_error("Milter.Bayes.update");
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        goto fail;
+    b->nspam = t->h->nspam;
+    b->nham = t->h->nham;
+    for (i = 0; i < t->h->nslots; i++) {
+        if (t->slots[i].hash == 0)
+            continue;
+        if ((slot = bayes_builder_slot(b, t->slots[i].hash)) == NULL)
+            goto fail;
+        slot->spam = t->slots[i].spam;
+        slot->ham = t->slots[i].ham;
+    }
+    bayes_release(t);
+
+    CAMLreturn(bayes_builder_alloc(b));
+
+fail:
+    if (b != NULL)
+        free(b->slots);
+    free(b);
+    bayes_release(t);
+    milter_error("Milter.Bayes.update");
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_bayes_train(value b_val, value spam_val, value body_val)
+{
+    CAMLparam3(b_val, spam_val, body_val);
+    int i;
+    struct bayes_slot *slot;
+    struct bayes_tokens t;
+    struct bayes_builder *b = Bayes_builder_val(b_val);
+
+    memset(&t, 0, sizeof(t));
+    bayes_feed(&t, (const unsigned char *)String_val(body_val),
+               caml_string_length(body_val));
+    if (t.toklen > 0)
+        bayes_end(&t);
+
+    for (i = 0; i < t.size; i++) {
+        if (t.seen[i] == 0)
+            continue;
+        if ((slot = bayes_builder_slot(b, t.seen[i])) == NULL) {
+            free(t.seen);
+            milter_error("Milter.Bayes.train");
+        }
+        if (Bool_val(spam_val)) {
+            if (slot->spam < UINT32_MAX)
+                slot->spam++;
+        } else if (slot->ham < UINT32_MAX) {
+            slot->ham++;
+        }
+    }
+    free(t.seen);
+
+    if (Bool_val(spam_val))
+        b->nspam++;
+    else
+        b->nham++;
+
+    CAMLreturn(Val_unit);
+}
+
+static int
+bayes_commit(struct bayes_builder *b, const char *path)
+{
+    int fd;
+    char *tmp;
+    uint64_t i, j, nslots;
+    struct bayes_slot *slots;
+    struct bayes_header h;
+
+    for (nslots = 16; nslots < 2 * b->count + 2; nslots <<= 1)
+        ;
+    slots = calloc(nslots, sizeof(*slots));
+    tmp = malloc(strlen(path) + 8);
+    if (slots == NULL || tmp == NULL) {
+        free(slots);
+        free(tmp);
+        return -1;
+    }
+    for (i = 0; i < b->nslots; i++) {
+        if (b->slots[i].hash == 0)
+            continue;
+        for (j = b->slots[i].hash & (nslots - 1); slots[j].hash != 0;
+             j = (j + 1) & (nslots - 1))
+            ;
+        slots[j] = b->slots[i];
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = BAYES_MAGIC;
+    h.version = BAYES_VERSION;
+    h.nslots = nslots;
+    h.count = b->count;
+    h.nspam = b->nspam;
+    h.nham = b->nham;
+    h.created = milter_clock_ms();
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(slots);
+        free(tmp);
+        return -1;
+    }
+    if (milter_file_mode(fd, path) == -1
+            || write(fd, &h, sizeof(h)) != sizeof(h)
+            || write(fd, slots, nslots * sizeof(*slots))
+               != (ssize_t)(nslots * sizeof(*slots))
+            || fsync(fd) == -1
+            || rename(tmp, path) == -1
+            || milter_fsync_dir(path) == -1) {
+        close(fd);
+        unlink(tmp);
+        free(slots);
+        free(tmp);
+        return -1;
+    }
+
+    close(fd);
+    free(slots);
+    free(tmp);
+    return 0;
+}
+
+CAMLprim value
+caml_milter_bayes_commit(value b_val, value path_val)
+{
+    CAMLparam2(b_val, path_val);
+    int ret;
+    char *path;
+    struct bayes_builder *b = Bayes_builder_val(b_val);
+
+    path = strdup(String_val(path_val));
+    if (path == NULL)
+        milter_error("Milter.Bayes.commit");
+
+    caml_release_runtime_system();
+    ret = bayes_commit(b, path);
+    caml_acquire_runtime_system();
+
+    free(path);
+    if (ret == -1)
+        milter_error("Milter.Bayes.commit");
+    CAMLreturn(Val_unit);
+}
@@ -0,0 +1,436 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Body verdict cache. The body callback hashes each message body as it
+ * streams through, after a canonicalization that ignores CRs, trailing
+ * whitespace, runs of whitespace and trailing empty lines, so that
+ * re-encoded copies of a body hash alike. The hash is SipHash-2-4 with a
+ * random key, which keeps senders from crafting a body that collides with
+ * one already judged.
+ *
+ * Verdicts set by the filter are kept in a bounded LRU cache shared by all
+ * connections. Bodies shorter than BODYCACHE_MIN_LEN canonical bytes are
+ * never cached: they are too likely to be shared by unrelated messages.
+ */
+
+#define BODYCACHE_MIN_LEN 64
+
+struct milter_bodyhash {
+    uint64_t v0, v1, v2, v3;
+    uint64_t tail;
+    uint64_t len;
+    int space;
+    int newlines;
+};
+
+struct bc_entry {
+    uint64_t hash;
+    int64_t expires;
+    int stat;
+    int hnext;
+    int prev;
+    int next;
+};
+
+static int bc_capacity = 0;
+static int bc_shortcircuit = 0;
+static uint64_t bc_k0, bc_k1;
+static long bc_hits = 0;
+static long bc_misses = 0;
+
+static pthread_mutex_t bc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct bc_entry *bc_entries = NULL;
+static int *bc_buckets = NULL;
+static int bc_nbuckets = 0;
+static int bc_count = 0;
+static int bc_head = -1;    /* Most recently used. */
+static int bc_tail = -1;
+
+int
+milter_bodycache_enabled(void)
+{
+    return bc_capacity > 0;
+}
+
+int
+milter_bodycache_shortcircuit(void)
+{
+    return bc_shortcircuit;
+}
+
+/* SipHash-2-4, fed a byte at a time. */
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(h)                                                     \
+    do {                                                                \
+        h->v0 += h->v1; h->v1 = ROTL(h->v1, 13); h->v1 ^= h->v0;        \
+        h->v0 = ROTL(h->v0, 32);                                        \
+        h->v2 += h->v3; h->v3 = ROTL(h->v3, 16); h->v3 ^= h->v2;        \
+        h->v0 += h->v3; h->v3 = ROTL(h->v3, 21); h->v3 ^= h->v0;        \
+        h->v2 += h->v1; h->v1 = ROTL(h->v1, 17); h->v1 ^= h->v2;        \
+        h->v2 = ROTL(h->v2, 32);                                        \
+    } while (0)
+
+static void
+bh_init(struct milter_bodyhash *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->v0 = bc_k0 ^ 0x736f6d6570736575ULL;
+    h->v1 = bc_k1 ^ 0x646f72616e646f6dULL;
+    h->v2 = bc_k0 ^ 0x6c7967656e657261ULL;
+    h->v3 = bc_k1 ^ 0x7465646279746573ULL;
+}
+
+static inline void
+bh_byte(struct milter_bodyhash *h, unsigned char c)
+{
+    h->tail |= (uint64_t)c << (8 * (h->len & 7));
+    if ((++h->len & 7) == 0) {
+        h->v3 ^= h->tail;
+        SIPROUND(h);
+        SIPROUND(h);
+        h->v0 ^= h->tail;
+        h->tail = 0;
+    }
+}
+
+/* Works on a copy, so the body may still be fed afterwards. */
+static uint64_t
+bh_final(const struct milter_bodyhash *state)
+{
+    uint64_t b;
+    struct milter_bodyhash copy = *state, *h = &copy;
+
+    b = h->len << 56 | h->tail;
+    h->v3 ^= b;
+    SIPROUND(h);
+    SIPROUND(h);
+    h->v0 ^= b;
+    h->v2 ^= 0xff;
+    SIPROUND(h);
+    SIPROUND(h);
+    SIPROUND(h);
+    SIPROUND(h);
+    return h->v0 ^ h->v1 ^ h->v2 ^ h->v3;
+}
+
+static struct milter_bodyhash *
+bh_get(SMFICTX *ctx)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->bodyhash == NULL && (p->bodyhash = malloc(sizeof(*p->bodyhash))))
+        bh_init(p->bodyhash);
+    return p->bodyhash;
+}
+
+void
+milter_bodycache_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+
+    if (!milter_bodycache_enabled())
+        return;
+    p = smfi_getpriv(ctx);
+    if (p != NULL && p->bodyhash != NULL)
+        bh_init(p->bodyhash);
+}
+
+void
+milter_bodycache_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t i;
+    unsigned char c;
+    struct milter_bodyhash *h;
+
+    if (!milter_bodycache_enabled() || (h = bh_get(ctx)) == NULL)
+        return;
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        switch (c) {
+        case '\r':
+            break;
+        case ' ':
+        case '\t':
+            h->space = 1;
+            break;
+        case '\n':
+            h->space = 0;
+            h->newlines++;
+            break;
+        default:
+            for (; h->newlines > 0; h->newlines--)
+                bh_byte(h, '\n');
+            if (h->space) {
+                bh_byte(h, ' ');
+                h->space = 0;
+            }
+            bh_byte(h, c);
+            break;
+        }
+    }
+}
+
+void
+milter_bodycache_free(struct milter_priv *p)
+{
+    free(p->bodyhash);
+    p->bodyhash = NULL;
+}
+
+size_t
+milter_bodycache_memory(const struct milter_priv *p)
+{
+    return p->bodyhash != NULL ? sizeof(*p->bodyhash) : 0;
+}
+
+/* The hash of the current body, or 0 if it is not to be cached. */
+static uint64_t
+bc_key(SMFICTX *ctx)
+{
+    uint64_t hash;
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || p->bodyhash == NULL
+            || p->bodyhash->len < BODYCACHE_MIN_LEN)
+        return 0;
+    hash = bh_final(p->bodyhash);
+    return hash == 0 ? 1 : hash;
+}
+
+/* LRU cache, under bc_mutex. */
+
+static void
+bc_unlink(int i)
+{
+    struct bc_entry *e = &bc_entries[i];
+
+    if (e->prev != -1)
+        bc_entries[e->prev].next = e->next;
+    else
+        bc_head = e->next;
+    if (e->next != -1)
+        bc_entries[e->next].prev = e->prev;
+    else
+        bc_tail = e->prev;
+}
+
+static void
+bc_push(int i)
+{
+    struct bc_entry *e = &bc_entries[i];
+
+    e->prev = -1;
+    e->next = bc_head;
+    if (bc_head != -1)
+        bc_entries[bc_head].prev = i;
+    bc_head = i;
+    if (bc_tail == -1)
+        bc_tail = i;
+}
+
+static int
+bc_find(uint64_t hash)
+{
+    int i;
+
+    for (i = bc_buckets[hash & (bc_nbuckets - 1)]; i != -1;
+         i = bc_entries[i].hnext)
+        if (bc_entries[i].hash == hash)
+            return i;
+    return -1;
+}
+
+static void
+bc_unhash(int i)
+{
+    int *ip;
+
+    for (ip = &bc_buckets[bc_entries[i].hash & (bc_nbuckets - 1)];
+         *ip != i; ip = &bc_entries[*ip].hnext)
+        ;
+    *ip = bc_entries[i].hnext;
+}
+
+/* Returns the cached stat for the current body, or -1. */
+int
+milter_bodycache_lookup(SMFICTX *ctx)
+{
+    int i, stat;
+    uint64_t hash;
+
+    if (!milter_bodycache_enabled() || (hash = bc_key(ctx)) == 0)
+        return -1;
+
+    stat = -1;
+    pthread_mutex_lock(&bc_mutex);
+    i = bc_find(hash);
+    if (i != -1 && bc_entries[i].expires <= milter_now()) {
+        bc_unlink(i);
+        bc_unhash(i);
+        /* Moved to the tail so it is reused first. */
+        bc_entries[i].hash = 0;
+        bc_entries[i].prev = bc_tail;
+        bc_entries[i].next = -1;
+        if (bc_tail != -1)
+            bc_entries[bc_tail].next = i;
+        else
+            bc_head = i;
+        bc_tail = i;
+        i = -1;
+    }
+    if (i != -1) {
+        stat = bc_entries[i].stat;
+        bc_unlink(i);
+        bc_push(i);
+    }
+    pthread_mutex_unlock(&bc_mutex);
+
+    if (stat == -1)
+        __atomic_add_fetch(&bc_misses, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&bc_hits, 1, __ATOMIC_RELAXED);
+    return stat;
+}
+
+static void
+bc_store(uint64_t hash, int stat, int64_t ttl)
+{
+    int i;
+
+    pthread_mutex_lock(&bc_mutex);
+    i = bc_find(hash);
+    if (i != -1) {
+        bc_unlink(i);
+    } else {
+        if (bc_count < bc_capacity) {
+            i = bc_count++;
+        } else {
+            i = bc_tail;
+            bc_unlink(i);
+            if (bc_entries[i].hash != 0)
+                bc_unhash(i);
+        }
+        bc_entries[i].hash = hash;
+        bc_entries[i].hnext = bc_buckets[hash & (bc_nbuckets - 1)];
+        bc_buckets[hash & (bc_nbuckets - 1)] = i;
+    }
+    bc_entries[i].stat = stat;
+    bc_entries[i].expires = milter_now() + ttl;
+    bc_push(i);
+    pthread_mutex_unlock(&bc_mutex);
+}
+
+static void
+bc_seed(void)
+{
+    int fd;
+    uint64_t key[2];
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || read(fd, key, sizeof(key)) != sizeof(key)) {
+        key[0] = milter_now() ^ (uint64_t)getpid() << 32;
+        key[1] = milter_hash64(key, sizeof(key[0]));
+    }
+    if (fd != -1)
+        close(fd);
+    bc_k0 = key[0];
+    bc_k1 = key[1];
+}
+
+CAMLprim value
+caml_milter_bodycache_setsize(value size_val, value shortcircuit_val)
+{
+    CAMLparam2(size_val, shortcircuit_val);
+    int i, n, size = Int_val(size_val);
+
+    if (bc_capacity > 0 || size < 1)
+        milter_error("Milter.Bodycache.setsize");
+
+    for (n = 1; n < 2 * size; n *= 2)
+        ;
+    bc_entries = malloc(size * sizeof(*bc_entries));
+    bc_buckets = malloc(n * sizeof(*bc_buckets));
+    if (bc_entries == NULL || bc_buckets == NULL) {
+        free(bc_entries);
+        free(bc_buckets);
+        milter_error("Milter.Bodycache.setsize");
+    }
+    for (i = 0; i < n; i++)
+        bc_buckets[i] = -1;
+    bc_nbuckets = n;
+
+    bc_seed();
+    bc_shortcircuit = Bool_val(shortcircuit_val);
+    bc_capacity = size;
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_bodycache_find(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    int stat = milter_bodycache_lookup((SMFICTX *)ctx_val);
+
+    CAMLreturn(stat == -1 ? Val_none : Val_some(Val_int(stat)));
+}
+
+CAMLprim value
+caml_milter_bodycache_add(value ctx_val, value stat_val, value ttl_val)
+{
+    CAMLparam3(ctx_val, stat_val, ttl_val);
+    uint64_t hash;
+
+    if (milter_bodycache_enabled()
+            && (hash = bc_key((SMFICTX *)ctx_val)) != 0)
+        bc_store(hash, Int_val(stat_val),
+                 (int64_t)(Double_val(ttl_val) * 1e9));
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_bodycache_digest(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    char buf[17];
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->bodyhash == NULL)
+        CAMLreturn(Val_none);
+
+    snprintf(buf, sizeof(buf), "%016llx",
+             (unsigned long long)bh_final(p->bodyhash));
+    CAMLreturn(Val_some(caml_copy_string(buf)));
+}
+
+CAMLprim value
+caml_milter_bodycache_stats(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal1(res);
+
+    res = caml_alloc_tuple(2);
+    Store_field(res, 0, Val_long(__atomic_load_n(&bc_hits, __ATOMIC_RELAXED)));
+    Store_field(res, 1,
+                Val_long(__atomic_load_n(&bc_misses, __ATOMIC_RELAXED)));
+    CAMLreturn(res);
+}
@@ -0,0 +1,659 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * DKIM signing (RFC 6376). While enabled, every message has its body
+ * canonicalized and hashed with SHA-256 as the chunks arrive, and the
+ * headers to be signed are copied as they are received. Signing at end
+ * of message only has to hash the collected headers and compute the
+ * RSA signature, which is done without the runtime lock; the resulting
+ * DKIM-Signature header is inserted at the top of the message.
+ *
+ * Private keys are parsed when loaded and cached per selector and
+ * domain. Cached keys are reference counted, so that a key may be
+ * replaced while messages are being signed with the old one.
+ */
+
+#define DKIM_SIMPLE  0
+#define DKIM_RELAXED 1
+
+#define DKIM_MAX_HEADERS 64
+#define DKIM_BUF         4096
+
+struct dkim_header {
+    struct dkim_header *next;
+    char *name;
+    char *value;
+};
+
+struct milter_dkim {
+    EVP_MD_CTX *body;
+    int started;
+
+    /* Canonicalization state: empty lines held back, whether the current
+     * line has content, whether whitespace or a CR is pending, and
+     * whether anything was hashed at all. */
+    long blank;
+    int line;
+    int wsp;
+    int cr;
+    int hashed;
+    unsigned char buf[DKIM_BUF];
+    size_t buflen;
+
+    /* Headers to be signed, most recent first. */
+    struct dkim_header *headers;
+    size_t bytes;
+};
+
+struct dkim_key {
+    struct dkim_key *next;
+    char *selector;
+    char *domain;
+    EVP_PKEY *pkey;
+    int refs;
+};
+
+static int dkim_enabled = 0;
+static int dkim_hcanon = DKIM_RELAXED;
+static int dkim_bcanon = DKIM_RELAXED;
+static char *dkim_names[DKIM_MAX_HEADERS];
+static int dkim_nnames = 0;
+
+static pthread_mutex_t dkim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dkim_key *dkim_keys = NULL;
+
+int
+milter_dkim_enabled(void)
+{
+    return dkim_enabled;
+}
+
+static int
+dkim_signed(const char *name)
+{
+    int i;
+
+    for (i = 0; i < dkim_nnames; i++)
+        if (strcasecmp(dkim_names[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+/* Body canonicalization. */
+
+static void
+dkim_flush(struct milter_dkim *d)
+{
+    if (d->buflen > 0) {
+        EVP_DigestUpdate(d->body, d->buf, d->buflen);
+        d->buflen = 0;
+    }
+}
+
+static void
+dkim_put(struct milter_dkim *d, const void *data, size_t len)
+{
+    if (d->buflen + len > sizeof(d->buf))
+        dkim_flush(d);
+    memcpy(d->buf + d->buflen, data, len);
+    d->buflen += len;
+    d->hashed = 1;
+}
+
+static void
+dkim_content(struct milter_dkim *d, unsigned char c)
+{
+    if (!d->line) {
+        for (; d->blank > 0; d->blank--)
+            dkim_put(d, "\r\n", 2);
+        d->line = 1;
+    }
+    if (d->wsp) {
+        dkim_put(d, " ", 1);
+        d->wsp = 0;
+    }
+    dkim_put(d, &c, 1);
+}
+
+static void
+dkim_eol(struct milter_dkim *d)
+{
+    if (d->line)
+        dkim_put(d, "\r\n", 2);
+    else
+        d->blank++;
+    d->line = 0;
+    d->wsp = 0;
+}
+
+/* Lines end with LF, with or without a CR before it; a lone CR is
+ * content. */
+static void
+dkim_canon(struct milter_dkim *d, const unsigned char *data, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        if (d->cr) {
+            d->cr = 0;
+            if (c == '\n') {
+                dkim_eol(d);
+                continue;
+            }
+            dkim_content(d, '\r');
+        }
+        if (c == '\r')
+            d->cr = 1;
+        else if (c == '\n')
+            dkim_eol(d);
+        else if (dkim_bcanon == DKIM_RELAXED && (c == ' ' || c == '\t'))
+            d->wsp = 1;
+        else
+            dkim_content(d, c);
+    }
+}
+
+/* Finishes a copy of the hash, so that a message may be signed more
+ * than once. */
+static int
+dkim_body_final(struct milter_dkim *d, unsigned char *md)
+{
+    int ret;
+    struct milter_dkim t;
+
+    dkim_flush(d);
+    t = *d;
+    t.body = EVP_MD_CTX_new();
+    if (t.body == NULL || EVP_MD_CTX_copy_ex(t.body, d->body) != 1) {
+        EVP_MD_CTX_free(t.body);
+        return -1;
+    }
+    if (t.cr) {
+        t.cr = 0;
+        dkim_content(&t, '\r');
+    }
+    /* A last line without CRLF gets one; an empty body is a single CRLF
+     * in simple canonicalization and nothing in relaxed. */
+    if (t.line || (dkim_bcanon == DKIM_SIMPLE && !t.hashed))
+        dkim_put(&t, "\r\n", 2);
+    dkim_flush(&t);
+    ret = EVP_DigestFinal_ex(t.body, md, NULL) == 1 ? 0 : -1;
+    EVP_MD_CTX_free(t.body);
+    return ret;
+}
+
+/* Header canonicalization. */
+
+static void
+dkim_append(char **buf, size_t *len, size_t *size, const char *s, size_t n)
+{
+    char *b;
+
+    if (*buf == NULL)
+        return;
+    if (*len + n + 1 > *size) {
+        *size = 2 * (*len + n + 1);
+        b = realloc(*buf, *size);
+        if (b == NULL) {
+            free(*buf);
+            *buf = NULL;
+            return;
+        }
+        *buf = b;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+static void
+dkim_header_canon(char **buf, size_t *len, size_t *size, const char *name,
+                  const char *v, int crlf)
+{
+    int wsp = 0;
+    size_t i, n;
+    char c;
+
+    if (dkim_hcanon == DKIM_SIMPLE) {
+        dkim_append(buf, len, size, name, strlen(name));
+        dkim_append(buf, len, size, ": ", 2);
+        /* Folds are passed with bare LFs. */
+        for (i = 0; v[i] != '\0'; i += n) {
+            n = strcspn(v + i, "\r\n");
+            dkim_append(buf, len, size, v + i, n);
+            if (v[i + n] == '\r' && v[i + n + 1] == '\n')
+                n++;
+            if (v[i + n] != '\0') {
+                dkim_append(buf, len, size, "\r\n", 2);
+                n++;
+            }
+        }
+    } else {
+        for (i = 0; name[i] != '\0'; i++) {
+            c = tolower((unsigned char)name[i]);
+            dkim_append(buf, len, size, &c, 1);
+        }
+        dkim_append(buf, len, size, ":", 1);
+        while (*v == ' ' || *v == '\t' || *v == '\r' || *v == '\n')
+            v++;
+        for (i = 0; v[i] != '\0'; i++) {
+            if (v[i] == '\r' || v[i] == '\n')
+                continue;
+            if (v[i] == ' ' || v[i] == '\t') {
+                wsp = 1;
+                continue;
+            }
+            if (wsp)
+                dkim_append(buf, len, size, " ", 1);
+            wsp = 0;
+            dkim_append(buf, len, size, v + i, 1);
+        }
+    }
+    if (crlf)
+        dkim_append(buf, len, size, "\r\n", 2);
+}
+
+/* Hooks, called from the callbacks. */
+
+static struct milter_dkim *
+dkim_get(SMFICTX *ctx)
+{
+    struct milter_dkim *d;
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->dkim == NULL) {
+        d = calloc(1, sizeof(*d));
+        if (d == NULL)
+            return NULL;
+        d->body = EVP_MD_CTX_new();
+        if (d->body == NULL) {
+            free(d);
+            return NULL;
+        }
+        p->dkim = d;
+    }
+    d = p->dkim;
+    if (!d->started) {
+        if (EVP_DigestInit_ex(d->body, EVP_sha256(), NULL) != 1)
+            return NULL;
+        d->started = 1;
+    }
+    return d;
+}
+
+static void
+dkim_clear(struct milter_dkim *d)
+{
+    struct dkim_header *h, *next;
+
+    for (h = d->headers; h != NULL; h = next) {
+        next = h->next;
+        free(h->name);
+        free(h->value);
+        free(h);
+    }
+    d->headers = NULL;
+    d->bytes = 0;
+    d->started = 0;
+    d->blank = 0;
+    d->line = 0;
+    d->wsp = 0;
+    d->cr = 0;
+    d->hashed = 0;
+    d->buflen = 0;
+}
+
+void
+milter_dkim_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+
+    if (!dkim_enabled)
+        return;
+    p = smfi_getpriv(ctx);
+    if (p != NULL && p->dkim != NULL)
+        dkim_clear(p->dkim);
+}
+
+void
+milter_dkim_header(SMFICTX *ctx, const char *name, const char *v)
+{
+    struct milter_dkim *d;
+    struct dkim_header *h;
+
+    if (!dkim_enabled || !dkim_signed(name) || (d = dkim_get(ctx)) == NULL)
+        return;
+    h = malloc(sizeof(*h));
+    if (h == NULL)
+        return;
+    h->name = strdup(name);
+    h->value = strdup(v);
+    if (h->name == NULL || h->value == NULL) {
+        free(h->name);
+        free(h->value);
+        free(h);
+        return;
+    }
+    h->next = d->headers;
+    d->headers = h;
+    d->bytes += sizeof(*h) + strlen(name) + strlen(v) + 2;
+}
+
+void
+milter_dkim_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    struct milter_dkim *d;
+
+    if (dkim_enabled && (d = dkim_get(ctx)) != NULL)
+        dkim_canon(d, data, len);
+}
+
+void
+milter_dkim_free(struct milter_priv *p)
+{
+    if (p->dkim == NULL)
+        return;
+    dkim_clear(p->dkim);
+    EVP_MD_CTX_free(p->dkim->body);
+    free(p->dkim);
+    p->dkim = NULL;
+}
+
+size_t
+milter_dkim_memory(const struct milter_priv *p)
+{
+    if (p->dkim == NULL)
+        return 0;
+    return sizeof(*p->dkim) + p->dkim->bytes;
+}
+
+/* Keys. */
+
+static void
+dkim_key_unref(struct dkim_key *k)
+{
+    int refs;
+
+    pthread_mutex_lock(&dkim_mutex);
+    refs = --k->refs;
+    pthread_mutex_unlock(&dkim_mutex);
+    if (refs > 0)
+        return;
+    EVP_PKEY_free(k->pkey);
+    free(k->selector);
+    free(k->domain);
+    free(k);
+}
+
+static struct dkim_key *
+dkim_key_find(const char *selector, const char *domain)
+{
+    struct dkim_key *k;
+
+    pthread_mutex_lock(&dkim_mutex);
+    for (k = dkim_keys; k != NULL; k = k->next) {
+        if (strcmp(k->selector, selector) == 0
+                && strcasecmp(k->domain, domain) == 0) {
+            k->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dkim_mutex);
+    return k;
+}
+
+static struct dkim_key *
+dkim_key_load(const char *path)
+{
+    FILE *fp;
+    EVP_PKEY *pkey;
+    struct dkim_key *k;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
+    pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (pkey == NULL)
+        return NULL;
+    if (EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA
+            || (k = calloc(1, sizeof(*k))) == NULL) {
+        EVP_PKEY_free(pkey);
+        return NULL;
+    }
+    k->pkey = pkey;
+    k->refs = 1;
+    return k;
+}
+
+/* Signing. */
+
+/* Builds the header value and signs it; returns NULL on failure. */
+static char *
+dkim_sign(struct milter_dkim *d, struct dkim_key *k)
+{
+    int n, i;
+    size_t hlen = 0, hsize = 1024, vlen = 0, vsize = 1024, siglen;
+    char *hdata, *v, *b64 = NULL;
+    unsigned char md[EVP_MAX_MD_SIZE], bh[64], *sig = NULL;
+    struct dkim_header *h, *used[DKIM_MAX_HEADERS * 4];
+    EVP_MD_CTX *mctx = NULL;
+
+    if (dkim_body_final(d, md) == -1)
+        return NULL;
+    EVP_EncodeBlock(bh, md, 32);
+
+    hdata = malloc(hsize);
+    v = malloc(vsize);
+
+    /* Each instance of a signed header is listed in h=, bottom up. */
+    n = 0;
+    for (i = 0; i < dkim_nnames; i++) {
+        for (h = d->headers; h != NULL; h = h->next) {
+            if (strcasecmp(h->name, dkim_names[i]) != 0
+                    || n == DKIM_MAX_HEADERS * 4)
+                continue;
+            used[n++] = h;
+            dkim_header_canon(&hdata, &hlen, &hsize, h->name, h->value, 1);
+        }
+    }
+
+    if (v != NULL)
+        vlen = snprintf(v, vsize,
+                        "v=1; a=rsa-sha256; c=%s/%s; d=%s; s=%s;\r\n\t"
+                        "t=%lld; h=",
+                        dkim_hcanon == DKIM_SIMPLE ? "simple" : "relaxed",
+                        dkim_bcanon == DKIM_SIMPLE ? "simple" : "relaxed",
+                        k->domain, k->selector, (long long)time(NULL));
+    if (vlen >= vsize)
+        goto out;
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            dkim_append(&v, &vlen, &vsize, ":", 1);
+        dkim_append(&v, &vlen, &vsize, used[i]->name,
+                    strlen(used[i]->name));
+    }
+    dkim_append(&v, &vlen, &vsize, ";\r\n\tbh=", 7);
+    dkim_append(&v, &vlen, &vsize, (char *)bh, strlen((char *)bh));
+    dkim_append(&v, &vlen, &vsize, ";\r\n\tb=", 6);
+    if (v == NULL)
+        goto out;
+
+    /* The signature covers its own header with an empty b= tag. */
+    dkim_header_canon(&hdata, &hlen, &hsize, "DKIM-Signature", v, 0);
+    if (hdata == NULL)
+        goto out;
+
+    mctx = EVP_MD_CTX_new();
+    if (mctx == NULL
+            || EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, k->pkey) != 1
+            || EVP_DigestSignUpdate(mctx, hdata, hlen) != 1
+            || EVP_DigestSignFinal(mctx, NULL, &siglen) != 1
+            || (sig = malloc(siglen)) == NULL
+            || EVP_DigestSignFinal(mctx, sig, &siglen) != 1
+            || (b64 = malloc(4 * ((siglen + 2) / 3) + 1)) == NULL)
+        goto out;
+    EVP_EncodeBlock((unsigned char *)b64, sig, siglen);
+    dkim_append(&v, &vlen, &vsize, b64, strlen(b64));
+    if (v == NULL)
+        goto out;
+
+    /* libmilter expects folds with bare LFs; the MTA adds the CRs. */
+    for (i = 0, n = 0; v[i] != '\0'; i++)
+        if (v[i] != '\r')
+            v[n++] = v[i];
+    v[n] = '\0';
+
+    EVP_MD_CTX_free(mctx);
+    free(sig);
+    free(b64);
+    free(hdata);
+    return v;
+
+out:
+    EVP_MD_CTX_free(mctx);
+    free(sig);
+    free(b64);
+    free(hdata);
+    free(v);
+    return NULL;
+}
+
+/* OCaml interface. */
+
+CAMLprim value
+caml_milter_dkim_enable(value headers_val, value hcanon_val,
+                        value bcanon_val)
+{
+    CAMLparam3(headers_val, hcanon_val, bcanon_val);
+    int i, n, from = 0;
+    char *names[DKIM_MAX_HEADERS];
+    value l;
+
+    for (l = headers_val; l != Val_emptylist; l = Field(l, 1))
+        if (strcasecmp(String_val(Field(l, 0)), "From") == 0)
+            from = 1;
+    if (!from)
+        caml_invalid_argument("Milter.Dkim.enable");
+
+    n = 0;
+    for (l = headers_val; l != Val_emptylist && n < DKIM_MAX_HEADERS;
+         l = Field(l, 1)) {
+        names[n] = strdup(String_val(Field(l, 0)));
+        if (names[n] == NULL) {
+            for (i = 0; i < n; i++)
+                free(names[i]);
+            milter_error("Milter.Dkim.enable");
+        }
+        n++;
+    }
+
+    for (i = 0; i < dkim_nnames; i++)
+        free(dkim_names[i]);
+    memcpy(dkim_names, names, n * sizeof(names[0]));
+    dkim_nnames = n;
+
+    dkim_hcanon = Int_val(hcanon_val);
+    dkim_bcanon = Int_val(bcanon_val);
+    dkim_enabled = 1;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_dkim_load(value selector_val, value domain_val, value path_val)
+{
+    CAMLparam3(selector_val, domain_val, path_val);
+    char *path;
+    struct dkim_key *k, **kp, *old = NULL;
+
+    path = strdup(String_val(path_val));
+    if (path == NULL)
+        milter_error("Milter.Dkim.load_key");
+
+    caml_release_runtime_system();
+    k = dkim_key_load(path);
+    caml_acquire_runtime_system();
+    free(path);
+    if (k == NULL)
+        milter_error("Milter.Dkim.load_key");
+    k->selector = strdup(String_val(selector_val));
+    k->domain = strdup(String_val(domain_val));
+    if (k->selector == NULL || k->domain == NULL) {
+        dkim_key_unref(k);
+        milter_error("Milter.Dkim.load_key");
+    }
+
+    pthread_mutex_lock(&dkim_mutex);
+    for (kp = &dkim_keys; *kp != NULL; kp = &(*kp)->next) {
+        if (strcmp((*kp)->selector, k->selector) == 0
+                && strcasecmp((*kp)->domain, k->domain) == 0) {
+            old = *kp;
+            *kp = old->next;
+            break;
+        }
+    }
+    k->next = dkim_keys;
+    dkim_keys = k;
+    pthread_mutex_unlock(&dkim_mutex);
+    if (old != NULL)
+        dkim_key_unref(old);
+
+    milter_log(MILTER_LOG_INFO, NULL, "dkim: loaded key %s._domainkey.%s",
+               k->selector, k->domain);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_dkim_sign(value ctx_val, value selector_val, value domain_val)
+{
+    CAMLparam3(ctx_val, selector_val, domain_val);
+    int ret = MI_FAILURE;
+    char *v;
+    SMFICTX *ctx = (SMFICTX *)ctx_val;
+    struct milter_priv *p = smfi_getpriv(ctx);
+    struct dkim_key *k;
+
+    if (p == NULL || p->dkim == NULL || !p->dkim->started)
+        milter_error("Milter.Dkim.sign");
+    k = dkim_key_find(String_val(selector_val), String_val(domain_val));
+    if (k == NULL)
+        milter_error("Milter.Dkim.sign");
+
+    caml_release_runtime_system();
+    v = dkim_sign(p->dkim, k);
+    if (v != NULL) {
+        pthread_mutex_lock(&p->io);
+        ret = smfi_insheader(ctx, 0, "DKIM-Signature", v);
+        pthread_mutex_unlock(&p->io);
+        free(v);
+    }
+    caml_acquire_runtime_system();
+    dkim_key_unref(k);
+
+    if (ret == MI_FAILURE)
+        milter_error("Milter.Dkim.sign");
+    CAMLreturn(Val_unit);
+}
@@ -0,0 +1,833 @@
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Asynchronous stub resolver. Queries are sent by the threads asking for
+ * them over a few UDP sockets, so any number of them can be in flight at
+ * once; a resolver thread reads the answers, retransmits lost queries
+ * and wakes up waiters. Answers are cached according to their TTL, and
+ * concurrent lookups for the same name and type share a single query.
+ * Everything is protected by one mutex.
+ *
+ * Query ids come from getrandom(), and each query goes out through a
+ * randomly chosen socket. The resolver thread replaces every socket after
+ * DNS_SOCKET_USES queries, so the kernel gives it a new random source
+ * port. An answer is only accepted from the server, on the socket the
+ * query was last sent through.
+ *
+ * There is no TCP fallback: a truncated answer completes the query with
+ * SERVFAIL. Queries advertise a 4 KiB EDNS0 payload, so only unusually
+ * large answers are affected.
+ */
+
+#define DNS_PORT          53
+#define DNS_RETRY         1000000000 /* 1s */
+#define DNS_TRIES         3
+#define DNS_TTL_MAX       86400
+#define DNS_TTL_NEGATIVE  300
+#define DNS_CACHE_BUCKETS 4096
+#define DNS_CACHE_MAX     65536
+#define DNS_PACKET_MAX    4096
+#define DNS_SOCKETS       8
+#define DNS_SOCKET_USES   256
+#define DNS_ID_TRIES      64
+
+#define DNS_CLASS_IN      1
+#define DNS_TYPE_SOA      6
+#define DNS_TYPE_OPT      41
+
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond;
+static struct sockaddr_storage dns_server;
+static socklen_t dns_server_len = 0;
+
+struct dns_socket {
+    int fd;
+    int family;
+    int uses;       /* Queries sent through the socket. */
+    int pending;    /* Queries waiting for an answer on it. */
+};
+
+static struct dns_socket dns_sockets[DNS_SOCKETS];
+static int dns_started = 0;
+
+static struct milter_dns *dns_cache[DNS_CACHE_BUCKETS];
+static int dns_cache_size = 0;
+static struct milter_dns *dns_pending = NULL;
+static struct milter_dns *dns_ids[65536];
+static uint16_t dns_pool[256];
+static size_t dns_pool_len = 0;
+static uint32_t dns_seed = 0;
+
+void
+milter_dns_lock(void)
+{
+    pthread_mutex_lock(&dns_mutex);
+}
+
+void
+milter_dns_unlock(void)
+{
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+static uint32_t
+dns_hash(const char *name, int type)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)type;
+
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char)tolower((unsigned char)*name);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Random numbers are drawn from the kernel a few hundred at a time. The
+ * xorshift32 generator is only used if getrandom() fails. Called with
+ * dns_mutex held. */
+static uint16_t
+dns_random(void)
+{
+    ssize_t n;
+
+    if (dns_pool_len == 0) {
+        n = getrandom(dns_pool, sizeof(dns_pool), GRND_NONBLOCK);
+        if (n > 0)
+            dns_pool_len = n / sizeof(dns_pool[0]);
+    }
+    if (dns_pool_len > 0)
+        return dns_pool[--dns_pool_len];
+
+    dns_seed ^= dns_seed << 13;
+    dns_seed ^= dns_seed >> 17;
+    dns_seed ^= dns_seed << 5;
+    return (uint16_t)(dns_seed >> 8);
+}
+
+static void
+dns_free(struct milter_dns *q)
+{
+    struct milter_dns_rr *rr, *next;
+
+    for (rr = q->answers; rr != NULL; rr = next) {
+        next = rr->next;
+        free(rr);
+    }
+    free(q->name);
+    free(q);
+}
+
+static void
+dns_uncache(struct milter_dns *q)
+{
+    struct milter_dns **pp;
+
+    for (pp = &dns_cache[q->hash % DNS_CACHE_BUCKETS]; *pp != NULL;
+         pp = &(*pp)->hnext) {
+        if (*pp == q) {
+            *pp = q->hnext;
+            q->cached = 0;
+            dns_cache_size--;
+            return;
+        }
+    }
+}
+
+/* Drops unreferenced entries, expired ones first. */
+static void
+dns_cache_sweep(int64_t now)
+{
+    int i, pass;
+    struct milter_dns **pp, *q;
+
+    for (pass = 0; pass < 2 && dns_cache_size >= DNS_CACHE_MAX; pass++) {
+        for (i = 0; i < DNS_CACHE_BUCKETS; i++) {
+            pp = &dns_cache[i];
+            while ((q = *pp) != NULL) {
+                if (q->refs == 0 && q->done
+                        && (pass == 1 || q->expires <= now)) {
+                    *pp = q->hnext;
+                    dns_cache_size--;
+                    dns_free(q);
+                } else {
+                    pp = &q->hnext;
+                }
+            }
+        }
+    }
+}
+
+/* Resolver configuration. Must be called with dns_mutex held. */
+
+static void
+dns_default_server(void)
+{
+    FILE *fp;
+    char line[256], addr[64];
+    struct sockaddr_in *sin = (struct sockaddr_in *)&dns_server;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&dns_server;
+
+    memset(&dns_server, 0, sizeof(dns_server));
+
+    fp = fopen("/etc/resolv.conf", "r");
+    if (fp != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "nameserver %63s", addr) != 1)
+                continue;
+            if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(DNS_PORT);
+                dns_server_len = sizeof(*sin);
+                break;
+            }
+            if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(DNS_PORT);
+                dns_server_len = sizeof(*sin6);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    if (dns_server_len == 0) {
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin->sin_port = htons(DNS_PORT);
+        dns_server_len = sizeof(*sin);
+    }
+}
+
+static void *dns_thread(void *arg);
+
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+
+static void
+dns_init_once(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dns_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (getrandom(&dns_seed, sizeof(dns_seed), GRND_NONBLOCK)
+            != sizeof(dns_seed))
+        dns_seed = (uint32_t)milter_now() ^ ((uint32_t)getpid() << 16);
+    if (dns_seed == 0)
+        dns_seed = 1;
+}
+
+/* The socket is left unbound, so that the kernel binds it to a random
+ * port when the first query is sent. */
+static int
+dns_socket_open(struct dns_socket *s)
+{
+    s->fd = socket(dns_server.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    s->family = dns_server.ss_family;
+    s->uses = 0;
+    s->pending = 0;
+    return s->fd == -1 ? -1 : 0;
+}
+
+/* Replaces the sockets that sent their share of queries, or that are of
+ * the wrong family for the server, once no query waits on them. Only
+ * called by dns_thread, so that sockets are never closed while it polls
+ * them. */
+static void
+dns_socket_rotate(void)
+{
+    int i;
+    struct dns_socket *s;
+
+    for (i = 0; i < DNS_SOCKETS; i++) {
+        s = &dns_sockets[i];
+        if (s->pending > 0)
+            continue;
+        if (s->fd != -1 && s->uses < DNS_SOCKET_USES
+                && s->family == dns_server.ss_family)
+            continue;
+        if (s->fd != -1)
+            close(s->fd);
+        dns_socket_open(s);
+    }
+}
+
+/* Picks a random socket for a query, preferring those that have not yet
+ * sent their share. */
+static int
+dns_socket_pick(void)
+{
+    int i, j, start, pass;
+    struct dns_socket *s;
+
+    start = dns_random() % DNS_SOCKETS;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < DNS_SOCKETS; i++) {
+            j = (start + i) % DNS_SOCKETS;
+            s = &dns_sockets[j];
+            if (s->fd != -1 && s->family == dns_server.ss_family
+                    && (pass == 1 || s->uses < DNS_SOCKET_USES))
+                return j;
+        }
+    }
+    return -1;
+}
+
+static int
+dns_init(void)
+{
+    int i;
+    pthread_t thread;
+
+    pthread_once(&dns_once, dns_init_once);
+
+    if (dns_server_len == 0)
+        dns_default_server();
+
+    for (i = 0; i < DNS_SOCKETS; i++)
+        if (dns_socket_open(&dns_sockets[i]) == -1)
+            break;
+    if (i == DNS_SOCKETS
+            && pthread_create(&thread, NULL, dns_thread, NULL) == 0) {
+        pthread_detach(thread);
+        dns_started = 1;
+        return 0;
+    }
+
+    while (i-- > 0)
+        close(dns_sockets[i].fd);
+    return -1;
+}
+
+/* Wire format. */
+
+static int
+dns_encode(unsigned char *buf, uint16_t id, const char *name, int type)
+{
+    size_t n, off;
+    const char *dot;
+
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = 0x01;      /* RD */
+    buf[3] = 0x00;
+    buf[4] = 0; buf[5] = 1;     /* QDCOUNT */
+    buf[6] = 0; buf[7] = 0;
+    buf[8] = 0; buf[9] = 0;
+    buf[10] = 0; buf[11] = 1;   /* ARCOUNT: EDNS0 */
+    off = 12;
+
+    while (*name != '\0') {
+        dot = strchr(name, '.');
+        n = dot == NULL ? strlen(name) : (size_t)(dot - name);
+        if (n == 0 || n > 63 || off + n + 1 > 12 + 255)
+            return -1;
+        buf[off++] = n;
+        memcpy(buf + off, name, n);
+        off += n;
+        name += n;
+        if (*name == '.')
+            name++;
+    }
+    buf[off++] = 0;
+
+    buf[off++] = type >> 8;
+    buf[off++] = type & 0xff;
+    buf[off++] = 0;
+    buf[off++] = DNS_CLASS_IN;
+
+    /* OPT pseudo-record advertising a large UDP payload, so that TXT
+     * answers rarely get truncated. */
+    buf[off++] = 0;
+    buf[off++] = 0;
+    buf[off++] = DNS_TYPE_OPT;
+    buf[off++] = DNS_PACKET_MAX >> 8;
+    buf[off++] = DNS_PACKET_MAX & 0xff;
+    memset(buf + off, 0, 6);
+    off += 6;
+
+    return off;
+}
+
+/* Expands the (possibly compressed) name at *off into out. */
+static int
+dns_name(const unsigned char *msg, size_t len, size_t *off,
+         char *out, size_t outlen)
+{
+    size_t pos = *off, o = 0;
+    int jumped = 0, hops = 0;
+    unsigned n;
+
+    for (;;) {
+        if (pos >= len)
+            return -1;
+        n = msg[pos];
+        if ((n & 0xc0) == 0xc0) {
+            if (pos + 1 >= len || ++hops > 16)
+                return -1;
+            if (!jumped)
+                *off = pos + 2;
+            pos = ((n & 0x3f) << 8) | msg[pos + 1];
+            jumped = 1;
+            continue;
+        }
+        if (n > 63)
+            return -1;
+        pos++;
+        if (n == 0)
+            break;
+        if (pos + n > len || o + n + 2 > outlen)
+            return -1;
+        if (o > 0)
+            out[o++] = '.';
+        memcpy(out + o, msg + pos, n);
+        o += n;
+        pos += n;
+    }
+    if (!jumped)
+        *off = pos;
+    out[o] = '\0';
+    return 0;
+}
+
+static struct milter_dns_rr *
+dns_rr(const void *data, size_t len)
+{
+    struct milter_dns_rr *rr = malloc(sizeof(*rr) + len + 1);
+
+    if (rr == NULL)
+        return NULL;
+    rr->next = NULL;
+    rr->len = len;
+    memcpy(rr->data, data, len);
+    rr->data[len] = '\0';
+    return rr;
+}
+
+/* Converts an answer's RDATA to its stored form: addresses as raw bytes,
+ * TXT records as the concatenation of their strings, MX records as the
+ * exchange name and PTR records as the name they point to. */
+static struct milter_dns_rr *
+dns_rdata(const unsigned char *msg, size_t len, size_t off, size_t rdlen,
+          int type)
+{
+    char buf[DNS_PACKET_MAX];
+    size_t n, o, end = off + rdlen;
+
+    switch (type) {
+    case MILTER_DNS_A:
+        return rdlen == 4 ? dns_rr(msg + off, 4) : NULL;
+    case MILTER_DNS_AAAA:
+        return rdlen == 16 ? dns_rr(msg + off, 16) : NULL;
+    case MILTER_DNS_TXT:
+        for (o = 0; off < end; off += n) {
+            n = msg[off++];
+            if (off + n > end)
+                return NULL;
+            memcpy(buf + o, msg + off, n);
+            o += n;
+        }
+        return dns_rr(buf, o);
+    case MILTER_DNS_MX:
+        off += 2;
+        if (rdlen < 3 || dns_name(msg, len, &off, buf, sizeof(buf)) == -1)
+            return NULL;
+        return dns_rr(buf, strlen(buf));
+    case MILTER_DNS_PTR:
+        if (dns_name(msg, len, &off, buf, sizeof(buf)) == -1)
+            return NULL;
+        return dns_rr(buf, strlen(buf));
+    default:
+        return dns_rr(msg + off, rdlen);
+    }
+}
+
+static void
+dns_complete(struct milter_dns *q, int rcode, uint32_t ttl)
+{
+    if (q->pprev != NULL)
+        q->pprev->pnext = q->pnext;
+    else
+        dns_pending = q->pnext;
+    if (q->pnext != NULL)
+        q->pnext->pprev = q->pprev;
+    dns_ids[q->id] = NULL;
+    if (q->sock != -1)
+        dns_sockets[q->sock].pending--;
+    q->sock = -1;
+
+    if (ttl > DNS_TTL_MAX)
+        ttl = DNS_TTL_MAX;
+    q->rcode = rcode;
+    q->expires = milter_now() + (int64_t)ttl * 1000000000;
+    q->done = 1;
+
+    if (q->refs == 0 && !q->cached)
+        dns_free(q);
+    pthread_cond_broadcast(&dns_cond);
+}
+
+static int
+dns_from_server(const struct sockaddr_storage *from)
+{
+    const struct sockaddr_in *a = (const struct sockaddr_in *)from;
+    const struct sockaddr_in *b = (const struct sockaddr_in *)&dns_server;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)from;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)&dns_server;
+
+    if (from->ss_family != dns_server.ss_family)
+        return 0;
+    if (from->ss_family == AF_INET)
+        return a->sin_port == b->sin_port
+            && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    return a6->sin6_port == b6->sin6_port
+        && memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+}
+
+/* Handles an answer received on the given socket. Called with dns_mutex
+ * held. */
+static void
+dns_answer(const unsigned char *msg, size_t len, int sock,
+           const struct sockaddr_storage *from)
+{
+    int rcode, an, ns, i, type;
+    uint16_t id;
+    size_t off, rdlen;
+    uint32_t ttl, minttl;
+    char name[256];
+    struct milter_dns *q;
+    struct milter_dns_rr *rr, **tail;
+
+    if (len < 12 || !(msg[2] & 0x80))
+        return;
+    id = (msg[0] << 8) | msg[1];
+    q = dns_ids[id];
+    if (q == NULL || q->sock != sock || !dns_from_server(from))
+        return;
+
+    off = 12;
+    if (((msg[4] << 8) | msg[5]) != 1
+            || dns_name(msg, len, &off, name, sizeof(name)) == -1
+            || off + 4 > len
+            || strcasecmp(name, q->name) != 0
+            || ((msg[off] << 8) | msg[off + 1]) != q->type)
+        return;
+    off += 4;
+
+    rcode = msg[3] & 0x0f;
+    if (msg[2] & 0x02)  /* Truncated; treated as a server failure. */
+        rcode = 2;
+    an = (msg[6] << 8) | msg[7];
+    ns = (msg[8] << 8) | msg[9];
+
+    minttl = DNS_TTL_MAX;
+    tail = &q->answers;
+    for (i = 0; i < an + ns; i++) {
+        if (dns_name(msg, len, &off, name, sizeof(name)) == -1
+                || off + 10 > len)
+            break;
+        type = (msg[off] << 8) | msg[off + 1];
+        ttl = ((uint32_t)msg[off + 4] << 24) | (msg[off + 5] << 16)
+            | (msg[off + 6] << 8) | msg[off + 7];
+        rdlen = (msg[off + 8] << 8) | msg[off + 9];
+        off += 10;
+        if (off + rdlen > len)
+            break;
+
+        if (i < an && type == q->type) {
+            rr = dns_rdata(msg, len, off, rdlen, type);
+            if (rr != NULL) {
+                *tail = rr;
+                tail = &rr->next;
+            }
+            if (ttl < minttl)
+                minttl = ttl;
+        } else if (i >= an && type == DNS_TYPE_SOA && q->answers == NULL) {
+            /* Negative answers are cached for the SOA minimum TTL. */
+            size_t o = off;
+            if (dns_name(msg, len, &o, name, sizeof(name)) == 0
+                    && dns_name(msg, len, &o, name, sizeof(name)) == 0
+                    && o + 20 <= off + rdlen) {
+                o += 16;
+                ttl = ((uint32_t)msg[o] << 24) | (msg[o + 1] << 16)
+                    | (msg[o + 2] << 8) | msg[o + 3];
+                if (ttl < minttl)
+                    minttl = ttl;
+            }
+        }
+        off += rdlen;
+    }
+
+    if (q->answers == NULL && minttl == DNS_TTL_MAX)
+        minttl = rcode == 0 || rcode == 3 ? DNS_TTL_NEGATIVE : 0;
+    dns_complete(q, rcode, minttl);
+}
+
+/* Sends or resends a query, each time through a random socket. */
+static int
+dns_send(struct milter_dns *q)
+{
+    int n;
+    unsigned char buf[512];
+
+    n = dns_encode(buf, q->id, q->name, q->type);
+    if (n == -1)
+        return -1;
+    if (q->sock != -1)
+        dns_sockets[q->sock].pending--;
+    q->sock = dns_socket_pick();
+    q->tries++;
+    q->sent = milter_now();
+    /* Lost packets, and queries that found no socket of the server's
+     * family after it changed, are retransmitted by dns_thread. */
+    if (q->sock != -1) {
+        dns_sockets[q->sock].pending++;
+        dns_sockets[q->sock].uses++;
+        sendto(dns_sockets[q->sock].fd, buf, n, MSG_DONTWAIT,
+               (struct sockaddr *)&dns_server, dns_server_len);
+    }
+    return 0;
+}
+
+static void *
+dns_thread(void *arg)
+{
+    int i, nfds, socks[DNS_SOCKETS];
+    ssize_t n;
+    int64_t now;
+    socklen_t fromlen;
+    struct sockaddr_storage from;
+    struct pollfd pfd[DNS_SOCKETS];
+    struct milter_dns *q, *next;
+    static unsigned char buf[DNS_PACKET_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&dns_mutex);
+        dns_socket_rotate();
+        for (i = nfds = 0; i < DNS_SOCKETS; i++) {
+            if (dns_sockets[i].fd == -1)
+                continue;
+            pfd[nfds].fd = dns_sockets[i].fd;
+            pfd[nfds].events = POLLIN;
+            socks[nfds++] = i;
+        }
+        pthread_mutex_unlock(&dns_mutex);
+
+        if (poll(pfd, nfds, 100) > 0) {
+            for (i = 0; i < nfds; i++) {
+                if (!(pfd[i].revents & POLLIN))
+                    continue;
+                for (;;) {
+                    fromlen = sizeof(from);
+                    n = recvfrom(pfd[i].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &fromlen);
+                    if (n <= 0)
+                        break;
+                    pthread_mutex_lock(&dns_mutex);
+                    dns_answer(buf, n, socks[i], &from);
+                    pthread_mutex_unlock(&dns_mutex);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&dns_mutex);
+        now = milter_now();
+        for (q = dns_pending; q != NULL; q = next) {
+            next = q->pnext;
+            if (now - q->sent < DNS_RETRY)
+                continue;
+            if (q->tries < DNS_TRIES)
+                dns_send(q);
+            else
+                dns_complete(q, MILTER_DNS_TIMEOUT, 0);
+        }
+        pthread_mutex_unlock(&dns_mutex);
+    }
+
+    return NULL;
+}
+
+struct milter_dns *
+milter_dns_lookup(const char *name, int type)
+{
+    int i;
+    int64_t now;
+    uint16_t id;
+    uint32_t hash;
+    struct milter_dns *q, **bucket;
+
+    hash = dns_hash(name, type);
+    now = milter_now();
+
+    pthread_mutex_lock(&dns_mutex);
+
+    if (!dns_started && dns_init() == -1) {
+        pthread_mutex_unlock(&dns_mutex);
+        return NULL;
+    }
+
+    bucket = &dns_cache[hash % DNS_CACHE_BUCKETS];
+    for (q = *bucket; q != NULL; q = q->hnext) {
+        if (q->hash != hash || q->type != type || strcasecmp(q->name, name))
+            continue;
+        if (!q->done || q->expires > now) {
+            q->refs++;
+            pthread_mutex_unlock(&dns_mutex);
+            return q;
+        }
+        dns_uncache(q);
+        if (q->refs == 0)
+            dns_free(q);
+        break;
+    }
+
+    /* Fails rather than waiting for an id once nearly all are in use. */
+    for (i = 0; i < DNS_ID_TRIES; i++) {
+        id = dns_random();
+        if (dns_ids[id] == NULL)
+            break;
+    }
+    if (i == DNS_ID_TRIES) {
+        pthread_mutex_unlock(&dns_mutex);
+        return NULL;
+    }
+
+    q = calloc(1, sizeof(*q));
+    if (q == NULL || (q->name = strdup(name)) == NULL) {
+        free(q);
+        pthread_mutex_unlock(&dns_mutex);
+        return NULL;
+    }
+    q->type = type;
+    q->hash = hash;
+    q->refs = 1;
+    q->id = id;
+    q->sock = -1;
+
+    if (dns_send(q) == -1) {
+        dns_free(q);
+        pthread_mutex_unlock(&dns_mutex);
+        return NULL;
+    }
+
+    dns_ids[id] = q;
+    q->pnext = dns_pending;
+    if (dns_pending != NULL)
+        dns_pending->pprev = q;
+    dns_pending = q;
+
+    if (dns_cache_size >= DNS_CACHE_MAX)
+        dns_cache_sweep(now);
+    if (dns_cache_size < DNS_CACHE_MAX) {
+        q->hnext = *bucket;
+        *bucket = q;
+        q->cached = 1;
+        dns_cache_size++;
+    }
+
+    pthread_mutex_unlock(&dns_mutex);
+    return q;
+}
+
+int
+milter_dns_done(struct milter_dns *q)
+{
+    int done;
+
+    pthread_mutex_lock(&dns_mutex);
+    done = q->done;
+    pthread_mutex_unlock(&dns_mutex);
+    return done;
+}
+
+int64_t
+milter_dns_expires(struct milter_dns *q)
+{
+    int64_t expires;
+
+    pthread_mutex_lock(&dns_mutex);
+    expires = q->expires;
+    pthread_mutex_unlock(&dns_mutex);
+    return expires;
+}
+
+void
+milter_dns_release(struct milter_dns *q)
+{
+    pthread_mutex_lock(&dns_mutex);
+    if (--q->refs == 0 && q->done && !q->cached)
+        dns_free(q);
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+void
+milter_dns_wait(int (*ready)(void *), void *arg, int64_t deadline)
+{
+    struct timespec ts;
+
+    pthread_once(&dns_once, dns_init_once);
+
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+
+    pthread_mutex_lock(&dns_mutex);
+    while (!ready(arg) && milter_now() < deadline)
+        if (pthread_cond_timedwait(&dns_cond, &dns_mutex, &ts) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+CAMLprim value
+caml_milter_setresolver(value addr_val, value port_val)
+{
+    CAMLparam2(addr_val, port_val);
+    struct sockaddr_in *sin = (struct sockaddr_in *)&dns_server;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&dns_server;
+    mlsize_t len = caml_string_length(addr_val);
+
+    if (len != 4 && len != 16)
+        milter_error("Milter.setresolver");
+
+    pthread_mutex_lock(&dns_mutex);
+    memset(&dns_server, 0, sizeof(dns_server));
+    if (len == 16) {
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, String_val(addr_val), 16);
+        sin6->sin6_port = htons(Int_val(port_val));
+        dns_server_len = sizeof(*sin6);
+    } else {
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, String_val(addr_val), 4);
+        sin->sin_port = htons(Int_val(port_val));
+        dns_server_len = sizeof(*sin);
+    }
+    /* Sockets of the other family are replaced by dns_thread. Queries in
+     * flight are resent to the new server when they time out. */
+    pthread_mutex_unlock(&dns_mutex);
+
+    CAMLreturn(Val_unit);
+}
@@ -0,0 +1,261 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * DNSBL and RHSBL lookups. Queries for the client address and host name
+ * are sent from milter_connect() before the runtime lock is taken, so
+ * their answers are usually in by the time the filter asks for them.
+ */
+
+struct milter_dnsbl {
+    struct milter_dnsbl *next;
+    const char *zone;
+    char *name;
+    struct milter_dns *q;
+};
+
+static char **dnsbl_zones = NULL;
+static int dnsbl_nzones = 0;
+static char **rhsbl_zones = NULL;
+static int rhsbl_nzones = 0;
+
+static void
+dnsbl_query(struct milter_priv *p, const char *zone, const char *name,
+            const char *prefix)
+{
+    char qname[512];
+    struct milter_dnsbl *d;
+
+    for (d = p->dnsbl; d != NULL; d = d->next)
+        if (d->zone == zone && strcasecmp(d->name, name) == 0)
+            return;
+
+    if (snprintf(qname, sizeof(qname), "%s.%s", prefix, zone)
+            >= (int)sizeof(qname))
+        return;
+
+    d = malloc(sizeof(*d));
+    if (d == NULL)
+        return;
+    d->zone = zone;
+    d->name = strdup(name);
+    d->q = milter_dns_lookup(qname, MILTER_DNS_A);
+    if (d->name == NULL || d->q == NULL) {
+        if (d->q != NULL)
+            milter_dns_release(d->q);
+        free(d->name);
+        free(d);
+        return;
+    }
+    d->next = p->dnsbl;
+    p->dnsbl = d;
+}
+
+static void
+dnsbl_check_domain(struct milter_priv *p, const char *domain)
+{
+    int i;
+
+    for (i = 0; i < rhsbl_nzones; i++)
+        dnsbl_query(p, rhsbl_zones[i], domain, domain);
+}
+
+void
+milter_dnsbl_start(struct milter_priv *p, const _SOCK_ADDR *sa,
+                   const char *host)
+{
+    int i;
+    char name[INET6_ADDRSTRLEN], rev[128], *r;
+    const unsigned char *a;
+
+    if (dnsbl_nzones > 0 && sa != NULL) {
+        r = NULL;
+        if (sa->sa_family == AF_INET) {
+            a = (const unsigned char *)
+                &((const struct sockaddr_in *)sa)->sin_addr;
+            inet_ntop(AF_INET, a, name, sizeof(name));
+            snprintf(rev, sizeof(rev), "%u.%u.%u.%u", a[3], a[2], a[1], a[0]);
+            r = rev;
+        } else if (sa->sa_family == AF_INET6) {
+            a = (const unsigned char *)
+                &((const struct sockaddr_in6 *)sa)->sin6_addr;
+            inet_ntop(AF_INET6, a, name, sizeof(name));
+            r = rev;
+            for (i = 15; i >= 0; i--)
+                r += sprintf(r, "%x.%x.", a[i] & 0x0f, a[i] >> 4);
+            r[-1] = '\0';
+            r = rev;
+        }
+        if (r != NULL)
+            for (i = 0; i < dnsbl_nzones; i++)
+                dnsbl_query(p, dnsbl_zones[i], name, rev);
+    }
+
+    /* Unresolved clients are given as a bracketed address. */
+    if (host != NULL && host[0] != '[')
+        dnsbl_check_domain(p, host);
+}
+
+void
+milter_dnsbl_free(struct milter_priv *p)
+{
+    struct milter_dnsbl *d, *next;
+
+    for (d = p->dnsbl; d != NULL; d = next) {
+        next = d->next;
+        milter_dns_release(d->q);
+        free(d->name);
+        free(d);
+    }
+    p->dnsbl = NULL;
+}
+
+static int
+dnsbl_ready(void *arg)
+{
+    struct milter_dnsbl *d;
+
+    for (d = arg; d != NULL; d = d->next)
+        if (!d->q->done)
+            return 0;
+    return 1;
+}
+
+static void
+dnsbl_add(char ***zones, int *n, value zone_val)
+{
+    char **z, *zone;
+
+    zone = strdup(String_val(zone_val));
+    z = realloc(*zones, (*n + 1) * sizeof(char *));
+    if (zone == NULL || z == NULL) {
+        free(zone);
+        milter_error("Milter.Dnsbl.add");
+    }
+    z[(*n)++] = zone;
+    *zones = z;
+}
+
+CAMLprim value
+caml_milter_dnsbl_add(value zone_val)
+{
+    CAMLparam1(zone_val);
+    dnsbl_add(&dnsbl_zones, &dnsbl_nzones, zone_val);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_dnsbl_add_domain(value zone_val)
+{
+    CAMLparam1(zone_val);
+    dnsbl_add(&rhsbl_zones, &rhsbl_nzones, zone_val);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_dnsbl_check(value ctx_val, value domain_val)
+{
+    CAMLparam2(ctx_val, domain_val);
+    struct milter_priv *p = milter_priv_get((SMFICTX *)ctx_val);
+
+    if (p == NULL)
+        milter_error("Milter.Dnsbl.check");
+    dnsbl_check_domain(p, String_val(domain_val));
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_dnsbl_results(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal4(res, cell, listing, addrs);
+    CAMLlocal1(addr);
+    char buf[INET_ADDRSTRLEN];
+    struct milter_dnsbl *d;
+    struct milter_dns_rr *rr;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    res = Val_emptylist;
+    if (p == NULL)
+        CAMLreturn(res);
+
+    /* Answers of done queries never change, so they can be read without
+     * holding the resolver lock while allocating. */
+    for (d = p->dnsbl; d != NULL; d = d->next) {
+        if (!milter_dns_done(d->q) || d->q->rcode != 0
+                || d->q->answers == NULL)
+            continue;
+
+        addrs = Val_emptylist;
+        for (rr = d->q->answers; rr != NULL; rr = rr->next) {
+            inet_ntop(AF_INET, rr->data, buf, sizeof(buf));
+            addr = caml_copy_string(buf);
+            cell = caml_alloc(2, 0);
+            Store_field(cell, 0, addr);
+            Store_field(cell, 1, addrs);
+            addrs = cell;
+        }
+
+        listing = caml_alloc(3, 0);
+        Store_field(listing, 0, caml_copy_string(d->zone));
+        Store_field(listing, 1, caml_copy_string(d->name));
+        Store_field(listing, 2, addrs);
+
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, listing);
+        Store_field(cell, 1, res);
+        res = cell;
+    }
+
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_dnsbl_pending(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    int n = 0;
+    struct milter_dnsbl *d;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p != NULL)
+        for (d = p->dnsbl; d != NULL; d = d->next)
+            if (!milter_dns_done(d->q))
+                n++;
+
+    CAMLreturn(Val_int(n));
+}
+
+CAMLprim value
+caml_milter_dnsbl_wait(value ctx_val, value timeout_val)
+{
+    CAMLparam2(ctx_val, timeout_val);
+    int64_t deadline;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->dnsbl == NULL)
+        CAMLreturn(Val_unit);
+
+    deadline = milter_now() + (int64_t)(Double_val(timeout_val) * 1e9);
+
+    caml_release_runtime_system();
+    milter_dns_wait(dnsbl_ready, p->dnsbl, deadline);
+    caml_acquire_runtime_system();
+
+    CAMLreturn(Val_unit);
+}
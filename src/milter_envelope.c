@@ -0,0 +1,466 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Envelope address parser. The path and ESMTP parameters of MAIL FROM and
+ * RCPT TO are validated against the RFC 5321 grammar and split into their
+ * parts in C, from the envfrom and envrcpt callbacks and without the
+ * runtime lock, into a buffer owned by the connection. Only the parts the
+ * filter asks for are copied to the OCaml heap.
+ *
+ * Characters are classified with a single table lookup, so each run of
+ * atext, domain or parameter characters is consumed by a tight loop.
+ * Bytes above 0x7f are accepted wherever RFC 6531 allows UTF-8.
+ */
+
+#define ENV_ATEXT    0x01
+#define ENV_LETDIG   0x02
+#define ENV_LDH      0x04
+#define ENV_QTEXT    0x08
+#define ENV_KEYWORD  0x10
+#define ENV_VALUE    0x20
+#define ENV_DCONTENT 0x40
+
+#define ENV_UTF8 (ENV_ATEXT | ENV_LETDIG | ENV_LDH | ENV_QTEXT | ENV_VALUE)
+
+#define ENV_MAX_LOCAL  64
+#define ENV_MAX_DOMAIN 255
+
+static const unsigned char env_ascii[128] = {
+    /* 0x00 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 0x08 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 0x10 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 0x18 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 0x20 */ 0x08, 0x69, 0x60, 0x69, 0x69, 0x69, 0x69, 0x69,
+    /* 0x28 */ 0x68, 0x68, 0x69, 0x69, 0x68, 0x7d, 0x68, 0x69,
+    /* 0x30 */ 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x38 */ 0x7f, 0x7f, 0x68, 0x68, 0x68, 0x49, 0x68, 0x69,
+    /* 0x40 */ 0x68, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x48 */ 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x50 */ 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x58 */ 0x7f, 0x7f, 0x7f, 0x28, 0x20, 0x28, 0x69, 0x69,
+    /* 0x60 */ 0x69, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x68 */ 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x70 */ 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+    /* 0x78 */ 0x7f, 0x7f, 0x7f, 0x69, 0x69, 0x69, 0x69, 0x00,
+};
+
+#define env_class(c) \
+    ((unsigned char)(c) < 0x80 ? env_ascii[(unsigned char)(c)] : ENV_UTF8)
+
+struct env_param {
+    uint32_t key;       /* Offsets into the buffer. */
+    uint32_t value;     /* Zero if the parameter has no value. */
+};
+
+struct env_path {
+    char *buf;
+    size_t size;
+    int valid;
+    int null;
+    uint32_t local;
+    uint32_t domain;
+    struct env_param *params;
+    int nparams;
+    int maxparams;
+};
+
+struct milter_envelope {
+    struct env_path from;
+    struct env_path rcpt;
+};
+
+static int envelope_enabled = 0;
+
+int
+milter_envelope_enabled(void)
+{
+    return envelope_enabled;
+}
+
+/* Parses a domain or address literal, lowercasing it into out. */
+static const char *
+env_domain(const char *s, char **out)
+{
+    const char *start = s;
+    char *o = *out;
+
+    if (*s == '[') {
+        for (s++; env_class(*s) & ENV_DCONTENT; s++)
+            ;
+        if (*s != ']' || s - start < 2)
+            return NULL;
+        s++;
+        memcpy(o, start, s - start);
+        o += s - start;
+    } else {
+        for (;;) {
+            if (!(env_class(*s) & ENV_LETDIG))
+                return NULL;
+            while (env_class(*s) & ENV_LDH) {
+                *o++ = *s >= 'A' && *s <= 'Z' ? *s + ('a' - 'A') : *s;
+                s++;
+            }
+            if (s[-1] == '-')
+                return NULL;
+            if (*s != '.')
+                break;
+            *o++ = *s++;
+        }
+    }
+
+    if (s - start > ENV_MAX_DOMAIN)
+        return NULL;
+    *o++ = '\0';
+    *out = o;
+    return s;
+}
+
+/* Parses a dot-string or quoted-string, unquoting it into out. */
+static const char *
+env_local(const char *s, char **out)
+{
+    char *o = *out;
+
+    if (*s == '"') {
+        for (s++; *s != '"'; s++) {
+            if (*s == '\\') {
+                s++;
+                if (*s < 32 || *s > 126)
+                    return NULL;
+            } else if (!(env_class(*s) & ENV_QTEXT)) {
+                return NULL;
+            }
+            *o++ = *s;
+        }
+        s++;
+    } else {
+        for (;;) {
+            if (!(env_class(*s) & ENV_ATEXT))
+                return NULL;
+            while (env_class(*s) & ENV_ATEXT)
+                *o++ = *s++;
+            if (*s != '.')
+                break;
+            *o++ = *s++;
+        }
+    }
+
+    if (o - *out > ENV_MAX_LOCAL)
+        return NULL;
+    *o++ = '\0';
+    *out = o;
+    return s;
+}
+
+static int
+env_param(struct env_path *e, const char *s, char **out)
+{
+    char *o = *out;
+    struct env_param *params;
+    int n;
+
+    if (e->nparams == e->maxparams) {
+        n = e->maxparams == 0 ? 8 : e->maxparams * 2;
+        params = realloc(e->params, n * sizeof(*params));
+        if (params == NULL)
+            return -1;
+        e->params = params;
+        e->maxparams = n;
+    }
+
+    /* esmtp-keyword, uppercased. */
+    if (!(env_class(*s) & ENV_KEYWORD) || *s == '-')
+        return -1;
+    e->params[e->nparams].key = o - e->buf;
+    for (; env_class(*s) & ENV_KEYWORD; s++)
+        *o++ = *s >= 'a' && *s <= 'z' ? *s - ('a' - 'A') : *s;
+    *o++ = '\0';
+
+    e->params[e->nparams].value = 0;
+    if (*s == '=') {
+        s++;
+        if (*s == '\0')
+            return -1;
+        e->params[e->nparams].value = o - e->buf;
+        while (env_class(*s) & ENV_VALUE)
+            *o++ = *s++;
+        *o++ = '\0';
+    }
+    if (*s != '\0')
+        return -1;
+
+    e->nparams++;
+    *out = o;
+    return 0;
+}
+
+/*
+ * Parses a reverse-path or, if rcpt is set, a forward-path, which
+ * libmilter passes as it was given, followed by its parameters. Angle
+ * brackets may be missing, as sendmail tolerates, and source routes are
+ * skipped. Only reverse-paths may be null and only forward-paths may be
+ * a bare postmaster.
+ */
+static int
+env_parse(struct env_path *e, char **argv, int rcpt)
+{
+    int i, bracket;
+    char *buf, *o;
+    size_t size;
+    const char *s;
+
+    e->valid = 0;
+    e->null = 0;
+    e->nparams = 0;
+
+    size = 4;
+    for (i = 0; argv[i] != NULL; i++)
+        size += strlen(argv[i]) + 2;
+    if (size > e->size) {
+        if ((buf = realloc(e->buf, size)) == NULL)
+            return -1;
+        e->buf = buf;
+        e->size = size;
+    }
+
+    /* Offset zero is the empty string. */
+    o = e->buf;
+    *o++ = '\0';
+
+    s = argv[0];
+    while (*s == ' ')
+        s++;
+    if ((bracket = *s == '<'))
+        s++;
+
+    if (bracket && *s == '>' && !rcpt) {
+        e->null = 1;
+        e->local = e->domain = 0;
+        goto params;
+    }
+
+    if (bracket && *s == '@') {
+        for (;;) {
+            s++;
+            if ((s = env_domain(s, &o)) == NULL)
+                return -1;
+            if (*s != ',')
+                break;
+            if (*++s != '@')
+                return -1;
+        }
+        if (*s++ != ':')
+            return -1;
+        o = e->buf + 1;
+    }
+
+    e->local = o - e->buf;
+    if ((s = env_local(s, &o)) == NULL)
+        return -1;
+    if (*s == '@') {
+        e->domain = o - e->buf;
+        if ((s = env_domain(s + 1, &o)) == NULL)
+            return -1;
+    } else if (rcpt && strcasecmp(e->buf + e->local, "postmaster") == 0) {
+        e->domain = 0;
+    } else {
+        return -1;
+    }
+
+params:
+    if (bracket && *s++ != '>')
+        return -1;
+    while (*s == ' ')
+        s++;
+    if (*s != '\0')
+        return -1;
+
+    for (i = 1; argv[i] != NULL; i++)
+        if (env_param(e, argv[i], &o) == -1)
+            return -1;
+
+    e->valid = 1;
+    return 0;
+}
+
+static void
+env_free(struct env_path *e)
+{
+    free(e->buf);
+    free(e->params);
+}
+
+static struct milter_envelope *
+env_get(SMFICTX *ctx)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->envelope == NULL)
+        p->envelope = calloc(1, sizeof(*p->envelope));
+    return p->envelope;
+}
+
+void
+milter_envelope_envfrom(SMFICTX *ctx, char **argv)
+{
+    struct milter_envelope *env;
+
+    if (!envelope_enabled || (env = env_get(ctx)) == NULL)
+        return;
+    env_parse(&env->from, argv, 0);
+    env->rcpt.valid = 0;
+}
+
+void
+milter_envelope_envrcpt(SMFICTX *ctx, char **argv)
+{
+    struct milter_envelope *env;
+
+    if (!envelope_enabled || (env = env_get(ctx)) == NULL)
+        return;
+    env_parse(&env->rcpt, argv, 1);
+}
+
+void
+milter_envelope_free(struct milter_priv *p)
+{
+    if (p->envelope == NULL)
+        return;
+    env_free(&p->envelope->from);
+    env_free(&p->envelope->rcpt);
+    free(p->envelope);
+    p->envelope = NULL;
+}
+
+size_t
+milter_envelope_memory(const struct milter_priv *p)
+{
+    const struct milter_envelope *env = p->envelope;
+
+    if (env == NULL)
+        return 0;
+    return sizeof(*env) + env->from.size + env->rcpt.size
+         + (env->from.maxparams + env->rcpt.maxparams)
+           * sizeof(struct env_param);
+}
+
+static value
+env_value(const struct env_path *e)
+{
+    CAMLparam0();
+    CAMLlocal5(res, params, cell, param, v);
+    int i;
+
+    if (!e->valid)
+        CAMLreturn(Val_none);
+
+    params = Val_emptylist;
+    for (i = e->nparams - 1; i >= 0; i--) {
+        param = caml_alloc_tuple(2);
+        v = caml_copy_string(e->buf + e->params[i].key);
+        Store_field(param, 0, v);
+        if (e->params[i].value == 0) {
+            Store_field(param, 1, Val_none);
+        } else {
+            v = caml_copy_string(e->buf + e->params[i].value);
+            v = Val_some(v);
+            Store_field(param, 1, v);
+        }
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, param);
+        Store_field(cell, 1, params);
+        params = cell;
+    }
+
+    res = caml_alloc_tuple(4);
+    Store_field(res, 0, Val_bool(e->null));
+    v = caml_copy_string(e->buf + e->local);
+    Store_field(res, 1, v);
+    v = caml_copy_string(e->buf + e->domain);
+    Store_field(res, 2, v);
+    Store_field(res, 3, params);
+
+    CAMLreturn(Val_some(res));
+}
+
+CAMLprim value
+caml_milter_envelope_enable(value unit)
+{
+    CAMLparam1(unit);
+    envelope_enabled = 1;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_envelope_sender(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->envelope == NULL)
+        CAMLreturn(Val_none);
+    CAMLreturn(env_value(&p->envelope->from));
+}
+
+CAMLprim value
+caml_milter_envelope_recipient(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->envelope == NULL)
+        CAMLreturn(Val_none);
+    CAMLreturn(env_value(&p->envelope->rcpt));
+}
+
+CAMLprim value
+caml_milter_envelope_parse(value rcpt_val, value path_val, value params_val)
+{
+    CAMLparam3(rcpt_val, path_val, params_val);
+    CAMLlocal1(res);
+    int i, n;
+    char **argv;
+    value l;
+    struct env_path e;
+
+    n = 1;
+    for (l = params_val; l != Val_emptylist; l = Field(l, 1))
+        n++;
+    argv = malloc((n + 1) * sizeof(*argv));
+    if (argv == NULL)
+        milter_error("Milter.Envelope.parse");
+
+    argv[0] = (char *)String_val(path_val);
+    i = 1;
+    for (l = params_val; l != Val_emptylist; l = Field(l, 1))
+        argv[i++] = (char *)String_val(Field(l, 0));
+    argv[n] = NULL;
+
+    memset(&e, 0, sizeof(e));
+    env_parse(&e, argv, Bool_val(rcpt_val));
+    free(argv);
+
+    /* Strings with NUL bytes would have been cut short. */
+    if (strlen(String_val(path_val)) != caml_string_length(path_val))
+        e.valid = 0;
+    for (l = params_val; l != Val_emptylist; l = Field(l, 1))
+        if (strlen(String_val(Field(l, 0)))
+                != caml_string_length(Field(l, 0)))
+            e.valid = 0;
+    res = env_value(&e);
+    env_free(&e);
+
+    CAMLreturn(res);
+}
@@ -0,0 +1,317 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Greylisting triplet store in a shared memory-mapped table. Slots are
+ * keyed by a hash of the client network, sender and recipient, and hold
+ * the time the triplet was first and last seen, in seconds since the
+ * table was created. Every field is updated atomically, so the table stays
+ * consistent if a process crashes, and can be shared by several
+ * processes without locks.
+ *
+ * Each process that opens a table runs a thread that sweeps a slice of it
+ * every second, replacing expired entries, and entries whose insert was
+ * interrupted, with tombstones. Tombstones are skipped by lookups and
+ * reused by inserts, but never emptied, as other processes may be probing
+ * past them. Keys only change by compare-and-swap from the value they
+ * were seen with.
+ */
+
+#define GL_MAGIC      0x4d474c31 /* "MGL1" */
+#define GL_PROBES     64
+#define GL_EMPTY      0
+#define GL_TOMBSTONE  1
+#define GL_SWEEP_TIME 3600       /* Seconds to sweep the whole table. */
+#define GL_STALE      60         /* Seconds to finish an insert. */
+
+struct gl_slot {
+    uint64_t key;
+    uint32_t first;
+    uint32_t last;
+    uint32_t passed;
+    uint32_t pad;
+    uint64_t reserved;
+};
+
+struct gl_table {
+    struct milter_shm_header *h;
+    struct gl_slot *slots;
+    size_t len;
+    uint32_t delay;
+    uint32_t retry;
+    uint32_t expire;
+    int stop;
+};
+
+#define Gl_table_val(v) (*(struct gl_table **)Data_custom_val(v))
+
+static void
+gl_finalize(value t_val)
+{
+    /* The sweeper unmaps the table and frees it when it sees this. */
+    __atomic_store_n(&Gl_table_val(t_val)->stop, 1, __ATOMIC_RELEASE);
+}
+
+static struct custom_operations gl_ops = {
+    "milter.greylist",
+    gl_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+static uint32_t
+gl_now(struct gl_table *t)
+{
+    int64_t ms = milter_clock_ms() - t->h->created;
+
+    /* Never zero, which marks a slot whose insert was interrupted. */
+    return (uint32_t)((ms > 0 ? ms : 0) / 1000) + 1;
+}
+
+/* Seconds since then, which may be ahead of now if the clock was set
+ * back or another process wrote it a little later. */
+static uint32_t
+gl_age(uint32_t now, uint32_t then)
+{
+    return now > then ? now - then : 0;
+}
+
+static int
+gl_expired(struct gl_table *t, struct gl_slot *s, uint32_t now)
+{
+    uint32_t first = __atomic_load_n(&s->first, __ATOMIC_ACQUIRE);
+    uint32_t last = __atomic_load_n(&s->last, __ATOMIC_ACQUIRE);
+
+    /* An insert interrupted before setting first, once it is stale. */
+    if (first == 0)
+        return gl_age(now, last) > GL_STALE;
+    if (__atomic_load_n(&s->passed, __ATOMIC_ACQUIRE) > 0)
+        return gl_age(now, last) > t->expire;
+    return gl_age(now, first) > t->retry;
+}
+
+static struct gl_slot *
+gl_slot(struct gl_table *t, uint64_t key)
+{
+    int i;
+    uint64_t mask, k;
+    struct gl_slot *s, *free_slot;
+
+    mask = t->h->nslots - 1;
+    free_slot = NULL;
+    for (i = 0; i < GL_PROBES; i++) {
+        s = &t->slots[(key + i) & mask];
+        k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return s;
+        if (k == GL_TOMBSTONE && free_slot == NULL)
+            free_slot = s;
+        if (k == GL_EMPTY) {
+            if (free_slot == NULL)
+                free_slot = s;
+            break;
+        }
+    }
+
+    /* Not found; claim the first free slot of the chain. */
+    while (free_slot != NULL) {
+        k = __atomic_load_n(&free_slot->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return free_slot;
+        if (k != GL_EMPTY && k != GL_TOMBSTONE)
+            return NULL;
+        if (__atomic_compare_exchange_n(&free_slot->key, &k, key, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* Until first is set, the entry counts as new; last tells
+             * the sweeper when the insert started. */
+            __atomic_store_n(&free_slot->last, gl_now(t), __ATOMIC_RELEASE);
+            __atomic_store_n(&free_slot->first, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&free_slot->passed, 0, __ATOMIC_RELEASE);
+            return free_slot;
+        }
+    }
+    return NULL;
+}
+
+static void
+gl_sweep(struct gl_table *t, uint64_t *pos)
+{
+    uint64_t i, n, mask, k;
+    uint32_t now;
+    struct gl_slot *s;
+
+    mask = t->h->nslots - 1;
+    n = t->h->nslots / GL_SWEEP_TIME + 1;
+    now = gl_now(t);
+
+    for (i = 0; i < n; i++, (*pos)++) {
+        s = &t->slots[*pos & mask];
+        k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (k == GL_EMPTY || k == GL_TOMBSTONE)
+            continue;
+        if (gl_expired(t, s, now))
+            __atomic_compare_exchange_n(&s->key, &k, GL_TOMBSTONE, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void *
+gl_sweeper(void *arg)
+{
+    uint64_t pos;
+    struct timespec ts = { 1, 0 };
+    struct gl_table *t = arg;
+
+    pos = (uint64_t)getpid() * 2654435761u;
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        gl_sweep(t, &pos);
+        msync(t->h, t->len, MS_ASYNC);
+        nanosleep(&ts, NULL);
+    }
+
+    munmap(t->h, t->len);
+    free(t);
+    return NULL;
+}
+
+CAMLprim value
+caml_milter_greylist_open(value path_val, value slots_val, value policy_val)
+{
+    CAMLparam3(path_val, slots_val, policy_val);
+    CAMLlocal1(res);
+    pthread_t thread;
+    size_t len;
+    struct milter_shm_header *h;
+    struct gl_table *t;
+
+    if (Long_val(slots_val) <= 0)
+        milter_error("Milter.Greylist.openfile");
+
+    h = milter_shm_map(String_val(path_val), GL_MAGIC, Long_val(slots_val),
+                       sizeof(struct gl_slot), &len);
+    if (h == NULL)
+        milter_error("Milter.Greylist.openfile");
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        munmap(h, len);
+        milter_error("Milter.Greylist.openfile");
+    }
+    t->h = h;
+    t->len = len;
+    t->slots = (struct gl_slot *)(h + 1);
+    t->delay = Long_val(Field(policy_val, 0));
+    t->retry = Long_val(Field(policy_val, 1));
+    t->expire = Long_val(Field(policy_val, 2));
+
+    if (pthread_create(&thread, NULL, gl_sweeper, t) != 0) {
+        free(t);
+        munmap(h, len);
+        milter_error("Milter.Greylist.openfile");
+    }
+    pthread_detach(thread);
+
+    res = caml_alloc_custom(&gl_ops, sizeof(t), 0, 1);
+    Gl_table_val(res) = t;
+
+    CAMLreturn(res);
+}
+
+static uint64_t
+gl_key(value addr_val, value sender_val, value rcpt_val)
+{
+    size_t i, n, alen, slen, rlen;
+    unsigned char *buf;
+    uint64_t key;
+
+    /* The client is identified by its /24 or /64 network. */
+    alen = caml_string_length(addr_val) == 16 ? 8 : 3;
+    slen = caml_string_length(sender_val);
+    rlen = caml_string_length(rcpt_val);
+
+    n = alen + slen + rlen + 2;
+    buf = malloc(n);
+    if (buf == NULL)
+        return GL_EMPTY;
+
+    memcpy(buf, String_val(addr_val), alen);
+    buf[alen] = '\0';
+    memcpy(buf + alen + 1, String_val(sender_val), slen);
+    buf[alen + 1 + slen] = '\0';
+    memcpy(buf + alen + 2 + slen, String_val(rcpt_val), rlen);
+    for (i = alen + 1; i < n; i++)
+        buf[i] = tolower(buf[i]);
+
+    key = milter_hash64(buf, n);
+    free(buf);
+
+    if (key == GL_EMPTY || key == GL_TOMBSTONE)
+        key += 2;
+    return key;
+}
+
+CAMLprim value
+caml_milter_greylist_check(value t_val, value addr_val, value sender_val,
+                           value rcpt_val)
+{
+    CAMLparam4(t_val, addr_val, sender_val, rcpt_val);
+    CAMLlocal1(res);
+    uint64_t key;
+    uint32_t now, first, zero, age;
+    struct gl_table *t = Gl_table_val(t_val);
+    struct gl_slot *s;
+
+    key = gl_key(addr_val, sender_val, rcpt_val);
+    s = key == GL_EMPTY ? NULL : gl_slot(t, key);
+    if (s == NULL)
+        CAMLreturn(Val_int(0)); /* Table full: fail open. */
+
+    now = gl_now(t);
+
+    first = __atomic_load_n(&s->first, __ATOMIC_ACQUIRE);
+    if (gl_expired(t, s, now)) {
+        /* Start over, as if the triplet had never been seen; of the
+         * processes that find it expired, only the first does. */
+        if (__atomic_compare_exchange_n(&s->first, &first, now, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            __atomic_store_n(&s->passed, 0, __ATOMIC_RELEASE);
+    }
+
+    zero = 0;
+    __atomic_compare_exchange_n(&s->first, &zero, now, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    first = __atomic_load_n(&s->first, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&s->last, now, __ATOMIC_RELEASE);
+
+    /* Expired by the sweeper meanwhile: the triplet is new again. */
+    if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) != key)
+        first = now;
+
+    age = gl_age(now, first);
+    if (age >= t->delay) {
+        __atomic_add_fetch(&s->passed, 1, __ATOMIC_ACQ_REL);
+        CAMLreturn(Val_int(0));
+    }
+
+    res = caml_alloc(1, 0);
+    Store_field(res, 0, Val_long(t->delay - age));
+    CAMLreturn(res);
+}
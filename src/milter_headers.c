@@ -0,0 +1,452 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Per-message header store. Header fields are copied from the header
+ * callback, without the runtime lock, into one arena per connection, and
+ * a hash table maps lowercased field names to their occurrences. The
+ * occurrence lists are laid out in a single array the first time the
+ * store is queried, after which looking up a field by name and occurrence
+ * takes constant time.
+ *
+ * Occurrences are counted like smfi_chgheader() does and positions like
+ * smfi_insheader() does, for the header as it was received.
+ */
+
+struct hdr_entry {
+    uint32_t name;      /* Offsets into the arena. */
+    uint32_t value;
+    uint32_t len;
+    uint32_t slot;      /* Set when indexing. */
+};
+
+struct hdr_name {
+    uint32_t hash;
+    int first;          /* Entry of the first occurrence. */
+    int count;
+    int start;          /* Into the occurrence array, once indexed. */
+};
+
+struct milter_headers {
+    char *arena;
+    size_t len;
+    size_t size;
+    struct hdr_entry *entries;
+    int nentries;
+    int maxentries;
+    struct hdr_name *names;
+    int nnames;
+    int nslots;
+    int *occ;
+    int indexed;
+    int failed;
+};
+
+static int headers_enabled = 0;
+
+int
+milter_headers_enabled(void)
+{
+    return headers_enabled;
+}
+
+static uint32_t
+hdr_hash(const char *name, size_t len)
+{
+    size_t i;
+    uint32_t h = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619;
+    }
+    return h;
+}
+
+static struct milter_headers *
+hdr_get(SMFICTX *ctx)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->headers == NULL)
+        p->headers = calloc(1, sizeof(*p->headers));
+    return p->headers;
+}
+
+/* Returns the slot of name, or of the free slot where it belongs. */
+static int
+hdr_slot(struct milter_headers *h, const char *name, size_t len,
+         uint32_t hash)
+{
+    int i;
+    struct hdr_name *n;
+
+    for (i = hash & (h->nslots - 1); ; i = (i + 1) & (h->nslots - 1)) {
+        n = &h->names[i];
+        if (n->count == 0)
+            return i;
+        if (n->hash == hash
+                && strncasecmp(h->arena + h->entries[n->first].name, name,
+                               len) == 0
+                && h->arena[h->entries[n->first].name + len] == '\0')
+            return i;
+    }
+}
+
+static int
+hdr_grow_names(struct milter_headers *h)
+{
+    int i, j, nslots;
+    struct hdr_name *names, *old;
+
+    nslots = h->nslots == 0 ? 32 : h->nslots * 2;
+    names = calloc(nslots, sizeof(*names));
+    if (names == NULL)
+        return -1;
+
+    old = h->names;
+    h->names = names;
+    for (i = 0; i < h->nslots; i++) {
+        if (old[i].count == 0)
+            continue;
+        for (j = old[i].hash & (nslots - 1); names[j].count != 0;
+             j = (j + 1) & (nslots - 1))
+            ;
+        names[j] = old[i];
+    }
+    h->nslots = nslots;
+    free(old);
+    return 0;
+}
+
+void
+milter_headers_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+    struct milter_headers *h;
+
+    if (!headers_enabled)
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || (h = p->headers) == NULL)
+        return;
+
+    h->len = 0;
+    h->nentries = 0;
+    if (h->nnames > 0)
+        memset(h->names, 0, h->nslots * sizeof(*h->names));
+    h->nnames = 0;
+    free(h->occ);
+    h->occ = NULL;
+    h->indexed = 0;
+    h->failed = 0;
+}
+
+void
+milter_headers_add(SMFICTX *ctx, const char *name, const char *value)
+{
+    int slot;
+    char *arena;
+    size_t nlen, vlen, size;
+    uint32_t hash;
+    struct hdr_entry *e;
+    struct milter_headers *h;
+
+    if (!headers_enabled || (h = hdr_get(ctx)) == NULL || h->failed)
+        return;
+
+    nlen = strlen(name);
+    vlen = strlen(value);
+    if (h->len + nlen + vlen + 2 > h->size) {
+        size = h->size == 0 ? 4096 : h->size;
+        while (size < h->len + nlen + vlen + 2)
+            size *= 2;
+        if (size > UINT32_MAX || (arena = realloc(h->arena, size)) == NULL)
+            goto fail;
+        h->arena = arena;
+        h->size = size;
+    }
+    if (h->nentries == h->maxentries) {
+        size = h->maxentries == 0 ? 64 : h->maxentries * 2;
+        e = realloc(h->entries, size * sizeof(*e));
+        if (e == NULL)
+            goto fail;
+        h->entries = e;
+        h->maxentries = size;
+    }
+    if (2 * (h->nnames + 1) > h->nslots && hdr_grow_names(h) == -1)
+        goto fail;
+
+    e = &h->entries[h->nentries];
+    e->name = h->len;
+    memcpy(h->arena + h->len, name, nlen + 1);
+    h->len += nlen + 1;
+    e->value = h->len;
+    e->len = vlen;
+    memcpy(h->arena + h->len, value, vlen + 1);
+    h->len += vlen + 1;
+
+    hash = hdr_hash(name, nlen);
+    slot = hdr_slot(h, name, nlen, hash);
+    if (h->names[slot].count == 0) {
+        h->names[slot].hash = hash;
+        h->names[slot].first = h->nentries;
+        h->nnames++;
+    }
+    h->names[slot].count++;
+    h->nentries++;
+    h->indexed = 0;
+    return;
+
+fail:
+    h->failed = 1;
+}
+
+void
+milter_headers_free(struct milter_priv *p)
+{
+    struct milter_headers *h = p->headers;
+
+    if (h == NULL)
+        return;
+    free(h->arena);
+    free(h->entries);
+    free(h->names);
+    free(h->occ);
+    free(h);
+    p->headers = NULL;
+}
+
+size_t
+milter_headers_memory(const struct milter_priv *p)
+{
+    const struct milter_headers *h = p->headers;
+
+    if (h == NULL)
+        return 0;
+    return sizeof(*h) + h->size
+         + h->maxentries * sizeof(*h->entries)
+         + h->nslots * sizeof(*h->names)
+         + (h->occ != NULL ? (h->nentries + 1) * sizeof(int) : 0);
+}
+
+/* Lays out the occurrences of each name contiguously, in order. */
+static int
+hdr_index(struct milter_headers *h)
+{
+    int i, start, *fill;
+    uint32_t hash;
+    const char *name;
+
+    if (h->indexed)
+        return 0;
+
+    free(h->occ);
+    h->occ = malloc((h->nentries + 1) * sizeof(int));
+    fill = calloc(h->nslots + 1, sizeof(int));
+    if (h->occ == NULL || fill == NULL) {
+        free(fill);
+        return -1;
+    }
+
+    start = 0;
+    for (i = 0; i < h->nslots; i++) {
+        h->names[i].start = start;
+        start += h->names[i].count;
+    }
+    for (i = 0; i < h->nentries; i++) {
+        name = h->arena + h->entries[i].name;
+        hash = hdr_hash(name, strlen(name));
+        h->entries[i].slot = hdr_slot(h, name, strlen(name), hash);
+        h->occ[h->names[h->entries[i].slot].start
+               + fill[h->entries[i].slot]++] = i;
+    }
+
+    free(fill);
+    h->indexed = 1;
+    return 0;
+}
+
+static struct milter_headers *
+hdr_query(value ctx_val)
+{
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+    struct milter_headers *h;
+
+    if (!headers_enabled)
+        milter_error("Milter.Headers");
+    if (p == NULL || (h = p->headers) == NULL)
+        return NULL;
+    if (h->failed)
+        milter_error("Milter.Headers");
+    if (hdr_index(h) == -1)
+        milter_error("Milter.Headers");
+    return h;
+}
+
+static struct hdr_name *
+hdr_lookup(struct milter_headers *h, value name_val)
+{
+    int slot;
+    size_t len;
+    const char *name = String_val(name_val);
+
+    if (h == NULL || h->nnames == 0)
+        return NULL;
+    len = caml_string_length(name_val);
+    slot = hdr_slot(h, name, len, hdr_hash(name, len));
+    return h->names[slot].count == 0 ? NULL : &h->names[slot];
+}
+
+/* Resolves a selector to an occurrence (1-based) and entry, or -1. */
+static int
+hdr_select(struct milter_headers *h, value sel_val, int *occurrence)
+{
+    int n;
+    struct hdr_name *name;
+
+    name = hdr_lookup(h, Field(sel_val, 0));
+    if (name == NULL)
+        return -1;
+
+    switch (Tag_val(sel_val)) {
+    case 0: /* First */
+        n = 1;
+        break;
+    case 1: /* Last */
+        n = name->count;
+        break;
+    default: /* Nth */
+        n = Int_val(Field(sel_val, 1));
+        break;
+    }
+    if (n < 1 || n > name->count)
+        return -1;
+
+    *occurrence = n;
+    return h->occ[name->start + n - 1];
+}
+
+static value
+hdr_value(struct milter_headers *h, int entry)
+{
+    value v = caml_alloc_string(h->entries[entry].len);
+
+    memcpy((char *)String_val(v), h->arena + h->entries[entry].value,
+           h->entries[entry].len);
+    return v;
+}
+
+CAMLprim value
+caml_milter_headers_enable(value unit)
+{
+    CAMLparam1(unit);
+    headers_enabled = 1;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_headers_count(value ctx_val, value name_val)
+{
+    CAMLparam2(ctx_val, name_val);
+    struct hdr_name *name = hdr_lookup(hdr_query(ctx_val), name_val);
+
+    CAMLreturn(Val_int(name == NULL ? 0 : name->count));
+}
+
+CAMLprim value
+caml_milter_headers_find(value ctx_val, value sel_val)
+{
+    CAMLparam2(ctx_val, sel_val);
+    CAMLlocal1(v);
+    int entry, n;
+    struct milter_headers *h = hdr_query(ctx_val);
+
+    if (h == NULL || (entry = hdr_select(h, sel_val, &n)) == -1)
+        CAMLreturn(Val_none);
+
+    v = hdr_value(h, entry);
+    CAMLreturn(Val_some(v));
+}
+
+CAMLprim value
+caml_milter_headers_find_all(value ctx_val, value name_val)
+{
+    CAMLparam2(ctx_val, name_val);
+    CAMLlocal3(res, cell, v);
+    int i;
+    struct milter_headers *h = hdr_query(ctx_val);
+    struct hdr_name *name = hdr_lookup(h, name_val);
+
+    res = Val_emptylist;
+    if (name == NULL)
+        CAMLreturn(res);
+
+    for (i = name->count - 1; i >= 0; i--) {
+        v = hdr_value(h, h->occ[name->start + i]);
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, v);
+        Store_field(cell, 1, res);
+        res = cell;
+    }
+
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_headers_to_list(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal4(res, cell, pair, v);
+    int i;
+    struct milter_headers *h = hdr_query(ctx_val);
+
+    res = Val_emptylist;
+    if (h == NULL)
+        CAMLreturn(res);
+
+    for (i = h->nentries - 1; i >= 0; i--) {
+        pair = caml_alloc(2, 0);
+        v = caml_copy_string(h->arena + h->entries[i].name);
+        Store_field(pair, 0, v);
+        v = hdr_value(h, i);
+        Store_field(pair, 1, v);
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, pair);
+        Store_field(cell, 1, res);
+        res = cell;
+    }
+
+    CAMLreturn(res);
+}
+
+/* Returns the occurrence and position of the selected field. */
+CAMLprim value
+caml_milter_headers_locate(value ctx_val, value sel_val)
+{
+    CAMLparam2(ctx_val, sel_val);
+    CAMLlocal1(res);
+    int entry, n;
+    struct milter_headers *h = hdr_query(ctx_val);
+
+    if (h == NULL || (entry = hdr_select(h, sel_val, &n)) == -1)
+        caml_raise_not_found();
+
+    res = caml_alloc_tuple(2);
+    Store_field(res, 0, Val_int(n));
+    Store_field(res, 1, Val_int(entry));
+    CAMLreturn(res);
+}
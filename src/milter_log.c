@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Asynchronous logging. Each thread writes fixed-size records into its own
+ * single-producer ring buffer without taking any lock; a writer thread
+ * collects the records of all rings, formats them and writes them out in
+ * batches. When a ring is full the record is dropped and counted, so
+ * logging never stalls a callback.
+ *
+ * A record holds the format, which must be a string literal, and a copy of
+ * its arguments: numbers as 64 bits, strings as a length and their bytes.
+ * Only the writer runs printf, one conversion at a time. Arguments that do
+ * not fit in a record are cut, and the message with them.
+ *
+ * Rings are attached to threads on their first record and given back when
+ * the thread exits; the writer recycles them once drained, since libmilter
+ * starts a thread per connection.
+ */
+
+#define LOG_RING_SIZE 64        /* Records per thread; a power of two. */
+#define LOG_MSG_MAX   232       /* Bytes of arguments or text. */
+#define LOG_LINE_MAX  512       /* Bytes of a formatted message. */
+#define LOG_INTERVAL  50000000  /* 50ms */
+#define LOG_BATCH     4096
+
+struct log_record {
+    int64_t time;
+    uint64_t conn;
+    const char *fmt;            /* NULL if msg is the text itself. */
+    uint16_t level;
+    uint16_t len;
+    char msg[LOG_MSG_MAX];
+};
+
+/* A printf conversion, parsed from the format by both sides. */
+enum log_mod {
+    LOG_MOD_NONE, LOG_MOD_HH, LOG_MOD_H, LOG_MOD_L, LOG_MOD_LL,
+    LOG_MOD_J, LOG_MOD_Z, LOG_MOD_T, LOG_MOD_LD,
+};
+
+#define LOG_STAR (-2)           /* Width or precision given as '*'. */
+
+struct log_spec {
+    char flags[8];
+    int width;                  /* -1 if none. */
+    int prec;                   /* -1 if none. */
+    enum log_mod mod;
+    char conv;
+};
+
+struct log_ring {
+    struct log_ring *next;
+    uint64_t head;
+    uint64_t tail;
+    int dead;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+static const char *log_levels[] = {
+    "debug", "info", "notice", "warning", "error",
+};
+
+static int log_fd = -1;
+static int log_level = MILTER_LOG_INFO;
+static long log_dropped = 0;
+static long log_reported = 0;
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings = NULL;
+static struct log_ring *log_free = NULL;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *log_ring = NULL;
+
+static void
+log_ring_release(void *arg)
+{
+    struct log_ring *r = arg;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_init_once(void)
+{
+    pthread_key_create(&log_key, log_ring_release);
+}
+
+static struct log_ring *
+log_ring_get(void)
+{
+    struct log_ring *r;
+
+    if (log_ring != NULL)
+        return log_ring;
+
+    pthread_mutex_lock(&log_mutex);
+    r = log_free;
+    if (r != NULL)
+        log_free = r->next;
+    else
+        r = malloc(sizeof(*r));
+    if (r != NULL) {
+        r->head = r->tail = 0;
+        r->dead = 0;
+        r->next = log_rings;
+        log_rings = r;
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    if (r != NULL) {
+        pthread_setspecific(log_key, r);
+        log_ring = r;
+    }
+    return r;
+}
+
+/* Parses the conversion after a '%' and returns the rest of the format. */
+static const char *
+log_parse(const char *p, struct log_spec *sp)
+{
+    size_t n = 0;
+
+    while (strchr("-+ #0'", *p) != NULL && *p != '\0') {
+        if (n < sizeof(sp->flags) - 1)
+            sp->flags[n++] = *p;
+        p++;
+    }
+    sp->flags[n] = '\0';
+
+    sp->width = -1;
+    if (*p == '*') {
+        sp->width = LOG_STAR;
+        p++;
+    } else {
+        for (; *p >= '0' && *p <= '9'; p++)
+            sp->width = (sp->width < 0 ? 0 : sp->width * 10) + (*p - '0');
+    }
+
+    sp->prec = -1;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            sp->prec = LOG_STAR;
+            p++;
+        } else {
+            for (sp->prec = 0; *p >= '0' && *p <= '9'; p++)
+                sp->prec = sp->prec * 10 + (*p - '0');
+        }
+    }
+
+    sp->mod = LOG_MOD_NONE;
+    switch (*p) {
+    case 'h':
+        sp->mod = p[1] == 'h' ? LOG_MOD_HH : LOG_MOD_H;
+        p += sp->mod == LOG_MOD_HH ? 2 : 1;
+        break;
+    case 'l':
+        sp->mod = p[1] == 'l' ? LOG_MOD_LL : LOG_MOD_L;
+        p += sp->mod == LOG_MOD_LL ? 2 : 1;
+        break;
+    case 'j': sp->mod = LOG_MOD_J; p++; break;
+    case 'z': sp->mod = LOG_MOD_Z; p++; break;
+    case 't': sp->mod = LOG_MOD_T; p++; break;
+    case 'L': sp->mod = LOG_MOD_LD; p++; break;
+    }
+
+    sp->conv = *p;
+    return *p != '\0' ? p + 1 : p;
+}
+
+static int
+log_pack(char *buf, size_t *off, const void *src, size_t len)
+{
+    if (LOG_MSG_MAX - *off < len)
+        return -1;
+    memcpy(buf + *off, src, len);
+    *off += len;
+    return 0;
+}
+
+static int
+log_unpack(const struct log_record *rec, size_t *off, void *dst, size_t len)
+{
+    if (rec->len - *off < len)
+        return -1;
+    memcpy(dst, rec->msg + *off, len);
+    *off += len;
+    return 0;
+}
+
+/* Copies the arguments of fmt into buf, up to the first one that does not
+ * fit or that has an unknown conversion. Returns the bytes used. */
+static size_t
+log_pack_args(char *buf, const char *fmt, va_list ap)
+{
+    int i;
+    int64_t x;
+    uint64_t u;
+    double d;
+    uint8_t n;
+    size_t off = 0, len;
+    const char *p = fmt, *str;
+    struct log_spec sp;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        p = log_parse(p + 1, &sp);
+        if (sp.conv == '%')
+            continue;
+        if (sp.width == LOG_STAR) {
+            i = va_arg(ap, int);
+            if (log_pack(buf, &off, &i, sizeof(i)) == -1)
+                return off;
+        }
+        if (sp.prec == LOG_STAR) {
+            sp.prec = va_arg(ap, int);
+            if (log_pack(buf, &off, &sp.prec, sizeof(sp.prec)) == -1)
+                return off;
+        }
+
+        switch (sp.conv) {
+        case 'd': case 'i':
+            switch (sp.mod) {
+            case LOG_MOD_HH: x = (signed char)va_arg(ap, int); break;
+            case LOG_MOD_H:  x = (short)va_arg(ap, int); break;
+            case LOG_MOD_L:  x = va_arg(ap, long); break;
+            case LOG_MOD_LL: x = va_arg(ap, long long); break;
+            case LOG_MOD_J:  x = va_arg(ap, intmax_t); break;
+            case LOG_MOD_Z:  x = va_arg(ap, ssize_t); break;
+            case LOG_MOD_T:  x = va_arg(ap, ptrdiff_t); break;
+            default:         x = va_arg(ap, int); break;
+            }
+            if (log_pack(buf, &off, &x, sizeof(x)) == -1)
+                return off;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            switch (sp.mod) {
+            case LOG_MOD_HH: u = (unsigned char)va_arg(ap, unsigned); break;
+            case LOG_MOD_H:  u = (unsigned short)va_arg(ap, unsigned); break;
+            case LOG_MOD_L:  u = va_arg(ap, unsigned long); break;
+            case LOG_MOD_LL: u = va_arg(ap, unsigned long long); break;
+            case LOG_MOD_J:  u = va_arg(ap, uintmax_t); break;
+            case LOG_MOD_Z:  u = va_arg(ap, size_t); break;
+            case LOG_MOD_T:  u = va_arg(ap, ptrdiff_t); break;
+            default:         u = va_arg(ap, unsigned); break;
+            }
+            if (log_pack(buf, &off, &u, sizeof(u)) == -1)
+                return off;
+            break;
+        case 'c':
+            i = va_arg(ap, int);
+            if (log_pack(buf, &off, &i, sizeof(i)) == -1)
+                return off;
+            break;
+        case 'p':
+            u = (uintptr_t)va_arg(ap, void *);
+            if (log_pack(buf, &off, &u, sizeof(u)) == -1)
+                return off;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            d = sp.mod == LOG_MOD_LD ? (double)va_arg(ap, long double)
+                                     : va_arg(ap, double);
+            if (log_pack(buf, &off, &d, sizeof(d)) == -1)
+                return off;
+            break;
+        case 's':
+            str = va_arg(ap, const char *);
+            if (str == NULL)
+                str = "(null)";
+            len = sp.prec >= 0 ? strnlen(str, sp.prec) : strlen(str);
+            if (off == LOG_MSG_MAX)
+                return off;
+            /* Long strings are cut to what is left of the record. */
+            if (len > LOG_MSG_MAX - off - 1)
+                len = LOG_MSG_MAX - off - 1;
+            if (len > UINT8_MAX)
+                len = UINT8_MAX;
+            n = len;
+            log_pack(buf, &off, &n, 1);
+            log_pack(buf, &off, str, len);
+            break;
+        default:
+            return off;
+        }
+    }
+    return off;
+}
+
+static void
+log_put(int level, uint64_t conn, const char *fmt, const char *msg,
+        size_t len, va_list *ap)
+{
+    uint64_t head, tail;
+    struct timespec ts;
+    struct log_record *rec;
+    struct log_ring *r;
+
+    r = log_ring_get();
+    if (r == NULL) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == LOG_RING_SIZE) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &r->records[head & (LOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->conn = conn;
+    rec->level = level;
+    rec->fmt = fmt;
+    if (fmt != NULL) {
+        rec->len = log_pack_args(rec->msg, fmt, *ap);
+    } else {
+        if (len > LOG_MSG_MAX)
+            len = LOG_MSG_MAX;
+        rec->len = len;
+        memcpy(rec->msg, msg, len);
+    }
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+milter_log_enabled(int level)
+{
+    return __atomic_load_n(&log_fd, __ATOMIC_RELAXED) != -1
+        && level >= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+void
+milter_log(int level, struct milter_priv *p, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!milter_log_enabled(level))
+        return;
+
+    va_start(ap, fmt);
+    log_put(level, p == NULL ? 0 : p->id, fmt, NULL, 0, &ap);
+    va_end(ap);
+}
+
+/* Writer thread. */
+
+static int
+log_compare(const void *a, const void *b)
+{
+    const struct log_record *x = a, *y = b;
+
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Appends one conversion, rebuilt with its width and precision given in
+ * full and integers widened to long long. Returns -1 once the arguments
+ * run out. */
+static int
+log_conv(char *out, size_t size, size_t *pos, const struct log_spec *sp,
+         const struct log_record *rec, size_t *off)
+{
+    int i, n, width, prec;
+    int64_t x;
+    uint64_t u;
+    double d;
+    uint8_t len;
+    char spec[48], str[UINT8_MAX + 1];
+
+    width = sp->width;
+    prec = sp->prec;
+    if (width == LOG_STAR && log_unpack(rec, off, &width, sizeof(width)) == -1)
+        return -1;
+    if (prec == LOG_STAR && log_unpack(rec, off, &prec, sizeof(prec)) == -1)
+        return -1;
+
+    n = snprintf(spec, sizeof(spec), "%%%s", sp->flags);
+    if (width != -1)
+        n += snprintf(spec + n, sizeof(spec) - n, "%d", width);
+    if (prec >= 0 && sp->conv != 's')
+        n += snprintf(spec + n, sizeof(spec) - n, ".%d", prec);
+    if (sp->conv == 's')
+        snprintf(spec + n, sizeof(spec) - n, ".*s");
+    else
+        snprintf(spec + n, sizeof(spec) - n, "%s%c",
+                 strchr("diuoxX", sp->conv) != NULL ? "ll" : "", sp->conv);
+
+    switch (sp->conv) {
+    case 'd': case 'i':
+        if (log_unpack(rec, off, &x, sizeof(x)) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, (long long)x);
+        break;
+    case 'u': case 'o': case 'x': case 'X':
+        if (log_unpack(rec, off, &u, sizeof(u)) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, (unsigned long long)u);
+        break;
+    case 'c':
+        if (log_unpack(rec, off, &i, sizeof(i)) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, i);
+        break;
+    case 'p':
+        if (log_unpack(rec, off, &u, sizeof(u)) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, (void *)(uintptr_t)u);
+        break;
+    case 's':
+        if (log_unpack(rec, off, &len, 1) == -1
+                || log_unpack(rec, off, str, len) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, (int)len, str);
+        break;
+    default:
+        if (log_unpack(rec, off, &d, sizeof(d)) == -1)
+            return -1;
+        n = snprintf(out + *pos, size - *pos, spec, d);
+        break;
+    }
+    if (n > 0)
+        *pos += (size_t)n < size - *pos ? (size_t)n : size - *pos - 1;
+    return 0;
+}
+
+/* Formats the message of a record into out, which is size bytes long. */
+static size_t
+log_render(char *out, size_t size, const struct log_record *rec)
+{
+    size_t pos = 0, off = 0;
+    const char *p;
+    struct log_spec sp;
+
+    if (rec->fmt == NULL) {
+        pos = rec->len < size ? rec->len : size - 1;
+        memcpy(out, rec->msg, pos);
+        return pos;
+    }
+
+    for (p = rec->fmt; *p != '\0' && pos < size - 1; ) {
+        if (*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        p = log_parse(p + 1, &sp);
+        if (sp.conv == '%')
+            out[pos++] = '%';
+        else if (strchr("diuoxXcpseEfFgGaA", sp.conv) == NULL
+                 || log_conv(out, size, &pos, &sp, rec, &off) == -1)
+            break;
+    }
+    return pos;
+}
+
+static size_t
+log_format(char *buf, size_t size, const struct log_record *rec)
+{
+    int n;
+    time_t sec;
+    struct tm tm;
+    size_t len;
+    char msg[LOG_LINE_MAX];
+
+    sec = rec->time / 1000000000;
+    gmtime_r(&sec, &tm);
+    n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    len = log_render(msg, sizeof(msg), rec);
+    if (rec->conn != 0)
+        n += snprintf(buf + n, size - n, ".%06ldZ %s conn=%llu %.*s\n",
+                      (long)(rec->time % 1000000000 / 1000),
+                      log_levels[rec->level],
+                      (unsigned long long)rec->conn, (int)len, msg);
+    else
+        n += snprintf(buf + n, size - n, ".%06ldZ %s %.*s\n",
+                      (long)(rec->time % 1000000000 / 1000),
+                      log_levels[rec->level], (int)len, msg);
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+static size_t
+log_collect(struct log_record *batch, size_t max)
+{
+    size_t n;
+    uint64_t head, tail;
+    struct log_ring *r, **rp;
+
+    n = 0;
+    pthread_mutex_lock(&log_mutex);
+    rp = &log_rings;
+    while ((r = *rp) != NULL) {
+        /* Read dead before head, so a thread's last records are seen. */
+        int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (tail = r->tail; tail != head && n < max; tail++)
+            batch[n++] = r->records[tail & (LOG_RING_SIZE - 1)];
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        if (dead && tail == head) {
+            *rp = r->next;
+            r->next = log_free;
+            log_free = r;
+        } else {
+            rp = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    return n;
+}
+
+static void
+log_write(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *
+log_writer(void *arg)
+{
+    int fd;
+    long dropped;
+    size_t i, n, off;
+    struct timespec ts = { 0, LOG_INTERVAL };
+    static struct log_record batch[LOG_BATCH];
+    static char buf[LOG_BATCH * 64];
+
+    for (;;) {
+        n = log_collect(batch, LOG_BATCH);
+        if (n == 0)
+            nanosleep(&ts, NULL);
+
+        dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != log_reported && n < LOG_BATCH) {
+            batch[n].time = milter_clock_ms() * 1000000;
+            batch[n].conn = 0;
+            batch[n].fmt = NULL;
+            batch[n].level = MILTER_LOG_WARNING;
+            batch[n].len = snprintf(batch[n].msg, LOG_MSG_MAX,
+                                    "log overloaded: %ld records dropped",
+                                    dropped - log_reported);
+            log_reported = dropped;
+            n++;
+        }
+        if (n == 0)
+            continue;
+
+        qsort(batch, n, sizeof(batch[0]), log_compare);
+
+        fd = __atomic_load_n(&log_fd, __ATOMIC_ACQUIRE);
+        off = 0;
+        for (i = 0; i < n; i++) {
+            if (sizeof(buf) - off < LOG_LINE_MAX + 96) {
+                log_write(fd, buf, off);
+                off = 0;
+            }
+            off += log_format(buf + off, sizeof(buf) - off, &batch[i]);
+        }
+        log_write(fd, buf, off);
+    }
+
+    return NULL;
+}
+
+CAMLprim value
+caml_milter_log_open(value path_val)
+{
+    CAMLparam1(path_val);
+    int fd, old, ret;
+    pthread_t thread;
+
+    pthread_once(&log_once, log_init_once);
+
+    fd = open(String_val(path_val), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+              0644);
+    if (fd == -1)
+        milter_error("Milter.Log.openfile");
+
+    /* Reopening, such as after log rotation, replaces the file behind the
+     * descriptor in place: the writer may be using it, so its number must
+     * not be freed. Callers hold the runtime lock, so only one runs. */
+    old = __atomic_load_n(&log_fd, __ATOMIC_ACQUIRE);
+    if (old != -1) {
+        ret = dup3(fd, old, O_CLOEXEC);
+        close(fd);
+        if (ret == -1)
+            milter_error("Milter.Log.openfile");
+    } else {
+        __atomic_store_n(&log_fd, fd, __ATOMIC_RELEASE);
+        if (pthread_create(&thread, NULL, log_writer, NULL) != 0) {
+            __atomic_store_n(&log_fd, -1, __ATOMIC_RELEASE);
+            close(fd);
+            milter_error("Milter.Log.openfile");
+        }
+        pthread_detach(thread);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_log_setlevel(value level_val)
+{
+    CAMLparam1(level_val);
+    __atomic_store_n(&log_level, Int_val(level_val), __ATOMIC_RELAXED);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_log_write(value level_val, value ctx_val, value msg_val)
+{
+    CAMLparam3(level_val, ctx_val, msg_val);
+    int level = Int_val(level_val);
+    struct milter_priv *p = NULL;
+
+    if (milter_log_enabled(level)) {
+        if (ctx_val != Val_none)
+            p = smfi_getpriv((SMFICTX *)Some_val(ctx_val));
+        log_put(level, p == NULL ? 0 : p->id, NULL, String_val(msg_val),
+                caml_string_length(msg_val), NULL);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_log_enabled(value level_val)
+{
+    CAMLparam1(level_val);
+    CAMLreturn(Val_bool(milter_log_enabled(Int_val(level_val))));
+}
+
+CAMLprim value
+caml_milter_log_dropped(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&log_dropped, __ATOMIC_RELAXED)));
+}
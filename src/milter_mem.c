@@ -0,0 +1,161 @@
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Memory accounting. Each connection is charged for its native buffers,
+ * the bytes copied to OCaml as callback arguments during the current
+ * message, and the size of its setpriv value. The charge is brought up
+ * to date when a callback starts, which is also when the limits are
+ * enforced: a connection over its ceiling, or any connection while the
+ * process is over the global one, gets a temporary failure without its
+ * data reaching the native features or OCaml.
+ */
+
+static int64_t mem_total = 0;
+static int64_t mem_conn_limit = 0;
+static int64_t mem_total_limit = 0;
+static long mem_refusals = 0;
+
+static void
+mem_update(struct milter_priv *p)
+{
+    int64_t native, sum;
+
+    native = sizeof(*p)
+           + milter_tap_memory(p)
+           + milter_headers_memory(p)
+           + milter_bodycache_memory(p)
+           + milter_scan_memory(p)
+           + milter_envelope_memory(p)
+           + milter_bayes_memory(p)
+           + milter_view_memory(p)
+           + milter_spf_memory(p)
+           + milter_urls_memory(p)
+           + milter_dkim_memory(p);
+    sum = native + p->mem_copied + p->mem_priv;
+
+    __atomic_store_n(&p->mem_native, native, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem_total, sum - p->mem_counted, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->mem_counted, sum, __ATOMIC_RELAXED);
+    if (sum > p->mem_peak)
+        __atomic_store_n(&p->mem_peak, sum, __ATOMIC_RELAXED);
+}
+
+int
+milter_mem_check(SMFICTX *ctx)
+{
+    int64_t total;
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL)
+        return 0;
+    mem_update(p);
+    if (mem_conn_limit == 0 && mem_total_limit == 0)
+        return 0;
+
+    total = __atomic_load_n(&mem_total, __ATOMIC_RELAXED)
+          + milter_tap_queued();
+    if ((mem_conn_limit > 0 && p->mem_counted > mem_conn_limit)
+            || (mem_total_limit > 0 && total > mem_total_limit)) {
+        if (!p->mem_refused)
+            milter_log(MILTER_LOG_WARNING, p,
+                       "memory limit exceeded: %lld bytes, %lld in total",
+                       (long long)p->mem_counted, (long long)total);
+        p->mem_refused = 1;
+        __atomic_add_fetch(&mem_refusals, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void
+milter_mem_message(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL)
+        return;
+    p->mem_copied = 0;
+    p->mem_refused = 0;
+}
+
+void
+milter_mem_copied(struct milter_priv *p, size_t n)
+{
+    p->mem_copied += n;
+}
+
+/* The size is measured by Milter.setpriv, only while limits are set, as
+ * it walks the whole value. */
+void
+milter_mem_priv(struct milter_priv *p, size_t size)
+{
+    p->mem_priv = size;
+}
+
+void
+milter_mem_release(struct milter_priv *p)
+{
+    __atomic_sub_fetch(&mem_total, p->mem_counted, __ATOMIC_RELAXED);
+    p->mem_counted = 0;
+}
+
+CAMLprim value
+caml_milter_memory_setlimits(value conn_val, value total_val)
+{
+    CAMLparam2(conn_val, total_val);
+    mem_conn_limit = Long_val(conn_val) > 0 ? Long_val(conn_val) : 0;
+    mem_total_limit = Long_val(total_val) > 0 ? Long_val(total_val) : 0;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_memory_limited(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_bool(mem_conn_limit > 0 || mem_total_limit > 0));
+}
+
+CAMLprim value
+caml_milter_memory_usage(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal1(res);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    res = caml_alloc_tuple(4);
+    if (p == NULL) {
+        Store_field(res, 0, Val_long(0));
+        Store_field(res, 1, Val_long(0));
+        Store_field(res, 2, Val_long(0));
+        Store_field(res, 3, Val_long(0));
+        CAMLreturn(res);
+    }
+    Store_field(res, 0,
+                Val_long(__atomic_load_n(&p->mem_native, __ATOMIC_RELAXED)));
+    Store_field(res, 1, Val_long(p->mem_copied));
+    Store_field(res, 2, Val_long(p->mem_priv));
+    Store_field(res, 3,
+                Val_long(__atomic_load_n(&p->mem_peak, __ATOMIC_RELAXED)));
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_memory_total(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&mem_total, __ATOMIC_RELAXED)
+                        + milter_tap_queued()));
+}
+
+CAMLprim value
+caml_milter_memory_refusals(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&mem_refusals, __ATOMIC_RELAXED)));
+}
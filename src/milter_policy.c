@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Read-only policy tables. A table file is built once, offline or in the
+ * background, and then mapped by the filter: nothing is loaded into the
+ * OCaml heap, so the GC never scans it, and opening a table only checks
+ * its header: lookups bounds-check each slot they read, so the index is
+ * never walked up front.
+ *
+ * The layout follows CDB: a header, the records one after the other, and
+ * an open-addressed index of (hash, offset) slots at most half full. A
+ * lookup hashes the key, probes the index and compares the key of each
+ * record whose hash matches, usually touching two pages. Keys added more
+ * than once are stored once, with their first value.
+ *
+ * Tables are replaced by building a new file and renaming it over the old
+ * one. Reloading maps and checks the new file without the runtime lock
+ * and swaps it in with the lock held. Lookups also hold the lock, so none
+ * can still be using the old mapping when it is unmapped.
+ */
+
+#define PT_MAGIC   0x4d505431 /* "MPT1" */
+#define PT_VERSION 1
+
+struct pt_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t nslots;
+    uint64_t index;     /* Offset of the index. */
+    uint64_t size;
+    int64_t created;
+    uint64_t reserved[2];
+};
+
+struct pt_slot {
+    uint64_t hash;
+    uint64_t offset;    /* Of the record; zero for empty slots. */
+};
+
+/* Records are a key length and value length followed by the bytes. */
+struct pt_record {
+    uint32_t klen;
+    uint32_t vlen;
+};
+
+struct pt_map {
+    const struct pt_header *h;
+    const struct pt_slot *slots;
+    size_t len;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+struct pt_table {
+    char *path;
+    struct pt_map map;
+};
+
+struct pt_builder {
+    char *path;
+    char *tmp;
+    FILE *f;
+    uint64_t offset;
+    struct pt_slot *entries;    /* Hash and offset of each record. */
+    uint64_t count;
+    uint64_t max;
+    int failed;
+};
+
+#define Pt_table_val(v)   (*(struct pt_table **)Data_custom_val(v))
+#define Pt_builder_val(v) (*(struct pt_builder **)Data_custom_val(v))
+
+static void
+pt_unmap(struct pt_map *m)
+{
+    if (m->h != NULL)
+        munmap((void *)m->h, m->len);
+    m->h = NULL;
+}
+
+static int
+pt_map(const char *path, struct pt_map *m)
+{
+    int fd;
+    void *base;
+    struct stat st;
+    const struct pt_header *h;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    h = base;
+    if (h->magic != PT_MAGIC || h->version != PT_VERSION
+            || h->size != (uint64_t)st.st_size
+            || h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0
+            || h->count >= h->nslots
+            || h->index < sizeof(*h) || h->index % 8 != 0
+            || h->index > h->size
+            || (h->size - h->index) / sizeof(struct pt_slot) != h->nslots) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    m->h = h;
+    m->slots = (const struct pt_slot *)((const char *)base + h->index);
+    m->len = st.st_size;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->mtime = st.st_mtim;
+    return 0;
+}
+
+/* Returns the record of key, or NULL. Corrupt offsets are ignored, and
+ * probes never go around the index more than once. */
+static const struct pt_record *
+pt_lookup(const struct pt_map *m, const char *key, size_t len)
+{
+    uint64_t i, n, hash, mask;
+    const char *base = (const char *)m->h;
+    const struct pt_slot *s;
+    struct pt_record r;
+
+    hash = milter_hash64(key, len);
+    mask = m->h->nslots - 1;
+    for (i = hash & mask, n = 0; n < m->h->nslots; i = (i + 1) & mask, n++) {
+        s = &m->slots[i];
+        if (s->offset == 0)
+            return NULL;
+        if (s->hash != hash
+                || s->offset > m->h->index - sizeof(r))
+            continue;
+        memcpy(&r, base + s->offset, sizeof(r));
+        if (r.klen == len
+                && (uint64_t)r.klen + r.vlen
+                       <= m->h->index - s->offset - sizeof(r)
+                && memcmp(base + s->offset + sizeof(r), key, len) == 0)
+            return (const struct pt_record *)(base + s->offset);
+    }
+    return NULL;
+}
+
+static void
+pt_table_finalize(value t_val)
+{
+    struct pt_table *t = Pt_table_val(t_val);
+
+    if (t == NULL)
+        return;
+    pt_unmap(&t->map);
+    free(t->path);
+    free(t);
+}
+
+static struct custom_operations pt_table_ops = {
+    "milter.policy",
+    pt_table_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+static void
+pt_builder_abort(struct pt_builder *b)
+{
+    if (b->f != NULL) {
+        fclose(b->f);
+        b->f = NULL;
+        unlink(b->tmp);
+    }
+    free(b->entries);
+    b->entries = NULL;
+}
+
+static void
+pt_builder_finalize(value b_val)
+{
+    struct pt_builder *b = Pt_builder_val(b_val);
+
+    if (b == NULL)
+        return;
+    pt_builder_abort(b);
+    free(b->path);
+    free(b->tmp);
+    free(b);
+}
+
+static struct custom_operations pt_builder_ops = {
+    "milter.policy.builder",
+    pt_builder_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+CAMLprim value
+caml_milter_policy_open(value path_val)
+{
+    CAMLparam1(path_val);
+    CAMLlocal1(res);
+    int ret;
+    struct pt_table *t;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL || (t->path = strdup(String_val(path_val))) == NULL) {
+        free(t);
+        milter_error("Milter.Policy.openfile");
+    }
+
+    caml_release_runtime_system();
+    ret = pt_map(t->path, &t->map);
+    caml_acquire_runtime_system();
+
+    if (ret == -1) {
+        free(t->path);
+        free(t);
+        milter_error("Milter.Policy.openfile");
+    }
+
+    res = caml_alloc_custom(&pt_table_ops, sizeof(t), 0, 1);
+    Pt_table_val(res) = t;
+
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_policy_reload(value t_val)
+{
+    CAMLparam1(t_val);
+    int ret;
+    struct stat st;
+    struct pt_map m, old;
+    struct pt_table *t = Pt_table_val(t_val);
+
+    memset(&m, 0, sizeof(m));
+
+    caml_release_runtime_system();
+    ret = stat(t->path, &st);
+    if (ret == 0 && st.st_dev == t->map.dev && st.st_ino == t->map.ino
+            && st.st_mtim.tv_sec == t->map.mtime.tv_sec
+            && st.st_mtim.tv_nsec == t->map.mtime.tv_nsec)
+        ret = 1;
+    else if (ret == 0)
+        ret = pt_map(t->path, &m);
+    caml_acquire_runtime_system();
+
+    if (ret == -1)
+        milter_error("Milter.Policy.reload");
+    if (ret == 1)
+        CAMLreturn(Val_false);
+
+    old = t->map;
+    t->map = m;
+
+    caml_release_runtime_system();
+    pt_unmap(&old);
+    caml_acquire_runtime_system();
+
+    milter_log(MILTER_LOG_INFO, NULL, "policy: reloaded %s, %llu entries",
+               t->path, (unsigned long long)m.h->count);
+
+    CAMLreturn(Val_true);
+}
+
+CAMLprim value
+caml_milter_policy_find(value t_val, value key_val)
+{
+    CAMLparam2(t_val, key_val);
+    CAMLlocal1(v);
+    const struct pt_record *r;
+    struct pt_record hdr;
+    struct pt_table *t = Pt_table_val(t_val);
+
+    r = pt_lookup(&t->map, String_val(key_val), caml_string_length(key_val));
+    if (r == NULL)
+        CAMLreturn(Val_none);
+
+    memcpy(&hdr, r, sizeof(hdr));
+    v = caml_alloc_string(hdr.vlen);
+    memcpy((char *)String_val(v), (const char *)(r + 1) + hdr.klen,
+           hdr.vlen);
+    CAMLreturn(Val_some(v));
+}
+
+CAMLprim value
+caml_milter_policy_mem(value t_val, value key_val)
+{
+    CAMLparam2(t_val, key_val);
+    struct pt_table *t = Pt_table_val(t_val);
+
+    CAMLreturn(Val_bool(pt_lookup(&t->map, String_val(key_val),
+                                  caml_string_length(key_val)) != NULL));
+}
+
+CAMLprim value
+caml_milter_policy_length(value t_val)
+{
+    CAMLparam1(t_val);
+    CAMLreturn(Val_long(Pt_table_val(t_val)->map.h->count));
+}
+
+CAMLprim value
+caml_milter_policy_create(value path_val)
+{
+    CAMLparam1(path_val);
+    CAMLlocal1(res);
+    int fd;
+    struct pt_header h;
+    struct pt_builder *b;
+    const char *path = String_val(path_val);
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        milter_error("Milter.Policy.create");
+    b->path = strdup(path);
+    b->tmp = malloc(strlen(path) + 8);
+    if (b->path == NULL || b->tmp == NULL)
+        goto fail;
+    sprintf(b->tmp, "%s.XXXXXX", path);
+
+    fd = mkstemp(b->tmp);
+    if (fd == -1)
+        goto fail;
+    if (milter_file_mode(fd, path) == -1
+            || (b->f = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(b->tmp);
+        goto fail;
+    }
+
+    /* The header is written last, once the index is known. */
+    memset(&h, 0, sizeof(h));
+    if (fwrite(&h, sizeof(h), 1, b->f) != 1) {
+        pt_builder_abort(b);
+        goto fail;
+    }
+    b->offset = sizeof(h);
+
+    res = caml_alloc_custom(&pt_builder_ops, sizeof(b), 0, 1);
+    Pt_builder_val(res) = b;
+    CAMLreturn(res);
+
+fail:
+    free(b->path);
+    free(b->tmp);
+    free(b);
+    milter_error("Milter.Policy.create");
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_policy_add(value b_val, value key_val, value v_val)
+{
+    CAMLparam3(b_val, key_val, v_val);
+    uint64_t max;
+    struct pt_slot *entries;
+    struct pt_record r;
+    struct pt_builder *b = Pt_builder_val(b_val);
+
+    if (b->f == NULL)
+        caml_invalid_argument("Milter.Policy.add");
+    if (b->failed)
+        milter_error("Milter.Policy.add");
+
+    if (b->count == b->max) {
+        max = b->max == 0 ? 1024 : b->max * 2;
+        entries = realloc(b->entries, max * sizeof(*entries));
+        if (entries == NULL)
+            goto fail;
+        b->entries = entries;
+        b->max = max;
+    }
+
+    r.klen = caml_string_length(key_val);
+    r.vlen = caml_string_length(v_val);
+    if (r.klen != caml_string_length(key_val)
+            || r.vlen != caml_string_length(v_val))
+        caml_invalid_argument("Milter.Policy.add");
+    if (fwrite(&r, sizeof(r), 1, b->f) != 1
+            || fwrite(String_val(key_val), 1, r.klen, b->f) != r.klen
+            || fwrite(String_val(v_val), 1, r.vlen, b->f) != r.vlen)
+        goto fail;
+
+    b->entries[b->count].hash = milter_hash64(String_val(key_val), r.klen);
+    b->entries[b->count].offset = b->offset;
+    b->count++;
+    b->offset += sizeof(r) + r.klen + r.vlen;
+
+    CAMLreturn(Val_unit);
+
+fail:
+    b->failed = 1;
+    milter_error("Milter.Policy.add");
+    CAMLreturn(Val_unit);
+}
+
+/* Whether the records at two offsets of the file being built have the
+ * same key, or -1 on error. */
+static int
+pt_same_key(int fd, uint64_t a, uint64_t b)
+{
+    char ka[4096], kb[4096];
+    size_t n;
+    uint64_t off;
+    struct pt_record ra, rb;
+
+    if (pread(fd, &ra, sizeof(ra), a) != sizeof(ra)
+            || pread(fd, &rb, sizeof(rb), b) != sizeof(rb))
+        return -1;
+    if (ra.klen != rb.klen)
+        return 0;
+    for (off = 0; off < ra.klen; off += n) {
+        n = ra.klen - off < sizeof(ka) ? ra.klen - off : sizeof(ka);
+        if (pread(fd, ka, n, a + sizeof(ra) + off) != (ssize_t)n
+                || pread(fd, kb, n, b + sizeof(rb) + off) != (ssize_t)n)
+            return -1;
+        if (memcmp(ka, kb, n) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Writes the index and header and moves the file into place. */
+static int
+pt_commit(struct pt_builder *b)
+{
+    int same;
+    uint64_t i, j, mask, nslots, count;
+    struct pt_slot *slots;
+    struct pt_header h;
+    static const char pad[8];
+
+    for (nslots = 16; nslots < 2 * b->count; nslots <<= 1)
+        ;
+    slots = calloc(nslots, sizeof(*slots));
+    if (slots == NULL)
+        return -1;
+
+    /* Keys added more than once keep their first value. Their records
+     * are read back from the file only when their hashes collide. */
+    if (fflush(b->f) == EOF) {
+        free(slots);
+        return -1;
+    }
+    mask = nslots - 1;
+    count = 0;
+    for (i = 0; i < b->count; i++) {
+        for (j = b->entries[i].hash & mask; slots[j].offset != 0;
+             j = (j + 1) & mask) {
+            if (slots[j].hash != b->entries[i].hash)
+                continue;
+            same = pt_same_key(fileno(b->f), slots[j].offset,
+                               b->entries[i].offset);
+            if (same == -1) {
+                free(slots);
+                return -1;
+            }
+            if (same)
+                break;
+        }
+        if (slots[j].offset == 0) {
+            slots[j] = b->entries[i];
+            count++;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = PT_MAGIC;
+    h.version = PT_VERSION;
+    h.count = count;
+    h.nslots = nslots;
+    h.index = (b->offset + 7) & ~(uint64_t)7;
+    h.size = h.index + nslots * sizeof(*slots);
+    h.created = milter_clock_ms();
+
+    if (fwrite(pad, 1, h.index - b->offset, b->f) != h.index - b->offset
+            || fwrite(slots, sizeof(*slots), nslots, b->f) != nslots
+            || fseek(b->f, 0, SEEK_SET) == -1
+            || fwrite(&h, sizeof(h), 1, b->f) != 1
+            || fflush(b->f) == EOF
+            || fsync(fileno(b->f)) == -1
+            || rename(b->tmp, b->path) == -1
+            || milter_fsync_dir(b->path) == -1) {
+        free(slots);
+        return -1;
+    }
+
+    free(slots);
+    fclose(b->f);
+    b->f = NULL;
+    return 0;
+}
+
+CAMLprim value
+caml_milter_policy_commit(value b_val)
+{
+    CAMLparam1(b_val);
+    int ret;
+    struct pt_builder *b = Pt_builder_val(b_val);
+
+    if (b->f == NULL)
+        caml_invalid_argument("Milter.Policy.commit");
+
+    ret = -1;
+    if (!b->failed) {
+        caml_release_runtime_system();
+        ret = pt_commit(b);
+        caml_acquire_runtime_system();
+    }
+
+    if (ret == -1) {
+        pt_builder_abort(b);
+        milter_error("Milter.Policy.commit");
+    }
+    free(b->entries);
+    b->entries = NULL;
+
+    CAMLreturn(Val_unit);
+}
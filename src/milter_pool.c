@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Worker pool. libmilter still serves each connection from a thread of
+ * its own, but in pool mode that thread only queues its callbacks and
+ * waits for them, so the OCaml runtime is entered from a fixed number of
+ * workers. Workers are registered with the runtime once, when started,
+ * and may be pinned to a set of CPUs so that the runtime lock stays
+ * within one cache domain.
+ */
+
+__thread int64_t milter_pool_queued_at = 0;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct milter_job *pool_head = NULL;
+static struct milter_job *pool_tail = NULL;
+static int pool_workers = 0;
+static int pool_busy = 0;
+static int pool_queued = 0;
+static int pool_peak = 0;
+static long pool_jobs = 0;
+static int64_t pool_wait = 0;
+
+int
+milter_pool_enabled(void)
+{
+    return __atomic_load_n(&pool_workers, __ATOMIC_ACQUIRE) > 0;
+}
+
+static void *
+pool_worker(void *arg)
+{
+    int64_t now;
+    struct milter_job *j;
+
+    caml_c_thread_register();
+
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        while (pool_head == NULL)
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        j = pool_head;
+        pool_head = j->next;
+        if (pool_head == NULL)
+            pool_tail = NULL;
+        pool_queued--;
+        pool_busy++;
+        now = milter_now();
+        pool_wait += now - j->queued;
+        pthread_mutex_unlock(&pool_mutex);
+
+        /* Makes ENTER_CALLBACK take the runtime lock and count the time
+         * spent in the queue as waiting for it. */
+        milter_pool_queued_at = j->queued;
+        j->ret = j->fn(j);
+        milter_pool_queued_at = 0;
+        sem_post(&j->done);
+
+        pthread_mutex_lock(&pool_mutex);
+        pool_busy--;
+    }
+
+    return NULL;
+}
+
+sfsistat
+milter_pool_run(struct milter_job *j)
+{
+    sem_init(&j->done, 0, 0);
+    j->next = NULL;
+    j->queued = milter_now();
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_tail != NULL)
+        pool_tail->next = j;
+    else
+        pool_head = j;
+    pool_tail = j;
+    if (++pool_queued > pool_peak)
+        pool_peak = pool_queued;
+    pool_jobs++;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    while (sem_wait(&j->done) == -1)
+        ;
+    sem_destroy(&j->done);
+    return j->ret;
+}
+
+CAMLprim value
+caml_milter_pool_start(value workers_val, value cpus_val)
+{
+    CAMLparam2(workers_val, cpus_val);
+    int i, n, ncpus, started;
+    int *cpus;
+    value l;
+    cpu_set_t set;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    n = Int_val(workers_val);
+    if (n <= 0 || milter_pool_enabled())
+        caml_invalid_argument("Milter.Pool.start");
+
+    ncpus = 0;
+    for (l = cpus_val; l != Val_emptylist; l = Field(l, 1)) {
+        i = Int_val(Field(l, 0));
+        if (i < 0 || i >= CPU_SETSIZE)
+            caml_invalid_argument("Milter.Pool.start");
+        ncpus++;
+    }
+    cpus = malloc((ncpus + 1) * sizeof(*cpus));
+    if (cpus == NULL)
+        milter_error("Milter.Pool.start");
+    ncpus = 0;
+    for (l = cpus_val; l != Val_emptylist; l = Field(l, 1))
+        cpus[ncpus++] = Int_val(Field(l, 0));
+
+    /* Worker i runs on the i-th CPU of the list, wrapping around. */
+    started = 0;
+    for (i = 0; i < n; i++) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (ncpus > 0) {
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % ncpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&thread, &attr, pool_worker, NULL) == 0)
+            started++;
+        pthread_attr_destroy(&attr);
+    }
+    free(cpus);
+
+    if (started == 0)
+        milter_error("Milter.Pool.start");
+    __atomic_store_n(&pool_workers, started, __ATOMIC_RELEASE);
+    milter_log(MILTER_LOG_INFO, NULL, "pool: %d workers on %d cpus",
+               started, ncpus);
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_pool_stats(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal2(res, v);
+    int workers, busy, queued, peak;
+    long jobs;
+    int64_t wait;
+
+    pthread_mutex_lock(&pool_mutex);
+    workers = __atomic_load_n(&pool_workers, __ATOMIC_ACQUIRE);
+    busy = pool_busy;
+    queued = pool_queued;
+    peak = pool_peak;
+    jobs = pool_jobs;
+    wait = pool_wait;
+    pthread_mutex_unlock(&pool_mutex);
+
+    res = caml_alloc_tuple(6);
+    Store_field(res, 0, Val_int(workers));
+    Store_field(res, 1, Val_int(busy));
+    Store_field(res, 2, Val_int(queued));
+    Store_field(res, 3, Val_int(peak));
+    Store_field(res, 4, Val_long(jobs));
+    v = caml_copy_double((double)wait / 1e9);
+    Store_field(res, 5, v);
+    CAMLreturn(res);
+}
@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Token buckets in a shared memory-mapped table. Each slot is a key hash,
+ * a 64-bit state word holding the tokens left (24 bits, in 1/16ths) and
+ * the time of the last update (40 bits, in milliseconds since the table
+ * was created), and the rate and burst the bucket was last used with.
+ * The key and state are only changed with compare-and-swap, so any number
+ * of processes may use the table without locks.
+ *
+ * Slots are never emptied. A slot whose bucket has been idle long enough
+ * to refill completely, at its own rate, is indistinguishable from a new
+ * one, so it is taken over by the first key that probes past it. The
+ * takeover first marks the old key as moving, which makes its takes fail
+ * their key check, then stores a full bucket and the new key. A take of
+ * the old key that passed its check before the mark can only land before
+ * the full bucket is stored, so the new key never inherits tokens taken
+ * by the old one. Other keys skip a moving slot, so one left behind by a
+ * process that died during a takeover is lost rather than blocking.
+ */
+
+#define RL_MAGIC       0x4d524c33 /* "MRL3" */
+#define RL_PROBES      32
+#define RL_FRAC        16
+#define RL_TOKENS_MAX  ((1 << 24) - 1)
+#define RL_TIME_BITS   40
+#define RL_TIME_MASK   ((UINT64_C(1) << RL_TIME_BITS) - 1)
+#define RL_MOVING      (UINT64_C(1) << 63)
+
+struct rl_slot {
+    uint64_t key;
+    uint64_t state;
+    uint64_t params;    /* Rate as a float, then burst; 0 if unknown. */
+};
+
+struct rl_table {
+    struct milter_shm_header *h;
+    struct rl_slot *slots;
+    size_t len;
+};
+
+#define Rl_table_val(v) ((struct rl_table *)Data_custom_val(v))
+
+static void
+rl_finalize(value t_val)
+{
+    struct rl_table *t = Rl_table_val(t_val);
+
+    if (t->h != NULL)
+        munmap(t->h, t->len);
+}
+
+static struct custom_operations rl_ops = {
+    "milter.ratelimit",
+    rl_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+/* Tokens in the bucket at time now, in 1/16ths. */
+static uint64_t
+rl_tokens(uint64_t state, uint64_t now, double rate, uint64_t burst)
+{
+    uint64_t tokens, then, elapsed;
+    double refill;
+
+    /* A zero state is a slot that was never used: a full bucket. */
+    if (state == 0)
+        return burst;
+
+    tokens = state >> RL_TIME_BITS;
+    then = state & RL_TIME_MASK;
+    elapsed = now > then ? now - then : 0;
+    refill = (double)elapsed * rate * RL_FRAC / 1000.0;
+
+    if (refill >= (double)(burst - (tokens < burst ? tokens : burst)))
+        return burst;
+    tokens += (uint64_t)refill;
+    return tokens < burst ? tokens : burst;
+}
+
+static uint64_t
+rl_params(double rate, uint64_t burst)
+{
+    float f = rate;
+    uint32_t bits;
+
+    memcpy(&bits, &f, sizeof(bits));
+    return (uint64_t)bits << 32 | burst;
+}
+
+/* Whether the slot's bucket is full by the parameters of its key. */
+static int
+rl_full(uint64_t state, uint64_t params, uint64_t now)
+{
+    float f;
+    uint32_t bits;
+    uint64_t burst;
+
+    if (state == 0)
+        return 1;
+    if (params == 0)
+        return 0;
+    bits = params >> 32;
+    memcpy(&f, &bits, sizeof(f));
+    burst = params & 0xffffffff;
+    return rl_tokens(state, now, f, burst) == burst;
+}
+
+/* Keys are never 0, which marks a free slot, and never have the moving
+ * bit set. */
+static uint64_t
+rl_key(value key_val)
+{
+    uint64_t key;
+
+    key = milter_hash64(String_val(key_val), caml_string_length(key_val))
+          & ~RL_MOVING;
+    return key != 0 ? key : 1;
+}
+
+static struct rl_slot *
+rl_slot(struct rl_table *t, uint64_t key, uint64_t now, uint64_t burst)
+{
+    int i;
+    uint64_t mask, k, state, params;
+    struct rl_slot *s;
+
+    mask = t->h->nslots - 1;
+    for (i = 0; i < RL_PROBES; i++) {
+        s = &t->slots[(key + i) & mask];
+        k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return s;
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&s->key, &k, key, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)
+                    || k == key)
+                return s;
+            continue;
+        }
+        if (k & RL_MOVING)
+            continue;
+        state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        params = __atomic_load_n(&s->params, __ATOMIC_ACQUIRE);
+        if (!rl_full(state, params, now))
+            continue;
+        if (!__atomic_compare_exchange_n(&s->key, &k, k | RL_MOVING, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (k == key)
+                return s;
+            continue;
+        }
+        /* Not zero, which the old key may have read before the mark. */
+        state = (burst << RL_TIME_BITS) | now;
+        __atomic_store_n(&s->state, state != 0 ? state : 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&s->key, key, __ATOMIC_RELEASE);
+        return s;
+    }
+    return NULL;
+}
+
+CAMLprim value
+caml_milter_ratelimit_open(value path_val, value slots_val)
+{
+    CAMLparam2(path_val, slots_val);
+    CAMLlocal1(res);
+    struct rl_table t;
+
+    if (Long_val(slots_val) <= 0)
+        milter_error("Milter.Ratelimit.openfile");
+
+    t.h = milter_shm_map(String_val(path_val), RL_MAGIC, Long_val(slots_val),
+                         sizeof(struct rl_slot), &t.len);
+    if (t.h == NULL)
+        milter_error("Milter.Ratelimit.openfile");
+    t.slots = (struct rl_slot *)(t.h + 1);
+
+    res = caml_alloc_custom(&rl_ops, sizeof(t), 0, 1);
+    *Rl_table_val(res) = t;
+
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_ratelimit_take(value t_val, value key_val, value rate_val,
+                           value burst_val)
+{
+    CAMLparam4(t_val, key_val, rate_val, burst_val);
+    int allowed;
+    uint64_t key, now, burst, cost, tokens, old, new, params;
+    double rate = Double_val(rate_val);
+    struct rl_table *t = Rl_table_val(t_val);
+    struct rl_slot *s;
+
+    burst = (uint64_t)(Double_val(burst_val) * RL_FRAC);
+    if (burst > RL_TOKENS_MAX)
+        burst = RL_TOKENS_MAX;
+    cost = RL_FRAC;
+
+    key = rl_key(key_val);
+    now = (uint64_t)(milter_clock_ms() - t->h->created) & RL_TIME_MASK;
+
+again:
+    s = rl_slot(t, key, now, burst);
+    if (s == NULL)
+        CAMLreturn(Val_true); /* Table full: fail open. */
+
+    params = rl_params(rate, burst);
+    if (__atomic_load_n(&s->params, __ATOMIC_RELAXED) != params)
+        __atomic_store_n(&s->params, params, __ATOMIC_RELEASE);
+    old = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    do {
+        /* Taken over by another key since it was found. */
+        if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) != key)
+            goto again;
+        tokens = rl_tokens(old, now, rate, burst);
+        allowed = tokens >= cost;
+        if (allowed)
+            tokens -= cost;
+        new = (tokens << RL_TIME_BITS) | now;
+        if (new == 0)
+            new = 1;
+    } while (!__atomic_compare_exchange_n(&s->state, &old, new, 0,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    CAMLreturn(Val_bool(allowed));
+}
+
+CAMLprim value
+caml_milter_ratelimit_peek(value t_val, value key_val, value rate_val,
+                           value burst_val)
+{
+    CAMLparam4(t_val, key_val, rate_val, burst_val);
+    int i;
+    uint64_t key, now, burst, mask, state;
+    double rate = Double_val(rate_val);
+    struct rl_table *t = Rl_table_val(t_val);
+    struct rl_slot *s;
+
+    burst = (uint64_t)(Double_val(burst_val) * RL_FRAC);
+    if (burst > RL_TOKENS_MAX)
+        burst = RL_TOKENS_MAX;
+
+    key = rl_key(key_val);
+    now = (uint64_t)(milter_clock_ms() - t->h->created) & RL_TIME_MASK;
+
+    state = 0;
+    mask = t->h->nslots - 1;
+    for (i = 0; i < RL_PROBES; i++) {
+        s = &t->slots[(key + i) & mask];
+        if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) == key) {
+            state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+            break;
+        }
+    }
+
+    CAMLreturn(caml_copy_double((double)rl_tokens(state, now, rate, burst)
+                                / RL_FRAC));
+}
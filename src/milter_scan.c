@@ -0,0 +1,933 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Attachment scanning. The body callback runs a streaming MIME parser
+ * without the runtime lock; the decoded content of each attachment is
+ * written to a memfd, which is sealed when the part ends and passed to
+ * the scanner with SCM_RIGHTS, so the scanner reads the very same pages
+ * and nothing touches the disk. A background thread collects the
+ * verdicts while the rest of the message streams in.
+ *
+ * The scanner listens on a Unix stream socket. For each attachment the
+ * filter connects, sends a single "<size> <filename>\n" message carrying
+ * the descriptor, and reads back one line: "OK", "FOUND <name>" or
+ * "ERROR <reason>".
+ */
+
+#define SCAN_MAX_DEPTH     8
+#define SCAN_LINE_MAX      1024
+#define SCAN_BOUNDARY_MAX  72
+#define SCAN_OUT_MAX       8192
+
+enum scan_mode {
+    SCAN_SKIP,        /* Preamble, epilogue or a part not kept. */
+    SCAN_HEADERS,
+    SCAN_BODY,
+};
+
+enum scan_verdict {
+    SCAN_PENDING,
+    SCAN_CLEAN,
+    SCAN_INFECTED,
+    SCAN_ERROR,
+};
+
+struct scan_job {
+    struct scan_job *next;      /* In the connection's list. */
+    struct scan_job *pnext;     /* In the collector's list. */
+    int refs;
+    int sock;
+    char *filename;
+    char *content_type;
+    size_t size;
+    enum scan_verdict verdict;
+    char reply[256];
+    size_t replylen;
+};
+
+struct scan_part {
+    char content_type[64];
+    char boundary[SCAN_BOUNDARY_MAX + 1];
+    char filename[256];
+    int attachment;
+    int base64;
+};
+
+struct milter_scan {
+    struct scan_job *jobs;
+    enum scan_mode mode;
+    int started;
+    char boundaries[SCAN_MAX_DEPTH][SCAN_BOUNDARY_MAX + 1];
+    int depth;
+
+    char line[SCAN_LINE_MAX];
+    size_t linelen;
+    int longline;
+
+    struct scan_part part;
+    char header[SCAN_LINE_MAX];
+    size_t headerlen;
+
+    /* The attachment being written. */
+    int fd;
+    size_t size;
+    int crlf;
+    int cr;             /* A '\r' cut from the end of a piece of line. */
+    int toolarge;
+    int error;          /* errno of a failed write. */
+    unsigned b64;
+    int b64n;
+    unsigned char out[SCAN_OUT_MAX];
+    size_t outlen;
+};
+
+static char *scan_path = NULL;
+static size_t scan_max_size = 0;
+
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond;
+static struct scan_job *scan_pending = NULL;
+static int scan_wake[2] = { -1, -1 };
+
+int
+milter_scan_enabled(void)
+{
+    return scan_path != NULL;
+}
+
+static void
+scan_job_release(struct scan_job *j)
+{
+    int refs;
+
+    pthread_mutex_lock(&scan_mutex);
+    refs = --j->refs;
+    pthread_mutex_unlock(&scan_mutex);
+    if (refs > 0)
+        return;
+    if (j->sock != -1)
+        close(j->sock);
+    free(j->filename);
+    free(j->content_type);
+    free(j);
+}
+
+/* Must be called with scan_mutex held. */
+static void
+scan_job_finish(struct scan_job *j, enum scan_verdict verdict,
+                const char *reply)
+{
+    j->verdict = verdict;
+    if (reply != j->reply)
+        snprintf(j->reply, sizeof(j->reply), "%s", reply);
+    pthread_cond_broadcast(&scan_cond);
+}
+
+/* Collector thread. */
+
+static void
+scan_reply(struct scan_job *j)
+{
+    char *r = j->reply;
+
+    if (strcmp(r, "OK") == 0) {
+        scan_job_finish(j, SCAN_CLEAN, "");
+    } else if (strncmp(r, "FOUND ", 6) == 0) {
+        memmove(r, r + 6, strlen(r + 6) + 1);
+        scan_job_finish(j, SCAN_INFECTED, r);
+    } else if (strncmp(r, "ERROR ", 6) == 0) {
+        memmove(r, r + 6, strlen(r + 6) + 1);
+        scan_job_finish(j, SCAN_ERROR, r);
+    } else {
+        scan_job_finish(j, SCAN_ERROR, "invalid reply from scanner");
+    }
+}
+
+/* Grows the poll arrays, keeping the old ones if memory is short. */
+static void
+scan_grow(struct pollfd **fds, struct scan_job ***jobs, int *max, int n)
+{
+    struct pollfd *f;
+    struct scan_job **j;
+
+    f = realloc(*fds, n * sizeof(**fds));
+    if (f != NULL)
+        *fds = f;
+    j = realloc(*jobs, n * sizeof(**jobs));
+    if (j != NULL)
+        *jobs = j;
+    if (f != NULL && j != NULL)
+        *max = n;
+}
+
+static void *
+scan_collector(void *arg)
+{
+    int i, n;
+    ssize_t r;
+    char c;
+    struct pollfd *fds = NULL;
+    struct scan_job **jobs = NULL, *j, **jp;
+    int max = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&scan_mutex);
+        n = 0;
+        for (j = scan_pending; j != NULL; j = j->pnext)
+            n++;
+        if (n + 1 > max)
+            scan_grow(&fds, &jobs, &max, 2 * (n + 1));
+        if (max == 0) {
+            pthread_mutex_unlock(&scan_mutex);
+            sleep(1);
+            continue;
+        }
+        /* Jobs that do not fit are polled once others are done. */
+        n = 0;
+        for (j = scan_pending; j != NULL && n + 1 < max; j = j->pnext) {
+            jobs[n] = j;
+            fds[n].fd = j->sock;
+            fds[n].events = POLLIN;
+            n++;
+        }
+        pthread_mutex_unlock(&scan_mutex);
+
+        fds[n].fd = scan_wake[0];
+        fds[n].events = POLLIN;
+        if (poll(fds, n + 1, -1) <= 0)
+            continue;
+        if (fds[n].revents & POLLIN)
+            while (read(scan_wake[0], &c, 1) == 1)
+                ;
+
+        pthread_mutex_lock(&scan_mutex);
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            j = jobs[i];
+            r = read(j->sock, j->reply + j->replylen,
+                     sizeof(j->reply) - 1 - j->replylen);
+            if (r == -1 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (r > 0) {
+                char *nl;
+                j->replylen += r;
+                j->reply[j->replylen] = '\0';
+                nl = strchr(j->reply, '\n');
+                if (nl == NULL && j->replylen < sizeof(j->reply) - 1)
+                    continue;
+                if (nl != NULL)
+                    *nl = '\0';
+                scan_reply(j);
+            } else {
+                scan_job_finish(j, SCAN_ERROR, "scanner closed connection");
+            }
+
+            for (jp = &scan_pending; *jp != j; jp = &(*jp)->pnext)
+                ;
+            *jp = j->pnext;
+            close(j->sock);
+            j->sock = -1;
+            if (--j->refs == 0) {
+                free(j->filename);
+                free(j->content_type);
+                free(j);
+            }
+        }
+        pthread_mutex_unlock(&scan_mutex);
+    }
+
+    return NULL;
+}
+
+/* Sends a finished attachment to the scanner. */
+static void
+scan_submit(struct milter_scan *s)
+{
+    int sock;
+    char buf[300];
+    char cmsg[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sockaddr_un sun;
+    struct scan_job *j;
+
+    j = calloc(1, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->sock = -1;
+    j->refs = 1;
+    j->size = s->size;
+    j->filename = strdup(s->part.filename);
+    j->content_type = strdup(s->part.content_type);
+    j->next = s->jobs;
+    s->jobs = j;
+
+    if (s->toolarge) {
+        j->verdict = SCAN_ERROR;
+        snprintf(j->reply, sizeof(j->reply), "not scanned: too large");
+        return;
+    }
+    if (s->error != 0) {
+        j->verdict = SCAN_ERROR;
+        snprintf(j->reply, sizeof(j->reply), "not scanned: write: %s",
+                 strerror(s->error));
+        milter_log(MILTER_LOG_WARNING, NULL, "scanner: %s", j->reply);
+        return;
+    }
+
+    fcntl(s->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+    lseek(s->fd, 0, SEEK_SET);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, scan_path, sizeof(sun.sun_path) - 1);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1
+            || connect(sock, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+        if (sock != -1)
+            close(sock);
+        j->verdict = SCAN_ERROR;
+        snprintf(j->reply, sizeof(j->reply), "connect: %s", strerror(errno));
+        milter_log(MILTER_LOG_WARNING, NULL, "scanner: %s", j->reply);
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%zu %s\n", s->size, s->part.filename);
+    iov.iov_base = buf;
+    iov.iov_len = strlen(buf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &s->fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        close(sock);
+        j->verdict = SCAN_ERROR;
+        snprintf(j->reply, sizeof(j->reply), "send: %s", strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&scan_mutex);
+    j->sock = sock;
+    j->refs++;
+    j->pnext = scan_pending;
+    scan_pending = j;
+    pthread_mutex_unlock(&scan_mutex);
+    if (write(scan_wake[1], "", 1) == -1)
+        ; /* The collector is awake already. */
+}
+
+/* Attachment content. */
+
+static void
+scan_flush(struct milter_scan *s)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < s->outlen && !s->toolarge && s->error == 0) {
+        n = write(s->fd, s->out + off, s->outlen - off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            s->error = n == -1 ? errno : EIO;
+            break;
+        }
+        off += n;
+    }
+    s->outlen = 0;
+}
+
+static void
+scan_out(struct milter_scan *s, unsigned char c)
+{
+    if (s->toolarge || s->error != 0)
+        return;
+    if (++s->size > scan_max_size) {
+        s->toolarge = 1;
+        return;
+    }
+    if (s->outlen == SCAN_OUT_MAX)
+        scan_flush(s);
+    s->out[s->outlen++] = c;
+}
+
+/* Characters other than 'A' that map to 0 are skipped. */
+static const unsigned char scan_b64[256] = {
+    ['A'] =  0, ['B'] =  1, ['C'] =  2, ['D'] =  3, ['E'] =  4, ['F'] =  5,
+    ['G'] =  6, ['H'] =  7, ['I'] =  8, ['J'] =  9, ['K'] = 10, ['L'] = 11,
+    ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16, ['R'] = 17,
+    ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+    ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29,
+    ['e'] = 30, ['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+    ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40, ['p'] = 41,
+    ['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+    ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53,
+    ['2'] = 54, ['3'] = 55, ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
+    ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+};
+
+static void
+scan_content(struct milter_scan *s, const char *data, size_t len, int eol)
+{
+    size_t i;
+    unsigned char c;
+
+    if (s->fd == -1)
+        return;
+
+    if (!s->part.base64) {
+        if (s->crlf) {
+            scan_out(s, '\r');
+            scan_out(s, '\n');
+        }
+        /* Pieces of long lines may end with the '\r' of the line break,
+         * which is only known once the next piece arrives. */
+        if (s->cr && !(eol && len == 0))
+            scan_out(s, '\r');
+        s->cr = 0;
+        if (len > 0 && data[len - 1] == '\r') {
+            len--;
+            s->cr = !eol;
+        }
+        for (i = 0; i < len; i++)
+            scan_out(s, data[i]);
+        /* The line break before a boundary belongs to the boundary. */
+        s->crlf = eol;
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        if (c != 'A' && scan_b64[c] == 0)
+            continue;
+        s->b64 = s->b64 << 6 | scan_b64[c];
+        if (++s->b64n == 4) {
+            scan_out(s, s->b64 >> 16);
+            scan_out(s, s->b64 >> 8);
+            scan_out(s, s->b64);
+            s->b64 = 0;
+            s->b64n = 0;
+        }
+    }
+}
+
+static void
+scan_part_end(struct milter_scan *s)
+{
+    if (s->fd == -1)
+        return;
+    /* Trailing base64 quantum cut short by padding. */
+    if (s->part.base64 && s->b64n >= 2) {
+        s->b64 <<= 6 * (4 - s->b64n);
+        scan_out(s, s->b64 >> 16);
+        if (s->b64n == 3)
+            scan_out(s, s->b64 >> 8);
+    }
+    if (s->cr)
+        scan_out(s, '\r');
+    scan_flush(s);
+    scan_submit(s);
+    close(s->fd);
+    s->fd = -1;
+}
+
+static void
+scan_part_begin(struct milter_scan *s)
+{
+    if (!s->part.attachment || s->part.boundary[0] != '\0')
+        return;
+#ifdef MFD_ALLOW_SEALING
+    s->fd = memfd_create("milter-attachment",
+                         MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    s->fd = -1;
+    errno = ENOSYS;
+#endif
+    if (s->fd == -1) {
+        milter_log(MILTER_LOG_WARNING, NULL, "memfd_create: %s",
+                   strerror(errno));
+        return;
+    }
+    s->size = 0;
+    s->crlf = 0;
+    s->cr = 0;
+    s->toolarge = 0;
+    s->error = 0;
+    s->b64 = 0;
+    s->b64n = 0;
+    s->outlen = 0;
+    if (s->part.filename[0] == '\0')
+        snprintf(s->part.filename, sizeof(s->part.filename), "part%d",
+                 s->depth);
+}
+
+/* Header fields. */
+
+static void
+scan_param(const char *v, const char *name, char *out, size_t size)
+{
+    size_t n, len = strlen(name);
+    const char *p;
+
+    for (p = v; (p = strchr(p, ';')) != NULL; ) {
+        for (p++; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++)
+            ;
+        if (strncasecmp(p, name, len) != 0 || p[len] != '=')
+            continue;
+        p += len + 1;
+        n = 0;
+        if (*p == '"') {
+            for (p++; *p != '\0' && *p != '"' && n < size - 1; p++)
+                out[n++] = *p;
+        } else {
+            for (; *p != '\0' && *p != ';' && !isspace((unsigned char)*p)
+                   && n < size - 1; p++)
+                out[n++] = *p;
+        }
+        out[n] = '\0';
+        return;
+    }
+}
+
+static void
+scan_field(struct scan_part *part, const char *name, const char *v)
+{
+    size_t n;
+
+    while (*v == ' ' || *v == '\t')
+        v++;
+
+    if (strcasecmp(name, "Content-Type") == 0) {
+        for (n = 0; v[n] != '\0' && v[n] != ';' && !isspace((unsigned char)v[n])
+                    && n < sizeof(part->content_type) - 1; n++)
+            part->content_type[n] = tolower((unsigned char)v[n]);
+        part->content_type[n] = '\0';
+        if (strncmp(part->content_type, "multipart/", 10) == 0)
+            scan_param(v, "boundary", part->boundary, sizeof(part->boundary));
+        else if (part->filename[0] == '\0')
+            scan_param(v, "name", part->filename, sizeof(part->filename));
+    } else if (strcasecmp(name, "Content-Disposition") == 0) {
+        if (strncasecmp(v, "attachment", 10) == 0)
+            part->attachment = 1;
+        scan_param(v, "filename", part->filename, sizeof(part->filename));
+        if (part->filename[0] != '\0')
+            part->attachment = 1;
+    } else if (strcasecmp(name, "Content-Transfer-Encoding") == 0) {
+        part->base64 = strncasecmp(v, "base64", 6) == 0;
+    }
+    if (part->filename[0] != '\0')
+        part->attachment = 1;
+}
+
+static void
+scan_header_line(struct milter_scan *s)
+{
+    char *colon;
+
+    if (s->headerlen == 0)
+        return;
+    s->header[s->headerlen] = '\0';
+    s->headerlen = 0;
+    colon = strchr(s->header, ':');
+    if (colon == NULL)
+        return;
+    *colon = '\0';
+    scan_field(&s->part, s->header, colon + 1);
+}
+
+/* Body lines. */
+
+static int
+scan_boundary(struct milter_scan *s, const char *line, size_t len)
+{
+    int k;
+    size_t blen;
+
+    if (len < 3 || line[0] != '-' || line[1] != '-')
+        return 0;
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+        len--;
+
+    for (k = s->depth - 1; k >= 0; k--) {
+        blen = strlen(s->boundaries[k]);
+        if (len < blen + 2 || memcmp(line + 2, s->boundaries[k], blen) != 0)
+            continue;
+        if (len == blen + 2) {
+            scan_part_end(s);
+            s->depth = k + 1;
+            memset(&s->part, 0, sizeof(s->part));
+            s->headerlen = 0;
+            s->mode = SCAN_HEADERS;
+            return 1;
+        }
+        if (len == blen + 4 && line[blen + 2] == '-' && line[blen + 3] == '-') {
+            scan_part_end(s);
+            s->depth = k;
+            s->mode = SCAN_SKIP;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+scan_line(struct milter_scan *s, const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    if (scan_boundary(s, line, len))
+        return;
+
+    switch (s->mode) {
+    case SCAN_HEADERS:
+        if (len == 0) {
+            scan_header_line(s);
+            if (s->part.boundary[0] != '\0' && s->depth < SCAN_MAX_DEPTH) {
+                memcpy(s->boundaries[s->depth++], s->part.boundary,
+                       sizeof(s->part.boundary));
+                s->mode = SCAN_SKIP;
+            } else {
+                scan_part_begin(s);
+                s->mode = SCAN_BODY;
+            }
+            break;
+        }
+        if (line[0] != ' ' && line[0] != '\t')
+            scan_header_line(s);
+        if (s->headerlen + len < sizeof(s->header)) {
+            memcpy(s->header + s->headerlen, line, len);
+            s->headerlen += len;
+        }
+        break;
+    case SCAN_BODY:
+        scan_content(s, line, len, 1);
+        break;
+    case SCAN_SKIP:
+        break;
+    }
+}
+
+static struct milter_scan *
+scan_get(SMFICTX *ctx)
+{
+    struct milter_scan *s;
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->scan == NULL && (s = calloc(1, sizeof(*s))) != NULL) {
+        s->fd = -1;
+        p->scan = s;
+    }
+    return p->scan;
+}
+
+static void
+scan_jobs_free(struct milter_scan *s)
+{
+    struct scan_job *j, *next;
+
+    for (j = s->jobs; j != NULL; j = next) {
+        next = j->next;
+        scan_job_release(j);
+    }
+    s->jobs = NULL;
+}
+
+void
+milter_scan_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+    struct milter_scan *s;
+
+    if (!milter_scan_enabled())
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || (s = p->scan) == NULL)
+        return;
+
+    scan_jobs_free(s);
+    if (s->fd != -1)
+        close(s->fd);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+void
+milter_scan_header(SMFICTX *ctx, const char *name, const char *v)
+{
+    struct milter_scan *s;
+
+    if (milter_scan_enabled() && (s = scan_get(ctx)) != NULL && !s->started)
+        scan_field(&s->part, name, v);
+}
+
+void
+milter_scan_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t i, n;
+    const char *nl, *p = (const char *)data;
+    struct milter_scan *s;
+
+    if (!milter_scan_enabled() || (s = scan_get(ctx)) == NULL)
+        return;
+
+    if (!s->started) {
+        /* The message header describes the top-level entity. */
+        s->started = 1;
+        if (s->part.boundary[0] != '\0') {
+            memcpy(s->boundaries[s->depth++], s->part.boundary,
+                   sizeof(s->part.boundary));
+            s->mode = SCAN_SKIP;
+        } else {
+            scan_part_begin(s);
+            s->mode = SCAN_BODY;
+        }
+    }
+
+    for (i = 0; i < len; i += n) {
+        nl = memchr(p + i, '\n', len - i);
+        n = (nl == NULL ? len : (size_t)(nl - p) + 1) - i;
+
+        if (s->longline) {
+            /* The rest of a line too long to be a boundary. */
+            if (s->mode == SCAN_BODY)
+                scan_content(s, p + i, nl == NULL ? n : n - 1, nl != NULL);
+            if (nl != NULL)
+                s->longline = 0;
+            continue;
+        }
+
+        if (s->linelen + n > sizeof(s->line)) {
+            if (s->mode == SCAN_BODY) {
+                scan_content(s, s->line, s->linelen, 0);
+                scan_content(s, p + i, nl == NULL ? n : n - 1, nl != NULL);
+            }
+            s->linelen = 0;
+            s->longline = nl == NULL;
+            continue;
+        }
+
+        memcpy(s->line + s->linelen, p + i, n);
+        s->linelen += n;
+        if (nl != NULL) {
+            scan_line(s, s->line, s->linelen - 1);
+            s->linelen = 0;
+        }
+    }
+}
+
+/* Finishes a non-multipart attachment at the end of the message. */
+void
+milter_scan_eom(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+    struct milter_scan *s;
+
+    if (!milter_scan_enabled())
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || (s = p->scan) == NULL)
+        return;
+    if (s->linelen > 0) {
+        scan_line(s, s->line, s->linelen);
+        s->linelen = 0;
+    }
+    scan_part_end(s);
+}
+
+void
+milter_scan_free(struct milter_priv *p)
+{
+    struct milter_scan *s = p->scan;
+
+    if (s == NULL)
+        return;
+    scan_jobs_free(s);
+    if (s->fd != -1)
+        close(s->fd);
+    free(s);
+    p->scan = NULL;
+}
+
+/* Counts the attachment being written, which lives in shared memory.
+ * Submitted attachments belong to the scanner. */
+size_t
+milter_scan_memory(const struct milter_priv *p)
+{
+    if (p->scan == NULL)
+        return 0;
+    return sizeof(*p->scan) + (p->scan->fd != -1 ? p->scan->size : 0);
+}
+
+static int
+scan_ready(struct milter_scan *s)
+{
+    struct scan_job *j;
+
+    for (j = s->jobs; j != NULL; j = j->next)
+        if (j->verdict == SCAN_PENDING)
+            return 0;
+    return 1;
+}
+
+CAMLprim value
+caml_milter_scan_setscanner(value path_val, value max_val)
+{
+    CAMLparam2(path_val, max_val);
+    pthread_t thread;
+    pthread_condattr_t attr;
+
+    if (scan_path != NULL || pipe2(scan_wake, O_CLOEXEC | O_NONBLOCK) == -1)
+        milter_error("Milter.Scan.setscanner");
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scan_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&thread, NULL, scan_collector, NULL) != 0)
+        milter_error("Milter.Scan.setscanner");
+    pthread_detach(thread);
+
+    scan_max_size = Long_val(max_val);
+    scan_path = strdup(String_val(path_val));
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_scan_wait(value ctx_val, value timeout_val)
+{
+    CAMLparam2(ctx_val, timeout_val);
+    int64_t deadline;
+    struct timespec ts;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->scan == NULL)
+        CAMLreturn(Val_unit);
+
+    deadline = milter_now() + (int64_t)(Double_val(timeout_val) * 1e9);
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+
+    caml_release_runtime_system();
+    pthread_mutex_lock(&scan_mutex);
+    while (!scan_ready(p->scan)
+           && pthread_cond_timedwait(&scan_cond, &scan_mutex, &ts) == 0)
+        ;
+    pthread_mutex_unlock(&scan_mutex);
+    caml_acquire_runtime_system();
+
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Returns the attachments of the current message as a list of records
+ * { filename; content_type; size; verdict }, verdict being
+ * Pending | Clean | Infected of string | Failed of string.
+ */
+/* Verdict of a job, copied under the lock so the OCaml values can be
+ * allocated without it. */
+struct scan_result {
+    struct scan_job *job;
+    enum scan_verdict verdict;
+    char reply[256];
+};
+
+CAMLprim value
+caml_milter_scan_results(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal4(res, cell, r, v);
+    size_t i, n;
+    struct scan_job *j;
+    struct scan_result *results;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    res = Val_emptylist;
+    if (p == NULL || p->scan == NULL)
+        CAMLreturn(res);
+
+    /* The list itself only changes on the connection's thread. */
+    for (n = 0, j = p->scan->jobs; j != NULL; j = j->next)
+        n++;
+    if (n == 0)
+        CAMLreturn(res);
+    results = malloc(n * sizeof(*results));
+    if (results == NULL)
+        milter_error("Milter.Scan.results");
+
+    pthread_mutex_lock(&scan_mutex);
+    for (i = 0, j = p->scan->jobs; j != NULL; i++, j = j->next) {
+        results[i].job = j;
+        results[i].verdict = j->verdict;
+        memcpy(results[i].reply, j->reply, sizeof(results[i].reply));
+    }
+    pthread_mutex_unlock(&scan_mutex);
+
+    for (i = 0; i < n; i++) {
+        j = results[i].job;
+        switch (results[i].verdict) {
+        case SCAN_PENDING:
+            v = Val_int(0);
+            break;
+        case SCAN_CLEAN:
+            v = Val_int(1);
+            break;
+        case SCAN_INFECTED:
+        case SCAN_ERROR:
+            v = caml_alloc(1, results[i].verdict == SCAN_INFECTED ? 0 : 1);
+            Store_field(v, 0, caml_copy_string(results[i].reply));
+            break;
+        }
+        r = caml_alloc(4, 0);
+        Store_field(r, 0, caml_copy_string(j->filename ? j->filename : ""));
+        Store_field(r, 1,
+                    caml_copy_string(j->content_type ? j->content_type : ""));
+        Store_field(r, 2, Val_long(j->size));
+        Store_field(r, 3, v);
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, r);
+        Store_field(cell, 1, res);
+        res = cell;
+    }
+    free(results);
+
+    CAMLreturn(res);
+}
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Memory-mapped tables shared between processes. A table file is a
+ * header followed by a power of two number of fixed-size slots. New files
+ * are fully initialized under a temporary name and then linked into
+ * place, so concurrent processes never see a partial header.
+ */
+
+uint64_t
+milter_hash64(const void *data, size_t len)
+{
+    size_t i;
+    uint64_t h = 14695981039346656037ull;
+    const unsigned char *p = data;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+
+    /* FNV-1a mixes the high bits poorly; finish with splitmix64. */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+int64_t
+milter_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+milter_file_mode(int fd, const char *path)
+{
+    struct stat st;
+    mode_t mode = 0644;
+
+    if (stat(path, &st) == 0)
+        mode = st.st_mode & 07777;
+    return fchmod(fd, mode);
+}
+
+int
+milter_fsync_dir(const char *path)
+{
+    int fd, ret;
+    char *dir, *slash;
+
+    dir = strdup(path);
+    if (dir == NULL)
+        return -1;
+    slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = '\0';
+    else if (slash != NULL)
+        *slash = '\0';
+
+    fd = open(slash == NULL ? "." : dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1)
+        return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static int
+shm_create(const char *path, uint32_t magic, uint64_t nslots,
+           uint32_t slot_size, size_t len)
+{
+    int fd;
+    char *tmp;
+    struct milter_shm_header h;
+
+    tmp = malloc(strlen(path) + 8);
+    if (tmp == NULL)
+        return -1;
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = magic;
+    h.slot_size = slot_size;
+    h.nslots = nslots;
+    h.created = milter_clock_ms();
+
+    if (ftruncate(fd, len) == -1
+            || pwrite(fd, &h, sizeof(h), 0) != sizeof(h)
+            || fsync(fd) == -1
+            || (link(tmp, path) == -1 && errno != EEXIST)) {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    /* If another process won the race, its file is used instead. */
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return 0;
+}
+
+struct milter_shm_header *
+milter_shm_map(const char *path, uint32_t magic, uint64_t nslots,
+               uint32_t slot_size, size_t *lenp)
+{
+    int fd;
+    void *base;
+    size_t len;
+    struct stat st;
+    struct milter_shm_header *h;
+
+    for (len = 1; len < nslots; len <<= 1)
+        ;
+    nslots = len;
+    len = sizeof(*h) + nslots * slot_size;
+
+    fd = open(path, O_RDWR);
+    if (fd == -1 && errno == ENOENT) {
+        if (shm_create(path, magic, nslots, slot_size, len) == -1)
+            return NULL;
+        fd = open(path, O_RDWR);
+    }
+    if (fd == -1)
+        return NULL;
+
+    /* An existing table keeps its own size. */
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return NULL;
+    }
+    len = st.st_size;
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    h = base;
+    if (h->magic != magic || h->slot_size != slot_size
+            || h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0
+            || sizeof(*h) + h->nslots * slot_size != len) {
+        munmap(base, len);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    *lenp = len;
+    return h;
+}
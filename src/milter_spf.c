@@ -0,0 +1,1344 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * SPF (RFC 7208) evaluation of the envelope sender against the client
+ * address. An evaluation is a function of the DNS answers it has seen so
+ * far: each step runs check_host() from the start, with every query it
+ * needs memoized, and stops at the first answer that is not in yet. After
+ * a step that could not finish, the includes, redirects and address
+ * lookups of every record fetched so far are queried at once, so that a
+ * tree of includes is resolved concurrently rather than one level per
+ * round trip. Steps are taken when the sender is seen and whenever the
+ * filter asks for the result.
+ *
+ * Parsed records are cached for the TTL of their TXT answer, and results
+ * for the smallest TTL of the answers they depend on, unless the policy
+ * uses macros that depend on more than the client address and sender
+ * domain.
+ */
+
+#define SPF_PASS      0
+#define SPF_FAIL      1
+#define SPF_SOFTFAIL  2
+#define SPF_NEUTRAL   3
+#define SPF_NONE      4
+#define SPF_TEMPERROR 5
+#define SPF_PERMERROR 6
+#define SPF_PENDING   (-1)
+
+#define SPF_MAX_LOOKUPS  10
+#define SPF_MAX_VOID     2
+#define SPF_MAX_NAMES    10
+#define SPF_MAX_PREFETCH 64
+#define SPF_DOMAIN_MAX   253
+#define SPF_CACHE_BUCKETS 1024
+#define SPF_CACHE_MAX     16384
+
+enum spf_mech {
+    SPF_ALL,
+    SPF_INCLUDE,
+    SPF_A,
+    SPF_MX,
+    SPF_PTR,
+    SPF_IP4,
+    SPF_IP6,
+    SPF_EXISTS,
+};
+
+struct spf_term {
+    enum spf_mech mech;
+    int result;             /* From the qualifier. */
+    char *spec;             /* Domain-spec, unexpanded; NULL if none. */
+    int cidr4;
+    int cidr6;
+    unsigned char addr[16]; /* ip4 and ip6 only. */
+};
+
+struct spf_record {
+    char *domain;
+    uint32_t hash;
+    int error;              /* A result other than pass, or 0. */
+    struct spf_term *terms;
+    int nterms;
+    char *redirect;
+    int64_t expires;
+    int refs;
+    int cached;
+    struct spf_record *next;
+};
+
+struct spf_result {
+    char *key;
+    uint32_t hash;
+    int result;
+    int64_t expires;
+    struct spf_result *next;
+};
+
+struct spf_query {
+    int type;
+    char *name;
+    struct milter_dns *q;
+    struct spf_record *rec;  /* TXT queries, once parsed. */
+    int seen;                /* Done when the last step started. */
+    int prefetched;
+};
+
+struct milter_spf {
+    int family;              /* 4 or 6; 0 if the client is unknown. */
+    unsigned char ip[16];
+    char *helo;
+    char *sender;
+    char *local;
+    char *domain;
+    int result;
+
+    /* State of the current step. */
+    int lookups;
+    int voids;
+    int cacheable;
+    int64_t expires;
+
+    struct spf_query *queries;
+    int nqueries;
+    int aqueries;
+};
+
+static int spf_enabled = 0;
+static pthread_mutex_t spf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct spf_record *spf_records[SPF_CACHE_BUCKETS];
+static int spf_nrecords = 0;
+static struct spf_result *spf_results[SPF_CACHE_BUCKETS];
+static int spf_nresults = 0;
+static long spf_hits = 0;
+static long spf_misses = 0;
+
+static uint32_t
+spf_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *s != '\0'; s++) {
+        h ^= (unsigned char)tolower((unsigned char)*s);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Record parsing. */
+
+static void
+spf_record_free(struct spf_record *r)
+{
+    int i;
+
+    for (i = 0; i < r->nterms; i++)
+        free(r->terms[i].spec);
+    free(r->terms);
+    free(r->redirect);
+    free(r->domain);
+    free(r);
+}
+
+static int spf_expand(struct milter_spf *s, const char *spec,
+                      const char *domain, char *out, size_t outlen);
+
+static int
+spf_cidr(const char **p, int max, int *cidr)
+{
+    char *end;
+    long n;
+
+    if (!isdigit((unsigned char)**p))
+        return -1;
+    n = strtol(*p, &end, 10);
+    if (n > max || (end - *p > 1 && **p == '0'))
+        return -1;
+    *cidr = n;
+    *p = end;
+    return 0;
+}
+
+/* Parses the domain-spec and dual CIDR length of a, mx and ptr. */
+static int
+spf_parse_args(struct spf_term *t, const char *p, int cidrs)
+{
+    const char *end;
+    char buf[SPF_DOMAIN_MAX + 1];
+
+    if (*p == ':') {
+        p++;
+        end = cidrs ? strchr(p, '/') : NULL;
+        if (end == NULL)
+            end = p + strlen(p);
+        if (end == p || (t->spec = strndup(p, end - p)) == NULL
+                || spf_expand(NULL, t->spec, NULL, buf, sizeof(buf)) == -1)
+            return -1;
+        p = end;
+    }
+    if (cidrs && p[0] == '/' && p[1] != '/') {
+        p++;
+        if (spf_cidr(&p, 32, &t->cidr4) == -1)
+            return -1;
+    }
+    if (cidrs && p[0] == '/' && p[1] == '/') {
+        p += 2;
+        if (spf_cidr(&p, 128, &t->cidr6) == -1)
+            return -1;
+    }
+    return *p == '\0' ? 0 : -1;
+}
+
+static int
+spf_parse_ip(struct spf_term *t, const char *p, int family)
+{
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash;
+    size_t n;
+
+    if (*p++ != ':')
+        return -1;
+    slash = strchr(p, '/');
+    n = slash != NULL ? (size_t)(slash - p) : strlen(p);
+    if (n == 0 || n >= sizeof(addr))
+        return -1;
+    memcpy(addr, p, n);
+    addr[n] = '\0';
+    if (inet_pton(family, addr, t->addr) != 1)
+        return -1;
+    if (slash == NULL)
+        return 0;
+    p = slash + 1;
+    if (spf_cidr(&p, family == AF_INET ? 32 : 128,
+                 family == AF_INET ? &t->cidr4 : &t->cidr6) == -1)
+        return -1;
+    return *p == '\0' ? 0 : -1;
+}
+
+static int
+spf_parse_term(struct spf_record *r, struct spf_term *t, const char *p)
+{
+    size_t n;
+    char buf[SPF_DOMAIN_MAX + 1];
+
+    for (n = 0; isalnum((unsigned char)p[n]) || p[n] == '-' || p[n] == '_'
+                || p[n] == '.'; n++)
+        ;
+
+    /* Modifiers. Unknown ones are ignored, as is the explanation, which
+     * is not used. */
+    if (n > 0 && isalpha((unsigned char)p[0]) && p[n] == '=') {
+        if (n == 8 && strncasecmp(p, "redirect", 8) == 0) {
+            if (r->redirect != NULL || p[n + 1] == '\0'
+                    || spf_expand(NULL, p + n + 1, NULL, buf,
+                                  sizeof(buf)) == -1)
+                return -1;
+            r->redirect = strdup(p + n + 1);
+            return r->redirect == NULL ? -1 : 1;
+        }
+        return 1;
+    }
+
+    t->result = SPF_PASS;
+    switch (*p) {
+    case '+': p++; break;
+    case '-': t->result = SPF_FAIL; p++; break;
+    case '~': t->result = SPF_SOFTFAIL; p++; break;
+    case '?': t->result = SPF_NEUTRAL; p++; break;
+    }
+    for (n = 0; isalnum((unsigned char)p[n]); n++)
+        ;
+    t->cidr4 = 32;
+    t->cidr6 = 128;
+
+    if (n == 3 && strncasecmp(p, "all", 3) == 0) {
+        t->mech = SPF_ALL;
+        return p[n] == '\0' ? 0 : -1;
+    }
+    if ((n == 7 && strncasecmp(p, "include", 7) == 0)
+            || (n == 6 && strncasecmp(p, "exists", 6) == 0)) {
+        t->mech = n == 7 ? SPF_INCLUDE : SPF_EXISTS;
+        if (p[n] != ':' || p[n + 1] == '\0')
+            return -1;
+        return spf_parse_args(t, p + n, 0);
+    }
+    if (n == 1 && tolower((unsigned char)p[0]) == 'a') {
+        t->mech = SPF_A;
+        return spf_parse_args(t, p + n, 1);
+    }
+    if (n == 2 && strncasecmp(p, "mx", 2) == 0) {
+        t->mech = SPF_MX;
+        return spf_parse_args(t, p + n, 1);
+    }
+    if (n == 3 && strncasecmp(p, "ptr", 3) == 0) {
+        t->mech = SPF_PTR;
+        return spf_parse_args(t, p + n, 0);
+    }
+    if (n == 3 && strncasecmp(p, "ip4", 3) == 0) {
+        t->mech = SPF_IP4;
+        return spf_parse_ip(t, p + n, AF_INET);
+    }
+    if (n == 3 && strncasecmp(p, "ip6", 3) == 0) {
+        t->mech = SPF_IP6;
+        return spf_parse_ip(t, p + n, AF_INET6);
+    }
+    return -1;
+}
+
+/* Returns NULL only if memory is exhausted. */
+static struct spf_record *
+spf_parse(const char *domain, struct milter_dns *q, int64_t expires)
+{
+    int n;
+    char *text, *term, *save;
+    struct milter_dns_rr *rr, *found = NULL;
+    struct spf_record *r;
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL || (r->domain = strdup(domain)) == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->hash = spf_hash(domain);
+    r->expires = expires;
+
+    if (q->rcode != 0 && q->rcode != 3) {
+        r->error = SPF_TEMPERROR;
+        return r;
+    }
+
+    n = 0;
+    for (rr = q->answers; rr != NULL; rr = rr->next) {
+        if (rr->len >= 6 && strncasecmp((char *)rr->data, "v=spf1", 6) == 0
+                && (rr->len == 6 || rr->data[6] == ' ')) {
+            found = rr;
+            n++;
+        }
+    }
+    if (n != 1) {
+        r->error = n == 0 ? SPF_NONE : SPF_PERMERROR;
+        return r;
+    }
+
+    /* A record has at most one term per two bytes. */
+    text = strndup((char *)found->data + 6, found->len - 6);
+    r->terms = calloc(found->len / 2 + 1, sizeof(*r->terms));
+    if (text == NULL || r->terms == NULL) {
+        free(text);
+        spf_record_free(r);
+        return NULL;
+    }
+    for (term = strtok_r(text, " ", &save); term != NULL;
+         term = strtok_r(NULL, " ", &save)) {
+        switch (spf_parse_term(r, &r->terms[r->nterms], term)) {
+        case 0:
+            r->nterms++;
+            break;
+        case -1:
+            free(r->terms[r->nterms].spec);
+            r->terms[r->nterms].spec = NULL;
+            r->error = SPF_PERMERROR;
+            free(text);
+            return r;
+        }
+    }
+    free(text);
+    return r;
+}
+
+/* Caches. Entries are dropped when the cache is full, expired ones
+ * first. Both require spf_mutex. */
+
+static void
+spf_record_unref(struct spf_record *r)
+{
+    if (--r->refs == 0 && !r->cached)
+        spf_record_free(r);
+}
+
+static void
+spf_records_sweep(int64_t now)
+{
+    int i, pass;
+    struct spf_record **pp, *r;
+
+    for (pass = 0; pass < 2 && spf_nrecords >= SPF_CACHE_MAX; pass++) {
+        for (i = 0; i < SPF_CACHE_BUCKETS; i++) {
+            pp = &spf_records[i];
+            while ((r = *pp) != NULL) {
+                if (r->refs == 0 && (pass == 1 || r->expires <= now)) {
+                    *pp = r->next;
+                    spf_nrecords--;
+                    spf_record_free(r);
+                } else {
+                    pp = &r->next;
+                }
+            }
+        }
+    }
+}
+
+static struct spf_record *
+spf_records_find(const char *domain, int64_t now)
+{
+    uint32_t hash = spf_hash(domain);
+    struct spf_record **pp, *r;
+
+    for (pp = &spf_records[hash % SPF_CACHE_BUCKETS]; (r = *pp) != NULL;
+         pp = &r->next) {
+        if (r->hash != hash || strcasecmp(r->domain, domain) != 0)
+            continue;
+        if (r->expires > now) {
+            r->refs++;
+            return r;
+        }
+        *pp = r->next;
+        r->cached = 0;
+        spf_nrecords--;
+        if (r->refs == 0)
+            spf_record_free(r);
+        return NULL;
+    }
+    return NULL;
+}
+
+static void
+spf_records_add(struct spf_record *r, int64_t now)
+{
+    struct spf_record **bucket = &spf_records[r->hash % SPF_CACHE_BUCKETS];
+
+    if (spf_nrecords >= SPF_CACHE_MAX)
+        spf_records_sweep(now);
+    if (spf_nrecords >= SPF_CACHE_MAX)
+        return;
+    r->next = *bucket;
+    *bucket = r;
+    r->cached = 1;
+    spf_nrecords++;
+}
+
+static void
+spf_result_key(struct milter_spf *s, char *key, size_t len)
+{
+    char addr[INET6_ADDRSTRLEN];
+
+    inet_ntop(s->family == 4 ? AF_INET : AF_INET6, s->ip, addr, sizeof(addr));
+    snprintf(key, len, "%s %s", addr, s->domain);
+}
+
+static int
+spf_results_find(const char *key, int64_t now)
+{
+    uint32_t hash = spf_hash(key);
+    struct spf_result *e;
+
+    for (e = spf_results[hash % SPF_CACHE_BUCKETS]; e != NULL; e = e->next)
+        if (e->hash == hash && e->expires > now && strcasecmp(e->key, key) == 0)
+            return e->result;
+    return SPF_PENDING;
+}
+
+static void
+spf_results_add(const char *key, int result, int64_t expires, int64_t now)
+{
+    int i;
+    uint32_t hash = spf_hash(key);
+    struct spf_result **pp, *e;
+
+    if (spf_nresults >= SPF_CACHE_MAX) {
+        for (i = 0; i < SPF_CACHE_BUCKETS; i++) {
+            pp = &spf_results[i];
+            while ((e = *pp) != NULL) {
+                if (e->expires <= now || spf_nresults >= SPF_CACHE_MAX) {
+                    *pp = e->next;
+                    spf_nresults--;
+                    free(e->key);
+                    free(e);
+                } else {
+                    pp = &e->next;
+                }
+            }
+        }
+    }
+
+    e = malloc(sizeof(*e));
+    if (e == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        return;
+    }
+    e->hash = hash;
+    e->result = result;
+    e->expires = expires;
+    e->next = spf_results[hash % SPF_CACHE_BUCKETS];
+    spf_results[hash % SPF_CACHE_BUCKETS] = e;
+    spf_nresults++;
+}
+
+/* Macro expansion. */
+
+/* The name of the client address in the reverse tree. */
+static void
+spf_reverse_ip(struct milter_spf *s, char *out, size_t len)
+{
+    int i;
+    char *o = out;
+
+    if (s->family == 4) {
+        snprintf(out, len, "%u.%u.%u.%u.in-addr.arpa", s->ip[3], s->ip[2],
+                 s->ip[1], s->ip[0]);
+        return;
+    }
+    for (i = 15; i >= 0; i--)
+        o += sprintf(o, "%x.%x.", s->ip[i] & 0x0f, s->ip[i] >> 4);
+    strcpy(o, "ip6.arpa");
+}
+
+/* The i macro: dotted quad, or dot-separated nibbles for IPv6. */
+static void
+spf_macro_ip(struct milter_spf *s, char *out, size_t len)
+{
+    int i;
+    char *o = out;
+
+    if (s->family == 4) {
+        snprintf(out, len, "%u.%u.%u.%u", s->ip[0], s->ip[1], s->ip[2],
+                 s->ip[3]);
+        return;
+    }
+    for (i = 0; i < 16; i++)
+        o += sprintf(o, "%x.%x.", s->ip[i] >> 4, s->ip[i] & 0x0f);
+    o[-1] = '\0';
+}
+
+static const char *
+spf_macro_value(struct milter_spf *s, int c, const char *domain, char *buf,
+                size_t len)
+{
+    switch (c) {
+    case 's':
+        s->cacheable = 0;
+        return s->sender;
+    case 'l':
+        s->cacheable = 0;
+        return s->local;
+    case 'o':
+        return s->domain;
+    case 'd':
+        return domain;
+    case 'i':
+        spf_macro_ip(s, buf, len);
+        return buf;
+    case 'p':
+        return "unknown";
+    case 'v':
+        return s->family == 4 ? "in-addr" : "ip6";
+    case 'h':
+        s->cacheable = 0;
+        return s->helo != NULL ? s->helo : "unknown";
+    }
+    return NULL;
+}
+
+/* Appends the transformed value of a macro. */
+static int
+spf_macro(const char *v, int keep, int reverse, const char *delims,
+          int escape, char *out, size_t *o, size_t outlen)
+{
+    int i, k, n, first;
+    const char *p, *parts[128];
+    size_t lens[128], j;
+
+    n = 0;
+    for (p = v;;) {
+        if (n == 128)
+            return -1;
+        parts[n] = p;
+        lens[n] = strcspn(p, delims);
+        p += lens[n++];
+        if (*p == '\0')
+            break;
+        p++;
+    }
+
+    /* Reversed first, then only the rightmost parts are kept. */
+    first = keep > 0 && keep < n ? n - keep : 0;
+    for (i = first; i < n; i++) {
+        k = reverse ? n - 1 - i : i;
+        if (i > first) {
+            if (*o + 1 >= outlen)
+                return -1;
+            out[(*o)++] = '.';
+        }
+        for (j = 0; j < lens[k]; j++) {
+            unsigned char c = parts[k][j];
+
+            if (escape && !isalnum(c) && !strchr("-._~", c)) {
+                if (*o + 3 >= outlen)
+                    return -1;
+                *o += sprintf(out + *o, "%%%02X", c);
+            } else {
+                if (*o + 1 >= outlen)
+                    return -1;
+                out[(*o)++] = c;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expands a macro-string into out, then drops labels from the left until
+ * it fits in a domain name. With s NULL, only checks the syntax. Returns
+ * -1 on a syntax error.
+ */
+static int
+spf_expand(struct milter_spf *s, const char *spec, const char *domain,
+           char *out, size_t outlen)
+{
+    int c, keep, reverse, escape;
+    char delims[8], buf[INET6_ADDRSTRLEN * 2];
+    char big[4096];
+    const char *p, *v, *dot;
+    size_t o = 0, d;
+
+    for (p = spec; *p != '\0'; p++) {
+        if (*p != '%') {
+            if ((unsigned char)*p < 0x21 || (unsigned char)*p > 0x7e)
+                return -1;
+            if (o + 1 < sizeof(big))
+                big[o++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == '%' || *p == '_' || *p == '-') {
+            v = *p == '%' ? "%" : *p == '_' ? " " : "%20";
+            if (o + strlen(v) < sizeof(big)) {
+                memcpy(big + o, v, strlen(v));
+                o += strlen(v);
+            }
+            continue;
+        }
+        if (*p++ != '{')
+            return -1;
+        /* Upper-case macros are URL-escaped. */
+        escape = isupper((unsigned char)*p);
+        c = tolower((unsigned char)*p);
+        if (c == '\0' || strchr("slodiphv", c) == NULL)
+            return -1;
+        p++;
+        keep = 0;
+        while (isdigit((unsigned char)*p))
+            keep = keep * 10 + (*p++ - '0');
+        if (keep > 128)
+            return -1;
+        reverse = tolower((unsigned char)*p) == 'r';
+        if (reverse)
+            p++;
+        d = 0;
+        while (*p != '\0' && strchr(".-+,/_=", *p) != NULL && d < 7)
+            delims[d++] = *p++;
+        delims[d] = '\0';
+        if (d == 0)
+            strcpy(delims, ".");
+        if (*p != '}')
+            return -1;
+
+        if (s == NULL)
+            continue;
+        v = spf_macro_value(s, c, domain, buf, sizeof(buf));
+        if (v == NULL || spf_macro(v, keep, reverse, delims, escape, big, &o,
+                                   sizeof(big)) == -1)
+            return -1;
+    }
+    big[o] = '\0';
+
+    if (s == NULL)
+        return 0;
+
+    /* Trailing dots are not part of the name. */
+    while (o > 0 && big[o - 1] == '.')
+        big[--o] = '\0';
+    v = big;
+    while (strlen(v) > SPF_DOMAIN_MAX && (dot = strchr(v, '.')) != NULL)
+        v = dot + 1;
+    if (strlen(v) >= outlen || strlen(v) > SPF_DOMAIN_MAX)
+        return -1;
+    strcpy(out, v);
+    return 0;
+}
+
+/* Evaluation. */
+
+#define SPF_MATCH   7
+#define SPF_NOMATCH 8
+
+static int spf_check_host(struct milter_spf *s, const char *domain);
+
+static int
+spf_domain_valid(const char *domain)
+{
+    size_t n, len = strlen(domain);
+    const char *p;
+
+    if (len == 0 || len > SPF_DOMAIN_MAX || strchr(domain, '.') == NULL)
+        return 0;
+    for (p = domain; *p != '\0'; p += n + (p[n] == '.')) {
+        n = strcspn(p, ".");
+        if (n == 0 || n > 63)
+            return 0;
+    }
+    return 1;
+}
+
+/* Returns the memoized query, which is only valid until the next call. */
+static struct spf_query *
+spf_query(struct milter_spf *s, const char *name, int type)
+{
+    int i, n;
+    struct spf_query *e;
+
+    for (i = 0; i < s->nqueries; i++)
+        if (s->queries[i].type == type
+                && strcasecmp(s->queries[i].name, name) == 0)
+            return &s->queries[i];
+
+    if (s->nqueries == s->aqueries) {
+        n = s->aqueries > 0 ? 2 * s->aqueries : 16;
+        e = realloc(s->queries, n * sizeof(*e));
+        if (e == NULL)
+            return NULL;
+        s->queries = e;
+        s->aqueries = n;
+    }
+    e = &s->queries[s->nqueries];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    if ((e->name = strdup(name)) == NULL)
+        return NULL;
+    s->nqueries++;
+    return e;
+}
+
+/* Returns the record of a domain, or NULL with *r set to SPF_PENDING or
+ * SPF_TEMPERROR. */
+static struct spf_record *
+spf_record(struct milter_spf *s, const char *domain, int *r)
+{
+    int64_t now = milter_now();
+    struct spf_query *e;
+    struct spf_record *rec;
+
+    *r = SPF_TEMPERROR;
+    e = spf_query(s, domain, MILTER_DNS_TXT);
+    if (e == NULL)
+        return NULL;
+
+    if (e->rec == NULL && e->q == NULL) {
+        pthread_mutex_lock(&spf_mutex);
+        e->rec = spf_records_find(domain, now);
+        pthread_mutex_unlock(&spf_mutex);
+        if (e->rec == NULL
+                && (e->q = milter_dns_lookup(domain, MILTER_DNS_TXT)) == NULL)
+            return NULL;
+    }
+
+    if (e->rec == NULL) {
+        if (!milter_dns_done(e->q)) {
+            *r = SPF_PENDING;
+            return NULL;
+        }
+        rec = spf_parse(domain, e->q, milter_dns_expires(e->q));
+        if (rec == NULL)
+            return NULL;
+        rec->refs = 1;
+        if (rec->error != SPF_TEMPERROR) {
+            pthread_mutex_lock(&spf_mutex);
+            spf_records_add(rec, now);
+            pthread_mutex_unlock(&spf_mutex);
+        }
+        e->rec = rec;
+    }
+
+    if (e->rec->expires < s->expires)
+        s->expires = e->rec->expires;
+    return e->rec;
+}
+
+/* Returns 0 once the query is answered, setting *answers to NULL if the
+ * name or data does not exist; SPF_PENDING or SPF_TEMPERROR otherwise. */
+static int
+spf_lookup(struct milter_spf *s, const char *name, int type,
+           struct milter_dns_rr **answers)
+{
+    int64_t expires;
+    struct spf_query *e;
+
+    e = spf_query(s, name, type);
+    if (e == NULL)
+        return SPF_TEMPERROR;
+    if (e->q == NULL && (e->q = milter_dns_lookup(name, type)) == NULL)
+        return SPF_TEMPERROR;
+    if (!milter_dns_done(e->q))
+        return SPF_PENDING;
+
+    expires = milter_dns_expires(e->q);
+    if (expires < s->expires)
+        s->expires = expires;
+    if (e->q->rcode != 0 && e->q->rcode != 3)
+        return SPF_TEMPERROR;
+    *answers = e->q->rcode == 0 ? e->q->answers : NULL;
+    return 0;
+}
+
+static int
+spf_match_ip(struct milter_spf *s, const unsigned char *addr, int cidr)
+{
+    int bytes = cidr / 8, bits = cidr % 8;
+    unsigned char mask;
+
+    if (memcmp(addr, s->ip, bytes) != 0)
+        return 0;
+    if (bits == 0)
+        return 1;
+    mask = (0xff << (8 - bits)) & 0xff;
+    return (addr[bytes] & mask) == (s->ip[bytes] & mask);
+}
+
+static int
+spf_void(struct milter_spf *s)
+{
+    return ++s->voids > SPF_MAX_VOID ? SPF_PERMERROR : SPF_NOMATCH;
+}
+
+/* Whether an address of name is the client's. */
+static int
+spf_match_a(struct milter_spf *s, const char *name, int cidr4, int cidr6,
+            int top)
+{
+    int r;
+    struct milter_dns_rr *rr, *answers;
+
+    r = spf_lookup(s, name,
+                   s->family == 4 ? MILTER_DNS_A : MILTER_DNS_AAAA, &answers);
+    if (r != 0)
+        return r;
+    if (answers == NULL)
+        return top ? spf_void(s) : SPF_NOMATCH;
+    for (rr = answers; rr != NULL; rr = rr->next)
+        if (spf_match_ip(s, rr->data, s->family == 4 ? cidr4 : cidr6))
+            return SPF_MATCH;
+    return SPF_NOMATCH;
+}
+
+static int
+spf_subdomain(const char *name, const char *domain)
+{
+    size_t n = strlen(name), d = strlen(domain);
+
+    if (n > 0 && name[n - 1] == '.')
+        n--;
+    if (n == d)
+        return strncasecmp(name, domain, d) == 0;
+    return n > d && name[n - d - 1] == '.'
+        && strncasecmp(name + n - d, domain, d) == 0;
+}
+
+static int
+spf_mechanism(struct milter_spf *s, struct spf_term *t, const char *domain)
+{
+    int n, r, err, pending;
+    char target[SPF_DOMAIN_MAX + 1], rev[80];
+    struct milter_dns_rr *rr, *answers;
+
+    switch (t->mech) {
+    case SPF_ALL:
+        return SPF_MATCH;
+    case SPF_IP4:
+        return s->family == 4 && spf_match_ip(s, t->addr, t->cidr4)
+             ? SPF_MATCH : SPF_NOMATCH;
+    case SPF_IP6:
+        return s->family == 6 && spf_match_ip(s, t->addr, t->cidr6)
+             ? SPF_MATCH : SPF_NOMATCH;
+    default:
+        break;
+    }
+
+    if (++s->lookups > SPF_MAX_LOOKUPS)
+        return SPF_PERMERROR;
+    if (t->spec == NULL)
+        strcpy(target, domain);
+    else if (spf_expand(s, t->spec, domain, target, sizeof(target)) == -1)
+        return SPF_PERMERROR;
+
+    switch (t->mech) {
+    case SPF_INCLUDE:
+        switch ((r = spf_check_host(s, target))) {
+        case SPF_PASS:
+            return SPF_MATCH;
+        case SPF_FAIL:
+        case SPF_SOFTFAIL:
+        case SPF_NEUTRAL:
+            return SPF_NOMATCH;
+        case SPF_PENDING:
+        case SPF_TEMPERROR:
+            return r;
+        default:
+            return SPF_PERMERROR;
+        }
+
+    case SPF_A:
+        return spf_match_a(s, target, t->cidr4, t->cidr6, 1);
+
+    case SPF_EXISTS:
+        if ((r = spf_lookup(s, target, MILTER_DNS_A, &answers)) != 0)
+            return r;
+        return answers != NULL ? SPF_MATCH : spf_void(s);
+
+    case SPF_MX:
+        if ((r = spf_lookup(s, target, MILTER_DNS_MX, &answers)) != 0)
+            return r;
+        if (answers == NULL)
+            return spf_void(s);
+        for (n = 0, rr = answers; rr != NULL; rr = rr->next)
+            n++;
+        if (n > SPF_MAX_NAMES)
+            return SPF_PERMERROR;
+        /* The exchanges are all looked up at once. */
+        pending = err = 0;
+        for (rr = answers; rr != NULL; rr = rr->next) {
+            if (rr->len == 0)
+                continue;
+            r = spf_match_a(s, (char *)rr->data, t->cidr4, t->cidr6, 0);
+            if (r == SPF_MATCH)
+                return r;
+            if (r == SPF_PENDING)
+                pending = 1;
+            else if (r != SPF_NOMATCH)
+                err = r;
+        }
+        return pending ? SPF_PENDING : err ? err : SPF_NOMATCH;
+
+    case SPF_PTR:
+        /* Failures to resolve the client's names are not errors. */
+        spf_reverse_ip(s, rev, sizeof(rev));
+        r = spf_lookup(s, rev, MILTER_DNS_PTR, &answers);
+        if (r == SPF_PENDING)
+            return r;
+        if (r != 0)
+            return SPF_NOMATCH;
+        if (answers == NULL)
+            return spf_void(s);
+        pending = 0;
+        for (n = 0, rr = answers; rr != NULL && n < SPF_MAX_NAMES;
+             rr = rr->next, n++) {
+            if (!spf_subdomain((char *)rr->data, target))
+                continue;
+            r = spf_match_a(s, (char *)rr->data, 32, 128, 0);
+            if (r == SPF_MATCH)
+                return r;
+            if (r == SPF_PENDING)
+                pending = 1;
+        }
+        return pending ? SPF_PENDING : SPF_NOMATCH;
+
+    default:
+        return SPF_PERMERROR;
+    }
+}
+
+static int
+spf_check_host(struct milter_spf *s, const char *domain)
+{
+    int i, r;
+    char target[SPF_DOMAIN_MAX + 1];
+    struct spf_record *rec;
+
+    if (!spf_domain_valid(domain))
+        return SPF_NONE;
+    rec = spf_record(s, domain, &r);
+    if (rec == NULL)
+        return r;
+    if (rec->error != 0)
+        return rec->error;
+
+    for (i = 0; i < rec->nterms; i++) {
+        r = spf_mechanism(s, &rec->terms[i], domain);
+        if (r == SPF_MATCH)
+            return rec->terms[i].result;
+        if (r != SPF_NOMATCH)
+            return r;
+    }
+
+    if (rec->redirect == NULL)
+        return SPF_NEUTRAL;
+    if (++s->lookups > SPF_MAX_LOOKUPS
+            || spf_expand(s, rec->redirect, domain, target,
+                          sizeof(target)) == -1)
+        return SPF_PERMERROR;
+    r = spf_check_host(s, target);
+    return r == SPF_NONE ? SPF_PERMERROR : r;
+}
+
+/* Queries what the records fetched so far may need. */
+static void
+spf_prefetch(struct milter_spf *s)
+{
+    int i, j, r, cacheable = s->cacheable;
+    char target[SPF_DOMAIN_MAX + 1];
+    const char *name;
+    struct spf_record *rec;
+    struct spf_term *t;
+    struct milter_dns_rr *answers;
+
+    for (i = 0; i < s->nqueries && s->nqueries < SPF_MAX_PREFETCH; i++) {
+        if (s->queries[i].type != MILTER_DNS_TXT || s->queries[i].prefetched)
+            continue;
+        if (s->queries[i].rec == NULL && !milter_dns_done(s->queries[i].q))
+            continue;
+        s->queries[i].prefetched = 1;
+        name = s->queries[i].name;
+        rec = spf_record(s, name, &r);
+        if (rec == NULL || rec->error != 0)
+            continue;
+
+        for (j = 0; j < rec->nterms; j++) {
+            t = &rec->terms[j];
+            if (t->spec == NULL)
+                strcpy(target, rec->domain);
+            else if (spf_expand(s, t->spec, rec->domain, target,
+                                sizeof(target)) == -1)
+                continue;
+            switch (t->mech) {
+            case SPF_INCLUDE:
+                if (spf_domain_valid(target))
+                    spf_record(s, target, &r);
+                break;
+            case SPF_A:
+                spf_lookup(s, target,
+                           s->family == 4 ? MILTER_DNS_A : MILTER_DNS_AAAA,
+                           &answers);
+                break;
+            case SPF_MX:
+                spf_lookup(s, target, MILTER_DNS_MX, &answers);
+                break;
+            case SPF_EXISTS:
+                spf_lookup(s, target, MILTER_DNS_A, &answers);
+                break;
+            default:
+                break;
+            }
+        }
+        if (rec->redirect != NULL
+                && spf_expand(s, rec->redirect, rec->domain, target,
+                              sizeof(target)) == 0
+                && spf_domain_valid(target))
+            spf_record(s, target, &r);
+    }
+    s->cacheable = cacheable;
+}
+
+static void
+spf_clear(struct milter_spf *s)
+{
+    int i;
+    struct spf_query *e;
+
+    for (i = 0; i < s->nqueries; i++) {
+        e = &s->queries[i];
+        if (e->q != NULL)
+            milter_dns_release(e->q);
+        if (e->rec != NULL) {
+            pthread_mutex_lock(&spf_mutex);
+            spf_record_unref(e->rec);
+            pthread_mutex_unlock(&spf_mutex);
+        }
+        free(e->name);
+    }
+    s->nqueries = 0;
+}
+
+static void
+spf_step(struct milter_spf *s)
+{
+    int i, r;
+    char key[SPF_DOMAIN_MAX + INET6_ADDRSTRLEN + 2];
+
+    if (s->result != SPF_PENDING)
+        return;
+
+    for (i = 0; i < s->nqueries; i++)
+        if (s->queries[i].q != NULL)
+            s->queries[i].seen = milter_dns_done(s->queries[i].q);
+    s->lookups = 0;
+    s->voids = 0;
+    s->cacheable = 1;
+    s->expires = INT64_MAX;
+
+    r = spf_check_host(s, s->domain);
+    if (r == SPF_PENDING) {
+        spf_prefetch(s);
+        return;
+    }
+
+    s->result = r;
+    if (s->cacheable && r != SPF_TEMPERROR) {
+        spf_result_key(s, key, sizeof(key));
+        pthread_mutex_lock(&spf_mutex);
+        spf_results_add(key, r, s->expires, milter_now());
+        pthread_mutex_unlock(&spf_mutex);
+    }
+    spf_clear(s);
+}
+
+/* Called with milter_dns_lock() held. */
+static int
+spf_ready(void *arg)
+{
+    int i;
+    struct milter_spf *s = arg;
+
+    for (i = 0; i < s->nqueries; i++)
+        if (s->queries[i].q != NULL && !s->queries[i].seen
+                && s->queries[i].q->done)
+            return 1;
+    return 0;
+}
+
+static void
+spf_start(struct milter_spf *s, const char *sender)
+{
+    int r;
+    size_t n;
+    const char *at;
+    char key[SPF_DOMAIN_MAX + INET6_ADDRSTRLEN + 2];
+
+    spf_clear(s);
+    free(s->sender);
+    free(s->local);
+    s->sender = s->local = s->domain = NULL;
+    s->result = SPF_NONE;
+
+    /* The null sender is checked as postmaster at the HELO name. */
+    if (*sender == '\0') {
+        if (s->helo == NULL)
+            return;
+        sender = s->helo;
+    }
+    at = strrchr(sender, '@');
+    n = at != NULL ? (size_t)(at - sender) : 0;
+    s->local = n > 0 ? strndup(sender, n) : strdup("postmaster");
+    if (s->local == NULL)
+        return;
+    at = at != NULL ? at + 1 : sender;
+    s->sender = malloc(strlen(s->local) + strlen(at) + 2);
+    if (s->sender == NULL)
+        return;
+    sprintf(s->sender, "%s@%s", s->local, at);
+    s->domain = s->sender + strlen(s->local) + 1;
+
+    if (s->family == 0 || !spf_domain_valid(s->domain))
+        return;
+
+    spf_result_key(s, key, sizeof(key));
+    pthread_mutex_lock(&spf_mutex);
+    r = spf_results_find(key, milter_now());
+    if (r != SPF_PENDING)
+        spf_hits++;
+    else
+        spf_misses++;
+    pthread_mutex_unlock(&spf_mutex);
+
+    s->result = r;
+    spf_step(s);
+}
+
+/* Hooks, called from the callbacks. */
+
+int
+milter_spf_enabled(void)
+{
+    return spf_enabled;
+}
+
+void
+milter_spf_connect(struct milter_priv *p, const _SOCK_ADDR *sa)
+{
+    struct milter_spf *s;
+    const struct sockaddr_in6 *sin6;
+
+    if (!spf_enabled || (s = calloc(1, sizeof(*s))) == NULL)
+        return;
+    s->result = SPF_NONE;
+
+    if (sa != NULL && sa->sa_family == AF_INET) {
+        s->family = 4;
+        memcpy(s->ip, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+    } else if (sa != NULL && sa->sa_family == AF_INET6) {
+        sin6 = (const struct sockaddr_in6 *)sa;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            s->family = 4;
+            memcpy(s->ip, sin6->sin6_addr.s6_addr + 12, 4);
+        } else {
+            s->family = 6;
+            memcpy(s->ip, &sin6->sin6_addr, 16);
+        }
+    }
+    p->spf = s;
+}
+
+void
+milter_spf_helo(SMFICTX *ctx, const char *helo)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || p->spf == NULL || helo == NULL)
+        return;
+    free(p->spf->helo);
+    p->spf->helo = strdup(helo);
+}
+
+void
+milter_spf_envfrom(SMFICTX *ctx, char **argv)
+{
+    char sender[512];
+    const char *a, *colon;
+    size_t n;
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || p->spf == NULL)
+        return;
+
+    /* Strips the brackets and any source route. */
+    a = argv[0];
+    while (*a == ' ')
+        a++;
+    if (*a == '<')
+        a++;
+    if (*a == '@' && (colon = strchr(a, ':')) != NULL)
+        a = colon + 1;
+    n = strcspn(a, "> ");
+    if (n >= sizeof(sender))
+        n = 0;
+    memcpy(sender, a, n);
+    sender[n] = '\0';
+
+    spf_start(p->spf, sender);
+}
+
+void
+milter_spf_free(struct milter_priv *p)
+{
+    struct milter_spf *s = p->spf;
+
+    if (s == NULL)
+        return;
+    spf_clear(s);
+    free(s->queries);
+    free(s->sender);
+    free(s->local);
+    free(s->helo);
+    free(s);
+    p->spf = NULL;
+}
+
+size_t
+milter_spf_memory(const struct milter_priv *p)
+{
+    if (p->spf == NULL)
+        return 0;
+    return sizeof(*p->spf) + p->spf->aqueries * sizeof(struct spf_query);
+}
+
+/* OCaml interface. */
+
+CAMLprim value
+caml_milter_spf_enable(value unit)
+{
+    CAMLparam1(unit);
+    spf_enabled = 1;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_spf_check(value ctx_val, value sender_val)
+{
+    CAMLparam2(ctx_val, sender_val);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->spf == NULL)
+        milter_error("Milter.Spf.check");
+    spf_start(p->spf, String_val(sender_val));
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_spf_result(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || p->spf == NULL)
+        CAMLreturn(Val_none);
+    spf_step(p->spf);
+    if (p->spf->result == SPF_PENDING)
+        CAMLreturn(Val_none);
+    CAMLreturn(Val_some(Val_int(p->spf->result)));
+}
+
+CAMLprim value
+caml_milter_spf_wait(value ctx_val, value timeout_val)
+{
+    CAMLparam2(ctx_val, timeout_val);
+    int64_t deadline;
+    struct milter_spf *s;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    if (p == NULL || (s = p->spf) == NULL || s->result != SPF_PENDING)
+        CAMLreturn(Val_unit);
+
+    deadline = milter_now() + (int64_t)(Double_val(timeout_val) * 1e9);
+
+    caml_release_runtime_system();
+    for (;;) {
+        spf_step(s);
+        if (s->result != SPF_PENDING || milter_now() >= deadline)
+            break;
+        milter_dns_wait(spf_ready, s, deadline);
+    }
+    caml_acquire_runtime_system();
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_spf_stats(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal1(res);
+    long hits, misses;
+
+    pthread_mutex_lock(&spf_mutex);
+    hits = spf_hits;
+    misses = spf_misses;
+    pthread_mutex_unlock(&spf_mutex);
+
+    res = caml_alloc_tuple(2);
+    Store_field(res, 0, Val_long(hits));
+    Store_field(res, 1, Val_long(misses));
+    CAMLreturn(res);
+}
@@ -1,9 +1,17 @@
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h> 
 
 #include <libmilter/mfapi.h>
@@ -19,20 +27,44 @@
 #include <caml/unixsupport.h>
 #include <caml/threads.h>
 
-#define Some_val(v)    Field(v, 0)
-#define Val_none       Val_int(0)
-
-#define ENTER_CALLBACK                                                     \
+#include "milter_stubs.h"
+
+/*
+ * Pool workers are registered once and for all, so they must take the
+ * runtime lock themselves; their callbacks count from when they were
+ * queued.
+ */
+#define ENTER_CALLBACK(ctx, cb)                                            \
+    int64_t __caml_milter_enter_time = milter_pool_queued_at != 0          \
+                                     ? milter_pool_queued_at               \
+                                     : milter_now();                       \
+    int64_t __caml_milter_lock_wait = 0;                                   \
     int __caml_milter_c_thread_registered = caml_c_thread_register();      \
-    if (__caml_milter_c_thread_registered) caml_acquire_runtime_system();
+    int __caml_milter_acquire = __caml_milter_c_thread_registered          \
+                              || milter_pool_queued_at != 0;               \
+    if (__caml_milter_acquire) {                                           \
+        caml_acquire_runtime_system();                                     \
+        __caml_milter_lock_wait = milter_now() - __caml_milter_enter_time; \
+        milter_lock_wait(__caml_milter_lock_wait);                         \
+    }                                                                      \
+    milter_enter(ctx, cb, __caml_milter_enter_time, __caml_milter_lock_wait);
 
 #define LEAVE_CALLBACK                         \
-    if (__caml_milter_c_thread_registered) {   \
+    if (__caml_milter_acquire)                 \
         caml_release_runtime_system();         \
-        caml_c_thread_unregister();            \
-    }
+    if (__caml_milter_c_thread_registered)     \
+        caml_c_thread_unregister();
+
+int64_t
+milter_now(void)
+{
+    struct timespec ts;
 
-static CAMLprim value
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+CAMLprim value
 Val_some(value v)
 {
     CAMLparam1(v);
@@ -44,25 +76,338 @@ Val_some(value v)
     CAMLreturn(r);
 }
 
-static void
+void
 milter_error(const char *err)
 {
+    milter_log(MILTER_LOG_ERROR, NULL, "%s failed", err);
     caml_raise_with_string(*caml_named_value("Milter.Milter_error"), err);
 }
 
-CAMLprim value
-caml_milter_opensocket(value rmsocket_val)
+static pthread_mutex_t milter_conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t milter_conn_cond = PTHREAD_COND_INITIALIZER;
+static int milter_conn_count = 0;
+static uint64_t milter_conn_id = 0;
+
+struct milter_priv *
+milter_priv_get(SMFICTX *ctx)
 {
-    CAMLparam1(rmsocket_val);
-    int ret;
-    int rmsocket = Bool_val(rmsocket_val);
+    struct milter_priv *p;
 
-    caml_release_runtime_system();
-    ret = smfi_opensocket(rmsocket);
-    caml_acquire_runtime_system();
-    if (ret == MI_FAILURE)
-        milter_error("Milter.opensocket");
-    CAMLreturn(Val_unit);
+    p = smfi_getpriv(ctx);
+    if (p != NULL)
+        return p;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->v = Val_none;
+    p->ctx = ctx;
+    p->id = __atomic_add_fetch(&milter_conn_id, 1, __ATOMIC_RELAXED);
+    p->trace = milter_trace_start();
+    pthread_mutex_init(&p->io, NULL);
+
+    if (smfi_setpriv(ctx, p) == MI_FAILURE) {
+        pthread_mutex_destroy(&p->io);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&milter_conn_mutex);
+    milter_conn_count++;
+    pthread_mutex_unlock(&milter_conn_mutex);
+
+    return p;
+}
+
+/* Must be called with the runtime lock held if an OCaml value was set. */
+static void
+milter_priv_free(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+
+    p = smfi_getpriv(ctx);
+    if (p == NULL)
+        return;
+
+    if (Is_block(p->v))
+        caml_remove_generational_global_root(&(p->v));
+    milter_dnsbl_free(p);
+    if (p->trace != NULL)
+        milter_trace_finish(p);
+    milter_tap_free(p);
+    milter_headers_free(p);
+    milter_bodycache_free(p);
+    milter_scan_free(p);
+    milter_envelope_free(p);
+    milter_bayes_free(p);
+    milter_view_free(p);
+    milter_spf_free(p);
+    milter_urls_free(p);
+    milter_dkim_free(p);
+    milter_mem_release(p);
+    smfi_setpriv(ctx, NULL);
+    pthread_mutex_destroy(&p->io);
+    free(p);
+
+    pthread_mutex_lock(&milter_conn_mutex);
+    if (--milter_conn_count == 0)
+        pthread_cond_broadcast(&milter_conn_cond);
+    pthread_mutex_unlock(&milter_conn_mutex);
+}
+
+/*
+ * Admission control. The time callbacks spend waiting for the runtime lock
+ * is sampled on every callback; if the smallest wait seen during an
+ * interval exceeds the target, there is a standing queue and new
+ * connections are refused with a tempfail until it clears. The samples
+ * are written with the runtime lock held and read without it.
+ */
+
+#define MILTER_ADMISSION_INTERVAL 100000000 /* 100ms */
+
+static int milter_max_connections = 0;
+static int64_t milter_lock_target = 0;
+static int64_t milter_lock_window = 0;
+static int64_t milter_lock_window_min = 0;
+static int64_t milter_lock_min = 0;
+static int milter_overloaded = 0;
+static long milter_rejections = 0;
+
+static void
+milter_lock_wait(int64_t wait)
+{
+    int64_t now = milter_now();
+
+    if (now - milter_lock_window >= MILTER_ADMISSION_INTERVAL) {
+        __atomic_store_n(&milter_lock_min, milter_lock_window_min,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&milter_overloaded,
+                         milter_lock_target > 0
+                             && milter_lock_window_min > milter_lock_target,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&milter_lock_window, now, __ATOMIC_RELAXED);
+        milter_lock_window_min = wait;
+    } else if (wait < milter_lock_window_min) {
+        milter_lock_window_min = wait;
+    }
+}
+
+/* Does not require the runtime lock. */
+static int
+milter_admit(void)
+{
+    int64_t window;
+
+    if (milter_max_connections > 0
+            && __atomic_load_n(&milter_conn_count, __ATOMIC_RELAXED)
+               >= milter_max_connections)
+        return 0;
+
+    /* Without recent samples the queue is assumed to have drained. */
+    window = __atomic_load_n(&milter_lock_window, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&milter_overloaded, __ATOMIC_RELAXED)
+            && milter_now() - window < 2 * MILTER_ADMISSION_INTERVAL)
+        return 0;
+
+    return 1;
+}
+
+static void
+milter_enter(SMFICTX *ctx, enum milter_callback cb, int64_t started,
+             int64_t lock_wait)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p != NULL) {
+        p->callback = cb;
+        p->started = started;
+        p->lock_wait = lock_wait;
+    }
+}
+
+/* Start time of a callback that may return without running OCaml code;
+ * only read if the connection is traced. */
+static int64_t
+milter_native_start(SMFICTX *ctx)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    return p != NULL && p->trace != NULL ? milter_now() : 0;
+}
+
+/* Records the trace event of a callback that returned without running
+ * OCaml code, and so without the runtime lock. */
+static sfsistat
+milter_native(SMFICTX *ctx, enum milter_callback cb, int64_t started,
+              sfsistat s)
+{
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p != NULL && p->trace != NULL) {
+        milter_enter(ctx, cb, started, 0);
+        milter_trace_span(p, 0, s);
+    }
+    return s;
+}
+
+/* Records the callback's trace event and charges the connection for its
+ * arguments; size is that of the arguments. Body chunks are lent to
+ * OCaml rather than copied, and the parts it retains are charged by the
+ * views, so they are not charged here. */
+static void
+milter_leave(SMFICTX *ctx, size_t size, sfsistat s)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL)
+        return;
+    if (p->callback != MILTER_BODY)
+        milter_mem_copied(p, size);
+    if (p->trace != NULL)
+        milter_trace_span(p, size, s);
+}
+
+static size_t
+milter_argv_size(char **argv)
+{
+    size_t size = 0;
+
+    for (; *argv != NULL; argv++)
+        size += strlen(*argv);
+    return size;
+}
+
+/* Wraps libmilter calls that write to the MTA. */
+static void
+milter_io_lock(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p != NULL)
+        pthread_mutex_lock(&p->io);
+}
+
+static void
+milter_io_unlock(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p != NULL)
+        pthread_mutex_unlock(&p->io);
+}
+
+/*
+ * Progress watchdog. Connections enter the list while their eom callback
+ * runs, and a C thread calls smfi_progress() for them at regular
+ * intervals. The list mutex is only held to pick the due connections,
+ * which are marked busy; progress is then sent outside it, serialized
+ * with the callback thread by the connection's io mutex. Once
+ * milter_watchdog_remove() returns no more reports will be written for
+ * the connection.
+ */
+
+#define MILTER_WD_BATCH 64
+
+static int64_t milter_wd_interval = 0;
+static int64_t milter_wd_limit = 0;
+static int64_t milter_mta_timeout = 0;
+static pthread_mutex_t milter_wd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t milter_wd_cond = PTHREAD_COND_INITIALIZER;
+static struct milter_priv *milter_wd_list = NULL;
+static int milter_wd_started = 0;
+
+static void *
+milter_watchdog(void *arg)
+{
+    int64_t now, period;
+    struct timespec ts;
+    struct milter_priv *p;
+    struct milter_priv *due[MILTER_WD_BATCH];
+    int i, n;
+
+    for (;;) {
+        period = milter_wd_interval / 4;
+        if (period < 10000000)
+            period = 10000000;
+        ts.tv_sec = period / 1000000000;
+        ts.tv_nsec = period % 1000000000;
+        nanosleep(&ts, NULL);
+
+        /* Connections past the batch size stay due and are picked up
+         * on the next pass. */
+        n = 0;
+        pthread_mutex_lock(&milter_wd_mutex);
+        now = milter_now();
+        for (p = milter_wd_list; p != NULL && n < MILTER_WD_BATCH;
+             p = p->wd_next) {
+            if (now - p->started >= milter_wd_limit)
+                continue;
+            if (now - p->wd_progress < milter_wd_interval)
+                continue;
+            p->wd_progress = now;
+            p->wd_busy = 1;
+            due[n++] = p;
+        }
+        pthread_mutex_unlock(&milter_wd_mutex);
+
+        for (i = 0; i < n; i++) {
+            p = due[i];
+            pthread_mutex_lock(&p->io);
+            smfi_progress(p->ctx);
+            pthread_mutex_unlock(&p->io);
+        }
+
+        if (n > 0) {
+            pthread_mutex_lock(&milter_wd_mutex);
+            for (i = 0; i < n; i++)
+                due[i]->wd_busy = 0;
+            pthread_cond_broadcast(&milter_wd_cond);
+            pthread_mutex_unlock(&milter_wd_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+milter_watchdog_add(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || milter_wd_interval == 0)
+        return;
+
+    pthread_mutex_lock(&milter_wd_mutex);
+    p->wd_progress = p->started;
+    p->wd_busy = 0;
+    p->wd_prev = NULL;
+    p->wd_next = milter_wd_list;
+    if (milter_wd_list != NULL)
+        milter_wd_list->wd_prev = p;
+    milter_wd_list = p;
+    p->wd_active = 1;
+    pthread_mutex_unlock(&milter_wd_mutex);
+}
+
+static void
+milter_watchdog_remove(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || !p->wd_active)
+        return;
+
+    pthread_mutex_lock(&milter_wd_mutex);
+    if (p->wd_prev != NULL)
+        p->wd_prev->wd_next = p->wd_next;
+    else
+        milter_wd_list = p->wd_next;
+    if (p->wd_next != NULL)
+        p->wd_next->wd_prev = p->wd_prev;
+    p->wd_active = 0;
+    while (p->wd_busy)
+        pthread_cond_wait(&milter_wd_cond, &milter_wd_mutex);
+    pthread_mutex_unlock(&milter_wd_mutex);
 }
 
 static const int milter_flag_table[] = {
@@ -153,48 +498,114 @@ make_sockaddr(_SOCK_ADDR *sa)
     CAMLreturn(res);
 }
 
+/*
+ * Whether the OCaml filter has a function for each callback. Callbacks
+ * that native features rely on are installed regardless, and return
+ * without taking the runtime lock when there is no OCaml function.
+ */
+static int milter_ocaml[MILTER_NEGOTIATE + 1];
+
+/* Admission control for a new connection, on the thread libmilter runs
+ * it on; refused connections are marked as such. Does not require the
+ * runtime lock. */
 static sfsistat
-milter_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *sockaddr)
+milter_connect_admit(SMFICTX *ctx)
+{
+    int admitted;
+    struct milter_priv *p;
+
+    admitted = milter_admit();
+
+    p = milter_priv_get(ctx);
+    if (p == NULL)
+        return SMFIS_TEMPFAIL;
+
+    if (!admitted) {
+        p->rejected = 1;
+        __atomic_add_fetch(&milter_rejections, 1, __ATOMIC_RELAXED);
+        milter_log(MILTER_LOG_NOTICE, p, "connection refused: overloaded");
+        return SMFIS_TEMPFAIL;
+    }
+
+    if (milter_mem_check(ctx) == -1) {
+        p->rejected = 1;
+        return SMFIS_TEMPFAIL;
+    }
+
+    return SMFIS_CONTINUE;
+}
+
+/* The connect callback of an admitted connection. */
+static sfsistat
+milter_connect_admitted(SMFICTX *ctx, char *host, _SOCK_ADDR *sockaddr)
 {
     value ret, ctx_val, host_val, sockaddr_val;
     sfsistat s;
+    struct milter_priv *p = smfi_getpriv(ctx);
     static value *closure = NULL;
 
-    ENTER_CALLBACK;
+    milter_dnsbl_start(p, sockaddr, host);
+    milter_spf_connect(p, sockaddr);
+
+    ENTER_CALLBACK(ctx, MILTER_CONNECT);
 
     ret = Val_none;
     ctx_val = (value)ctx;
     host_val = Val_none;
     sockaddr_val = Val_none;
+    s = SMFIS_CONTINUE;
 
     Begin_roots4(ret, ctx_val, host_val, sockaddr_val);
 
-    if (host != NULL)
-        host_val = Val_some(caml_copy_string(host));
-
-    if (sockaddr != NULL)
-        sockaddr_val = Val_some(make_sockaddr(sockaddr));
-
+    /* Always installed to track connections; the OCaml callback is
+     * optional. */
     if (closure == NULL)
         closure = caml_named_value("milter_connect");
-    ret = caml_callback3(*closure, ctx_val, host_val, sockaddr_val);
 
-    s = milter_stat_table[Int_val(ret)];
+    if (closure != NULL) {
+        if (host != NULL)
+            host_val = Val_some(caml_copy_string(host));
+
+        if (sockaddr != NULL)
+            sockaddr_val = Val_some(make_sockaddr(sockaddr));
+
+        ret = caml_callback3(*closure, ctx_val, host_val, sockaddr_val);
+
+        s = milter_stat_table[Int_val(ret)];
+    }
 
     End_roots();
 
+    milter_leave(ctx, host != NULL ? strlen(host) : 0, s);
     LEAVE_CALLBACK;
     return s;
 }
 
+static sfsistat
+milter_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *sockaddr)
+{
+    sfsistat s = milter_connect_admit(ctx);
+
+    if (s != SMFIS_CONTINUE)
+        return s;
+    return milter_connect_admitted(ctx, host, sockaddr);
+}
+
 static sfsistat
 milter_helo(SMFICTX *ctx, char *helo)
 {
     value ret, ctx_val, helo_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
+
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_HELO, started, SMFIS_TEMPFAIL);
+    milter_spf_helo(ctx, helo);
+    if (!milter_ocaml[MILTER_HELO])
+        return milter_native(ctx, MILTER_HELO, started, SMFIS_CONTINUE);
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_HELO);
 
     ret = Val_none;
     ctx_val = (value)ctx;
@@ -213,6 +624,7 @@ milter_helo(SMFICTX *ctx, char *helo)
 
     End_roots();
 
+    milter_leave(ctx, helo != NULL ? strlen(helo) : 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -224,8 +636,25 @@ milter_envfrom(SMFICTX *ctx, char **envfrom)
     char **p;
     static value *closure = NULL;
     sfsistat s;
-
-    ENTER_CALLBACK;
+    int64_t started = milter_native_start(ctx);
+
+    milter_headers_reset(ctx);
+    milter_bodycache_reset(ctx);
+    milter_scan_reset(ctx);
+    milter_bayes_reset(ctx);
+    milter_view_reset(ctx);
+    milter_urls_reset(ctx);
+    milter_dkim_reset(ctx);
+    milter_mem_message(ctx);
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_ENVFROM, started, SMFIS_TEMPFAIL);
+    milter_tap_envfrom(ctx, envfrom);
+    milter_envelope_envfrom(ctx, envfrom);
+    milter_spf_envfrom(ctx, envfrom);
+    if (!milter_ocaml[MILTER_ENVFROM])
+        return milter_native(ctx, MILTER_ENVFROM, started, SMFIS_CONTINUE);
+
+    ENTER_CALLBACK(ctx, MILTER_ENVFROM);
 
     ctx_val = (value)ctx;
     ret = envfrom_val = args_val = args_tail = Val_none;
@@ -252,6 +681,7 @@ milter_envfrom(SMFICTX *ctx, char **envfrom)
 
     End_roots();
 
+    milter_leave(ctx, milter_argv_size(envfrom), s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -263,8 +693,16 @@ milter_envrcpt(SMFICTX *ctx, char **envrcpt)
     char **p;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
 
-    ENTER_CALLBACK;
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_ENVRCPT, started, SMFIS_TEMPFAIL);
+    milter_tap_envrcpt(ctx, envrcpt);
+    milter_envelope_envrcpt(ctx, envrcpt);
+    if (!milter_ocaml[MILTER_ENVRCPT])
+        return milter_native(ctx, MILTER_ENVRCPT, started, SMFIS_CONTINUE);
+
+    ENTER_CALLBACK(ctx, MILTER_ENVRCPT);
 
     ctx_val = (value)ctx;
     ret = envrcpt_val = args_val = args_tail = Val_none;
@@ -291,6 +729,7 @@ milter_envrcpt(SMFICTX *ctx, char **envrcpt)
 
     End_roots();
 
+    milter_leave(ctx, milter_argv_size(envrcpt), s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -301,8 +740,19 @@ milter_header(SMFICTX *ctx, char *headerf, char *headerv)
     value ret, ctx_val, headerf_val, headerv_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
+
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_HEADER, started, SMFIS_TEMPFAIL);
+    milter_headers_add(ctx, headerf, headerv);
+    milter_scan_header(ctx, headerf, headerv);
+    milter_urls_header(ctx, headerf, headerv);
+    milter_dkim_header(ctx, headerf, headerv);
+    milter_tap_header(ctx, headerf, headerv);
+    if (!milter_ocaml[MILTER_HEADER])
+        return milter_native(ctx, MILTER_HEADER, started, SMFIS_CONTINUE);
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_HEADER);
 
     ctx_val = (value)ctx;
     ret = headerf_val = headerv_val = Val_none;
@@ -320,6 +770,7 @@ milter_header(SMFICTX *ctx, char *headerf, char *headerv)
 
     End_roots();
 
+    milter_leave(ctx, strlen(headerf) + strlen(headerv), s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -330,8 +781,12 @@ milter_eoh(SMFICTX *ctx)
     value ret, ctx_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
 
-    ENTER_CALLBACK;
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_EOH, started, SMFIS_TEMPFAIL);
+
+    ENTER_CALLBACK(ctx, MILTER_EOH);
 
     ctx_val = (value)ctx;
     ret = Val_none;
@@ -346,6 +801,7 @@ milter_eoh(SMFICTX *ctx)
 
     End_roots();
 
+    milter_leave(ctx, 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -357,8 +813,20 @@ milter_body(SMFICTX *ctx, unsigned char *bodyp, size_t bodylen)
     static value *closure = NULL;
     intnat dims[] = { bodylen };
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
+
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_BODY, started, SMFIS_TEMPFAIL);
+    milter_bodycache_body(ctx, bodyp, bodylen);
+    milter_scan_body(ctx, bodyp, bodylen);
+    milter_bayes_body(ctx, bodyp, bodylen);
+    milter_urls_body(ctx, bodyp, bodylen);
+    milter_dkim_body(ctx, bodyp, bodylen);
+    milter_tap_body(ctx, bodyp, bodylen);
+    if (!milter_ocaml[MILTER_BODY])
+        return milter_native(ctx, MILTER_BODY, started, SMFIS_CONTINUE);
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_BODY);
 
     ctx_val = (value)ctx;
     ret = ctx_val = body_val = len_val = Val_unit;
@@ -370,12 +838,17 @@ milter_body(SMFICTX *ctx, unsigned char *bodyp, size_t bodylen)
 
     if (closure == NULL)
         closure = caml_named_value("milter_body");
-    ret = caml_callback3(*closure, ctx_val, body_val, len_val);
+    milter_view_enter(ctx, bodyp, bodylen);
+    ret = caml_callback3_exn(*closure, ctx_val, body_val, len_val);
+    milter_view_leave(ctx);
+    if (Is_exception_result(ret))
+        caml_raise(Extract_exception(ret));
 
     s = milter_stat_table[Int_val(ret)];
 
     End_roots();
 
+    milter_leave(ctx, bodylen, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -385,9 +858,24 @@ milter_eom(SMFICTX *ctx)
 {
     value ret, ctx_val;
     static value *closure = NULL;
+    int cached;
     sfsistat s;
-
-    ENTER_CALLBACK;
+    int64_t started = milter_native_start(ctx);
+
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_EOM, started, SMFIS_TEMPFAIL);
+    milter_tap_eom(ctx);
+    milter_scan_eom(ctx);
+    if (milter_bodycache_shortcircuit()
+            && (cached = milter_bodycache_lookup(ctx)) != -1)
+        return milter_native(ctx, MILTER_EOM, started,
+                             milter_stat_table[cached]);
+    if (!milter_ocaml[MILTER_EOM])
+        return milter_native(ctx, MILTER_EOM, started, SMFIS_CONTINUE);
+    milter_bayes_eom(ctx);
+    milter_urls_eom(ctx);
+
+    ENTER_CALLBACK(ctx, MILTER_EOM);
 
     ctx_val = (value)ctx;
     ret = Val_none;
@@ -396,12 +884,17 @@ milter_eom(SMFICTX *ctx)
 
     if (closure == NULL)
         closure = caml_named_value("milter_eom");
-    ret = caml_callback(*closure, ctx_val);
+    milter_watchdog_add(ctx);
+    ret = caml_callback_exn(*closure, ctx_val);
+    milter_watchdog_remove(ctx);
+    if (Is_exception_result(ret))
+        caml_raise(Extract_exception(ret));
 
     s = milter_stat_table[Int_val(ret)];
 
     End_roots();
 
+    milter_leave(ctx, 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -412,8 +905,14 @@ milter_abort(SMFICTX *ctx)
     value ret, ctx_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
+
+    milter_tap_abort(ctx);
+    milter_view_reset(ctx);
+    if (!milter_ocaml[MILTER_ABORT])
+        return milter_native(ctx, MILTER_ABORT, started, SMFIS_CONTINUE);
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_ABORT);
 
     ctx_val = (value)ctx;
     ret = Val_none;
@@ -428,6 +927,7 @@ milter_abort(SMFICTX *ctx)
 
     End_roots();
 
+    milter_leave(ctx, 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -437,20 +937,37 @@ milter_close(SMFICTX *ctx)
 {
     value ret, ctx_val;
     static value *closure = NULL;
+    struct milter_priv *p;
     sfsistat s;
 
-    ENTER_CALLBACK;
+    /* Connections refused by admission control never reached the OCaml
+     * callbacks, so the runtime lock is not needed. */
+    p = smfi_getpriv(ctx);
+    if (p != NULL && p->rejected && !Is_block(p->v)) {
+        milter_priv_free(ctx);
+        return SMFIS_CONTINUE;
+    }
+
+    ENTER_CALLBACK(ctx, MILTER_CLOSE);
 
     ctx_val = (value)ctx;
     ret = Val_none;
 
     Begin_roots2(ret, ctx_val);
 
+    /* Always installed to release the per-connection state; the OCaml
+     * callback is optional. */
     if (closure == NULL)
         closure = caml_named_value("milter_close");
-    ret = caml_callback(*closure, ctx_val);
 
-    s = milter_stat_table[Int_val(ret)];
+    s = SMFIS_CONTINUE;
+    if (closure != NULL) {
+        ret = caml_callback(*closure, ctx_val);
+        s = milter_stat_table[Int_val(ret)];
+    }
+
+    milter_leave(ctx, 0, s);
+    milter_priv_free(ctx);
 
     End_roots();
 
@@ -464,8 +981,12 @@ milter_unknown(SMFICTX *ctx, const char *cmd)
     value ret, ctx_val, cmd_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
+
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_UNKNOWN, started, SMFIS_TEMPFAIL);
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_UNKNOWN);
 
     ctx_val = (value)ctx;
     ret = cmd_val = Val_none;
@@ -482,6 +1003,7 @@ milter_unknown(SMFICTX *ctx, const char *cmd)
 
     End_roots();
 
+    milter_leave(ctx, strlen(cmd), s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -492,8 +1014,12 @@ milter_data(SMFICTX *ctx)
     value ret, ctx_val;
     static value *closure = NULL;
     sfsistat s;
+    int64_t started = milter_native_start(ctx);
 
-    ENTER_CALLBACK;
+    if (milter_mem_check(ctx) == -1)
+        return milter_native(ctx, MILTER_DATA, started, SMFIS_TEMPFAIL);
+
+    ENTER_CALLBACK(ctx, MILTER_DATA);
 
     ctx_val = (value)ctx;
     ret = Val_none;
@@ -508,6 +1034,7 @@ milter_data(SMFICTX *ctx)
 
     End_roots();
 
+    milter_leave(ctx, 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -560,7 +1087,7 @@ milter_negotiate(SMFICTX *ctx,
     static value *closure = NULL;
     sfsistat s;
 
-    ENTER_CALLBACK;
+    ENTER_CALLBACK(ctx, MILTER_NEGOTIATE);
 
     ctx_val = (value)ctx;
     ret = head = actions_val = actions_tail = steps_val = steps_tail = Val_none;
@@ -621,6 +1148,7 @@ milter_negotiate(SMFICTX *ctx,
     End_roots();
     End_roots();
 
+    milter_leave(ctx, 0, s);
     LEAVE_CALLBACK;
     return s;
 }
@@ -631,30 +1159,317 @@ isnone(value opt)
     return (opt == Val_none);
 }
 
+static int
+milter_want(value desc_val, int field, enum milter_callback cb, int native)
+{
+    milter_ocaml[cb] = !isnone(Field(desc_val, field));
+    return milter_ocaml[cb] || native;
+}
+
+/*
+ * Pool mode. The functions given to libmilter queue the callbacks above
+ * for the workers; callbacks with only native work run in place.
+ */
+
+static sfsistat
+milter_connect_job(struct milter_job *j)
+{
+    return milter_connect_admitted(j->ctx, j->arg[0], j->arg[1]);
+}
+
+/* Connections are refused before they are queued, so that load is shed
+ * without waiting for a worker when the pool is saturated. */
+static sfsistat
+milter_pool_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *sockaddr)
+{
+    struct milter_job j = {
+        .fn = milter_connect_job, .ctx = ctx, .arg = { host, sockaddr }
+    };
+    sfsistat s = milter_connect_admit(ctx);
+
+    if (s != SMFIS_CONTINUE)
+        return s;
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_helo_job(struct milter_job *j)
+{
+    return milter_helo(j->ctx, j->arg[0]);
+}
+
+static sfsistat
+milter_pool_helo(SMFICTX *ctx, char *helo)
+{
+    struct milter_job j = {
+        .fn = milter_helo_job, .ctx = ctx, .arg = { helo }
+    };
+
+    if (!milter_ocaml[MILTER_HELO])
+        return milter_helo(ctx, helo);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_envfrom_job(struct milter_job *j)
+{
+    return milter_envfrom(j->ctx, j->arg[0]);
+}
+
+static sfsistat
+milter_pool_envfrom(SMFICTX *ctx, char **envfrom)
+{
+    struct milter_job j = {
+        .fn = milter_envfrom_job, .ctx = ctx, .arg = { envfrom }
+    };
+
+    if (!milter_ocaml[MILTER_ENVFROM])
+        return milter_envfrom(ctx, envfrom);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_envrcpt_job(struct milter_job *j)
+{
+    return milter_envrcpt(j->ctx, j->arg[0]);
+}
+
+static sfsistat
+milter_pool_envrcpt(SMFICTX *ctx, char **envrcpt)
+{
+    struct milter_job j = {
+        .fn = milter_envrcpt_job, .ctx = ctx, .arg = { envrcpt }
+    };
+
+    if (!milter_ocaml[MILTER_ENVRCPT])
+        return milter_envrcpt(ctx, envrcpt);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_header_job(struct milter_job *j)
+{
+    return milter_header(j->ctx, j->arg[0], j->arg[1]);
+}
+
+static sfsistat
+milter_pool_header(SMFICTX *ctx, char *headerf, char *headerv)
+{
+    struct milter_job j = {
+        .fn = milter_header_job, .ctx = ctx, .arg = { headerf, headerv }
+    };
+
+    if (!milter_ocaml[MILTER_HEADER])
+        return milter_header(ctx, headerf, headerv);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_eoh_job(struct milter_job *j)
+{
+    return milter_eoh(j->ctx);
+}
+
+static sfsistat
+milter_pool_eoh(SMFICTX *ctx)
+{
+    struct milter_job j = { .fn = milter_eoh_job, .ctx = ctx };
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_body_job(struct milter_job *j)
+{
+    return milter_body(j->ctx, j->arg[0], j->n[0]);
+}
+
+static sfsistat
+milter_pool_body(SMFICTX *ctx, unsigned char *bodyp, size_t bodylen)
+{
+    struct milter_job j = {
+        .fn = milter_body_job, .ctx = ctx, .arg = { bodyp }, .n = { bodylen }
+    };
+
+    if (!milter_ocaml[MILTER_BODY])
+        return milter_body(ctx, bodyp, bodylen);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_eom_job(struct milter_job *j)
+{
+    return milter_eom(j->ctx);
+}
+
+static sfsistat
+milter_pool_eom(SMFICTX *ctx)
+{
+    struct milter_job j = { .fn = milter_eom_job, .ctx = ctx };
+
+    if (!milter_ocaml[MILTER_EOM])
+        return milter_eom(ctx);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_abort_job(struct milter_job *j)
+{
+    return milter_abort(j->ctx);
+}
+
+static sfsistat
+milter_pool_abort(SMFICTX *ctx)
+{
+    struct milter_job j = { .fn = milter_abort_job, .ctx = ctx };
+
+    if (!milter_ocaml[MILTER_ABORT])
+        return milter_abort(ctx);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_close_job(struct milter_job *j)
+{
+    return milter_close(j->ctx);
+}
+
+static sfsistat
+milter_pool_close(SMFICTX *ctx)
+{
+    struct milter_job j = { .fn = milter_close_job, .ctx = ctx };
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    /* Refused connections are closed without the runtime lock. */
+    if (p != NULL && p->rejected && !Is_block(p->v))
+        return milter_close(ctx);
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_unknown_job(struct milter_job *j)
+{
+    return milter_unknown(j->ctx, j->arg[0]);
+}
+
+static sfsistat
+milter_pool_unknown(SMFICTX *ctx, const char *cmd)
+{
+    struct milter_job j = {
+        .fn = milter_unknown_job, .ctx = ctx, .arg = { (char *)cmd }
+    };
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_data_job(struct milter_job *j)
+{
+    return milter_data(j->ctx);
+}
+
+static sfsistat
+milter_pool_data(SMFICTX *ctx)
+{
+    struct milter_job j = { .fn = milter_data_job, .ctx = ctx };
+    return milter_pool_run(&j);
+}
+
+static sfsistat
+milter_negotiate_job(struct milter_job *j)
+{
+    return milter_negotiate(j->ctx, j->n[0], j->n[1], j->n[2], j->n[3],
+                            j->arg[0], j->arg[1], j->arg[2], j->arg[3]);
+}
+
+static sfsistat
+milter_pool_negotiate(SMFICTX *ctx,
+                      unsigned long f0, unsigned long f1,
+                      unsigned long f2, unsigned long f3,
+                      unsigned long *pf0, unsigned long *pf1,
+                      unsigned long *pf2, unsigned long *pf3)
+{
+    struct milter_job j = {
+        .fn = milter_negotiate_job, .ctx = ctx,
+        .arg = { pf0, pf1, pf2, pf3 }, .n = { f0, f1, f2, f3 }
+    };
+    return milter_pool_run(&j);
+}
+
+static void
+milter_pool_desc(struct smfiDesc *desc)
+{
+#define POOL(field, fn) if (desc->field != NULL) desc->field = fn
+    POOL(xxfi_connect,   milter_pool_connect);
+    POOL(xxfi_helo,      milter_pool_helo);
+    POOL(xxfi_envfrom,   milter_pool_envfrom);
+    POOL(xxfi_envrcpt,   milter_pool_envrcpt);
+    POOL(xxfi_header,    milter_pool_header);
+    POOL(xxfi_eoh,       milter_pool_eoh);
+    POOL(xxfi_body,      milter_pool_body);
+    POOL(xxfi_eom,       milter_pool_eom);
+    POOL(xxfi_abort,     milter_pool_abort);
+    POOL(xxfi_close,     milter_pool_close);
+    POOL(xxfi_unknown,   milter_pool_unknown);
+    POOL(xxfi_data,      milter_pool_data);
+    POOL(xxfi_negotiate, milter_pool_negotiate);
+#undef POOL
+}
+
 CAMLprim value
 caml_milter_register(value desc_val)
 {
     CAMLparam1(desc_val);
     CAMLlocal1(ret);
     struct smfiDesc desc;
+    int tap = milter_tap_enabled();
+    int headers = milter_headers_enabled();
+    int bodycache = milter_bodycache_enabled();
+    int scan = milter_scan_enabled();
+    int envelope = milter_envelope_enabled();
+    int bayes = milter_bayes_enabled();
+    int spf = milter_spf_enabled();
+    int urls = milter_urls_enabled();
+    int dkim = milter_dkim_enabled();
+    /* Body views are only made by the body callback, and retained ones
+     * are given back when the message is aborted. */
+    int views = !isnone(Field(desc_val, 9));
 
     desc.xxfi_name      = String_val(Field(desc_val, 0));
     desc.xxfi_version   = Int_val(Field(desc_val, 1));
     desc.xxfi_flags     = milter_flags(Field(desc_val, 2));
-    desc.xxfi_connect   = isnone(Field(desc_val,  3)) ? NULL : milter_connect;
-    desc.xxfi_helo      = isnone(Field(desc_val,  4)) ? NULL : milter_helo;
-    desc.xxfi_envfrom   = isnone(Field(desc_val,  5)) ? NULL : milter_envfrom;
-    desc.xxfi_envrcpt   = isnone(Field(desc_val,  6)) ? NULL : milter_envrcpt;
-    desc.xxfi_header    = isnone(Field(desc_val,  7)) ? NULL : milter_header;
+    desc.xxfi_connect   = milter_connect;
+    desc.xxfi_helo      = milter_want(desc_val,  4, MILTER_HELO, spf)
+                        ? milter_helo : NULL;
+    desc.xxfi_envfrom   = milter_want(desc_val,  5, MILTER_ENVFROM,
+                                      tap || headers || bodycache || scan
+                                      || envelope || bayes || spf || urls
+                                      || dkim)
+                        ? milter_envfrom : NULL;
+    desc.xxfi_envrcpt   = milter_want(desc_val,  6, MILTER_ENVRCPT,
+                                      tap || envelope)
+                        ? milter_envrcpt : NULL;
+    desc.xxfi_header    = milter_want(desc_val,  7, MILTER_HEADER,
+                                      tap || headers || scan || urls || dkim)
+                        ? milter_header : NULL;
     desc.xxfi_eoh       = isnone(Field(desc_val,  8)) ? NULL : milter_eoh;
-    desc.xxfi_body      = isnone(Field(desc_val,  9)) ? NULL : milter_body;
-    desc.xxfi_eom       = isnone(Field(desc_val, 10)) ? NULL : milter_eom;
-    desc.xxfi_abort     = isnone(Field(desc_val, 11)) ? NULL : milter_abort;
-    desc.xxfi_close     = isnone(Field(desc_val, 12)) ? NULL : milter_close;
+    desc.xxfi_body      = milter_want(desc_val,  9, MILTER_BODY,
+                                      tap || bodycache || scan || bayes
+                                      || urls || dkim)
+                        ? milter_body : NULL;
+    desc.xxfi_eom       = milter_want(desc_val, 10, MILTER_EOM,
+                                      tap || milter_bodycache_shortcircuit()
+                                      || scan)
+                        ? milter_eom : NULL;
+    desc.xxfi_abort     = milter_want(desc_val, 11, MILTER_ABORT,
+                                      tap || views)
+                        ? milter_abort : NULL;
+    desc.xxfi_close     = milter_close;
     desc.xxfi_unknown   = isnone(Field(desc_val, 13)) ? NULL : milter_unknown;
     desc.xxfi_data      = isnone(Field(desc_val, 14)) ? NULL : milter_data;
     desc.xxfi_negotiate = isnone(Field(desc_val, 15)) ? NULL : milter_negotiate;
 
+    if (milter_pool_enabled())
+        milter_pool_desc(&desc);
+
     caml_release_runtime_system();
     ret = smfi_register(desc);
     caml_acquire_runtime_system();
@@ -664,6 +1479,8 @@ caml_milter_register(value desc_val)
     CAMLreturn(Val_unit);
 }
 
+static char *milter_conn = NULL;
+
 CAMLprim value
 caml_milter_setconn(value conn_value)
 {
@@ -675,10 +1492,15 @@ caml_milter_setconn(value conn_value)
     ret = smfi_setconn(conn);
     caml_acquire_runtime_system();
 
-    free(conn);
-
-    if (ret == MI_FAILURE)
+    if (ret == MI_FAILURE) {
+        free(conn);
         milter_error("Milter.setconn");
+    }
+
+    /* Kept to find the listening socket in caml_milter_handoff(). */
+    if (milter_conn != NULL)
+        free(milter_conn);
+    milter_conn = conn;
 
     CAMLreturn(Val_unit);
 }
@@ -722,6 +1544,112 @@ caml_milter_stop(value unit)
     CAMLreturn(Val_int(0)); /* SMFIS_CONTINUE */
 }
 
+/*
+ * Listening socket handoff between processes. libmilter offers no way to
+ * listen on an existing descriptor, so caml_milter_inheritsocket() lets it
+ * open a throwaway UNIX socket and then replaces that descriptor with the
+ * inherited one via dup2(2). The process handing its socket off replaces
+ * it in turn before stopping, as libmilter would otherwise remove the
+ * socket's path.
+ */
+
+static int milter_listen_fd = -1;
+
+static int
+milter_listener_matches(int fd, const char *conn)
+{
+    int val;
+    char *port, *end;
+    long portnum;
+    socklen_t len;
+    struct sockaddr_storage ss;
+    struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+
+    len = sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == -1 || !val)
+        return 0;
+
+    len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr *)&ss, &len) == -1)
+        return 0;
+
+    if (strncmp(conn, "unix:", 5) == 0 || strncmp(conn, "local:", 6) == 0)
+        conn = strchr(conn, ':') + 1;
+    if (conn[0] == '/')
+        return ss.ss_family == AF_UNIX && strcmp(sun->sun_path, conn) == 0;
+
+    if (strncmp(conn, "inet:", 5) == 0 && ss.ss_family != AF_INET)
+        return 0;
+    if (strncmp(conn, "inet6:", 6) == 0 && ss.ss_family != AF_INET6)
+        return 0;
+
+    port = strchr(conn, ':');
+    if (port == NULL)
+        return 0;
+    portnum = strtol(port + 1, &end, 10);
+    if (end == port + 1 || (*end != '@' && *end != '\0'))
+        return 0;
+
+    if (ss.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&ss)->sin_port) == portnum;
+    if (ss.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port) == portnum;
+    return 0;
+}
+
+/*
+ * Opens libmilter's listening socket and records its descriptor, which
+ * libmilter does not expose: every open descriptor is checked for a
+ * listener bound to the address of conn. Fails if none is found, as the
+ * socket could then not be handed off.
+ */
+static int
+milter_opensocket(const char *conn, int rmsocket)
+{
+    int fd, found = -1;
+    DIR *d;
+    struct dirent *e;
+
+    if (smfi_opensocket(rmsocket) == MI_FAILURE)
+        return MI_FAILURE;
+
+    d = opendir("/proc/self/fd");
+    if (d == NULL)
+        return MI_FAILURE;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+        fd = atoi(e->d_name);
+        if (fd != dirfd(d) && milter_listener_matches(fd, conn)) {
+            found = fd;
+            break;
+        }
+    }
+    closedir(d);
+    if (found == -1)
+        return MI_FAILURE;
+    milter_listen_fd = found;
+    return MI_SUCCESS;
+}
+
+CAMLprim value
+caml_milter_opensocket(value rmsocket_val)
+{
+    CAMLparam1(rmsocket_val);
+    int ret;
+    int rmsocket = Bool_val(rmsocket_val);
+
+    caml_release_runtime_system();
+    if (milter_conn != NULL)
+        ret = milter_opensocket(milter_conn, rmsocket);
+    else
+        ret = smfi_opensocket(rmsocket);
+    caml_acquire_runtime_system();
+    if (ret == MI_FAILURE)
+        milter_error("Milter.opensocket");
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim value
 caml_milter_main(value unit)
 {
@@ -729,7 +1657,13 @@ caml_milter_main(value unit)
     int ret;
 
     caml_release_runtime_system();
-    ret = smfi_main();
+    /* Opened here, unless already done, to know its descriptor; smfi_main()
+     * opens it otherwise. */
+    ret = MI_SUCCESS;
+    if (milter_listen_fd == -1 && milter_conn != NULL)
+        ret = milter_opensocket(milter_conn, 0);
+    if (ret == MI_SUCCESS)
+        ret = smfi_main();
     caml_acquire_runtime_system();
     if (ret == MI_FAILURE)
         milter_error("Milter.main");
@@ -737,6 +1671,305 @@ caml_milter_main(value unit)
     CAMLreturn(Val_unit);
 }
 
+CAMLprim value
+caml_milter_inheritsocket(value fd_val)
+{
+    CAMLparam1(fd_val);
+    int ret, lfd;
+    int fd = Int_val(fd_val);
+    char dir[] = "/tmp/milter.XXXXXX";
+    char conn[sizeof(dir) + 16];
+
+    caml_release_runtime_system();
+    ret = MI_FAILURE;
+    if (mkdtemp(dir) == NULL)
+        goto out;
+    snprintf(conn, sizeof(conn), "unix:%s/sock", dir);
+    if (smfi_setconn(conn) == MI_FAILURE
+            || milter_opensocket(conn, 1) == MI_FAILURE)
+        goto clean;
+    lfd = milter_listen_fd;
+    milter_listen_fd = -1;
+    if (lfd == -1 || dup2(fd, lfd) == -1)
+        goto clean;
+    close(fd);
+    milter_listen_fd = lfd;
+    ret = MI_SUCCESS;
+clean:
+    unlink(conn + 5);
+    rmdir(dir);
+out:
+    caml_acquire_runtime_system();
+
+    if (ret == MI_FAILURE)
+        milter_error("Milter.inheritsocket");
+
+    CAMLreturn(Val_unit);
+}
+
+static int
+milter_unix_socket(const char *path, struct sockaddr_un *sun)
+{
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+CAMLprim value
+caml_milter_handoff(value path_val)
+{
+    CAMLparam1(path_val);
+    int ret, fd, s, d;
+    char ack, byte = 0;
+    char *path = strdup(String_val(path_val));
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct sockaddr_un sun, anon = { .sun_family = AF_UNIX };
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    caml_release_runtime_system();
+    ret = MI_FAILURE;
+    fd = milter_listen_fd;
+    if (fd == -1)
+        goto out;
+    if ((s = milter_unix_socket(path, &sun)) == -1)
+        goto out;
+    if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        goto close;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(s, &msg, 0) != 1)
+        goto close;
+    /* Wait until the new process holds the socket before we stop. */
+    if (read(s, &ack, 1) != 1)
+        goto close;
+
+    /* libmilter unlinks the socket path when it closes a listener bound
+     * to it. Our descriptor now gets a listener of its own, autobound to
+     * an abstract address, so that the new process keeps the path. */
+    if ((d = socket(AF_UNIX, SOCK_STREAM, 0)) != -1) {
+        if (bind(d, (struct sockaddr *)&anon, sizeof(sa_family_t)) == 0
+                && listen(d, 1) == 0 && dup2(d, fd) != -1)
+            milter_listen_fd = -1;
+        close(d);
+    }
+    if (milter_listen_fd != -1)
+        milter_log(MILTER_LOG_WARNING, NULL,
+                   "could not detach the listening socket");
+
+    smfi_stop();
+    milter_log(MILTER_LOG_NOTICE, NULL, "listening socket handed off");
+    ret = MI_SUCCESS;
+close:
+    close(s);
+out:
+    caml_acquire_runtime_system();
+
+    free(path);
+
+    if (ret == MI_FAILURE)
+        milter_error("Milter.handoff");
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_takeover(value path_val)
+{
+    CAMLparam1(path_val);
+    int s, c, fd;
+    char byte, ack = 0;
+    char *path = strdup(String_val(path_val));
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct sockaddr_un sun;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    caml_release_runtime_system();
+    fd = -1;
+    if ((s = milter_unix_socket(path, &sun)) == -1)
+        goto out;
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        goto close;
+    if (listen(s, 1) == -1 || (c = accept(s, NULL, NULL)) == -1)
+        goto unlink;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(c, &msg, 0) == 1) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+                         && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (fd != -1 && write(c, &ack, 1) != 1) {
+        close(fd);
+        fd = -1;
+    }
+    close(c);
+unlink:
+    unlink(path);
+close:
+    close(s);
+out:
+    caml_acquire_runtime_system();
+
+    free(path);
+
+    if (fd == -1)
+        milter_error("Milter.takeover");
+
+    CAMLreturn(Val_int(fd));
+}
+
+CAMLprim value
+caml_milter_setmaxconnections(value max_val)
+{
+    CAMLparam1(max_val);
+    milter_max_connections = Int_val(max_val);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_setlocktarget(value target_val)
+{
+    CAMLparam1(target_val);
+    milter_lock_target = (int64_t)(Double_val(target_val) * 1e9);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_lockwait(value unit)
+{
+    CAMLparam1(unit);
+    int64_t wait = __atomic_load_n(&milter_lock_min, __ATOMIC_RELAXED);
+    CAMLreturn(caml_copy_double((double)wait / 1e9));
+}
+
+CAMLprim value
+caml_milter_rejections(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&milter_rejections, __ATOMIC_RELAXED)));
+}
+
+CAMLprim value
+caml_milter_setwatchdog(value interval_val, value limit_val)
+{
+    CAMLparam2(interval_val, limit_val);
+    pthread_t thread;
+    int64_t interval = (int64_t)(Double_val(interval_val) * 1e9);
+    int64_t limit = (int64_t)(Double_val(limit_val) * 1e9);
+
+    /* A watchdog without a limit would never report progress. */
+    if (interval < 0 || (interval > 0 && limit <= 0))
+        milter_error("Milter.setwatchdog");
+
+    milter_wd_interval = interval;
+    milter_wd_limit = limit;
+
+    if (milter_wd_interval > 0 && !milter_wd_started) {
+        if (pthread_create(&thread, NULL, milter_watchdog, NULL) != 0)
+            milter_error("Milter.setwatchdog");
+        pthread_detach(thread);
+        milter_wd_started = 1;
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_setmtatimeout(value timeout_val)
+{
+    CAMLparam1(timeout_val);
+    milter_mta_timeout = (int64_t)(Double_val(timeout_val) * 1e9);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_deadline(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal1(res);
+    int64_t budget;
+    struct timeval tv;
+    SMFICTX *ctx = (SMFICTX *)ctx_val;
+    struct milter_priv *p;
+
+    p = smfi_getpriv(ctx);
+    if (p == NULL)
+        CAMLreturn(Val_none);
+
+    if (p->callback == MILTER_EOM && milter_wd_interval > 0)
+        budget = milter_wd_limit;
+    else
+        budget = milter_mta_timeout;
+    if (budget == 0)
+        CAMLreturn(Val_none);
+
+    gettimeofday(&tv, NULL);
+    res = caml_alloc(1, 0);
+    Store_field(res, 0,
+                caml_copy_double(tv.tv_sec + tv.tv_usec / 1e6
+                                 + (p->started + budget - milter_now()) / 1e9));
+
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_connections(value unit)
+{
+    CAMLparam1(unit);
+    int n;
+
+    pthread_mutex_lock(&milter_conn_mutex);
+    n = milter_conn_count;
+    pthread_mutex_unlock(&milter_conn_mutex);
+
+    CAMLreturn(Val_int(n));
+}
+
+CAMLprim value
+caml_milter_drain(value unit)
+{
+    CAMLparam1(unit);
+
+    caml_release_runtime_system();
+    pthread_mutex_lock(&milter_conn_mutex);
+    while (milter_conn_count > 0)
+        pthread_cond_wait(&milter_conn_cond, &milter_conn_mutex);
+    pthread_mutex_unlock(&milter_conn_mutex);
+    caml_acquire_runtime_system();
+
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim value
 caml_milter_getsymval(value ctx_val, value sym_val)
 {
@@ -755,70 +1988,43 @@ caml_milter_getsymval(value ctx_val, value sym_val)
     CAMLreturn(res);
 }
 
-struct milter_priv {
-    value v;
-};
-
 CAMLprim value
 caml_milter_getpriv(value ctx_val)
 {
     CAMLparam1(ctx_val);
-    CAMLlocal1(res);
     SMFICTX *ctx = (SMFICTX *)ctx_val;
     struct milter_priv *p;
 
     p = smfi_getpriv(ctx);
     if (p == NULL)
-        return Val_none;
+        CAMLreturn(Val_none);
 
-    res = caml_alloc(1, 0);
-    Store_field(res, 0, p->v);
-
-    CAMLreturn(res);
+    CAMLreturn(p->v);
 }
 
 CAMLprim value
-caml_milter_setpriv(value ctx_val, value priv_opt)
+caml_milter_setpriv(value ctx_val, value priv_opt, value size_val)
 {
-    CAMLparam2(ctx_val, priv_opt);
-    CAMLlocal1(priv);
-    int ret, new_root;
+    CAMLparam3(ctx_val, priv_opt, size_val);
     SMFICTX *ctx = (SMFICTX *)ctx_val;
     struct milter_priv *p;
 
-    p = smfi_getpriv(ctx);
+    p = milter_priv_get(ctx);
+    if (p == NULL)
+        milter_error("Milter.setpriv");
 
-    if (priv_opt == Val_none) {
-        if (p != NULL) {
+    if (Is_block(p->v)) {
+        if (priv_opt == Val_none) {
             caml_remove_generational_global_root(&(p->v));
-            caml_stat_free(p);
-            ret = smfi_setpriv(ctx, NULL);
-            if (ret == MI_FAILURE)
-                milter_error("Milter.setpriv");
+            p->v = Val_none;
+        } else {
+            caml_modify_generational_global_root(&(p->v), priv_opt);
         }
-        CAMLreturn(Val_unit);
-    }
-
-    priv = Some_val(priv_opt);
-
-    if (p == NULL) {
-        p = caml_stat_alloc(sizeof(*p));
-        p->v = priv;
+    } else if (priv_opt != Val_none) {
+        p->v = priv_opt;
         caml_register_generational_global_root(&(p->v));
-        new_root = 1;
-    } else {
-        caml_modify_generational_global_root(&(p->v), priv);
-        new_root = 0;
-    }
-
-    ret = smfi_setpriv(ctx, p);
-    if (ret == MI_FAILURE) {
-        if (new_root) {
-            caml_stat_free(p);
-            caml_remove_generational_global_root(&(p->v));
-        }
-        milter_error("Milter.setpriv");
     }
+    milter_mem_priv(p, Long_val(size_val));
 
     CAMLreturn(Val_unit);
 }
@@ -925,7 +2131,9 @@ caml_milter_addheader(value ctx_val, value headerf_val, value headerv_val)
     char *headerv = strdup(String_val(headerv_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_addheader(ctx, headerf, headerv);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(headerf);
@@ -951,7 +2159,9 @@ caml_milter_chgheader(value ctx_val,
                   : strdup(String_val(headerv_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_chgheader(ctx, headerf, idx, headerv);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(headerf);
@@ -976,7 +2186,9 @@ caml_milter_insheader(value ctx_val, value idx_val,
     char *headerv = strdup(String_val(headerv_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_insheader(ctx, idx, headerf, headerv);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(headerf);
@@ -1000,7 +2212,9 @@ caml_milter_chgfrom(value ctx_val, value mail_val, value args_val)
                : strdup(String_val(Some_val(args_val)));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_chgfrom(ctx, mail, args);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(mail);
@@ -1022,7 +2236,9 @@ caml_milter_addrcpt(value ctx_val, value rcpt_val)
     char *rcpt = strdup(String_val(rcpt_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_addrcpt(ctx, rcpt);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(rcpt);
@@ -1045,7 +2261,9 @@ caml_milter_addrcpt_par(value ctx_val, value rcpt_val, value args_val)
                : strdup(String_val(Some_val(args_val)));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_addrcpt_par(ctx, rcpt, args);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(rcpt);
@@ -1067,7 +2285,9 @@ caml_milter_delrcpt(value ctx_val, value rcpt_val)
     char *rcpt = strdup(String_val(rcpt_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_delrcpt(ctx, rcpt);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(rcpt);
@@ -1083,14 +2303,18 @@ caml_milter_replacebody(value ctx_val, value body_val)
 {
     CAMLparam2(ctx_val, body_val);
     int ret;
-    int len = caml_ba_byte_size(Caml_ba_array_val(body_val));
+    int len = caml_string_length(body_val);
     SMFICTX *ctx = (SMFICTX *)ctx_val;
     unsigned char *body = malloc(len);
 
-    memcpy(body, Caml_ba_data_val(body_val), len);
+    if (body == NULL && len > 0)
+        milter_error("Milter.replacebody");
+    memcpy(body, Bytes_val(body_val), len);
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_replacebody(ctx, body, len);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(body);
@@ -1109,7 +2333,9 @@ caml_milter_progress(value ctx_val)
     SMFICTX *ctx = (SMFICTX *)ctx_val;
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_progress(ctx);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
     if (ret == MI_FAILURE)
         milter_error("Milter.progress");
@@ -1126,7 +2352,9 @@ caml_milter_quarantine(value ctx_val, value reason_val)
     char *reason = strdup(String_val(reason_val));
 
     caml_release_runtime_system();
+    milter_io_lock(ctx);
     ret = smfi_quarantine(ctx, reason);
+    milter_io_unlock(ctx);
     caml_acquire_runtime_system();
 
     free(reason);
@@ -0,0 +1,386 @@
+#ifndef MILTER_STUBS_H
+#define MILTER_STUBS_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+
+#define Some_val(v)    Field(v, 0)
+#define Val_none       Val_int(0)
+
+enum milter_callback {
+    MILTER_CONNECT,
+    MILTER_HELO,
+    MILTER_ENVFROM,
+    MILTER_ENVRCPT,
+    MILTER_HEADER,
+    MILTER_EOH,
+    MILTER_BODY,
+    MILTER_EOM,
+    MILTER_ABORT,
+    MILTER_CLOSE,
+    MILTER_UNKNOWN,
+    MILTER_DATA,
+    MILTER_NEGOTIATE,
+};
+
+struct milter_dnsbl;
+struct milter_trace;
+struct milter_tap;
+struct milter_headers;
+struct milter_bodyhash;
+struct milter_scan;
+struct milter_envelope;
+struct milter_bayes;
+struct milter_view;
+struct milter_spf;
+struct milter_urls;
+struct milter_dkim;
+
+/*
+ * Per-connection state, stored as libmilter's private data pointer. It is
+ * created on the first callback of a connection and released in
+ * milter_close(). The OCaml value set through Milter.setpriv is kept in
+ * the v field as an option.
+ */
+struct milter_priv {
+    value v;
+    SMFICTX *ctx;
+    uint64_t id;
+    int rejected;
+
+    /* The callback being run, when libmilter called it and how long it
+     * waited for the runtime lock. */
+    enum milter_callback callback;
+    int64_t started;
+    int64_t lock_wait;
+
+    /* Serializes writes to the MTA between the callback thread and the
+     * watchdog thread. */
+    pthread_mutex_t io;
+
+    /* Watchdog list links, time of the last progress report and whether
+     * the watchdog is sending one outside the list mutex. */
+    struct milter_priv *wd_next;
+    struct milter_priv *wd_prev;
+    int64_t wd_progress;
+    int wd_active;
+    int wd_busy;
+
+    /* DNSBL queries started for this connection. */
+    struct milter_dnsbl *dnsbl;
+
+    /* Trace events, if the connection was sampled. */
+    struct milter_trace *trace;
+
+    /* Message being rebuilt by the tap. */
+    struct milter_tap *tap;
+
+    /* Header fields of the current message, if the store is enabled. */
+    struct milter_headers *headers;
+
+    /* Hash of the current message body, if the body cache is enabled. */
+    struct milter_bodyhash *bodyhash;
+
+    /* MIME parser state and attachments sent to the scanner. */
+    struct milter_scan *scan;
+
+    /* Parsed sender and current recipient, if the parser is enabled. */
+    struct milter_envelope *envelope;
+
+    /* Tokens of the current message, if the classifier is enabled. */
+    struct milter_bayes *bayes;
+
+    /* Chunk being passed to the body callback, and the views and retained
+     * copies taken from it. */
+    const unsigned char *chunk;
+    size_t chunk_len;
+    struct milter_view *view;
+
+    /* Client address and SPF evaluation of the sender, if enabled. */
+    struct milter_spf *spf;
+
+    /* URLs found in the current message, if extraction is enabled. */
+    struct milter_urls *urls;
+
+    /* Body hash and signed headers of the current message, if signing is
+     * enabled. */
+    struct milter_dkim *dkim;
+
+    /* Memory charged to the connection, in bytes: native buffers, data
+     * handed to OCaml during the current message and the setpriv value,
+     * and their sum as last added to the global total. */
+    int64_t mem_native;
+    int64_t mem_copied;
+    int64_t mem_priv;
+    int64_t mem_counted;
+    int64_t mem_peak;
+    int mem_refused;
+};
+
+/* milter_stubs.c */
+
+value Val_some(value v);
+CAMLnoreturn_start
+void milter_error(const char *err)
+CAMLnoreturn_end;
+
+/* Monotonic time in nanoseconds. */
+int64_t milter_now(void);
+
+/* Does not require the runtime lock. */
+struct milter_priv *milter_priv_get(SMFICTX *ctx);
+
+/* milter_dns.c */
+
+#define MILTER_DNS_A     1
+#define MILTER_DNS_PTR   12
+#define MILTER_DNS_MX    15
+#define MILTER_DNS_TXT   16
+#define MILTER_DNS_AAAA  28
+
+/* rcode of queries that got no answer. */
+#define MILTER_DNS_TIMEOUT (-1)
+
+struct milter_dns_rr {
+    struct milter_dns_rr *next;
+    size_t len;
+    unsigned char data[];
+};
+
+/*
+ * A DNS query and, once done, its cached answer. Queries are shared
+ * between all callers asking for the same name and type while they are
+ * in flight or cached. The state, rcode and answers fields may only be
+ * read with milter_dns_lock() held or after milter_dns_done() returned
+ * true; answers never change once the query is done.
+ */
+struct milter_dns {
+    char *name;
+    int type;
+    int done;
+    int rcode;
+    struct milter_dns_rr *answers;
+
+    /* Private to milter_dns.c. */
+    uint32_t hash;
+    int refs;
+    int cached;
+    int64_t expires;
+    uint16_t id;
+    int sock;
+    int tries;
+    int64_t sent;
+    struct milter_dns *hnext;
+    struct milter_dns *pnext;
+    struct milter_dns *pprev;
+};
+
+void milter_dns_lock(void);
+void milter_dns_unlock(void);
+
+/* Starts a query or returns a shared one. Returns NULL if the name is
+ * invalid, memory is exhausted or nearly all query ids are in use. */
+struct milter_dns *milter_dns_lookup(const char *name, int type);
+int milter_dns_done(struct milter_dns *q);
+/* When the answer of a done query expires, as per milter_now(). */
+int64_t milter_dns_expires(struct milter_dns *q);
+void milter_dns_release(struct milter_dns *q);
+
+/* Blocks until ready(arg) returns true or deadline (as per milter_now())
+ * passes. ready is called with milter_dns_lock() held, and again after
+ * every query that completes. */
+void milter_dns_wait(int (*ready)(void *), void *arg, int64_t deadline);
+
+/* milter_shm.c */
+
+struct milter_shm_header {
+    uint32_t magic;
+    uint32_t slot_size;
+    uint64_t nslots;
+    int64_t created;
+    uint64_t reserved[5];
+};
+
+/* Maps a shared table, creating it if needed. The number of slots is
+ * rounded up to a power of two; existing tables keep their size. Slots
+ * follow the header and are zero-filled on creation. */
+struct milter_shm_header *milter_shm_map(const char *path, uint32_t magic,
+                                         uint64_t nslots, uint32_t slot_size,
+                                         size_t *len);
+uint64_t milter_hash64(const void *data, size_t len);
+
+/* Wall-clock time in milliseconds, comparable between processes. */
+int64_t milter_clock_ms(void);
+
+/* Files built under a temporary name and renamed over another: gives the
+ * temporary file, which mkstemp() creates 0600, the mode of the file it
+ * replaces or 0644, and makes the rename durable by syncing the directory
+ * of path. */
+int milter_file_mode(int fd, const char *path);
+int milter_fsync_dir(const char *path);
+
+/* milter_log.c */
+
+#define MILTER_LOG_DEBUG   0
+#define MILTER_LOG_INFO    1
+#define MILTER_LOG_NOTICE  2
+#define MILTER_LOG_WARNING 3
+#define MILTER_LOG_ERROR   4
+
+int milter_log_enabled(int level);
+
+/* Never blocks; p may be NULL for messages not tied to a connection. */
+void milter_log(int level, struct milter_priv *p, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* milter_trace.c */
+
+/* Returns NULL unless tracing is on and the connection is sampled. */
+struct milter_trace *milter_trace_start(void);
+void milter_trace_span(struct milter_priv *p, size_t size, sfsistat stat);
+void milter_trace_finish(struct milter_priv *p);
+
+/* milter_tap.c */
+
+int milter_tap_enabled(void);
+void milter_tap_envfrom(SMFICTX *ctx, char **argv);
+void milter_tap_envrcpt(SMFICTX *ctx, char **argv);
+void milter_tap_header(SMFICTX *ctx, const char *name, const char *v);
+void milter_tap_body(SMFICTX *ctx, const unsigned char *data, size_t len);
+void milter_tap_eom(SMFICTX *ctx);
+void milter_tap_abort(SMFICTX *ctx);
+void milter_tap_free(struct milter_priv *p);
+size_t milter_tap_memory(const struct milter_priv *p);
+/* Bytes of rebuilt messages waiting for the writer. */
+size_t milter_tap_queued(void);
+
+/* milter_headers.c */
+
+int milter_headers_enabled(void);
+void milter_headers_reset(SMFICTX *ctx);
+void milter_headers_add(SMFICTX *ctx, const char *name, const char *value);
+void milter_headers_free(struct milter_priv *p);
+size_t milter_headers_memory(const struct milter_priv *p);
+
+/* milter_bodycache.c */
+
+int milter_bodycache_enabled(void);
+int milter_bodycache_shortcircuit(void);
+void milter_bodycache_reset(SMFICTX *ctx);
+void milter_bodycache_body(SMFICTX *ctx, const unsigned char *data,
+                           size_t len);
+/* Returns the cached verdict as an index into Milter.stat, or -1. */
+int milter_bodycache_lookup(SMFICTX *ctx);
+void milter_bodycache_free(struct milter_priv *p);
+size_t milter_bodycache_memory(const struct milter_priv *p);
+
+/* milter_scan.c */
+
+int milter_scan_enabled(void);
+void milter_scan_reset(SMFICTX *ctx);
+void milter_scan_header(SMFICTX *ctx, const char *name, const char *v);
+void milter_scan_body(SMFICTX *ctx, const unsigned char *data, size_t len);
+void milter_scan_eom(SMFICTX *ctx);
+void milter_scan_free(struct milter_priv *p);
+size_t milter_scan_memory(const struct milter_priv *p);
+
+/* milter_envelope.c */
+
+int milter_envelope_enabled(void);
+void milter_envelope_envfrom(SMFICTX *ctx, char **argv);
+void milter_envelope_envrcpt(SMFICTX *ctx, char **argv);
+void milter_envelope_free(struct milter_priv *p);
+size_t milter_envelope_memory(const struct milter_priv *p);
+
+/* milter_bayes.c */
+
+int milter_bayes_enabled(void);
+void milter_bayes_reset(SMFICTX *ctx);
+void milter_bayes_body(SMFICTX *ctx, const unsigned char *data, size_t len);
+/* Scores the message; does not require the runtime lock. */
+void milter_bayes_eom(SMFICTX *ctx);
+void milter_bayes_free(struct milter_priv *p);
+size_t milter_bayes_memory(const struct milter_priv *p);
+
+/* milter_pool.c */
+
+/* A callback handed to the worker pool by a libmilter thread. */
+struct milter_job {
+    sfsistat (*fn)(struct milter_job *);
+    SMFICTX *ctx;
+    void *arg[4];
+    unsigned long n[4];
+
+    /* Private to milter_pool.c. */
+    sfsistat ret;
+    int64_t queued;
+    sem_t done;
+    struct milter_job *next;
+};
+
+/* When the job was queued, on a worker running one; zero otherwise. */
+extern __thread int64_t milter_pool_queued_at;
+
+int milter_pool_enabled(void);
+/* Runs j->fn on a worker and returns its result. */
+sfsistat milter_pool_run(struct milter_job *j);
+
+/* milter_mem.c */
+
+/* Brings the connection's charge up to date; returns -1 if it or the
+ * process is over its limit. */
+int milter_mem_check(SMFICTX *ctx);
+void milter_mem_message(SMFICTX *ctx);
+void milter_mem_copied(struct milter_priv *p, size_t n);
+void milter_mem_priv(struct milter_priv *p, size_t size);
+void milter_mem_release(struct milter_priv *p);
+
+/* milter_view.c */
+
+void milter_view_enter(SMFICTX *ctx, const unsigned char *data, size_t len);
+void milter_view_leave(SMFICTX *ctx);
+void milter_view_reset(SMFICTX *ctx);
+void milter_view_free(struct milter_priv *p);
+size_t milter_view_memory(const struct milter_priv *p);
+
+/* milter_dnsbl.c */
+
+void milter_dnsbl_start(struct milter_priv *p, const _SOCK_ADDR *sa,
+                        const char *host);
+void milter_dnsbl_free(struct milter_priv *p);
+
+/* milter_spf.c */
+
+int milter_spf_enabled(void);
+void milter_spf_connect(struct milter_priv *p, const _SOCK_ADDR *sa);
+void milter_spf_helo(SMFICTX *ctx, const char *helo);
+void milter_spf_envfrom(SMFICTX *ctx, char **argv);
+void milter_spf_free(struct milter_priv *p);
+size_t milter_spf_memory(const struct milter_priv *p);
+
+/* milter_urls.c */
+
+int milter_urls_enabled(void);
+void milter_urls_reset(SMFICTX *ctx);
+void milter_urls_header(SMFICTX *ctx, const char *name, const char *v);
+void milter_urls_body(SMFICTX *ctx, const unsigned char *data, size_t len);
+void milter_urls_eom(SMFICTX *ctx);
+void milter_urls_free(struct milter_priv *p);
+size_t milter_urls_memory(const struct milter_priv *p);
+
+/* milter_dkim.c */
+
+int milter_dkim_enabled(void);
+void milter_dkim_reset(SMFICTX *ctx);
+void milter_dkim_header(SMFICTX *ctx, const char *name, const char *v);
+void milter_dkim_body(SMFICTX *ctx, const unsigned char *data, size_t len);
+void milter_dkim_free(struct milter_priv *p);
+size_t milter_dkim_memory(const struct milter_priv *p);
+
+#endif
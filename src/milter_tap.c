@@ -0,0 +1,511 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/callback.h>
+#include <caml/memory.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Message tap. When enabled, each message is rebuilt in C from the
+ * envelope, header and body callbacks, without the runtime lock, and
+ * queued at eom. A writer thread writes the queued messages to the spool
+ * directory in batches: every file of a batch is written and synced under
+ * a temporary name, then renamed, and the directory is synced once for
+ * the whole batch. Only then is the OCaml notification function called
+ * with the path of each file.
+ *
+ * The spool file starts with the envelope as X-Envelope-From,
+ * X-Envelope-To and X-Envelope-Macro header fields, followed by the
+ * message with CRLF line endings.
+ */
+
+#define TAP_MAX_QUEUED (256 * 1024 * 1024)  /* Bytes waiting to be written. */
+#define TAP_MAX_BATCH  64
+
+struct tap_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct milter_tap {
+    struct milter_tap *next;    /* In the write queue. */
+    char name[64];
+    struct tap_buf env;
+    struct tap_buf head;
+    struct tap_buf body;
+    unsigned messages;
+    int active;
+    int failed;
+};
+
+static int tap_enabled = 0;
+static int tap_dirfd = -1;
+static char *tap_dir = NULL;
+static char **tap_macros = NULL;
+static value tap_notify = Val_unit;
+static long tap_dropped = 0;
+
+static pthread_mutex_t tap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tap_cond = PTHREAD_COND_INITIALIZER;
+static struct milter_tap *tap_head = NULL;
+static struct milter_tap **tap_tail = &tap_head;
+static size_t tap_queued = 0;
+
+int
+milter_tap_enabled(void)
+{
+    return tap_enabled;
+}
+
+static int
+tap_reserve(struct tap_buf *b, size_t n)
+{
+    char *data;
+    size_t size;
+
+    if (b->len + n <= b->size)
+        return 0;
+    size = b->size == 0 ? 4096 : b->size;
+    while (size < b->len + n)
+        size *= 2;
+    data = realloc(b->data, size);
+    if (data == NULL)
+        return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+static void
+tap_append(struct milter_tap *t, struct tap_buf *b, const char *s, size_t n)
+{
+    if (t->failed)
+        return;
+    if (tap_reserve(b, n) == -1) {
+        t->failed = 1;
+        return;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void
+tap_puts(struct milter_tap *t, struct tap_buf *b, const char *s)
+{
+    tap_append(t, b, s, strlen(s));
+}
+
+/* Appends s with bare LFs turned into CRLFs. */
+static void
+tap_append_crlf(struct milter_tap *t, struct tap_buf *b, const char *s)
+{
+    const char *nl;
+
+    while ((nl = strchr(s, '\n')) != NULL) {
+        if (nl > s && nl[-1] == '\r')
+            tap_append(t, b, s, nl - s + 1);
+        else {
+            tap_append(t, b, s, nl - s);
+            tap_append(t, b, "\r\n", 2);
+        }
+        s = nl + 1;
+    }
+    tap_puts(t, b, s);
+}
+
+static void
+tap_buf_free(struct tap_buf *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+static void
+tap_free(struct milter_tap *t)
+{
+    tap_buf_free(&t->env);
+    tap_buf_free(&t->head);
+    tap_buf_free(&t->body);
+    free(t);
+}
+
+static struct milter_tap *
+tap_get(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+
+    if (!tap_enabled)
+        return NULL;
+    p = milter_priv_get(ctx);
+    if (p == NULL)
+        return NULL;
+    if (p->tap == NULL)
+        p->tap = calloc(1, sizeof(*p->tap));
+    return p->tap;
+}
+
+static void
+tap_reset(struct milter_tap *t)
+{
+    t->env.len = t->head.len = t->body.len = 0;
+    t->active = 0;
+    t->failed = 0;
+}
+
+static void
+tap_envelope(struct milter_tap *t, const char *field, char **argv)
+{
+    tap_puts(t, &t->env, field);
+    tap_puts(t, &t->env, argv[0]);
+    for (argv++; *argv != NULL; argv++) {
+        tap_append(t, &t->env, " ", 1);
+        tap_puts(t, &t->env, *argv);
+    }
+    tap_append(t, &t->env, "\r\n", 2);
+}
+
+void
+milter_tap_envfrom(SMFICTX *ctx, char **argv)
+{
+    struct milter_tap *t = tap_get(ctx);
+
+    if (t == NULL)
+        return;
+    tap_reset(t);
+    t->active = 1;
+    tap_envelope(t, "X-Envelope-From: ", argv);
+}
+
+void
+milter_tap_envrcpt(SMFICTX *ctx, char **argv)
+{
+    struct milter_tap *t = tap_get(ctx);
+
+    if (t != NULL && t->active)
+        tap_envelope(t, "X-Envelope-To: ", argv);
+}
+
+void
+milter_tap_header(SMFICTX *ctx, const char *name, const char *v)
+{
+    struct milter_tap *t = tap_get(ctx);
+
+    if (t == NULL || !t->active)
+        return;
+    tap_puts(t, &t->head, name);
+    /* The leading space is kept when SMFIP_HDR_LEADSPC was negotiated. */
+    if (*v == ' ' || *v == '\t')
+        tap_append(t, &t->head, ":", 1);
+    else
+        tap_append(t, &t->head, ": ", 2);
+    tap_append_crlf(t, &t->head, v);
+    tap_append(t, &t->head, "\r\n", 2);
+}
+
+void
+milter_tap_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    struct milter_tap *t = tap_get(ctx);
+
+    if (t != NULL && t->active)
+        tap_append(t, &t->body, (const char *)data, len);
+}
+
+void
+milter_tap_abort(SMFICTX *ctx)
+{
+    struct milter_tap *t = tap_get(ctx);
+
+    if (t != NULL)
+        tap_reset(t);
+}
+
+/* Hands the message over to the writer thread. */
+void
+milter_tap_eom(SMFICTX *ctx)
+{
+    char **m, *v;
+    size_t size;
+    struct milter_priv *p;
+    struct milter_tap *t, *q;
+
+    t = tap_get(ctx);
+    if (t == NULL || !t->active)
+        return;
+
+    for (m = tap_macros; *m != NULL; m++) {
+        v = smfi_getsymval(ctx, *m);
+        if (v == NULL)
+            continue;
+        tap_puts(t, &t->env, "X-Envelope-Macro: ");
+        tap_puts(t, &t->env, *m);
+        tap_append(t, &t->env, "=", 1);
+        tap_puts(t, &t->env, v);
+        tap_append(t, &t->env, "\r\n", 2);
+    }
+
+    p = smfi_getpriv(ctx);
+    q = calloc(1, sizeof(*q));
+    size = t->env.len + t->head.len + t->body.len;
+    if (q == NULL || t->failed) {
+        free(q);
+        tap_reset(t);
+        __atomic_add_fetch(&tap_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pthread_mutex_lock(&tap_mutex);
+    if (tap_queued + size > TAP_MAX_QUEUED) {
+        pthread_mutex_unlock(&tap_mutex);
+        free(q);
+        tap_reset(t);
+        __atomic_add_fetch(&tap_dropped, 1, __ATOMIC_RELAXED);
+        milter_log(MILTER_LOG_WARNING, p, "tap: spool queue full");
+        return;
+    }
+    tap_queued += size;
+    pthread_mutex_unlock(&tap_mutex);
+
+    /* The buffers move to the queue; the connection starts afresh. */
+    snprintf(t->name, sizeof(t->name), "%lld.%d.%llu.%u",
+             (long long)milter_clock_ms(), (int)getpid(),
+             (unsigned long long)p->id, t->messages + 1);
+    *q = *t;
+    memset(&t->env, 0, sizeof(t->env));
+    memset(&t->head, 0, sizeof(t->head));
+    memset(&t->body, 0, sizeof(t->body));
+    t->messages++;
+    tap_reset(t);
+
+    pthread_mutex_lock(&tap_mutex);
+    q->next = NULL;
+    *tap_tail = q;
+    tap_tail = &q->next;
+    pthread_cond_signal(&tap_cond);
+    pthread_mutex_unlock(&tap_mutex);
+}
+
+void
+milter_tap_free(struct milter_priv *p)
+{
+    if (p->tap != NULL) {
+        tap_free(p->tap);
+        p->tap = NULL;
+    }
+}
+
+size_t
+milter_tap_memory(const struct milter_priv *p)
+{
+    const struct milter_tap *t = p->tap;
+
+    if (t == NULL)
+        return 0;
+    return sizeof(*t) + t->env.size + t->head.size + t->body.size;
+}
+
+size_t
+milter_tap_queued(void)
+{
+    return __atomic_load_n(&tap_queued, __ATOMIC_RELAXED);
+}
+
+/* Writer thread. */
+
+static int
+tap_writev(int fd, struct iovec *iov, int n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = writev(fd, iov, n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+static int
+tap_write(struct milter_tap *t, const char *tmp)
+{
+    int fd, ret;
+    struct iovec iov[4];
+
+    fd = openat(tap_dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                0600);
+    if (fd == -1)
+        return -1;
+
+    iov[0].iov_base = t->env.data;
+    iov[0].iov_len = t->env.len;
+    iov[1].iov_base = t->head.data;
+    iov[1].iov_len = t->head.len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    iov[3].iov_base = t->body.data;
+    iov[3].iov_len = t->body.len;
+
+    ret = tap_writev(fd, iov, 4);
+    if (ret == 0)
+        ret = fdatasync(fd);
+    close(fd);
+    return ret;
+}
+
+static void *
+tap_writer(void *arg)
+{
+    int i, n, err;
+    char tmp[80];
+    size_t size;
+    value path, res;
+    struct milter_tap *batch[TAP_MAX_BATCH];
+    int ok[TAP_MAX_BATCH];
+
+    caml_c_thread_register();
+
+    for (;;) {
+        pthread_mutex_lock(&tap_mutex);
+        while (tap_head == NULL)
+            pthread_cond_wait(&tap_cond, &tap_mutex);
+        for (n = 0; n < TAP_MAX_BATCH && tap_head != NULL; n++) {
+            batch[n] = tap_head;
+            tap_head = tap_head->next;
+        }
+        if (tap_head == NULL)
+            tap_tail = &tap_head;
+        pthread_mutex_unlock(&tap_mutex);
+
+        size = 0;
+        for (i = 0; i < n; i++) {
+            snprintf(tmp, sizeof(tmp), ".%s.tmp", batch[i]->name);
+            ok[i] = tap_write(batch[i], tmp) == 0
+                 && renameat(tap_dirfd, tmp, tap_dirfd, batch[i]->name) == 0;
+            if (!ok[i]) {
+                err = errno;
+                unlinkat(tap_dirfd, tmp, 0);
+                milter_log(MILTER_LOG_ERROR, NULL, "tap: %s: %s",
+                           batch[i]->name, strerror(err));
+                __atomic_add_fetch(&tap_dropped, 1, __ATOMIC_RELAXED);
+            }
+            size += batch[i]->env.len + batch[i]->head.len
+                  + batch[i]->body.len;
+        }
+        fsync(tap_dirfd);
+
+        pthread_mutex_lock(&tap_mutex);
+        tap_queued -= size;
+        pthread_mutex_unlock(&tap_mutex);
+
+        caml_acquire_runtime_system();
+        for (i = 0; i < n; i++) {
+            if (ok[i]) {
+                snprintf(tmp, sizeof(tmp), "/%s", batch[i]->name);
+                path = caml_alloc_string(strlen(tap_dir) + strlen(tmp));
+                sprintf((char *)String_val(path), "%s%s", tap_dir, tmp);
+                res = caml_callback_exn(tap_notify, path);
+                if (Is_exception_result(res))
+                    milter_log(MILTER_LOG_ERROR, NULL,
+                               "tap: notification raised an exception");
+            }
+        }
+        caml_release_runtime_system();
+
+        for (i = 0; i < n; i++)
+            tap_free(batch[i]);
+    }
+
+    return NULL;
+}
+
+CAMLprim value
+caml_milter_tap_start(value dir_val, value macros_val, value notify_val)
+{
+    CAMLparam3(dir_val, macros_val, notify_val);
+    CAMLlocal1(l);
+    int fd, ok;
+    size_t i, n;
+    char **macros, *dir;
+    pthread_t thread;
+
+    if (tap_enabled)
+        milter_error("Milter.Tap.start");
+
+    fd = open(String_val(dir_val), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        milter_error("Milter.Tap.start");
+
+    n = 0;
+    for (l = macros_val; l != Val_emptylist; l = Field(l, 1))
+        n++;
+    macros = calloc(n + 1, sizeof(char *));
+    dir = strdup(String_val(dir_val));
+    ok = macros != NULL && dir != NULL;
+    for (i = 0, l = macros_val; ok && l != Val_emptylist;
+         l = Field(l, 1), i++)
+        ok = (macros[i] = strdup(String_val(Field(l, 0)))) != NULL;
+    if (!ok) {
+        for (i = 0; macros != NULL && macros[i] != NULL; i++)
+            free(macros[i]);
+        free(macros);
+        free(dir);
+        close(fd);
+        milter_error("Milter.Tap.start");
+    }
+
+    tap_macros = macros;
+    tap_dir = dir;
+    tap_dirfd = fd;
+    tap_notify = notify_val;
+    caml_register_generational_global_root(&tap_notify);
+
+    if (pthread_create(&thread, NULL, tap_writer, NULL) != 0) {
+        caml_remove_generational_global_root(&tap_notify);
+        tap_notify = Val_unit;
+        for (i = 0; macros[i] != NULL; i++)
+            free(macros[i]);
+        free(macros);
+        free(dir);
+        close(fd);
+        tap_macros = NULL;
+        tap_dir = NULL;
+        tap_dirfd = -1;
+        milter_error("Milter.Tap.start");
+    }
+    pthread_detach(thread);
+    tap_enabled = 1;
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_tap_dropped(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&tap_dropped, __ATOMIC_RELAXED)));
+}
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/signals.h>
+#include <caml/threads.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Connection tracing in the Fuchsia trace format, which Perfetto and
+ * chrome://tracing read. Sampled connections record a complete duration
+ * event per callback into a buffer of their own; the buffer is queued when
+ * the connection closes and a background thread appends it to the trace
+ * file. Each connection is shown as a thread of the filter process, with
+ * a span for the connection, one per message and one per callback nested
+ * in them. Callbacks that return without running OCaml code, because
+ * the filter has no function for them, are recorded as well.
+ *
+ * All strings are interned once at the start of the file, so an event
+ * takes ten words.
+ */
+
+#define FXT_MAGIC            0x0016547846040010ULL
+#define FXT_INIT             1
+#define FXT_STRING           2
+#define FXT_EVENT            4
+#define FXT_DURATION         4
+#define FXT_ARG_UINT64       4
+#define FXT_ARG_STRING       6
+
+#define TRACE_MAX_WORDS      32768  /* Per connection. */
+#define TRACE_MAX_QUEUED     1024   /* Buffers waiting to be written. */
+
+enum trace_string {
+    TS_CATEGORY = 1,
+    TS_CONNECTION,
+    TS_MESSAGE,
+    TS_CALLBACKS,
+    TS_CONN = TS_CALLBACKS + MILTER_NEGOTIATE + 1,
+    TS_LOCK_WAIT,
+    TS_SIZE,
+    TS_STAT,
+    TS_STATS,
+};
+
+static const char *trace_callbacks[] = {
+    "connect", "helo", "envfrom", "envrcpt", "header", "eoh", "body",
+    "eom", "abort", "close", "unknown", "data", "negotiate",
+};
+
+static const char *trace_args[] = {
+    "conn", "lock_wait", "size", "stat",
+};
+
+static const struct {
+    sfsistat stat;
+    const char *name;
+} trace_stats[] = {
+    { SMFIS_CONTINUE, "continue" },
+    { SMFIS_REJECT,   "reject"   },
+    { SMFIS_DISCARD,  "discard"  },
+    { SMFIS_ACCEPT,   "accept"   },
+    { SMFIS_TEMPFAIL, "tempfail" },
+    { SMFIS_NOREPLY,  "noreply"  },
+    { SMFIS_SKIP,     "skip"     },
+    { SMFIS_ALL_OPTS, "all_opts" },
+};
+
+#define TRACE_NSTATS (sizeof(trace_stats) / sizeof(trace_stats[0]))
+
+struct milter_trace {
+    struct milter_trace *next;
+    int64_t started;
+    int64_t message;
+    size_t len;
+    size_t size;
+    uint64_t words[];
+};
+
+static int trace_fd = -1;
+static unsigned trace_sample = 0;
+static unsigned trace_count = 0;
+static long trace_dropped = 0;
+static uint64_t trace_pid;
+
+static pthread_mutex_t trace_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static struct milter_trace *trace_head = NULL;
+static struct milter_trace **trace_tail = &trace_head;
+static int trace_queued = 0;
+static int trace_started = 0;
+
+static int
+trace_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+    const char *p = buf;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static size_t
+trace_string_record(uint64_t *w, uint64_t index, const char *s)
+{
+    size_t len = strlen(s);
+    size_t n = (len + 7) / 8;
+
+    w[0] = FXT_STRING | (uint64_t)(n + 1) << 4 | index << 16
+         | (uint64_t)len << 32;
+    w[n] = 0;
+    memcpy(w + 1, s, len);
+    return n + 1;
+}
+
+/* Magic number, tick rate and string table. */
+static int
+trace_header(int fd)
+{
+    size_t i, n;
+    uint64_t w[256];
+
+    n = 0;
+    w[n++] = FXT_MAGIC;
+    w[n++] = FXT_INIT | 2 << 4;
+    w[n++] = 1000000000;
+
+    n += trace_string_record(w + n, TS_CATEGORY, "milter");
+    n += trace_string_record(w + n, TS_CONNECTION, "connection");
+    n += trace_string_record(w + n, TS_MESSAGE, "message");
+    for (i = 0; i <= MILTER_NEGOTIATE; i++)
+        n += trace_string_record(w + n, TS_CALLBACKS + i, trace_callbacks[i]);
+    for (i = 0; i < 4; i++)
+        n += trace_string_record(w + n, TS_CONN + i, trace_args[i]);
+    for (i = 0; i < TRACE_NSTATS; i++)
+        n += trace_string_record(w + n, TS_STATS + i, trace_stats[i].name);
+
+    return trace_write(fd, w, n * sizeof(w[0]));
+}
+
+static void *
+trace_writer(void *arg)
+{
+    struct milter_trace *t;
+
+    for (;;) {
+        pthread_mutex_lock(&trace_mutex);
+        while (trace_head == NULL)
+            pthread_cond_wait(&trace_cond, &trace_mutex);
+        t = trace_head;
+        trace_head = t->next;
+        if (trace_head == NULL)
+            trace_tail = &trace_head;
+        trace_queued--;
+        pthread_mutex_unlock(&trace_mutex);
+
+        pthread_mutex_lock(&trace_fd_mutex);
+        if (trace_fd != -1)
+            trace_write(trace_fd, t->words, t->len * sizeof(t->words[0]));
+        pthread_mutex_unlock(&trace_fd_mutex);
+        free(t);
+    }
+
+    return NULL;
+}
+
+struct milter_trace *
+milter_trace_start(void)
+{
+    unsigned sample, n;
+    struct milter_trace *t;
+
+    sample = __atomic_load_n(&trace_sample, __ATOMIC_RELAXED);
+    if (sample == 0)
+        return NULL;
+    n = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+    if (n % sample != 0)
+        return NULL;
+
+    t = malloc(sizeof(*t) + 256 * sizeof(t->words[0]));
+    if (t == NULL)
+        return NULL;
+    t->next = NULL;
+    t->started = milter_now();
+    t->message = 0;
+    t->len = 0;
+    t->size = 256;
+    return t;
+}
+
+static uint64_t *
+trace_reserve(struct milter_priv *p, size_t n)
+{
+    size_t size;
+    struct milter_trace *t = p->trace;
+
+    if (t->len + n > t->size) {
+        size = t->size * 2;
+        if (size > TRACE_MAX_WORDS)
+            return NULL;
+        t = realloc(t, sizeof(*t) + size * sizeof(t->words[0]));
+        if (t == NULL)
+            return NULL;
+        t->size = size;
+        p->trace = t;
+    }
+
+    t->len += n;
+    return t->words + t->len - n;
+}
+
+/* A complete duration event on the connection's thread. */
+static uint64_t *
+trace_event(struct milter_priv *p, uint64_t name, int nargs, int argwords,
+            int64_t start)
+{
+    uint64_t *w;
+    size_t n = 5 + argwords;   /* Header, start, pid, tid, args, end. */
+
+    w = trace_reserve(p, n);
+    if (w == NULL)
+        return NULL;
+
+    w[0] = FXT_EVENT | (uint64_t)n << 4 | (uint64_t)FXT_DURATION << 16
+         | (uint64_t)nargs << 20 | (uint64_t)TS_CATEGORY << 32 | name << 48;
+    w[1] = start;
+    w[2] = trace_pid;
+    w[3] = p->id;
+    return w + 4;
+}
+
+static uint64_t *
+trace_arg_uint64(uint64_t *w, uint64_t name, uint64_t v)
+{
+    w[0] = FXT_ARG_UINT64 | 2 << 4 | name << 16;
+    w[1] = v;
+    return w + 2;
+}
+
+void
+milter_trace_span(struct milter_priv *p, size_t size, sfsistat stat)
+{
+    size_t i;
+    int64_t now;
+    uint64_t *w;
+
+    now = milter_now();
+
+    for (i = 0; i < TRACE_NSTATS; i++)
+        if (trace_stats[i].stat == stat)
+            break;
+
+    w = trace_event(p, TS_CALLBACKS + p->callback, 3, 5, p->started);
+    if (w == NULL)
+        return;
+    w = trace_arg_uint64(w, TS_LOCK_WAIT, p->lock_wait);
+    w = trace_arg_uint64(w, TS_SIZE, size);
+    w[0] = FXT_ARG_STRING | 1 << 4 | (uint64_t)TS_STAT << 16
+         | (uint64_t)(i < TRACE_NSTATS ? TS_STATS + i : TS_STATS) << 32;
+    w[1] = now;
+
+    switch (p->callback) {
+    case MILTER_ENVFROM:
+        if (p->trace->message == 0)
+            p->trace->message = p->started;
+        break;
+    case MILTER_EOM:
+    case MILTER_ABORT:
+        if (p->trace->message != 0) {
+            w = trace_event(p, TS_MESSAGE, 0, 0, p->trace->message);
+            if (w != NULL)
+                w[0] = now;
+            p->trace->message = 0;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Closes the connection span and queues the buffer for writing. */
+void
+milter_trace_finish(struct milter_priv *p)
+{
+    uint64_t *w;
+    struct milter_trace *t;
+
+    w = trace_event(p, TS_CONNECTION, 1, 2, p->trace->started);
+    if (w != NULL) {
+        w = trace_arg_uint64(w, TS_CONN, p->id);
+        w[0] = milter_now();
+    }
+
+    t = p->trace;
+    p->trace = NULL;
+
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_queued < TRACE_MAX_QUEUED) {
+        t->next = NULL;
+        *trace_tail = t;
+        trace_tail = &t->next;
+        trace_queued++;
+        t = NULL;
+        pthread_cond_signal(&trace_cond);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (t != NULL) {
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+        free(t);
+    }
+}
+
+CAMLprim value
+caml_milter_trace_open(value path_val, value sample_val)
+{
+    CAMLparam2(path_val, sample_val);
+    int fd, err;
+    pthread_t thread;
+    char *path;
+
+    if (Int_val(sample_val) < 1)
+        caml_invalid_argument("Milter.Trace.openfile");
+
+    path = strdup(String_val(path_val));
+    if (path == NULL)
+        milter_error("Milter.Trace.openfile");
+
+    caml_release_runtime_system();
+    err = 0;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1 && trace_header(fd) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1) {
+        trace_pid = getpid();
+        pthread_mutex_lock(&trace_fd_mutex);
+        if (trace_fd != -1)
+            close(trace_fd);
+        trace_fd = fd;
+        pthread_mutex_unlock(&trace_fd_mutex);
+
+        pthread_mutex_lock(&trace_mutex);
+        if (!trace_started) {
+            if (pthread_create(&thread, NULL, trace_writer, NULL) == 0) {
+                pthread_detach(thread);
+                trace_started = 1;
+            } else {
+                err = 1;
+            }
+        }
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    caml_acquire_runtime_system();
+    free(path);
+
+    if (fd == -1 || err)
+        milter_error("Milter.Trace.openfile");
+
+    __atomic_store_n(&trace_sample, Int_val(sample_val), __ATOMIC_RELAXED);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_trace_stop(value unit)
+{
+    CAMLparam1(unit);
+    __atomic_store_n(&trace_sample, 0, __ATOMIC_RELAXED);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_trace_dropped(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(Val_long(__atomic_load_n(&trace_dropped, __ATOMIC_RELAXED)));
+}
@@ -0,0 +1,979 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * URL extraction. The body callback follows the MIME structure of the
+ * message just enough to find its text parts and their transfer
+ * encoding, decodes quoted-printable (joining soft line breaks) and
+ * base64 as the data streams in, and feeds the result to a scanner that
+ * recognizes URLs in plain text and HTML attributes alike. Since the
+ * scanner works a byte at a time, URLs may span chunks and encoded lines.
+ *
+ * Each URL is normalized when it ends: HTML entities are decoded, the
+ * user information and default port dropped, the host percent-decoded,
+ * lowercased and converted to its IDNA form, numeric IPv4 hosts written
+ * as dotted quads, and percent-escapes in the path reduced to their
+ * canonical form. The fragment is dropped. The message's URLs are kept
+ * in a set, in order of first appearance.
+ */
+
+#define URLS_LINE_MAX     1024
+#define URLS_BOUNDARY_MAX 72
+#define URLS_MAX_DEPTH    8
+#define URLS_URL_MAX      2048
+#define URLS_HOST_MAX     255
+
+enum urls_mode {
+    URLS_SKIP,
+    URLS_HEADERS,
+    URLS_BODY,
+};
+
+enum urls_encoding {
+    URLS_PLAIN,
+    URLS_QP,
+    URLS_BASE64,
+};
+
+struct urls_part {
+    char boundary[URLS_BOUNDARY_MAX + 1];
+    enum urls_encoding encoding;
+    int text;
+};
+
+struct urls_entry {
+    uint64_t hash;
+    char *url;
+    char *host;
+};
+
+struct milter_urls {
+    /* MIME structure. */
+    enum urls_mode mode;
+    int started;
+    char boundaries[URLS_MAX_DEPTH][URLS_BOUNDARY_MAX + 1];
+    int depth;
+    struct urls_part part;
+    char header[URLS_LINE_MAX];
+    size_t headerlen;
+    char line[URLS_LINE_MAX];
+    size_t linelen;
+    unsigned b64;
+    int b64n;
+
+    /* Scanner. */
+    char window[8];
+    char url[URLS_URL_MAX];
+    size_t urllen;
+    int capturing;
+    int overflow;
+
+    /* URLs found, and an index of their hashes. */
+    struct urls_entry *entries;
+    int nentries;
+    int aentries;
+    int *index;
+    int nindex;
+};
+
+static int urls_max = 0;
+
+int
+milter_urls_enabled(void)
+{
+    return urls_max > 0;
+}
+
+/* Normalization. */
+
+static int
+urls_hex(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decodes the entities found in HTML attributes. Numeric references of
+ * more than eight digits are left alone. */
+static size_t
+urls_entities(const char *in, size_t len, char *out)
+{
+    size_t i, j, k, o = 0, n, nlen;
+    int d, base;
+    long c;
+    static const struct { const char *name; char c; } named[] = {
+        { "amp;", '&' }, { "lt;", '<' }, { "gt;", '>' }, { "quot;", '"' },
+        { "apos;", '\'' }, { "sol;", '/' }, { "colon;", ':' },
+        { "period;", '.' }, { "quest;", '?' }, { "equals;", '=' },
+    };
+
+    for (i = 0; i < len; i++) {
+        out[o] = in[i];
+        if (in[i] != '&')
+            goto next;
+        if (i + 2 < len && in[i + 1] == '#') {
+            j = i + 2;
+            base = 10;
+            if (in[j] == 'x' || in[j] == 'X') {
+                j++;
+                base = 16;
+            }
+            for (c = 0, k = j; k < len && k - j < 8; k++) {
+                d = urls_hex(in[k]);
+                if (d == -1 || d >= base)
+                    break;
+                c = c * base + d;
+            }
+            if (k > j && k < len && in[k] == ';' && c > 0x20 && c < 0x7f) {
+                out[o] = c;
+                i = k;
+            }
+            goto next;
+        }
+        for (n = 0; n < sizeof(named) / sizeof(named[0]); n++) {
+            nlen = strlen(named[n].name);
+            if (i + 1 + nlen <= len
+                    && strncasecmp(in + i + 1, named[n].name, nlen) == 0) {
+                out[o] = named[n].c;
+                i += nlen;
+                break;
+            }
+        }
+    next:
+        o++;
+    }
+    out[o] = '\0';
+    return o;
+}
+
+static char
+urls_digit(uint32_t d)
+{
+    return d < 26 ? 'a' + d : '0' + d - 26;
+}
+
+static uint32_t
+urls_adapt(uint32_t delta, uint32_t points, int first)
+{
+    uint32_t k;
+
+    delta = first ? delta / 700 : delta / 2;
+    delta += delta / points;
+    for (k = 0; delta > (35 * 26) / 2; k += 36)
+        delta /= 35;
+    return k + 36 * delta / (delta + 38);
+}
+
+/* Punycode (RFC 3492) encoding of a label, with its "xn--" prefix. */
+static int
+urls_punycode(const uint32_t *cp, size_t n, char *out, size_t outlen)
+{
+    size_t j, o, h, b;
+    uint32_t m, c = 0x80, delta = 0, bias = 72, q, k, t;
+
+    if (outlen < 5)
+        return -1;
+    memcpy(out, "xn--", 4);
+    o = 4;
+    for (j = 0; j < n; j++) {
+        if (cp[j] < 0x80) {
+            if (o + 1 >= outlen)
+                return -1;
+            out[o++] = tolower(cp[j]);
+        }
+    }
+    h = b = o - 4;
+    if (b > 0) {
+        if (o + 1 >= outlen)
+            return -1;
+        out[o++] = '-';
+    }
+
+    while (h < n) {
+        for (m = UINT32_MAX, j = 0; j < n; j++)
+            if (cp[j] >= c && cp[j] < m)
+                m = cp[j];
+        if ((m - c) > (UINT32_MAX - delta) / (h + 1))
+            return -1;
+        delta += (m - c) * (h + 1);
+        c = m;
+        for (j = 0; j < n; j++) {
+            if (cp[j] < c && ++delta == 0)
+                return -1;
+            if (cp[j] != c)
+                continue;
+            for (q = delta, k = 36;; k += 36) {
+                t = k <= bias ? 1 : k >= bias + 26 ? 26 : k - bias;
+                if (q < t)
+                    break;
+                if (o + 1 >= outlen)
+                    return -1;
+                out[o++] = urls_digit(t + (q - t) % (36 - t));
+                q = (q - t) / (36 - t);
+            }
+            if (o + 1 >= outlen)
+                return -1;
+            out[o++] = urls_digit(q);
+            bias = urls_adapt(delta, h + 1, h == b);
+            delta = 0;
+            h++;
+        }
+        delta++;
+        c++;
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/* Converts each label with non-ASCII characters to its IDNA form. */
+static int
+urls_idna(const char *host, char *out, size_t outlen)
+{
+    int ascii;
+    size_t i, n, o = 0, len;
+    uint32_t cp[64], c;
+    const unsigned char *p = (const unsigned char *)host, *label;
+
+    while (*p != '\0') {
+        label = p;
+        len = strcspn((const char *)p, ".");
+        ascii = 1;
+        for (i = 0, n = 0; i < len; n++) {
+            if (n == 64)
+                return -1;
+            c = p[i];
+            if (c < 0x80) {
+                i++;
+            } else if ((c & 0xe0) == 0xc0 && i + 1 < len) {
+                c = (c & 0x1f) << 6 | (p[i + 1] & 0x3f);
+                i += 2;
+            } else if ((c & 0xf0) == 0xe0 && i + 2 < len) {
+                c = (c & 0x0f) << 12 | (p[i + 1] & 0x3f) << 6
+                  | (p[i + 2] & 0x3f);
+                i += 3;
+            } else if ((c & 0xf8) == 0xf0 && i + 3 < len) {
+                c = (c & 0x07) << 18 | (p[i + 1] & 0x3f) << 12
+                  | (p[i + 2] & 0x3f) << 6 | (p[i + 3] & 0x3f);
+                i += 4;
+            } else {
+                return -1;
+            }
+            if (c >= 0x80)
+                ascii = 0;
+            cp[n] = c;
+        }
+
+        if (ascii) {
+            if (o + len + 1 >= outlen)
+                return -1;
+            memcpy(out + o, label, len);
+            o += len;
+        } else {
+            i = urls_punycode(cp, n, out + o, outlen - o);
+            if ((int)i == -1)
+                return -1;
+            o += i;
+        }
+        p += len;
+        if (*p == '.') {
+            if (o + 1 >= outlen)
+                return -1;
+            out[o++] = '.';
+            p++;
+        }
+    }
+    out[o] = '\0';
+    return 0;
+}
+
+static int
+urls_unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* Writes the normalized form of a URL to out and its host to host. */
+static int
+urls_normalize(const char *in, size_t len, char *out, size_t outlen,
+               char *host, size_t hostlen)
+{
+    char buf[URLS_URL_MAX], raw[URLS_HOST_MAX + 1], dec[URLS_HOST_MAX + 1];
+    char *s, *auth, *end, *at, *colon;
+    const char *port = NULL;
+    size_t n, o, i;
+    int hi, lo;
+    struct in_addr in4;
+
+    if (len >= sizeof(buf))
+        return -1;
+    len = urls_entities(in, len, buf);
+
+    /* Scheme. */
+    s = strstr(buf, "://");
+    if (s == NULL || s == buf || (size_t)(s - buf) > 16)
+        return -1;
+    for (i = 0; buf + i < s; i++)
+        buf[i] = tolower((unsigned char)buf[i]);
+    *s = '\0';
+    auth = s + 3;
+    for (end = auth; *end != '\0' && !strchr("/?#\\", *end); end++)
+        ;
+
+    /* Host, without user information or port. */
+    for (at = end; at > auth && at[-1] != '@'; at--)
+        ;
+    auth = at;
+    n = end - auth;
+    if (n == 0 || n > URLS_HOST_MAX)
+        return -1;
+    memcpy(raw, auth, n);
+    raw[n] = '\0';
+    colon = raw[0] == '[' ? strchr(raw, ']') : raw;
+    if (colon != NULL && (colon = strrchr(colon, ':')) != NULL) {
+        *colon = '\0';
+        port = auth + (colon + 1 - raw);
+        if (strspn(colon + 1, "0123456789") != strlen(colon + 1)
+                || (strcmp(buf, "http") == 0 && strcmp(colon + 1, "80") == 0)
+                || (strcmp(buf, "https") == 0
+                    && strcmp(colon + 1, "443") == 0)
+                || colon[1] == '\0')
+            port = NULL;
+    }
+
+    for (i = 0, o = 0; raw[i] != '\0'; i++, o++) {
+        if (raw[i] == '%' && (hi = urls_hex(raw[i + 1])) != -1
+                && (lo = urls_hex(raw[i + 2])) != -1) {
+            dec[o] = hi << 4 | lo;
+            i += 2;
+        } else {
+            dec[o] = raw[i];
+        }
+        dec[o] = tolower((unsigned char)dec[o]);
+    }
+    while (o > 0 && dec[o - 1] == '.')
+        o--;
+    dec[o] = '\0';
+    if (o == 0)
+        return -1;
+
+    if (isdigit((unsigned char)dec[0])
+            && strspn(dec, "0123456789abcdefx.") == o
+            && inet_aton(dec, &in4) != 0)
+        inet_ntop(AF_INET, &in4, host, hostlen);
+    else if (urls_idna(dec, host, hostlen) == -1)
+        return -1;
+    for (i = 0; host[i] != '\0'; i++)
+        if (!isalnum((unsigned char)host[i]) && !strchr("-._[]:", host[i]))
+            return -1;
+
+    o = snprintf(out, outlen, "%s://%s", buf, host);
+    if (port != NULL)
+        o += snprintf(out + o, outlen - o, ":%.*s",
+                      (int)strspn(port, "0123456789"), port);
+    if (o + 2 >= outlen)
+        return -1;
+
+    /* Path and query. */
+    if (*end != '/' && *end != '\\')
+        out[o++] = '/';
+    for (s = end; *s != '\0' && *s != '#'; s++) {
+        if (o + 4 >= outlen)
+            return -1;
+        if (*s == '\\') {
+            out[o++] = '/';
+        } else if (*s == '%' && (hi = urls_hex(s[1])) != -1
+                   && (lo = urls_hex(s[2])) != -1) {
+            if (urls_unreserved(hi << 4 | lo)) {
+                out[o++] = hi << 4 | lo;
+            } else {
+                o += sprintf(out + o, "%%%02X", hi << 4 | lo);
+            }
+            s += 2;
+        } else if ((unsigned char)*s >= 0x80) {
+            o += sprintf(out + o, "%%%02X", (unsigned char)*s);
+        } else {
+            out[o++] = *s;
+        }
+    }
+    out[o] = '\0';
+    return 0;
+}
+
+/* The set of URLs. */
+
+static void
+urls_add(struct milter_urls *u, const char *url, const char *host)
+{
+    int i, n, *index;
+    uint64_t hash = milter_hash64(url, strlen(url));
+    struct urls_entry *e;
+
+    if (u->nentries >= urls_max)
+        return;
+
+    if (u->nindex > 0) {
+        for (i = hash & (u->nindex - 1); u->index[i] != -1;
+             i = (i + 1) & (u->nindex - 1)) {
+            e = &u->entries[u->index[i]];
+            if (e->hash == hash && strcmp(e->url, url) == 0)
+                return;
+        }
+    }
+
+    /* The index is kept at most half full. */
+    if (2 * (u->nentries + 1) > u->nindex) {
+        n = u->nindex > 0 ? 2 * u->nindex : 64;
+        index = malloc(n * sizeof(*index));
+        if (index == NULL)
+            return;
+        memset(index, 0xff, n * sizeof(*index));
+        for (i = 0; i < u->nentries; i++) {
+            int j = u->entries[i].hash & (n - 1);
+
+            while (index[j] != -1)
+                j = (j + 1) & (n - 1);
+            index[j] = i;
+        }
+        free(u->index);
+        u->index = index;
+        u->nindex = n;
+    }
+    if (u->nentries == u->aentries) {
+        n = u->aentries > 0 ? 2 * u->aentries : 16;
+        e = realloc(u->entries, n * sizeof(*e));
+        if (e == NULL)
+            return;
+        u->entries = e;
+        u->aentries = n;
+    }
+
+    e = &u->entries[u->nentries];
+    e->hash = hash;
+    e->url = strdup(url);
+    e->host = strdup(host);
+    if (e->url == NULL || e->host == NULL) {
+        free(e->url);
+        free(e->host);
+        return;
+    }
+    for (i = hash & (u->nindex - 1); u->index[i] != -1;
+         i = (i + 1) & (u->nindex - 1))
+        ;
+    u->index[i] = u->nentries++;
+}
+
+/* Scanner. */
+
+static int
+urls_char(unsigned char c)
+{
+    return c > 0x20 && c != 0x7f && strchr("\"'<>`{}|^", c) == NULL;
+}
+
+static void
+urls_end(struct milter_urls *u)
+{
+    size_t len = u->urllen;
+    char url[URLS_URL_MAX], host[URLS_HOST_MAX + 1];
+
+    u->capturing = 0;
+    u->urllen = 0;
+    if (u->overflow) {
+        u->overflow = 0;
+        return;
+    }
+    /* Trailing punctuation is part of the surrounding text. */
+    while (len > 0 && strchr(".,;:!?)]", u->url[len - 1]) != NULL)
+        len--;
+    if (urls_normalize(u->url, len, url, sizeof(url), host,
+                       sizeof(host)) == 0)
+        urls_add(u, url, host);
+}
+
+static int
+urls_suffix(const char *window, const char *s)
+{
+    size_t n = strlen(s);
+
+    return memcmp(window + sizeof(((struct milter_urls *)0)->window) - n, s,
+                  n) == 0;
+}
+
+static void
+urls_feed(struct milter_urls *u, const unsigned char *data, size_t len)
+{
+    size_t i;
+    unsigned char c;
+    const char *start;
+    char *w = u->window;
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+
+        if (u->capturing) {
+            if (urls_char(c)) {
+                if (u->urllen < sizeof(u->url) - 1)
+                    u->url[u->urllen++] = c;
+                else
+                    u->overflow = 1;
+                continue;
+            }
+            urls_end(u);
+        }
+
+        memmove(w, w + 1, sizeof(u->window) - 1);
+        w[sizeof(u->window) - 1] = tolower(c);
+
+        start = NULL;
+        if (c == '/') {
+            if (urls_suffix(w, "http://"))
+                start = "http://";
+            else if (urls_suffix(w, "https://"))
+                start = "https://";
+            else if (urls_suffix(w, "ftp://"))
+                start = "ftp://";
+        } else if (c == '.' && urls_suffix(w, "www.")
+                   && !isalnum((unsigned char)w[3]) && w[3] != '.'
+                   && w[3] != '/' && w[3] != '-') {
+            start = "http://www.";
+        }
+        if (start != NULL) {
+            strcpy(u->url, start);
+            u->urllen = strlen(start);
+            u->capturing = 1;
+            memset(w, 0, sizeof(u->window));
+        }
+    }
+}
+
+/* Decoding. */
+
+static const unsigned char urls_b64[256] = {
+    ['A'] =  1, ['B'] =  2, ['C'] =  3, ['D'] =  4, ['E'] =  5, ['F'] =  6,
+    ['G'] =  7, ['H'] =  8, ['I'] =  9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+    ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+    ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+    ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+    ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+    ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+    ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+    ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+};
+
+/* Decodes part of a line of content; eol is set if it ends the line. */
+static void
+urls_content(struct milter_urls *u, const char *data, size_t len, int eol)
+{
+    size_t i, o;
+    int hi, lo;
+    unsigned char out[URLS_LINE_MAX + 3], c;
+
+    switch (u->part.encoding) {
+    case URLS_PLAIN:
+        urls_feed(u, (const unsigned char *)data, len);
+        if (eol)
+            urls_feed(u, (const unsigned char *)"\n", 1);
+        break;
+
+    case URLS_QP:
+        /* Trailing white space is only padding at the end of a line. */
+        while (eol && len > 0
+                && (data[len - 1] == ' ' || data[len - 1] == '\t'))
+            len--;
+        for (i = 0, o = 0; i < len; i++) {
+            if (data[i] == '=' && i + 2 < len
+                    && (hi = urls_hex(data[i + 1])) != -1
+                    && (lo = urls_hex(data[i + 2])) != -1) {
+                out[o++] = hi << 4 | lo;
+                i += 2;
+            } else if (data[i] == '=' && i == len - 1 && eol) {
+                /* Soft line break. */
+                urls_feed(u, out, o);
+                return;
+            } else {
+                out[o++] = data[i];
+            }
+        }
+        if (eol)
+            out[o++] = '\n';
+        urls_feed(u, out, o);
+        break;
+
+    case URLS_BASE64:
+        for (i = 0, o = 0; i < len; i++) {
+            c = urls_b64[(unsigned char)data[i]];
+            if (c == 0)
+                continue;
+            u->b64 = u->b64 << 6 | (c - 1);
+            if (++u->b64n == 4) {
+                out[o++] = u->b64 >> 16;
+                out[o++] = u->b64 >> 8;
+                out[o++] = u->b64;
+                u->b64 = 0;
+                u->b64n = 0;
+            }
+            if (o + 3 > sizeof(out)) {
+                urls_feed(u, out, o);
+                o = 0;
+            }
+        }
+        urls_feed(u, out, o);
+        break;
+    }
+}
+
+/* Ends the current part, and any URL running to its end. */
+static void
+urls_part_end(struct milter_urls *u)
+{
+    unsigned char out[2];
+
+    /* The last group of padded base64 holds one or two bytes. */
+    if (u->part.encoding == URLS_BASE64 && u->b64n >= 2) {
+        out[0] = u->b64 >> (6 * u->b64n - 8);
+        out[1] = u->b64 >> (6 * u->b64n - 16);
+        urls_feed(u, out, u->b64n - 1);
+    }
+    if (u->capturing)
+        urls_end(u);
+    u->b64 = 0;
+    u->b64n = 0;
+}
+
+static void
+urls_field(struct urls_part *part, const char *name, const char *v)
+{
+    size_t n;
+    const char *p;
+
+    while (*v == ' ' || *v == '\t')
+        v++;
+
+    if (strcasecmp(name, "Content-Type") == 0) {
+        part->text = strncasecmp(v, "text/", 5) == 0
+                  || strncasecmp(v, "message/", 8) == 0;
+        if (strncasecmp(v, "multipart/", 10) != 0)
+            return;
+        for (p = v; (p = strchr(p, ';')) != NULL; ) {
+            for (p++; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n';
+                 p++)
+                ;
+            if (strncasecmp(p, "boundary=", 9) != 0)
+                continue;
+            p += 9;
+            if (*p == '"')
+                n = strcspn(++p, "\"");
+            else
+                n = strcspn(p, "; \t\r\n");
+            if (n > URLS_BOUNDARY_MAX)
+                n = URLS_BOUNDARY_MAX;
+            memcpy(part->boundary, p, n);
+            part->boundary[n] = '\0';
+            return;
+        }
+    } else if (strcasecmp(name, "Content-Transfer-Encoding") == 0) {
+        if (strncasecmp(v, "quoted-printable", 16) == 0)
+            part->encoding = URLS_QP;
+        else if (strncasecmp(v, "base64", 6) == 0)
+            part->encoding = URLS_BASE64;
+        else
+            part->encoding = URLS_PLAIN;
+    }
+}
+
+static void
+urls_part_begin(struct milter_urls *u)
+{
+    if (u->part.boundary[0] != '\0' && u->depth < URLS_MAX_DEPTH) {
+        memcpy(u->boundaries[u->depth++], u->part.boundary,
+               sizeof(u->part.boundary));
+        u->mode = URLS_SKIP;
+    } else {
+        u->mode = u->part.text ? URLS_BODY : URLS_SKIP;
+    }
+}
+
+static void
+urls_header_line(struct milter_urls *u)
+{
+    char *colon;
+
+    if (u->headerlen == 0)
+        return;
+    u->header[u->headerlen] = '\0';
+    u->headerlen = 0;
+    colon = strchr(u->header, ':');
+    if (colon == NULL)
+        return;
+    *colon = '\0';
+    urls_field(&u->part, u->header, colon + 1);
+}
+
+static int
+urls_boundary(struct milter_urls *u, const char *line, size_t len)
+{
+    int k;
+    size_t blen;
+
+    if (len < 3 || line[0] != '-' || line[1] != '-')
+        return 0;
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+        len--;
+
+    for (k = u->depth - 1; k >= 0; k--) {
+        blen = strlen(u->boundaries[k]);
+        if (len < blen + 2 || memcmp(line + 2, u->boundaries[k], blen) != 0)
+            continue;
+        if (len == blen + 2 || (len == blen + 4 && line[blen + 2] == '-'
+                                && line[blen + 3] == '-')) {
+            urls_part_end(u);
+            memset(&u->part, 0, sizeof(u->part));
+            u->part.text = 1;
+            u->headerlen = 0;
+            u->depth = len == blen + 2 ? k + 1 : k;
+            u->mode = len == blen + 2 ? URLS_HEADERS : URLS_SKIP;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+urls_line(struct milter_urls *u, const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    if (urls_boundary(u, line, len))
+        return;
+
+    switch (u->mode) {
+    case URLS_HEADERS:
+        if (len == 0) {
+            urls_header_line(u);
+            urls_part_begin(u);
+            break;
+        }
+        if (line[0] != ' ' && line[0] != '\t')
+            urls_header_line(u);
+        if (u->headerlen + len < sizeof(u->header)) {
+            memcpy(u->header + u->headerlen, line, len);
+            u->headerlen += len;
+        }
+        break;
+    case URLS_BODY:
+        urls_content(u, line, len, 1);
+        break;
+    case URLS_SKIP:
+        break;
+    }
+}
+
+/* Hooks, called from the callbacks. */
+
+static struct milter_urls *
+urls_get(SMFICTX *ctx)
+{
+    struct milter_urls *u;
+    struct milter_priv *p = milter_priv_get(ctx);
+
+    if (p == NULL)
+        return NULL;
+    if (p->urls == NULL && (u = calloc(1, sizeof(*u))) != NULL) {
+        u->part.text = 1;
+        p->urls = u;
+    }
+    return p->urls;
+}
+
+static void
+urls_clear(struct milter_urls *u)
+{
+    int i;
+
+    for (i = 0; i < u->nentries; i++) {
+        free(u->entries[i].url);
+        free(u->entries[i].host);
+    }
+    free(u->entries);
+    free(u->index);
+}
+
+void
+milter_urls_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+    struct milter_urls *u;
+
+    if (!milter_urls_enabled())
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || (u = p->urls) == NULL)
+        return;
+    urls_clear(u);
+    memset(u, 0, sizeof(*u));
+    u->part.text = 1;
+}
+
+void
+milter_urls_header(SMFICTX *ctx, const char *name, const char *v)
+{
+    struct milter_urls *u;
+
+    if (milter_urls_enabled() && (u = urls_get(ctx)) != NULL && !u->started)
+        urls_field(&u->part, name, v);
+}
+
+void
+milter_urls_body(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t i, n, keep;
+    const char *nl, *p = (const char *)data;
+    struct milter_urls *u;
+
+    if (!milter_urls_enabled() || (u = urls_get(ctx)) == NULL)
+        return;
+
+    if (!u->started) {
+        /* The message header describes the top-level entity. */
+        u->started = 1;
+        urls_part_begin(u);
+    }
+
+    for (i = 0; i < len; i += n) {
+        nl = memchr(p + i, '\n', len - i);
+        n = (nl == NULL ? len : (size_t)(nl - p) + 1) - i;
+
+        if (u->linelen + n <= sizeof(u->line)) {
+            memcpy(u->line + u->linelen, p + i, n);
+            u->linelen += n;
+            if (nl != NULL) {
+                urls_line(u, u->line, u->linelen - 1);
+                u->linelen = 0;
+            }
+            continue;
+        }
+
+        /* A line too long to be a boundary is decoded in pieces, keeping
+         * back what may be the start of a quoted-printable escape. */
+        if (u->mode == URLS_BODY) {
+            keep = u->part.encoding == URLS_QP ? 2 : 0;
+            if (u->linelen > keep) {
+                urls_content(u, u->line, u->linelen - keep, 0);
+                memmove(u->line, u->line + u->linelen - keep, keep);
+                u->linelen = keep;
+            }
+        } else {
+            u->linelen = 0;
+        }
+        n = sizeof(u->line) - u->linelen < n ? sizeof(u->line) - u->linelen
+                                              : n;
+        memcpy(u->line + u->linelen, p + i, n);
+        u->linelen += n;
+        if (u->line[u->linelen - 1] == '\n') {
+            urls_line(u, u->line, u->linelen - 1);
+            u->linelen = 0;
+        }
+    }
+}
+
+/* Finishes the last line and URL of the message. */
+void
+milter_urls_eom(SMFICTX *ctx)
+{
+    struct milter_priv *p;
+    struct milter_urls *u;
+
+    if (!milter_urls_enabled())
+        return;
+    p = smfi_getpriv(ctx);
+    if (p == NULL || (u = p->urls) == NULL)
+        return;
+    if (u->linelen > 0) {
+        if (u->mode == URLS_BODY)
+            urls_content(u, u->line, u->linelen, 0);
+        u->linelen = 0;
+    }
+    urls_part_end(u);
+}
+
+void
+milter_urls_free(struct milter_priv *p)
+{
+    if (p->urls == NULL)
+        return;
+    urls_clear(p->urls);
+    free(p->urls);
+    p->urls = NULL;
+}
+
+size_t
+milter_urls_memory(const struct milter_priv *p)
+{
+    int i;
+    size_t size;
+    const struct milter_urls *u = p->urls;
+
+    if (u == NULL)
+        return 0;
+    size = sizeof(*u) + u->aentries * sizeof(*u->entries)
+         + u->nindex * sizeof(*u->index);
+    for (i = 0; i < u->nentries; i++)
+        size += strlen(u->entries[i].url) + strlen(u->entries[i].host) + 2;
+    return size;
+}
+
+/* OCaml interface. */
+
+CAMLprim value
+caml_milter_urls_enable(value max_val)
+{
+    CAMLparam1(max_val);
+    urls_max = Int_val(max_val) > 0 ? Int_val(max_val) : 0;
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_urls_get(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal4(res, cell, url, s);
+    int i;
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+
+    res = Val_emptylist;
+    if (p == NULL || p->urls == NULL)
+        CAMLreturn(res);
+
+    for (i = p->urls->nentries - 1; i >= 0; i--) {
+        url = caml_alloc(2, 0);
+        s = caml_copy_string(p->urls->entries[i].url);
+        Store_field(url, 0, s);
+        s = caml_copy_string(p->urls->entries[i].host);
+        Store_field(url, 1, s);
+        cell = caml_alloc(2, 0);
+        Store_field(cell, 0, url);
+        Store_field(cell, 1, res);
+        res = cell;
+    }
+    CAMLreturn(res);
+}
@@ -0,0 +1,461 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmilter/mfapi.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+
+#include "milter_stubs.h"
+
+/*
+ * Borrowed body views. A view points into the chunk libmilter passed to
+ * the body callback, without copying it, and belongs to a scope that
+ * ends when the callback returns; every access checks that the scope is
+ * still live. Retaining a view copies it into a buffer from a pool kept
+ * by the connection, sorted in power-of-two size classes, and the copy
+ * belongs to a scope that ends with the message. Buffers go back to the
+ * pool when released, and the pool is freed when the connection closes.
+ *
+ * Views are only read with the runtime lock held. Scopes and pools are
+ * also changed by callbacks that do not take it, and by finalizers, so
+ * they are protected by view_mutex. A message ends in such a callback,
+ * while another thread may be past the scope check of a retained view and
+ * reading its buffer: buffers still retained then are left to their view,
+ * which frees them when released or finalized, rather than pooled.
+ */
+
+#define VIEW_MIN_SHIFT 6
+#define VIEW_CLASSES   11 /* 64 bytes to 64KB, the largest chunk. */
+
+struct view_scope {
+    int live;
+    int refs;
+};
+
+struct view_buf {
+    struct view_buf *next;
+    struct view_buf *prev;
+    int class;   /* -1 if larger than the largest class. */
+    size_t size;
+    unsigned char data[];
+};
+
+struct milter_view {
+    struct view_scope *body;
+    struct view_scope *message;
+    struct view_buf *used;
+    struct view_buf *free[VIEW_CLASSES];
+    size_t bytes;
+};
+
+struct view_val {
+    struct view_scope *scope;
+    struct milter_view *owner;
+    struct view_buf *buf;   /* Retained copies only. */
+    const unsigned char *data;
+    size_t len;
+};
+
+#define View_val(v) ((struct view_val *)Data_custom_val(v))
+
+static pthread_mutex_t view_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The functions below require view_mutex. */
+
+static struct view_scope *
+scope_new(void)
+{
+    struct view_scope *s = malloc(sizeof(*s));
+
+    if (s != NULL) {
+        s->live = 1;
+        s->refs = 1;
+    }
+    return s;
+}
+
+static void
+scope_unref(struct view_scope *s)
+{
+    if (--s->refs == 0)
+        free(s);
+}
+
+static void
+scope_end(struct view_scope *s)
+{
+    __atomic_store_n(&s->live, 0, __ATOMIC_RELEASE);
+    scope_unref(s);
+}
+
+static struct view_buf *
+buf_get(struct milter_view *v, size_t len)
+{
+    int c;
+    size_t size;
+    struct view_buf *b;
+
+    for (c = 0; c < VIEW_CLASSES && ((size_t)1 << (c + VIEW_MIN_SHIFT)) < len;
+         c++)
+        ;
+    if (c < VIEW_CLASSES && v->free[c] != NULL) {
+        b = v->free[c];
+        v->free[c] = b->next;
+    } else {
+        size = c < VIEW_CLASSES ? (size_t)1 << (c + VIEW_MIN_SHIFT) : len;
+        b = malloc(sizeof(*b) + size);
+        if (b == NULL)
+            return NULL;
+        b->class = c < VIEW_CLASSES ? c : -1;
+        b->size = size;
+        __atomic_add_fetch(&v->bytes, sizeof(*b) + size, __ATOMIC_RELAXED);
+    }
+
+    b->prev = NULL;
+    b->next = v->used;
+    if (v->used != NULL)
+        v->used->prev = b;
+    v->used = b;
+    return b;
+}
+
+static void
+buf_put(struct milter_view *v, struct view_buf *b)
+{
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else
+        v->used = b->next;
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+
+    if (b->class == -1) {
+        __atomic_sub_fetch(&v->bytes, sizeof(*b) + b->size, __ATOMIC_RELAXED);
+        free(b);
+    } else {
+        b->next = v->free[b->class];
+        v->free[b->class] = b;
+    }
+}
+
+/* Hands the retained buffers over to their views. */
+static void
+view_end_message(struct milter_view *v)
+{
+    struct view_buf *b;
+
+    if (v->message != NULL) {
+        scope_end(v->message);
+        v->message = NULL;
+    }
+    while ((b = v->used) != NULL) {
+        v->used = b->next;
+        __atomic_sub_fetch(&v->bytes, sizeof(*b) + b->size, __ATOMIC_RELAXED);
+    }
+}
+
+/* Gives back the buffer of a retained view, to the pool while its message
+ * lasts. */
+static void
+view_put(struct view_val *v)
+{
+    if (__atomic_load_n(&v->scope->live, __ATOMIC_RELAXED))
+        buf_put(v->owner, v->buf);
+    else
+        free(v->buf);
+}
+
+/* Hooks, called from the callbacks. */
+
+void
+milter_view_enter(SMFICTX *ctx, const unsigned char *data, size_t len)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL)
+        return;
+    p->chunk = data;
+    p->chunk_len = len;
+}
+
+void
+milter_view_leave(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL)
+        return;
+    p->chunk = NULL;
+    p->chunk_len = 0;
+    if (p->view != NULL && p->view->body != NULL) {
+        pthread_mutex_lock(&view_mutex);
+        scope_end(p->view->body);
+        p->view->body = NULL;
+        pthread_mutex_unlock(&view_mutex);
+    }
+}
+
+void
+milter_view_reset(SMFICTX *ctx)
+{
+    struct milter_priv *p = smfi_getpriv(ctx);
+
+    if (p == NULL || p->view == NULL)
+        return;
+    pthread_mutex_lock(&view_mutex);
+    view_end_message(p->view);
+    pthread_mutex_unlock(&view_mutex);
+}
+
+void
+milter_view_free(struct milter_priv *p)
+{
+    int c;
+    struct milter_view *v = p->view;
+    struct view_buf *b;
+
+    if (v == NULL)
+        return;
+
+    pthread_mutex_lock(&view_mutex);
+    if (v->body != NULL)
+        scope_end(v->body);
+    view_end_message(v);
+    pthread_mutex_unlock(&view_mutex);
+
+    for (c = 0; c < VIEW_CLASSES; c++) {
+        while ((b = v->free[c]) != NULL) {
+            v->free[c] = b->next;
+            free(b);
+        }
+    }
+    free(v);
+    p->view = NULL;
+}
+
+size_t
+milter_view_memory(const struct milter_priv *p)
+{
+    if (p->view == NULL)
+        return 0;
+    return sizeof(*p->view)
+         + __atomic_load_n(&p->view->bytes, __ATOMIC_RELAXED);
+}
+
+/* OCaml interface. */
+
+static void
+view_finalize(value v_val)
+{
+    struct view_val *v = View_val(v_val);
+
+    if (v->scope == NULL)
+        return;
+    pthread_mutex_lock(&view_mutex);
+    if (v->buf != NULL)
+        view_put(v);
+    scope_unref(v->scope);
+    pthread_mutex_unlock(&view_mutex);
+}
+
+static struct custom_operations view_ops = {
+    "milter.view",
+    view_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+static int
+view_live(struct view_val *v)
+{
+    return v->data != NULL
+        && __atomic_load_n(&v->scope->live, __ATOMIC_ACQUIRE);
+}
+
+static struct view_val *
+view_check(value v_val, const char *name)
+{
+    struct view_val *v = View_val(v_val);
+
+    if (!view_live(v))
+        milter_error(name);
+    return v;
+}
+
+static void
+view_range(struct view_val *v, value off_val, value len_val,
+           const char *name)
+{
+    intnat off = Long_val(off_val);
+    intnat len = Long_val(len_val);
+
+    if (off < 0 || len < 0 || (size_t)off + len > v->len)
+        caml_invalid_argument(name);
+}
+
+static value
+view_alloc(void)
+{
+    value res = caml_alloc_custom(&view_ops, sizeof(struct view_val), 0, 1);
+
+    memset(View_val(res), 0, sizeof(struct view_val));
+    return res;
+}
+
+CAMLprim value
+caml_milter_body_view(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    CAMLlocal1(res);
+    struct milter_priv *p = smfi_getpriv((SMFICTX *)ctx_val);
+    struct view_val *v;
+
+    if (p == NULL || p->chunk == NULL)
+        milter_error("Milter.Body.view");
+    if (p->view == NULL && (p->view = calloc(1, sizeof(*p->view))) == NULL)
+        milter_error("Milter.Body.view");
+
+    res = view_alloc();
+
+    pthread_mutex_lock(&view_mutex);
+    if (p->view->body == NULL && (p->view->body = scope_new()) == NULL) {
+        pthread_mutex_unlock(&view_mutex);
+        milter_error("Milter.Body.view");
+    }
+    p->view->body->refs++;
+    pthread_mutex_unlock(&view_mutex);
+
+    v = View_val(res);
+    v->scope = p->view->body;
+    v->owner = p->view;
+    v->data = p->chunk;
+    v->len = p->chunk_len;
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_body_length(value v_val)
+{
+    CAMLparam1(v_val);
+    CAMLreturn(Val_long(View_val(v_val)->len));
+}
+
+CAMLprim value
+caml_milter_body_valid(value v_val)
+{
+    CAMLparam1(v_val);
+    CAMLreturn(Val_bool(view_live(View_val(v_val))));
+}
+
+CAMLprim value
+caml_milter_body_get(value v_val, value i_val)
+{
+    CAMLparam2(v_val, i_val);
+    struct view_val *v = view_check(v_val, "Milter.Body.get");
+    intnat i = Long_val(i_val);
+
+    if (i < 0 || (size_t)i >= v->len)
+        caml_invalid_argument("Milter.Body.get");
+    CAMLreturn(Val_int(v->data[i]));
+}
+
+CAMLprim value
+caml_milter_body_sub(value v_val, value off_val, value len_val)
+{
+    CAMLparam3(v_val, off_val, len_val);
+    CAMLlocal1(res);
+    struct view_val *v;
+
+    view_range(view_check(v_val, "Milter.Body.sub"), off_val, len_val,
+               "Milter.Body.sub");
+    res = caml_alloc_string(Long_val(len_val));
+    /* The allocation may have moved the view. */
+    v = View_val(v_val);
+    memcpy(Bytes_val(res), v->data + Long_val(off_val), Long_val(len_val));
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_body_blit(value v_val, value off_val, value dst_val,
+                      value dst_off_val, value len_val)
+{
+    CAMLparam5(v_val, off_val, dst_val, dst_off_val, len_val);
+    struct view_val *v = view_check(v_val, "Milter.Body.blit");
+    intnat dst_off = Long_val(dst_off_val);
+
+    view_range(v, off_val, len_val, "Milter.Body.blit");
+    if (dst_off < 0
+            || (size_t)dst_off + Long_val(len_val) > caml_string_length(dst_val))
+        caml_invalid_argument("Milter.Body.blit");
+    memcpy(Bytes_val(dst_val) + dst_off, v->data + Long_val(off_val),
+           Long_val(len_val));
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_milter_body_retain(value v_val)
+{
+    CAMLparam1(v_val);
+    CAMLlocal1(res);
+    struct milter_view *owner;
+    struct view_buf *b;
+    struct view_val *v, *r;
+
+    view_check(v_val, "Milter.Body.retain");
+    res = view_alloc();
+    v = View_val(v_val);
+    owner = v->owner;
+
+    pthread_mutex_lock(&view_mutex);
+    /* A message may have ended meanwhile in a callback that does not take
+     * the runtime lock. */
+    if (!view_live(v)) {
+        pthread_mutex_unlock(&view_mutex);
+        milter_error("Milter.Body.retain");
+    }
+    if (owner->message == NULL && (owner->message = scope_new()) == NULL) {
+        pthread_mutex_unlock(&view_mutex);
+        milter_error("Milter.Body.retain");
+    }
+    if ((b = buf_get(owner, v->len)) == NULL) {
+        pthread_mutex_unlock(&view_mutex);
+        milter_error("Milter.Body.retain");
+    }
+    owner->message->refs++;
+    pthread_mutex_unlock(&view_mutex);
+
+    /* The buffer is only pooled again by the view it is given to below. */
+    memcpy(b->data, v->data, v->len);
+
+    r = View_val(res);
+    r->scope = owner->message;
+    r->owner = owner;
+    r->buf = b;
+    r->data = b->data;
+    r->len = v->len;
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_milter_body_release(value v_val)
+{
+    CAMLparam1(v_val);
+    struct view_val *v = View_val(v_val);
+
+    if (v->buf == NULL)
+        CAMLreturn(Val_unit);
+    pthread_mutex_lock(&view_mutex);
+    view_put(v);
+    pthread_mutex_unlock(&view_mutex);
+    v->buf = NULL;
+    v->data = NULL;
+    CAMLreturn(Val_unit);
+}
@@ -0,0 +1,133 @@
+(* A DNS server answering from a function of the query name and type, run
+   in a thread of the test. It keeps the queries it received so tests can
+   check what the resolver sent. *)
+
+type reply
+  = Answer of string list
+      (** Records of the queried type, as RDATA. *)
+  | Nxdomain
+  | Truncated
+  | Other_port of string list
+      (** An answer sent from a port other than the one queried. *)
+  | Drop
+
+type query =
+  { name  : string
+  ; qtype : int
+  ; id    : int
+  ; port  : int
+      (** The source port of the query. *)
+  }
+
+type t =
+  { port    : int
+  ; mutex   : Mutex.t
+  ; mutable queries : query list
+  }
+
+let a = 1
+let ptr = 12
+let mx = 15
+let txt = 16
+
+let encode_name name =
+  let labels = List.filter (( <> ) "") (String.split_on_char '.' name) in
+  String.concat ""
+    (List.map (fun l -> String.make 1 (Char.chr (String.length l)) ^ l) labels)
+  ^ "\000"
+
+let rdata_a addr =
+  String.concat ""
+    (List.map (fun b -> String.make 1 (Char.chr (int_of_string b)))
+       (String.split_on_char '.' addr))
+
+let rdata_txt s = String.make 1 (Char.chr (String.length s)) ^ s
+let rdata_mx name = "\000\010" ^ encode_name name
+let rdata_ptr = encode_name
+
+let u16 b n =
+  Buffer.add_char b (Char.chr ((n lsr 8) land 0xff));
+  Buffer.add_char b (Char.chr (n land 0xff))
+
+let get16 s off = (Char.code s.[off] lsl 8) lor Char.code s.[off + 1]
+
+(* Returns the query's id, name and type, and the end of its question. *)
+let parse msg =
+  let rec labels off acc =
+    let n = Char.code msg.[off] in
+    if n = 0 then
+      (String.concat "." (List.rev acc), off + 1)
+    else
+      labels (off + 1 + n) (String.sub msg (off + 1) n :: acc) in
+  let name, off = labels 12 [] in
+  (get16 msg 0, String.lowercase_ascii name, get16 msg off, off + 4)
+
+let response msg qend qtype ~tc ~rcode rdatas =
+  let b = Buffer.create 512 in
+  Buffer.add_string b (String.sub msg 0 2);
+  Buffer.add_char b (Char.chr (if tc then 0x83 else 0x81));
+  Buffer.add_char b (Char.chr (0x80 lor rcode));
+  u16 b 1;
+  u16 b (List.length rdatas);
+  u16 b 0;
+  u16 b 0;
+  Buffer.add_string b (String.sub msg 12 (qend - 12));
+  List.iter
+    (fun rd ->
+      u16 b 0xc00c;
+      u16 b qtype;
+      u16 b 1;
+      u16 b 0;
+      u16 b 300;
+      u16 b (String.length rd);
+      Buffer.add_string b rd)
+    rdatas;
+  Buffer.contents b
+
+let bind () =
+  let s = Unix.socket Unix.PF_INET Unix.SOCK_DGRAM 0 in
+  Unix.bind s (Unix.ADDR_INET (Unix.inet_addr_loopback, 0));
+  s
+
+let port_of = function
+  | Unix.ADDR_INET (_, port) -> port
+  | Unix.ADDR_UNIX _ -> 0
+
+let start zone =
+  let sock = bind () in
+  let other = bind () in
+  let t =
+    { port = port_of (Unix.getsockname sock)
+    ; mutex = Mutex.create ()
+    ; queries = []
+    } in
+  let buf = Bytes.create 4096 in
+  let rec loop () =
+    let n, from = Unix.recvfrom sock buf 0 (Bytes.length buf) [] in
+    let msg = Bytes.sub_string buf 0 n in
+    let id, name, qtype, qend = parse msg in
+    Mutex.lock t.mutex;
+    let q : query = { name; qtype; id; port = port_of from } in
+    t.queries <- q :: t.queries;
+    Mutex.unlock t.mutex;
+    let send s r =
+      ignore (Unix.sendto_substring s r 0 (String.length r) [] from) in
+    begin match zone name qtype with
+    | Answer rds -> send sock (response msg qend qtype ~tc:false ~rcode:0 rds)
+    | Nxdomain -> send sock (response msg qend qtype ~tc:false ~rcode:3 [])
+    | Truncated -> send sock (response msg qend qtype ~tc:true ~rcode:0 [])
+    | Other_port rds ->
+        send other (response msg qend qtype ~tc:false ~rcode:0 rds)
+    | Drop -> ()
+    end;
+    loop () in
+  ignore (Thread.create loop ());
+  t
+
+let port t = t.port
+
+let queries t =
+  Mutex.lock t.mutex;
+  let q = t.queries in
+  Mutex.unlock t.mutex;
+  List.rev q
@@ -0,0 +1,23 @@
+(* Connections driven through the callbacks given to Milter.register, with
+   the mock libmilter standing in for the MTA. *)
+
+external connect : string -> Unix.inet_addr -> Milter.ctx
+  = "caml_test_connect"
+external helo : Milter.ctx -> string -> unit = "caml_test_helo"
+external envfrom : Milter.ctx -> string -> unit = "caml_test_envfrom"
+external header : Milter.ctx -> string -> string -> unit = "caml_test_header"
+external eoh : Milter.ctx -> unit = "caml_test_eoh"
+external body : Milter.ctx -> string -> unit = "caml_test_body"
+external eom : Milter.ctx -> unit = "caml_test_eom"
+external close : Milter.ctx -> unit = "caml_test_close"
+
+external recv_fd : Unix.file_descr -> string * Unix.file_descr
+  = "caml_test_recv_fd"
+
+let check name ok =
+  if ok then
+    Printf.printf "ok   %s\n%!" name
+  else begin
+    Printf.printf "FAIL %s\n%!" name;
+    exit 1
+  end
@@ -0,0 +1,69 @@
+(* The library's resolver, through DNSBL lookups against a stub server. *)
+
+let check = Mock.check
+
+let zone name _ =
+  match name with
+  | "1.2.0.192.bl.example" -> Dnsstub.Answer [Dnsstub.rdata_a "127.0.0.2"]
+  | "listed.example.rhs.example" ->
+      Dnsstub.Answer [Dnsstub.rdata_a "127.0.0.3"]
+  | "truncated.example.rhs.example" -> Dnsstub.Truncated
+  | "spoofed.example.rhs.example" ->
+      Dnsstub.Other_port [Dnsstub.rdata_a "127.0.0.4"]
+  | _ -> Dnsstub.Nxdomain
+
+let listed ctx name =
+  List.filter (fun l -> l.Milter.Dnsbl.name = name)
+    (Milter.Dnsbl.results ctx)
+
+let distinct l = List.length (List.sort_uniq compare l)
+
+let () =
+  let server = Dnsstub.start zone in
+  Milter.setresolver Unix.inet_addr_loopback (Dnsstub.port server);
+  Milter.Dnsbl.add "bl.example";
+  Milter.Dnsbl.add_domain "rhs.example";
+  Milter.register { Milter.empty with Milter.name = "test_dns" };
+
+  let client = Unix.inet_addr_of_string "192.0.2.1" in
+  let ctx = Mock.connect "[192.0.2.1]" client in
+  Milter.Dnsbl.wait ctx 5.;
+  check "client address listed"
+    (match listed ctx "192.0.2.1" with
+     | [{ Milter.Dnsbl.zone = "bl.example"; addrs = ["127.0.0.2"]; _ }] -> true
+     | _ -> false);
+
+  Milter.Dnsbl.check ctx "listed.example";
+  Milter.Dnsbl.check ctx "truncated.example";
+  let t = Unix.gettimeofday () in
+  Milter.Dnsbl.wait ctx 5.;
+  check "truncated answer completes without retries"
+    (Milter.Dnsbl.pending ctx = 0 && Unix.gettimeofday () -. t < 0.9);
+  check "truncated answer is not a listing"
+    (listed ctx "truncated.example" = []);
+  check "domain listed"
+    (match listed ctx "listed.example" with
+     | [{ Milter.Dnsbl.addrs = ["127.0.0.3"]; _ }] -> true
+     | _ -> false);
+
+  for i = 1 to 200 do
+    Milter.Dnsbl.check ctx (Printf.sprintf "d%d.example" i)
+  done;
+  Milter.Dnsbl.wait ctx 5.;
+  check "all queries answered" (Milter.Dnsbl.pending ctx = 0);
+  let bulk =
+    List.filter (fun q -> q.Dnsstub.name.[0] = 'd') (Dnsstub.queries server) in
+  check "queries sent" (List.length bulk >= 200);
+  check "source ports vary"
+    (distinct (List.map (fun (q : Dnsstub.query) -> q.Dnsstub.port) bulk)
+     > 1);
+  let high =
+    List.length (List.filter (fun q -> q.Dnsstub.id >= 0x8000) bulk) in
+  check "ids are spread over the whole range" (high > 60 && high < 140);
+
+  Milter.Dnsbl.check ctx "spoofed.example";
+  Milter.Dnsbl.wait ctx 0.5;
+  check "answer from another port is ignored"
+    (Milter.Dnsbl.pending ctx = 1 && listed ctx "spoofed.example" = []);
+
+  Mock.close ctx
@@ -0,0 +1,104 @@
+(* Attachment scanning against a stub scanner, which reads the descriptor
+   it is passed and finds anything containing "EICAR". *)
+
+let check = Mock.check
+
+let contains s sub =
+  let n = String.length sub in
+  let rec from i =
+    i + n <= String.length s && (String.sub s i n = sub || from (i + 1)) in
+  from 0
+
+let read_all fd =
+  let buf = Buffer.create 4096 in
+  let chunk = Bytes.create 4096 in
+  let rec loop () =
+    let n = Unix.read fd chunk 0 (Bytes.length chunk) in
+    if n > 0 then begin
+      Buffer.add_string buf (Bytes.sub_string chunk 0 n);
+      loop ()
+    end in
+  loop ();
+  Buffer.contents buf
+
+(* What the scanner was sent, as (message, content) pairs. *)
+let scanned = ref []
+let mutex = Mutex.create ()
+
+let serve sock =
+  while true do
+    let c, _ = Unix.accept sock in
+    let msg, fd = Mock.recv_fd c in
+    ignore (Unix.lseek fd 0 Unix.SEEK_SET);
+    let data = read_all fd in
+    Unix.close fd;
+    Mutex.lock mutex;
+    scanned := (msg, data) :: !scanned;
+    Mutex.unlock mutex;
+    let r = if contains data "EICAR" then "FOUND Eicar-Test\n" else "OK\n" in
+    ignore (Unix.write_substring c r 0 (String.length r));
+    Unix.close c
+  done
+
+let long = String.make 1500 'x'
+
+(* The message is cut between the '\r' and the '\n' ending the long line. *)
+let head = String.concat "\r\n"
+  [ "--b1"
+  ; "Content-Type: text/plain"
+  ; "Content-Disposition: attachment; filename=\"notes.txt\""
+  ; ""
+  ; long ^ "\r"
+  ]
+
+let tail = String.concat "\r\n"
+  [ "\nend"
+  ; "--b1"
+  ; "Content-Type: application/octet-stream"
+  ; "Content-Disposition: attachment; filename=\"eicar.com\""
+  ; "Content-Transfer-Encoding: base64"
+  ; ""
+  ; "bm90IHJlYWxseSBFSUNBUiwgYnV0IHRoZSBzY2FubmVyIHNheXMgc28K"
+  ; "--b1--"
+  ; ""
+  ]
+
+let scan ctx chunks =
+  Mutex.lock mutex;
+  scanned := [];
+  Mutex.unlock mutex;
+  Mock.envfrom ctx "<sender@example.com>";
+  Mock.header ctx "Content-Type" "multipart/mixed; boundary=\"b1\"";
+  Mock.eoh ctx;
+  List.iter (Mock.body ctx) chunks;
+  Mock.eom ctx;
+  Milter.Scan.wait ctx 5.;
+  Milter.Scan.results ctx
+
+let verdicts name ctx chunks =
+  let open Milter.Scan in
+  check (name ^ ": verdicts")
+    (match scan ctx chunks with
+     | [ { filename = "notes.txt"; size = 1505; verdict = Clean; _ }
+       ; { filename = "eicar.com"; size = 42;
+           verdict = Infected "Eicar-Test"; _ } ] -> true
+     | _ -> false);
+  check (name ^ ": line breaks kept")
+    (List.assoc_opt "1505 notes.txt\n" !scanned = Some (long ^ "\r\nend"))
+
+let () =
+  let path = Filename.temp_file "test_scan" ".sock" in
+  Sys.remove path;
+  at_exit (fun () -> try Sys.remove path with Sys_error _ -> ());
+  let sock = Unix.socket Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  Unix.bind sock (Unix.ADDR_UNIX path);
+  Unix.listen sock 8;
+  ignore (Thread.create serve sock);
+
+  Milter.Scan.setscanner path 65536;
+  Milter.register { Milter.empty with Milter.name = "test_scan" };
+
+  let ctx = Mock.connect "[192.0.2.1]" (Unix.inet_addr_of_string "192.0.2.1") in
+  verdicts "one chunk" ctx [head ^ tail];
+  verdicts "line break across chunks" ctx [head; tail];
+  Mock.close ctx
@@ -0,0 +1,80 @@
+(* SPF evaluation against a stub DNS server. *)
+
+let check = Mock.check
+
+let records =
+  let open Dnsstub in
+  [ ("example.com", txt),
+      [rdata_txt "v=spf1 include:a.example.net include:b.example.net mx -all"]
+  ; ("a.example.net", txt), [rdata_txt "v=spf1 ip4:192.0.2.0/24 -all"]
+  ; ("b.example.net", txt), [rdata_txt "v=spf1 a:host.example.org ~all"]
+  ; ("host.example.org", a), [rdata_a "198.51.100.7"]
+  ; ("example.com", mx), [rdata_mx "mail.example.com"]
+  ; ("mail.example.com", a), [rdata_a "203.0.113.5"]
+  ; ("redir.com", txt), [rdata_txt "v=spf1 redirect=example.com"]
+  ; ("macro.com", txt),
+      [rdata_txt "v=spf1 exists:%{ir}.%{l1r+-}._spf.%{d} -all"]
+  ; ("5.113.0.203.foo._spf.macro.com", a), [rdata_a "127.0.0.2"]
+  ; ("loop.com", txt), [rdata_txt "v=spf1 include:loop.com -all"]
+  ; ("two.com", txt), [rdata_txt "v=spf1 -all"; rdata_txt "v=spf1 +all"]
+  ; ("ptr.com", txt), [rdata_txt "v=spf1 ptr -all"]
+  ; ("5.113.0.203.in-addr.arpa", ptr), [rdata_ptr "mail.ptr.com"]
+  ; ("mail.ptr.com", a), [rdata_a "203.0.113.5"]
+  ; ("v6.com", txt), [rdata_txt "v=spf1 ip6:2001:db8::/32 -all"]
+  ; ("void.com", txt),
+      [rdata_txt "v=spf1 a:x1.void.com a:x2.void.com a:x3.void.com +all"]
+  ]
+
+(* Names with records of another type get empty answers, others do not
+   exist. *)
+let zone name qtype =
+  match List.assoc_opt (name, qtype) records with
+  | Some rds -> Dnsstub.Answer rds
+  | None when List.exists (fun ((n, _), _) -> n = name) records ->
+      Dnsstub.Answer []
+  | None -> Dnsstub.Nxdomain
+
+let spf ?(helo = "mail.example.com") client sender =
+  let addr = Unix.inet_addr_of_string client in
+  let ctx = Mock.connect ("[" ^ client ^ "]") addr in
+  Mock.helo ctx helo;
+  Mock.envfrom ctx ("<" ^ sender ^ ">");
+  Milter.Spf.wait ctx 5.;
+  let r = Milter.Spf.result ctx in
+  Mock.close ctx;
+  r
+
+let () =
+  let server = Dnsstub.start zone in
+  Milter.setresolver Unix.inet_addr_loopback (Dnsstub.port server);
+  Milter.Spf.enable ();
+  Milter.register { Milter.empty with Milter.name = "test_spf" };
+
+  let cases = Milter.Spf.(
+    [ "ip4 in an include", "192.0.2.10", "user@example.com", Pass
+    ; "a in an include", "198.51.100.7", "user@example.com", Pass
+    ; "no match", "10.0.0.1", "user@example.com", Fail
+    ; "mx", "203.0.113.5", "user@example.com", Pass
+    ; "redirect", "10.0.0.1", "x@redir.com", Fail
+    ; "macros", "203.0.113.5", "foo-bar@macro.com", Pass
+    ; "macros, no match", "203.0.113.6", "foo-bar@macro.com", Fail
+    ; "include loop", "1.2.3.4", "x@loop.com", Permerror
+    ; "two records", "1.2.3.4", "x@two.com", Permerror
+    ; "no record", "1.2.3.4", "x@none.com", No_policy
+    ; "ptr", "203.0.113.5", "x@ptr.com", Pass
+    ; "ptr, no match", "203.0.113.9", "x@ptr.com", Fail
+    ; "ip6", "2001:db8::1", "x@v6.com", Pass
+    ; "mapped IPv4 address", "::ffff:192.0.2.10", "user@example.com", Pass
+    ; "void lookup limit", "1.2.3.4", "x@void.com", Permerror
+    ; "not a domain", "1.2.3.4", "x@nodot", No_policy
+    ]) in
+  List.iter
+    (fun (name, client, sender, expected) ->
+      check name (spf client sender = Some expected))
+    cases;
+  check "null sender checked at the HELO name"
+    (spf ~helo:"example.com" "192.0.2.10" "" = Some Milter.Spf.Pass);
+
+  let hits, _ = Milter.Spf.stats () in
+  ignore (spf "192.0.2.10" "user@example.com");
+  check "result cache" (fst (Milter.Spf.stats ()) = hits + 1)
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+
+#include "mock_mfapi.h"
+
+/*
+ * Drives a connection through the callbacks registered with
+ * Milter.register, from the OCaml thread, the way libmilter would call
+ * them. Strings are copied first, as the callbacks may run the GC.
+ */
+
+static char *
+test_strdup(value s)
+{
+    char *p = strdup(String_val(s));
+
+    if (p == NULL)
+        caml_raise_out_of_memory();
+    return p;
+}
+
+CAMLprim value
+caml_test_connect(value host_val, value addr_val)
+{
+    CAMLparam2(host_val, addr_val);
+    char *host;
+    SMFICTX *ctx;
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+    memset(&ss, 0, sizeof(ss));
+    if (caml_string_length(addr_val) == 16) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(25);
+        memcpy(&sin6->sin6_addr, String_val(addr_val), 16);
+    } else {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(25);
+        memcpy(&sin->sin_addr, String_val(addr_val), 4);
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        caml_raise_out_of_memory();
+    host = test_strdup(host_val);
+    mock_desc.xxfi_connect(ctx, host, (_SOCK_ADDR *)&ss);
+    free(host);
+
+    CAMLreturn((value)ctx);
+}
+
+CAMLprim value
+caml_test_helo(value ctx_val, value helo_val)
+{
+    CAMLparam2(ctx_val, helo_val);
+    char *helo;
+
+    if (mock_desc.xxfi_helo != NULL) {
+        helo = test_strdup(helo_val);
+        mock_desc.xxfi_helo((SMFICTX *)ctx_val, helo);
+        free(helo);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_test_envfrom(value ctx_val, value sender_val)
+{
+    CAMLparam2(ctx_val, sender_val);
+    char *argv[2];
+
+    if (mock_desc.xxfi_envfrom != NULL) {
+        argv[0] = test_strdup(sender_val);
+        argv[1] = NULL;
+        mock_desc.xxfi_envfrom((SMFICTX *)ctx_val, argv);
+        free(argv[0]);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_test_header(value ctx_val, value name_val, value v_val)
+{
+    CAMLparam3(ctx_val, name_val, v_val);
+    char *name, *v;
+
+    if (mock_desc.xxfi_header != NULL) {
+        name = test_strdup(name_val);
+        v = test_strdup(v_val);
+        mock_desc.xxfi_header((SMFICTX *)ctx_val, name, v);
+        free(name);
+        free(v);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_test_eoh(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+
+    if (mock_desc.xxfi_eoh != NULL)
+        mock_desc.xxfi_eoh((SMFICTX *)ctx_val);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_test_body(value ctx_val, value body_val)
+{
+    CAMLparam2(ctx_val, body_val);
+    size_t len = caml_string_length(body_val);
+    unsigned char *body;
+
+    if (mock_desc.xxfi_body != NULL) {
+        body = malloc(len + 1);
+        if (body == NULL)
+            caml_raise_out_of_memory();
+        memcpy(body, String_val(body_val), len);
+        mock_desc.xxfi_body((SMFICTX *)ctx_val, body, len);
+        free(body);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_test_eom(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+
+    if (mock_desc.xxfi_eom != NULL)
+        mock_desc.xxfi_eom((SMFICTX *)ctx_val);
+    CAMLreturn(Val_unit);
+}
+
+/* Receives a message and the descriptor it carries, for stub servers
+ * that are passed files with SCM_RIGHTS. */
+CAMLprim value
+caml_test_recv_fd(value sock_val)
+{
+    CAMLparam1(sock_val);
+    CAMLlocal2(res, msg_val);
+    char buf[1024];
+    char cmsg[CMSG_SPACE(sizeof(int))];
+    int fd = -1;
+    ssize_t n;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+
+    caml_enter_blocking_section();
+    n = recvmsg(Int_val(sock_val), &msg, MSG_CMSG_CLOEXEC);
+    caml_leave_blocking_section();
+    if (n == -1)
+        uerror("recvmsg", Nothing);
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET
+            && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    if (fd == -1)
+        caml_failwith("recv_fd: no descriptor");
+
+    msg_val = caml_alloc_string(n);
+    memcpy(String_val(msg_val), buf, n);
+    res = caml_alloc_tuple(2);
+    Store_field(res, 0, msg_val);
+    Store_field(res, 1, Val_int(fd));
+    CAMLreturn(res);
+}
+
+CAMLprim value
+caml_test_close(value ctx_val)
+{
+    CAMLparam1(ctx_val);
+    SMFICTX *ctx = (SMFICTX *)ctx_val;
+
+    mock_desc.xxfi_close(ctx);
+    free(ctx);
+    CAMLreturn(Val_unit);
+}
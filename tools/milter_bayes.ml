@@ -0,0 +1,68 @@
+(* Builds or updates a token table for Milter.Bayes from messages stored
+   one per file, as in maildir or MH folders. Only message bodies are
+   tokenized, as the filter only sees those. *)
+
+let usage =
+  "usage: milter-bayes [-update] -o table (-spam path | -ham path)...\n"
+
+let read_file path =
+  let ic = open_in_bin path in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  s
+
+(* The body starts after the first empty line. *)
+let body msg =
+  let n = String.length msg in
+  let rec find i =
+    match String.index_from msg i '\n' with
+    | exception Not_found -> n
+    | j ->
+        let k = if j + 1 < n && msg.[j + 1] = '\r' then j + 2 else j + 1 in
+        if k < n && msg.[k] = '\n' then k + 1 else find (j + 1) in
+  let start = find 0 in
+  String.sub msg start (n - start)
+
+let rec iter_files f path =
+  if Sys.is_directory path then
+    Array.iter
+      (fun name -> iter_files f (Filename.concat path name))
+      (Sys.readdir path)
+  else
+    f path
+
+let () =
+  let update = ref false in
+  let output = ref "" in
+  let inputs = ref [] in
+  let spec =
+    [ "-update", Arg.Set update,
+      " Add to the existing table instead of replacing it"
+    ; "-o", Arg.Set_string output,
+      "table Token table to write"
+    ; "-spam", Arg.String (fun p -> inputs := (true, p) :: !inputs),
+      "path Train on the spam in a file or directory"
+    ; "-ham", Arg.String (fun p -> inputs := (false, p) :: !inputs),
+      "path Train on the ham in a file or directory"
+    ] in
+  let spec = Arg.align spec in
+  Arg.parse spec (fun arg -> raise (Arg.Bad ("unexpected " ^ arg))) usage;
+  if !output = "" || !inputs = [] then begin
+    Arg.usage spec usage;
+    exit 2
+  end;
+  let b =
+    if !update then Milter.Bayes.update !output
+    else Milter.Bayes.create () in
+  let spam = ref 0 in
+  let ham = ref 0 in
+  List.iter
+    (fun (is_spam, path) ->
+      iter_files
+        (fun file ->
+          Milter.Bayes.train b ~spam:is_spam (body (read_file file));
+          incr (if is_spam then spam else ham))
+        path)
+    (List.rev !inputs);
+  Milter.Bayes.commit b !output;
+  Printf.printf "%s: trained on %d spam and %d ham\n" !output !spam !ham